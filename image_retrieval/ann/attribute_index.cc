@@ -0,0 +1,174 @@
+#include "image_retrieval/ann/attribute_index.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_format.h"
+
+namespace image_retrieval {
+namespace ann {
+
+void to_json(nlohmann::json& j, const Filter& filter) {
+  switch (filter.op) {
+    case Filter::Op::kNone:
+      j = nlohmann::json::object();
+      break;
+    case Filter::Op::kEqual:
+      j = nlohmann::json{{"field", filter.field}, {"value", filter.value}};
+      break;
+    case Filter::Op::kAnd:
+      j = nlohmann::json{{"and", filter.children}};
+      break;
+    case Filter::Op::kOr:
+      j = nlohmann::json{{"or", filter.children}};
+      break;
+    case Filter::Op::kNot:
+      j = nlohmann::json{{"not", filter.children.at(0)}};
+      break;
+  }
+}
+
+void from_json(const nlohmann::json& j, Filter& filter) {
+  filter = Filter();
+  if (j.contains("field")) {
+    filter.op = Filter::Op::kEqual;
+    filter.field = j.at("field").get<std::string>();
+    filter.value = ToAttributeValue(j.at("value"));
+  } else if (j.contains("and")) {
+    filter.op = Filter::Op::kAnd;
+    filter.children = j.at("and").get<std::vector<Filter>>();
+  } else if (j.contains("or")) {
+    filter.op = Filter::Op::kOr;
+    filter.children = j.at("or").get<std::vector<Filter>>();
+  } else if (j.contains("not")) {
+    filter.op = Filter::Op::kNot;
+    filter.children.push_back(j.at("not").get<Filter>());
+  } else if (!j.empty()) {
+    throw std::invalid_argument(
+        absl::StrFormat("Unknown filter: %s", j.dump()));
+  }
+}
+
+std::string ToAttributeValue(const nlohmann::json& value) {
+  return value.is_string() ? value.get<std::string>() : value.dump();
+}
+
+void AttributeIndex::Add(int64_t row, absl::string_view payload) {
+  if (fields_.empty() || payload.empty()) {
+    return;
+  }
+
+  nlohmann::json json =
+      nlohmann::json::parse(payload.begin(), payload.end(), nullptr, false);
+  if (!json.is_object()) {
+    return;
+  }
+  for (const auto& field : fields_) {
+    auto it = json.find(field);
+    if (it == json.end() || it->is_null()) {
+      continue;
+    }
+    auto& values = bitmaps_[field];
+    if (it->is_array()) {
+      for (const auto& value : *it) {
+        values[ToAttributeValue(value)].Add(row);
+      }
+    } else {
+      values[ToAttributeValue(*it)].Add(row);
+    }
+  }
+}
+
+const Bitmap* AttributeIndex::Find(const Filter& filter) const {
+  if (std::find(fields_.begin(), fields_.end(), filter.field) ==
+      fields_.end()) {
+    throw std::invalid_argument(absl::StrFormat(
+        "'%s' is not an attribute field, it should be one of --attributes",
+        filter.field));
+  }
+  auto field = bitmaps_.find(filter.field);
+  if (field == bitmaps_.end()) {
+    return nullptr;
+  }
+  auto value = field->second.find(filter.value);
+  return value == field->second.end() ? nullptr : &value->second;
+}
+
+Bitmap AttributeIndex::Evaluate(const Filter& filter, int64_t size) const {
+  switch (filter.op) {
+    case Filter::Op::kNone:
+      return Bitmap::Range(size);
+    case Filter::Op::kEqual: {
+      const Bitmap* rows = Find(filter);
+      return rows ? *rows : Bitmap();
+    }
+    case Filter::Op::kAnd: {
+      Bitmap result = Bitmap::Range(size);
+      for (const auto& child : filter.children) {
+        result = result.And(Evaluate(child, size));
+        if (result.IsEmpty()) {
+          break;
+        }
+      }
+      return result;
+    }
+    case Filter::Op::kOr: {
+      Bitmap result;
+      for (const auto& child : filter.children) {
+        result = result.Or(Evaluate(child, size));
+      }
+      return result;
+    }
+    case Filter::Op::kNot:
+      return Bitmap::Range(size).AndNot(Evaluate(filter.children.at(0), size));
+  }
+  return Bitmap();
+}
+
+double AttributeIndex::EstimateSelectivity(const Filter& filter,
+                                           int64_t size) const {
+  switch (filter.op) {
+    case Filter::Op::kNone:
+      return 1.;
+    case Filter::Op::kEqual: {
+      const Bitmap* rows = Find(filter);
+      return rows && size > 0
+                 ? std::min(1., static_cast<double>(rows->Cardinality()) / size)
+                 : 0.;
+    }
+    case Filter::Op::kAnd: {
+      double selectivity = 1.;
+      for (const auto& child : filter.children) {
+        selectivity *= EstimateSelectivity(child, size);
+      }
+      return selectivity;
+    }
+    case Filter::Op::kOr: {
+      double unselected = 1.;
+      for (const auto& child : filter.children) {
+        unselected *= 1. - EstimateSelectivity(child, size);
+      }
+      return 1. - unselected;
+    }
+    case Filter::Op::kNot:
+      return 1. - EstimateSelectivity(filter.children.at(0), size);
+  }
+  return 0.;
+}
+
+size_t AttributeIndex::GetMemoryUsage() const {
+  using Values = absl::flat_hash_map<std::string, Bitmap>;
+  using Fields = absl::flat_hash_map<std::string, Values>;
+  // Slots of the hash maps come with a control byte each
+  size_t bytes = bitmaps_.capacity() * (sizeof(Fields::value_type) + 1);
+  for (const auto& field : bitmaps_) {
+    bytes += field.first.capacity() +
+             field.second.capacity() * (sizeof(Values::value_type) + 1);
+    for (const auto& value : field.second) {
+      bytes += value.first.capacity() + value.second.GetMemoryUsage();
+    }
+  }
+  return bytes;
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
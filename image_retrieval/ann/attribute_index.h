@@ -0,0 +1,75 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_ATTRIBUTE_INDEX_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_ATTRIBUTE_INDEX_H_
+
+#include <string>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "image_retrieval/ann/bitmap.h"
+#include "nlohmann/json.hpp"
+
+namespace image_retrieval {
+namespace ann {
+
+// A boolean expression over attributes of the payload, e.g.
+//   {"and": [{"field": "source", "value": "web"},
+//            {"not": {"field": "license", "value": "cc-by-nc"}}]}
+struct Filter {
+  enum class Op { kNone, kEqual, kAnd, kOr, kNot };
+
+  Op op = Op::kNone;
+  // Of kEqual
+  std::string field;
+  std::string value;
+  // Of kAnd, kOr and kNot
+  std::vector<Filter> children;
+
+  friend void to_json(nlohmann::json& j, const Filter& filter);
+
+  friend void from_json(const nlohmann::json& j, Filter& filter);
+};
+
+// Attribute values are compared as strings, JSON numbers and booleans are
+// taken in their JSON text, e.g. 2021 as "2021".
+std::string ToAttributeValue(const nlohmann::json& value);
+
+/**
+ * Maps every value of the configured top-level fields of JSON payloads to the
+ * bitmap of rows having it. Array fields index each of their elements.
+ * Payloads that are not JSON objects have no attributes.
+ */
+class AttributeIndex {
+ public:
+  // Takes effect for the rows added afterwards.
+  void SetFields(const std::vector<std::string>& fields) { fields_ = fields; }
+
+  const std::vector<std::string>& GetFields() const { return fields_; }
+
+  void Add(int64_t row, absl::string_view payload);
+
+  // Returns the rows in [0, size) matching `filter`. Throws
+  // std::invalid_argument if it refers to a field that is not indexed.
+  Bitmap Evaluate(const Filter& filter, int64_t size) const;
+
+  // Estimates the fraction of the `size` rows matching `filter` from the
+  // sizes of its values' bitmaps, taking the children of kAnd and kOr as
+  // independent. Cheaper than Evaluate(), and throws the same way.
+  double EstimateSelectivity(const Filter& filter, int64_t size) const;
+
+  // Bytes of the bitmaps and the values they are keyed by.
+  size_t GetMemoryUsage() const;
+
+ private:
+  // The rows of the kEqual `filter`, null if none.
+  const Bitmap* Find(const Filter& filter) const;
+
+  std::vector<std::string> fields_;
+  // Field to value to rows
+  absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, Bitmap>>
+      bitmaps_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_ATTRIBUTE_INDEX_H_
@@ -1,10 +1,15 @@
 #include "image_retrieval/ann/binary_index.h"
 
+#include <cmath>
 #include <fstream>
+#include <queue>
 
+#include "absl/base/call_once.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/str_format.h"
 #include "absl/time/clock.h"
 #include "image_retrieval/feature_extraction/feature_decoder_utils.h"
+#include "image_retrieval/memory/arena.h"
 
 namespace image_retrieval {
 namespace ann {
@@ -15,29 +20,71 @@ size_t BUFFER_SIZE{4 * 1024 * 1024};
 
 using ::image_retrieval::feature_extraction::FeatureRecord;
 using ::image_retrieval::feature_extraction::ReadRecord;
+using ::image_retrieval::memory::Arena;
+using ::image_retrieval::memory::ArenaAllocator;
+using ::image_retrieval::memory::ArenaVector;
+using ::image_retrieval::profiling::ScopedPerfCounters;
 
 struct RecordWithDistance {
-  explicit RecordWithDistance(const FeatureRecord* record = nullptr,
-                              float distance = 0.f)
-      : record(record), distance(distance) {}
-
-  const FeatureRecord* record;
+  int64_t row;
   float distance;
 };
 
+// Records of a label, with their vectors laid out back to back.
+struct Bucket {
+  explicit Bucket(Arena* arena)
+      : values(ArenaAllocator<float>(arena)),
+        rows(ArenaAllocator<int64_t>(arena)) {}
+
+  ArenaVector<float> values;
+  ArenaVector<int64_t> rows;
+};
+
+struct Location {
+  int bucket;
+  size_t offset;
+};
+
+// Rows [offset, offset + end - start) of a bucket, whose neighbors go to
+// [start, end) of the scanned records.
 struct BucketRange {
   int bucket;
+  size_t offset;
   size_t start;
   size_t end;
 };
 
+// One table of multi-index hashing: the rows whose codes have the same bits
+// [begin, begin + length) are at [first, second) of `rows` in the bucket of
+// that substring.
+struct SubstringTable {
+  int begin;
+  int length;
+  absl::flat_hash_map<uint32_t, std::pair<uint32_t, uint32_t>> buckets;
+  std::vector<int64_t> rows;
+};
+
+// Number of subsets of `r` elements out of `n`, saturated past `max`.
+uint64_t Combinations(int n, int r, uint64_t max) {
+  uint64_t count = 1;
+  for (int i = 1; i <= r; ++i) {
+    count = count * (n - r + i) / i;
+    if (count > max) {
+      return max;
+    }
+  }
+  return count;
+}
+
 template <int BitLength = 2048>
 class BinaryIndex : public IndexBase {
  public:
   using FeatureRecord = ::image_retrieval::feature_extraction::FeatureRecord;
 
-  explicit BinaryIndex(int dim_size)
-      : IndexBase(dim_size), first_request_(true), thread_pool_(10) {
+  BinaryIndex(int dim_size, bool multi_index_hashing)
+      : IndexBase(dim_size),
+        multi_index_hashing_(multi_index_hashing),
+        thread_pool_(10) {
     bit_threshold_.resize(dim_size_, 0.f);
   }
 
@@ -45,7 +92,13 @@ class BinaryIndex : public IndexBase {
     for (int i = 0; i < dim_size_; ++i) {
       bit_threshold_[i] += record.value(i);
     }
-    index_data_[record.label()].emplace_back(std::move(record));
+    int64_t row = AddMetadata(record);
+    Bucket& bucket =
+        index_data_.try_emplace(record.label(), &arena_).first->second;
+    locations_.push_back({record.label(), bucket.rows.size()});
+    bucket.rows.push_back(row);
+    bucket.values.insert(bucket.values.end(), record.value().begin(),
+                         record.value().end());
     ++total_count_;
 
     return true;
@@ -60,93 +113,344 @@ class BinaryIndex : public IndexBase {
                           query.size(), dim_size_));
     }
 
-    if (first_request_) {
-      if (total_count_) {
-        for (int i = 0; i < dim_size_; ++i) {
-          bit_threshold_[i] /= total_count_;
-        }
-      }
-
-      for (const auto& kv : index_data_) {
-        for (const auto& record : kv.second) {
-          auto bits =
-              Binarize(record.value().data(), bit_threshold_.data(), dim_size_);
-          index_[record.label()].emplace_back(bits);
-        }
-      }
-
-      first_request_ = false;
-    }
+    // Concurrent first searches wait for the one building them
+    absl::call_once(codes_built_, &BinaryIndex::BuildCodes, this);
 
     if (index_.empty()) {
       return true;
     }
 
     auto query_bits = Binarize(query.data(), bit_threshold_.data(), dim_size_);
+    std::vector<uint64_t> selected;
+    const bool filtered = EvaluateFilter(request, &selected);
+    std::vector<RecordWithDistance> records;
+    if (!multi_index_hashing_ ||
+        !SearchTables(request, query_bits, filtered, selected, &records,
+                      response)) {
+      records.clear();
+      Scan(request, query_bits, filtered, selected, &records, response);
+    }
+
+    size_t partial_size = std::min(request.GetResultLimit(), records.size());
+    std::partial_sort(
+        records.begin(), records.begin() + partial_size, records.end(),
+        [](const RecordWithDistance& x, const RecordWithDistance& y) {
+          return x.distance < y.distance;
+        });
+    records.resize(partial_size);
+
+    response.total_count = total_count_;
+    for (const auto& record : records) {
+      AddNeighbor(record.row, record.distance, response);
+    }
+
+    return true;
+  }
+
+  // The codes are only there once the first search binarized the vectors.
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage = GetMetadataMemoryUsage();
+    for (const auto& kv : index_data_) {
+      usage.vectors += kv.second.values.capacity() * sizeof(float);
+      usage.metadata += kv.second.rows.capacity() * sizeof(int64_t);
+    }
+    // A node per bucket, and the table pointing to them
+    usage.metadata +=
+        index_data_.size() *
+            (sizeof(std::pair<const int, Bucket>) + sizeof(void*)) +
+        index_data_.bucket_count() * sizeof(void*) +
+        locations_.capacity() * sizeof(Location);
+
+    for (const auto& kv : index_) {
+      usage.codes += kv.second.capacity() * sizeof(std::bitset<BitLength>);
+    }
+    usage.codes += bit_threshold_.capacity() * sizeof(float) +
+                   codes_.capacity() * sizeof(codes_[0]);
+    for (const auto& table : tables_) {
+      // Slots of the hash map come with a control byte each
+      usage.codes +=
+          table.buckets.capacity() *
+              (sizeof(typename decltype(table.buckets)::value_type) + 1) +
+          table.rows.capacity() * sizeof(int64_t);
+    }
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats = IndexBase::GetStats();
+    stats.type = "binary";
+    stats.params = {{"bit_length", BitLength},
+                    {"multi_index_hashing", multi_index_hashing_},
+                    {"substring_tables", tables_.size()}};
+    return stats;
+  }
+
+ protected:
+  void CopyVector(int64_t row, float* values) override {
+    const Location& location = locations_[row];
+    const float* data = index_data_.at(location.bucket).values.data() +
+                        location.offset * dim_size_;
+    std::copy(data, data + dim_size_, values);
+  }
+
+ private:
+  // Computes the distance to every code of the labels of `request`.
+  void Scan(const SearchRequest& request,
+            const std::bitset<BitLength>& query_bits, bool filtered,
+            const std::vector<uint64_t>& selected,
+            std::vector<RecordWithDistance>* records,
+            SearchResponse& response) {
     std::vector<BucketRange> ranges;
-    ranges.reserve(index_.size());
     size_t start = 0;
     for (const auto& kv : index_) {
       const auto& label = kv.first;
       if (request.labels.empty() || request.labels.count(label)) {
-        ranges.push_back({label, start, start + index_[label].size()});
-        start += index_[label].size();
+        size_t size = kv.second.size();
+        for (size_t offset = 0; offset < size; offset += kScanChunkSize) {
+          size_t end = start + std::min(kScanChunkSize, size - offset);
+          ranges.push_back({label, offset, start, end});
+          start = end;
+        }
       }
     }
+    if (ranges.empty()) {
+      return;
+    }
 
-    std::vector<RecordWithDistance> records(ranges.back().end);
-    auto retrieve = [&](BucketRange range) {
-      size_t index = range.start;
-      size_t offset = 0;
-      const auto& sub_index = index_[range.bucket];
-      const auto& sub_index_data = index_data_[range.bucket];
-      for (size_t i = 0; i < sub_index.size(); ++i) {
+    // Rows filtered out or past `max_distance` are dropped as they are
+    // scanned, the accepted ones are packed at the front of their range.
+    records->resize(ranges.back().end);
+    std::vector<size_t> counts(ranges.size(), 0);
+    std::atomic<size_t> scanned(0);
+    auto retrieve = [&](size_t index) {
+      const BucketRange& range = ranges[index];
+      if (request.IsExpired()) {
+        return;
+      }
+      const auto& sub_index = index_.at(range.bucket);
+      const auto& rows = index_data_.at(range.bucket).rows;
+      size_t count = 0;
+      for (size_t i = range.offset; i < range.offset + range.end - range.start;
+           ++i) {
+        if (filtered && !IsRowSelected(selected, rows[i])) {
+          continue;
+        }
         float distance = (query_bits ^ sub_index[i]).count();
-        records[index + offset].record = &sub_index_data[i];
-        records[index + offset].distance = distance;
-        ++offset;
+        if (distance > request.max_distance) {
+          continue;
+        }
+        (*records)[range.start + count].row = rows[i];
+        (*records)[range.start + count].distance = distance;
+        ++count;
       }
+      counts[index] = count;
+      scanned += range.end - range.start;
     };
 
     std::atomic_int join(ranges.size());
-    for (const auto& range : ranges) {
-      thread_pool_.Schedule([&]() {
-        retrieve(range);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      thread_pool_.Schedule([&, i]() {
+        {
+          ScopedPerfCounters counters(request.perf);
+          retrieve(i);
+        }
         --join;
       });
     }
 
     while (join) {
     }
+    if (request.perf) {
+      request.perf->AddVectors(scanned);
+    }
 
-    int partial_size =
-        request.top_k < records.size() ? request.top_k : records.size();
-    std::partial_sort(
-        records.begin(), records.begin() + partial_size, records.end(),
-        [](const RecordWithDistance& x, const RecordWithDistance& y) {
-          return x.distance < y.distance;
-        });
+    size_t size = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (size != ranges[i].start) {
+        std::copy(records->begin() + ranges[i].start,
+                  records->begin() + ranges[i].start + counts[i],
+                  records->begin() + size);
+      }
+      size += counts[i];
+    }
+    records->resize(size);
 
-    if (records.size() > request.top_k) {
-      records.resize(request.top_k);
+    if (scanned < ranges.back().end) {
+      response.complete = false;
+      response.scanned_fraction =
+          static_cast<float>(scanned) / ranges.back().end;
     }
 
-    response.total_count = total_count_;
-    auto* neighbors = &response.neighbors;
-    for (const auto& record : records) {
-      neighbors->emplace_back();
-      auto* response_record = &neighbors->back();
-      response_record->CopyFrom(*record.record);
-      response_record->distance = record.distance;
+  }
+
+  // Splits the codes into substrings of about log2(n) bits, so a table has
+  // about one row per substring, as in "Fast Exact Search in Hamming Space
+  // with Multi-Index Hashing" by Norouzi et al.
+  void BuildTables() {
+    codes_.assign(total_count_, nullptr);
+    for (const auto& kv : index_) {
+      const auto& rows = index_data_.at(kv.first).rows;
+      for (size_t i = 0; i < rows.size(); ++i) {
+        codes_[rows[i]] = &kv.second[i];
+      }
+    }
+
+    int length = std::ceil(std::log2(std::max<int64_t>(total_count_, 2)));
+    length = std::min(std::max(length, 8), 32);
+    int count = std::max(1, (dim_size_ + length - 1) / length);
+    tables_.resize(count);
+    std::vector<std::pair<uint32_t, int64_t>> entries(total_count_);
+    for (int t = 0; t < count; ++t) {
+      SubstringTable& table = tables_[t];
+      table.begin = dim_size_ * t / count;
+      table.length = dim_size_ * (t + 1) / count - table.begin;
+      for (int64_t row = 0; row < total_count_; ++row) {
+        entries[row] = {Substring(*codes_[row], table), row};
+      }
+      std::sort(entries.begin(), entries.end());
+      table.rows.resize(total_count_);
+      for (int64_t i = 0; i < total_count_; ++i) {
+        auto& bucket = table.buckets[entries[i].first];
+        if (i == 0 || entries[i].first != entries[i - 1].first) {
+          bucket.first = i;
+        }
+        bucket.second = i + 1;
+        table.rows[i] = entries[i].second;
+      }
+    }
+  }
+
+  static uint32_t Substring(const std::bitset<BitLength>& bits,
+                            const SubstringTable& table) {
+    uint32_t value = 0;
+    for (int i = 0; i < table.length; ++i) {
+      value |= static_cast<uint32_t>(bits[table.begin + i]) << i;
+    }
+    return value;
+  }
+
+  // Probes the substrings of the query within a growing radius r in every
+  // table. A code at distance d has a substring within floor(d / m) of the
+  // query's, with m tables, so once radius r is probed every code closer than
+  // m * (r + 1) is known and the search stops when the results are, too.
+  // Returns false, with nothing found, if the next radius would probe more
+  // buckets than there are rows, in which case a scan is cheaper.
+  bool SearchTables(const SearchRequest& request,
+                    const std::bitset<BitLength>& query_bits, bool filtered,
+                    const std::vector<uint64_t>& selected,
+                    std::vector<RecordWithDistance>* records,
+                    SearchResponse& response) {
+    const size_t limit = request.GetResultLimit();
+    const int count = tables_.size();
+    std::vector<uint32_t> substrings(count);
+    int max_length = 0;
+    for (int t = 0; t < count; ++t) {
+      substrings[t] = Substring(query_bits, tables_[t]);
+      max_length = std::max(max_length, tables_[t].length);
     }
 
+    // Distances of the best `limit` results, farthest on top
+    std::priority_queue<float> best;
+    std::vector<uint64_t> visited((total_count_ + 63) / 64, 0);
+    uint64_t probes = 0;
+    int64_t verified = 0;
+    for (int radius = 0; radius <= max_length; ++radius) {
+      for (const auto& table : tables_) {
+        probes += Combinations(table.length, std::min(radius, table.length),
+                               total_count_);
+      }
+      if (probes > static_cast<uint64_t>(total_count_)) {
+        return false;
+      }
+      if (request.IsExpired()) {
+        response.complete = false;
+        response.scanned_fraction =
+            static_cast<float>(verified) / std::max<int64_t>(total_count_, 1);
+        return true;
+      }
+
+      for (int t = 0; t < count; ++t) {
+        const SubstringTable& table = tables_[t];
+        if (radius > table.length) {
+          continue;
+        }
+        // Every mask of `radius` bits out of `length`, in increasing order
+        const uint64_t end = uint64_t{1} << table.length;
+        for (uint64_t mask = (uint64_t{1} << radius) - 1; mask < end;) {
+          auto it = table.buckets.find(substrings[t] ^ mask);
+          if (it != table.buckets.end()) {
+            for (uint32_t i = it->second.first; i < it->second.second; ++i) {
+              int64_t row = table.rows[i];
+              uint64_t& word = visited[row >> 6];
+              if (word >> (row & 63) & 1) {
+                continue;
+              }
+              word |= uint64_t{1} << (row & 63);
+              ++verified;
+              if ((!request.labels.empty() &&
+                   !request.labels.count(metadata_.GetLabel(row))) ||
+                  (filtered && !IsRowSelected(selected, row))) {
+                continue;
+              }
+              float distance = (query_bits ^ *codes_[row]).count();
+              if (distance > request.max_distance) {
+                continue;
+              }
+              records->push_back({row, distance});
+              if (best.size() < limit) {
+                best.push(distance);
+              } else if (limit > 0 && distance < best.top()) {
+                best.pop();
+                best.push(distance);
+              }
+            }
+          }
+          if (mask == 0) {
+            break;
+          }
+          // Gosper's hack: the next larger mask with as many bits set
+          uint64_t lowest = mask & -mask;
+          uint64_t ripple = mask + lowest;
+          mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+        }
+      }
+
+      const float known = static_cast<float>(count) * (radius + 1);
+      if (request.max_distance < known ||
+          (best.size() == limit && (limit == 0 || best.top() < known))) {
+        break;
+      }
+    }
     return true;
   }
 
- private:
+  // Binarizes the vectors added so far against their mean.
+  void BuildCodes() {
+    if (total_count_) {
+      for (int i = 0; i < dim_size_; ++i) {
+        bit_threshold_[i] /= total_count_;
+      }
+    }
+
+    for (const auto& kv : index_data_) {
+      auto& bits =
+          index_
+              .try_emplace(kv.first,
+                           ArenaAllocator<std::bitset<BitLength>>(&arena_))
+              .first->second;
+      for (size_t i = 0; i < kv.second.rows.size(); ++i) {
+        bits.emplace_back(Binarize(kv.second.values.data() + i * dim_size_,
+                                   bit_threshold_.data(), dim_size_));
+      }
+    }
+    if (multi_index_hashing_) {
+      BuildTables();
+    }
+  }
+
   std::bitset<BitLength> Binarize(const float* vector, const float* mean,
                                   int64_t length) const {
-    std::bitset<BitLength> bits(length);
+    std::bitset<BitLength> bits;
     for (int64_t i = 0; i < length; ++i) {
       if (vector[i] > mean[i]) {
         bits.set(i);
@@ -156,22 +460,54 @@ class BinaryIndex : public IndexBase {
   }
 
  private:
-  std::atomic_bool first_request_;
+  absl::once_flag codes_built_;
+
+  const bool multi_index_hashing_;
 
-  std::unordered_map<int, std::vector<std::bitset<BitLength>>> index_;
+  // Of the codes and the vectors, declared ahead of them
+  Arena arena_;
 
-  std::unordered_map<int, std::vector<FeatureRecord>> index_data_;
+  std::unordered_map<int, ArenaVector<std::bitset<BitLength>>> index_;
+
+  std::unordered_map<int, Bucket> index_data_;
+
+  // Indexed by row
+  std::vector<Location> locations_;
 
   std::vector<float> bit_threshold_;
 
+  // Multi-index hashing, the code of every row is that of `index_`
+  std::vector<SubstringTable> tables_;
+  std::vector<const std::bitset<BitLength>*> codes_;
+
   concurrency::ThreadPool thread_pool_;
 };
 }  // namespace
 
 template class ::image_retrieval::ann::BinaryIndex<2048>;
 
-std::unique_ptr<IndexInterface> NewBinaryIndex2048(int dim_size) {
-  return std::make_unique<BinaryIndex<2048>>(dim_size);
+std::unique_ptr<IndexInterface> NewBinaryIndex2048(int dim_size,
+                                                   bool multi_index_hashing) {
+  return std::make_unique<BinaryIndex<2048>>(dim_size, multi_index_hashing);
+}
+
+std::unique_ptr<IndexInterface> NewBinaryIndex(int dim_size,
+                                               bool multi_index_hashing) {
+  if (dim_size <= 64) {
+    return std::make_unique<BinaryIndex<64>>(dim_size, multi_index_hashing);
+  } else if (dim_size <= 128) {
+    return std::make_unique<BinaryIndex<128>>(dim_size, multi_index_hashing);
+  } else if (dim_size <= 256) {
+    return std::make_unique<BinaryIndex<256>>(dim_size, multi_index_hashing);
+  } else if (dim_size <= 512) {
+    return std::make_unique<BinaryIndex<512>>(dim_size, multi_index_hashing);
+  } else if (dim_size <= 1024) {
+    return std::make_unique<BinaryIndex<1024>>(dim_size, multi_index_hashing);
+  } else if (dim_size <= 2048) {
+    return std::make_unique<BinaryIndex<2048>>(dim_size, multi_index_hashing);
+  }
+  throw std::invalid_argument(
+      absl::StrFormat("Binary codes of %d bits are not supported", dim_size));
 }
 
 }  // namespace ann
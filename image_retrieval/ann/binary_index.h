@@ -13,7 +13,18 @@
 namespace image_retrieval {
 namespace ann {
 
-std::unique_ptr<IndexInterface> NewBinaryIndex2048(int dim_size);
+// If `multi_index_hashing` is set, the codes are also split into substrings
+// with a hash table each, and a search only verifies the codes sharing a
+// nearly equal substring with the query. It is exact, and much faster than a
+// scan when the neighbors are within a few bits, e.g. near duplicates.
+// Searches that would probe too many buckets fall back to a scan.
+std::unique_ptr<IndexInterface> NewBinaryIndex2048(
+    int dim_size, bool multi_index_hashing = false);
+
+// Same, with codes of the smallest of 64, 128, ..., 2048 bits that fits
+// `dim_size`, e.g. of the vectors reduced by an ITQ rotation.
+std::unique_ptr<IndexInterface> NewBinaryIndex(
+    int dim_size, bool multi_index_hashing = false);
 
 }  // namespace ann
 }  // namespace image_retrieval
@@ -0,0 +1,246 @@
+#include "image_retrieval/ann/bitmap.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace image_retrieval {
+namespace ann {
+
+uint32_t Bitmap::Container::Cardinality() const {
+  if (!IsBitset()) {
+    return array.size();
+  }
+  uint32_t count = 0;
+  for (uint64_t word : bits) {
+    count += __builtin_popcountll(word);
+  }
+  return count;
+}
+
+void Bitmap::Container::ToBitset(uint64_t* words) const {
+  if (IsBitset()) {
+    std::copy(bits.begin(), bits.end(), words);
+    return;
+  }
+  std::fill(words, words + kBitsetWords, 0);
+  for (uint16_t low : array) {
+    words[low >> 6] |= uint64_t{1} << (low & 63);
+  }
+}
+
+bool Bitmap::FromBitset(uint16_t key, const uint64_t* words,
+                        Container* container) {
+  size_t count = 0;
+  for (size_t i = 0; i < kBitsetWords; ++i) {
+    count += __builtin_popcountll(words[i]);
+  }
+  if (count == 0) {
+    return false;
+  }
+
+  container->key = key;
+  if (count > kMaxArraySize) {
+    container->bits.assign(words, words + kBitsetWords);
+    return true;
+  }
+  container->array.reserve(count);
+  for (size_t i = 0; i < kBitsetWords; ++i) {
+    for (uint64_t word = words[i]; word; word &= word - 1) {
+      container->array.push_back(i * 64 + __builtin_ctzll(word));
+    }
+  }
+  return true;
+}
+
+Bitmap Bitmap::Range(uint32_t size) {
+  Bitmap bitmap;
+  for (uint64_t start = 0; start < size; start += 1 << 16) {
+    uint64_t count = std::min<uint64_t>(size - start, 1 << 16);
+    std::vector<uint64_t> words(kBitsetWords, 0);
+    for (uint64_t i = 0; i < count / 64; ++i) {
+      words[i] = ~uint64_t{0};
+    }
+    if (count % 64) {
+      words[count / 64] = (uint64_t{1} << (count % 64)) - 1;
+    }
+    Container container;
+    FromBitset(start >> 16, words.data(), &container);
+    bitmap.containers_.push_back(std::move(container));
+  }
+  return bitmap;
+}
+
+void Bitmap::Add(uint32_t value) {
+  uint16_t key = value >> 16;
+  uint16_t low = value & 0xffff;
+  auto it = std::lower_bound(
+      containers_.begin(), containers_.end(), key,
+      [](const Container& container, uint16_t key) {
+        return container.key < key;
+      });
+  if (it == containers_.end() || it->key != key) {
+    it = containers_.insert(it, Container());
+    it->key = key;
+  }
+
+  if (it->IsBitset()) {
+    it->bits[low >> 6] |= uint64_t{1} << (low & 63);
+    return;
+  }
+
+  // Rows are mostly added in increasing order
+  auto& array = it->array;
+  if (array.empty() || array.back() < low) {
+    array.push_back(low);
+  } else {
+    auto position = std::lower_bound(array.begin(), array.end(), low);
+    if (*position == low) {
+      return;
+    }
+    array.insert(position, low);
+  }
+
+  if (array.size() > kMaxArraySize) {
+    std::vector<uint64_t> words(kBitsetWords);
+    it->ToBitset(words.data());
+    it->bits.swap(words);
+    std::vector<uint16_t>().swap(array);
+  }
+}
+
+bool Bitmap::Contains(uint32_t value) const {
+  uint16_t key = value >> 16;
+  uint16_t low = value & 0xffff;
+  auto it = std::lower_bound(
+      containers_.begin(), containers_.end(), key,
+      [](const Container& container, uint16_t key) {
+        return container.key < key;
+      });
+  if (it == containers_.end() || it->key != key) {
+    return false;
+  }
+  if (it->IsBitset()) {
+    return it->bits[low >> 6] >> (low & 63) & 1;
+  }
+  return std::binary_search(it->array.begin(), it->array.end(), low);
+}
+
+uint64_t Bitmap::Cardinality() const {
+  uint64_t count = 0;
+  for (const auto& container : containers_) {
+    count += container.Cardinality();
+  }
+  return count;
+}
+
+Bitmap Bitmap::Combine(const Bitmap& x, const Bitmap& y, Op op) {
+  Bitmap result;
+  std::vector<uint64_t> x_words(kBitsetWords), y_words(kBitsetWords);
+  auto i = x.containers_.begin();
+  auto j = y.containers_.begin();
+  while (i != x.containers_.end() || j != y.containers_.end()) {
+    if (j == y.containers_.end() ||
+        (i != x.containers_.end() && i->key < j->key)) {
+      if (op != Op::kAnd) {
+        result.containers_.push_back(*i);
+      }
+      ++i;
+      continue;
+    }
+    if (i == x.containers_.end() || j->key < i->key) {
+      if (op == Op::kOr) {
+        result.containers_.push_back(*j);
+      }
+      ++j;
+      continue;
+    }
+
+    Container container;
+    container.key = i->key;
+    if (!i->IsBitset() && !j->IsBitset()) {
+      // Merging two sorted arrays
+      const auto& a = i->array;
+      const auto& b = j->array;
+      auto output = std::back_inserter(container.array);
+      if (op == Op::kAnd) {
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), output);
+      } else if (op == Op::kOr) {
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), output);
+      } else {
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(), output);
+      }
+      if (container.array.size() > kMaxArraySize) {
+        std::vector<uint64_t> words(kBitsetWords);
+        container.ToBitset(words.data());
+        container.bits.swap(words);
+        std::vector<uint16_t>().swap(container.array);
+      }
+      if (!container.array.empty() || container.IsBitset()) {
+        result.containers_.push_back(std::move(container));
+      }
+    } else {
+      i->ToBitset(x_words.data());
+      j->ToBitset(y_words.data());
+      for (size_t k = 0; k < kBitsetWords; ++k) {
+        if (op == Op::kAnd) {
+          x_words[k] &= y_words[k];
+        } else if (op == Op::kOr) {
+          x_words[k] |= y_words[k];
+        } else {
+          x_words[k] &= ~y_words[k];
+        }
+      }
+      if (FromBitset(i->key, x_words.data(), &container)) {
+        result.containers_.push_back(std::move(container));
+      }
+    }
+    ++i;
+    ++j;
+  }
+  return result;
+}
+
+Bitmap Bitmap::And(const Bitmap& other) const {
+  return Combine(*this, other, Op::kAnd);
+}
+
+Bitmap Bitmap::Or(const Bitmap& other) const {
+  return Combine(*this, other, Op::kOr);
+}
+
+Bitmap Bitmap::AndNot(const Bitmap& other) const {
+  return Combine(*this, other, Op::kAndNot);
+}
+
+void Bitmap::ToWords(uint32_t size, std::vector<uint64_t>* words) const {
+  size_t word_count = (static_cast<size_t>(size) + 63) / 64;
+  if (!containers_.empty()) {
+    word_count = std::max<size_t>(
+        word_count, (static_cast<size_t>(containers_.back().key) + 1) *
+                        kBitsetWords);
+  }
+  words->assign(word_count, 0);
+
+  for (const auto& container : containers_) {
+    uint64_t* base = words->data() + container.key * kBitsetWords;
+    if (container.IsBitset()) {
+      std::copy(container.bits.begin(), container.bits.end(), base);
+    } else {
+      for (uint16_t low : container.array) {
+        base[low >> 6] |= uint64_t{1} << (low & 63);
+      }
+    }
+  }
+}
+
+size_t Bitmap::GetMemoryUsage() const {
+  size_t bytes = containers_.capacity() * sizeof(Container);
+  for (const auto& container : containers_) {
+    bytes += container.array.capacity() * sizeof(uint16_t) +
+             container.bits.capacity() * sizeof(uint64_t);
+  }
+  return bytes;
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
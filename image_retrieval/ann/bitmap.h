@@ -0,0 +1,73 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_BITMAP_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_BITMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace image_retrieval {
+namespace ann {
+
+/**
+ * A compressed set of 32-bit row ids, laid out like a roaring bitmap: the ids
+ * are grouped by their high 16 bits, and every group is stored either as a
+ * sorted array of the low 16 bits while it is sparse, or as a 65536-bit
+ * bitset once it holds more than 4096 ids.
+ */
+class Bitmap {
+ public:
+  // Rows [0, size).
+  static Bitmap Range(uint32_t size);
+
+  void Add(uint32_t value);
+
+  bool Contains(uint32_t value) const;
+
+  uint64_t Cardinality() const;
+
+  bool IsEmpty() const { return containers_.empty(); }
+
+  Bitmap And(const Bitmap& other) const;
+
+  Bitmap Or(const Bitmap& other) const;
+
+  Bitmap AndNot(const Bitmap& other) const;
+
+  // Expands into plain 64-bit words, with bit `r % 64` of `words[r / 64]` set
+  // for every row `r`. `words` is resized to cover at least `size` rows.
+  void ToWords(uint32_t size, std::vector<uint64_t>* words) const;
+
+  // Bytes of the containers, not counting the Bitmap itself.
+  size_t GetMemoryUsage() const;
+
+ private:
+  static constexpr size_t kMaxArraySize = 4096;
+  static constexpr size_t kBitsetWords = 1024;
+
+  struct Container {
+    uint16_t key;
+    // Exactly one of them is in use
+    std::vector<uint16_t> array;
+    std::vector<uint64_t> bits;
+
+    bool IsBitset() const { return !bits.empty(); }
+    uint32_t Cardinality() const;
+    // Copies the ids into a bitset of kBitsetWords words.
+    void ToBitset(uint64_t* words) const;
+  };
+
+  enum class Op { kAnd, kOr, kAndNot };
+
+  static Bitmap Combine(const Bitmap& x, const Bitmap& y, Op op);
+
+  // Builds a container from a bitset, or returns false if it is empty.
+  static bool FromBitset(uint16_t key, const uint64_t* words,
+                         Container* container);
+
+  std::vector<Container> containers_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_BITMAP_H_
@@ -0,0 +1,93 @@
+#include "image_retrieval/ann/bitmap.h"
+
+#include <set>
+
+#include "absl/random/random.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+// Draws `count` rows, dense within the first container and sparse beyond it,
+// so that both the array and the bitset layouts get exercised.
+void MakeRows(absl::BitGen& gen, int count, Bitmap* bitmap,
+              std::set<uint32_t>* rows) {
+  for (int i = 0; i < count; ++i) {
+    uint32_t row = i % 2 ? absl::Uniform<uint32_t>(gen, 0, 1 << 14)
+                         : absl::Uniform<uint32_t>(gen, 0, 1 << 20);
+    bitmap->Add(row);
+    rows->insert(row);
+  }
+}
+
+void ExpectEqual(const Bitmap& bitmap, const std::set<uint32_t>& rows,
+                 uint32_t size) {
+  EXPECT_EQ(bitmap.Cardinality(), rows.size());
+  std::vector<uint64_t> words;
+  bitmap.ToWords(size, &words);
+  ASSERT_GE(words.size() * 64, size);
+  for (uint32_t row = 0; row < size; ++row) {
+    bool expected = rows.count(row);
+    ASSERT_EQ(bitmap.Contains(row), expected) << row;
+    ASSERT_EQ(words[row / 64] >> (row % 64) & 1, expected) << row;
+  }
+}
+
+TEST(Bitmap, AddAndContains) {
+  Bitmap bitmap;
+  EXPECT_TRUE(bitmap.IsEmpty());
+  std::set<uint32_t> rows;
+  for (uint32_t row = 10000; row > 0; row -= 2) {
+    bitmap.Add(row);
+    rows.insert(row);
+    // Crosses from an array to a bitset on the way
+    if (rows.size() == 4096 || rows.size() == 4097) {
+      ExpectEqual(bitmap, rows, 1 << 14);
+    }
+  }
+  bitmap.Add(10);
+  EXPECT_EQ(bitmap.Cardinality(), rows.size());
+  EXPECT_FALSE(bitmap.IsEmpty());
+  ExpectEqual(bitmap, rows, 1 << 14);
+}
+
+TEST(Bitmap, Range) {
+  std::set<uint32_t> rows;
+  for (uint32_t row = 0; row < 70000; ++row) {
+    rows.insert(row);
+  }
+  ExpectEqual(Bitmap::Range(70000), rows, 70100);
+  EXPECT_TRUE(Bitmap::Range(0).IsEmpty());
+}
+
+TEST(Bitmap, SetOperations) {
+  absl::BitGen gen;
+  for (int count : {100, 10000, 50000}) {
+    Bitmap x, y;
+    std::set<uint32_t> x_rows, y_rows;
+    MakeRows(gen, count, &x, &x_rows);
+    MakeRows(gen, count / 2, &y, &y_rows);
+
+    std::set<uint32_t> expected;
+    std::set_intersection(x_rows.begin(), x_rows.end(), y_rows.begin(),
+                          y_rows.end(),
+                          std::inserter(expected, expected.end()));
+    ExpectEqual(x.And(y), expected, 1 << 20);
+
+    expected.clear();
+    std::set_union(x_rows.begin(), x_rows.end(), y_rows.begin(), y_rows.end(),
+                   std::inserter(expected, expected.end()));
+    ExpectEqual(x.Or(y), expected, 1 << 20);
+
+    expected.clear();
+    std::set_difference(x_rows.begin(), x_rows.end(), y_rows.begin(),
+                        y_rows.end(), std::inserter(expected, expected.end()));
+    ExpectEqual(x.AndNot(y), expected, 1 << 20);
+  }
+  EXPECT_TRUE(Bitmap::Range(1000).AndNot(Bitmap::Range(1000)).IsEmpty());
+}
+
+}  // namespace
+}  // namespace ann
+}  // namespace image_retrieval
@@ -0,0 +1,46 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_COSINE_SPACE_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_COSINE_SPACE_H_
+
+#include <cstddef>
+#include "image_retrieval/ann/vector_distance.h"
+#include "third_party/hnswlib/hnswlib.h"
+
+namespace image_retrieval {
+namespace ann {
+
+// The kernel of GetCosineDistanceFn() and the dim size it is called with,
+// first as hnswlib reads it out of the param of every space.
+struct CosineKernel {
+  size_t dim_size;
+  CosineDistanceFn distance;
+};
+
+inline float HnswCosineDistance(const void* x, const void* y,
+                                const void* param) {
+  const auto* kernel = static_cast<const CosineKernel*>(param);
+  return kernel->distance(static_cast<const float*>(x),
+                          static_cast<const float*>(y), kernel->dim_size);
+}
+
+// Lets hnswlib build the graph by the same distance as the other indexes.
+class CosineSpace : public hnswlib::SpaceInterface<float> {
+ public:
+  explicit CosineSpace(size_t dim_size)
+      : kernel_{dim_size, GetCosineDistanceFn(dim_size)} {}
+
+  size_t get_data_size() override { return kernel_.dim_size * sizeof(float); }
+
+  hnswlib::DISTFUNC<float> get_dist_func() override {
+    return HnswCosineDistance;
+  }
+
+  void* get_dist_func_param() override { return &kernel_; }
+
+ private:
+  CosineKernel kernel_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_COSINE_SPACE_H_
@@ -0,0 +1,793 @@
+#include "image_retrieval/ann/disk_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <numeric>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "image_retrieval/ann/cosine_space.h"
+#include "image_retrieval/ann/hnsw_index.h"
+#include "image_retrieval/ann/vector_distance.h"
+#include "image_retrieval/clustering/kmeans.h"
+#include "image_retrieval/concurrency/thread_pool.h"
+#include "image_retrieval/memory/arena.h"
+#include "third_party/hnswlib/hnswlib.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::concurrency::ThreadPool;
+using ::image_retrieval::feature_extraction::FeatureRecord;
+using ::image_retrieval::memory::Arena;
+using ::image_retrieval::memory::ArenaAllocator;
+using ::image_retrieval::memory::ArenaVector;
+using ::image_retrieval::profiling::ScopedPerfCounters;
+
+constexpr size_t kSectorSize = 4096;
+// "DISKNDX1"
+constexpr uint64_t kMagic = 0x3158444e4b534944;
+// Rows the codebooks are trained on
+constexpr int64_t kPqTrainSize = 65536;
+constexpr int kPqCentroids = 256;
+// Rows encoded per matrix multiplication
+constexpr int64_t kPqEncodeBlock = 65536;
+// Of the graph being built, doubled whenever it is full
+constexpr size_t kInitialCapacity = 1 << 16;
+// Upper bound of the candidate list, whatever the number of results asked
+constexpr size_t kMaxSearchList = 1024;
+
+// The first sector of the file.
+struct Header {
+  uint64_t magic;
+  int32_t dim_size;
+  int32_t max_degree;
+  int64_t size;
+  // Node the searches start from
+  int64_t entry;
+  // A node is its vector, its degree and `max_degree` neighbor slots. Small
+  // nodes are packed `nodes_per_sector` to a sector, large ones take
+  // `sectors_per_node` sectors each, the other count is 0.
+  int64_t node_size;
+  int64_t nodes_per_sector;
+  int64_t sectors_per_node;
+  int32_t pq_subspaces;
+  int32_t pq_centroids;
+  // The codebook, the codes and the metadata follow the nodes from here
+  int64_t tail_offset;
+};
+static_assert(sizeof(Header) <= kSectorSize, "Header exceeds a sector");
+
+struct AlignedFree {
+  void operator()(char* data) const { std::free(data); }
+};
+
+// Sector aligned, as O_DIRECT reads require.
+using AlignedBuffer = std::unique_ptr<char, AlignedFree>;
+
+AlignedBuffer AllocateSectors(size_t size) {
+  return AlignedBuffer(static_cast<char*>(std::aligned_alloc(kSectorSize, size)));
+}
+
+Header ReadHeader(const std::string& path) {
+  Header header;
+  std::ifstream input(path, std::ios::binary);
+  if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      header.magic != kMagic) {
+    throw std::runtime_error(
+        absl::StrFormat("%s is not a disk index file", path));
+  }
+  return header;
+}
+
+// Bounds of the subspaces a vector is split into by product quantization.
+std::vector<int> SubspaceOffsets(int dim_size, int subspaces) {
+  std::vector<int> offsets(subspaces + 1);
+  for (int j = 0; j <= subspaces; ++j) {
+    offsets[j] = static_cast<int64_t>(j) * dim_size / subspaces;
+  }
+  return offsets;
+}
+
+struct Candidate {
+  float distance;
+  int64_t row;
+  bool expanded;
+};
+
+class DiskIndex : public IndexBase {
+ public:
+  // Builds a new index if `open` is false, or else serves the file at
+  // `options.path` from the first search on.
+  DiskIndex(int dim_size, const DiskIndexOptions& options, bool open)
+      : IndexBase(dim_size),
+        options_(options),
+        serving_(false),
+        capacity_(kInitialCapacity),
+        fd_(-1),
+        codes_(ArenaAllocator<uint8_t>(&arena_)),
+        cache_data_(ArenaAllocator<char>(&arena_)),
+        distance_(GetCosineDistanceFn(dim_size)),
+        io_pool_(options.io_threads) {
+    if (!open) {
+      space_ = std::make_unique<CosineSpace>(dim_size_);
+      builder_ = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+          space_.get(), capacity_, options_.M, options_.ef_construction);
+    }
+  }
+
+  ~DiskIndex() override {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool Add(const FeatureRecord& record) override {
+    absl::MutexLock l(&mu_);
+    if (!builder_) {
+      throw std::runtime_error(
+          "Records cannot be added to a disk index once it is written");
+    }
+
+    int64_t row = AddMetadata(record);
+    if (row >= capacity_) {
+      capacity_ *= 2;
+      builder_->resizeIndex(capacity_);
+    }
+    builder_->addPoint(record.value().data(), row);
+    ++total_count_;
+
+    return true;
+  }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    Serve();
+    const auto& query = request.query;
+    if (query.size() != dim_size_) {
+      throw std::runtime_error(
+          absl::StrFormat("Query feature dim size should be equal to index "
+                          "feature, while got %d vs %d",
+                          query.size(), dim_size_));
+    }
+    response.total_count = total_count_;
+    if (total_count_ == 0) {
+      return true;
+    }
+
+    // Of the beam search, the node reads run on the I/O threads
+    ScopedPerfCounters counters(request.perf);
+    std::vector<float> table = MakeDistanceTable(query.data());
+    const int subspaces = header_.pq_subspaces;
+    const int centroids = header_.pq_centroids;
+    auto approximate = [&](int64_t row) {
+      const uint8_t* code = codes_.data() + row * subspaces;
+      float dot = 0.f;
+      for (int j = 0; j < subspaces; ++j) {
+        dot += table[j * centroids + code[j]];
+      }
+      return 1.f - dot;
+    };
+
+    // Closest first, by the quantized distances
+    const int search_list = request.params.search_list > 0
+                                ? request.params.search_list
+                                : options_.search_list;
+    const size_t beam_width = request.params.beam_width > 0
+                                  ? request.params.beam_width
+                                  : options_.beam_width;
+    const size_t list_size = std::max<size_t>(
+        search_list,
+        std::min(request.GetResultLimit(), kMaxSearchList));
+    std::vector<Candidate> candidates;
+    absl::flat_hash_set<int64_t> visited;
+    auto visit = [&](int64_t row) {
+      if (!visited.insert(row).second) {
+        return;
+      }
+      float distance = approximate(row);
+      if (candidates.size() >= list_size &&
+          distance >= candidates.back().distance) {
+        return;
+      }
+      auto it = std::upper_bound(
+          candidates.begin(), candidates.end(), distance,
+          [](float distance, const Candidate& candidate) {
+            return distance < candidate.distance;
+          });
+      candidates.insert(it, {distance, row, false});
+      if (candidates.size() > list_size) {
+        candidates.pop_back();
+      }
+    };
+    visit(header_.entry);
+
+    std::vector<uint64_t> selected;
+    const bool filtered = EvaluateFilter(request, &selected);
+    auto accept = [&](int64_t row) {
+      return (request.labels.empty() ||
+              request.labels.count(metadata_.GetLabel(row))) &&
+             (!filtered || IsRowSelected(selected, row));
+    };
+
+    // The full vectors read with the nodes give the exact distances of every
+    // expanded node, nothing else is read for reranking
+    std::vector<std::pair<float, int64_t>> results;
+    std::vector<int64_t> beam;
+    std::vector<AlignedBuffer> buffers;
+    std::vector<const char*> nodes;
+    size_t expanded = 0;
+
+    // A filter selecting no more rows than a search would expand anyway is
+    // answered exactly by reading those rows, as the walk would rarely come
+    // by them
+    std::vector<int64_t> rows;
+    if (filtered) {
+      for (size_t i = 0; i < selected.size() && rows.size() <= list_size;
+           ++i) {
+        for (uint64_t word = selected[i]; word; word &= word - 1) {
+          int64_t row = i * 64 + __builtin_ctzll(word);
+          if (row < total_count_ && accept(row)) {
+            rows.push_back(row);
+          }
+        }
+      }
+    }
+    if (filtered && rows.size() <= list_size) {
+      for (size_t start = 0; start < rows.size(); start += list_size) {
+        beam.assign(rows.begin() + start,
+                    rows.begin() + std::min(rows.size(), start + list_size));
+        ReadNodes(beam, &buffers, &nodes);
+        for (size_t i = 0; i < beam.size(); ++i) {
+          float distance = distance_(
+              query.data(), reinterpret_cast<const float*>(nodes[i]),
+              dim_size_);
+          if (distance <= request.max_distance) {
+            results.emplace_back(distance, beam[i]);
+          }
+        }
+      }
+      candidates.clear();
+    }
+
+    while (true) {
+      beam.clear();
+      for (auto& candidate : candidates) {
+        if (!candidate.expanded) {
+          candidate.expanded = true;
+          beam.push_back(candidate.row);
+          if (beam.size() == beam_width) {
+            break;
+          }
+        }
+      }
+      if (beam.empty()) {
+        break;
+      }
+      if (request.IsExpired()) {
+        response.complete = false;
+        response.scanned_fraction =
+            static_cast<float>(expanded) / (expanded + beam.size());
+        break;
+      }
+
+      ReadNodes(beam, &buffers, &nodes);
+      for (size_t i = 0; i < beam.size(); ++i) {
+        const int64_t row = beam[i];
+        const float* values = reinterpret_cast<const float*>(nodes[i]);
+        if (accept(row)) {
+          float distance =
+              distance_(query.data(), values, dim_size_);
+          if (distance <= request.max_distance) {
+            results.emplace_back(distance, row);
+          }
+        }
+
+        const uint32_t* links =
+            reinterpret_cast<const uint32_t*>(values + dim_size_);
+        for (uint32_t j = 0; j < links[0]; ++j) {
+          visit(links[1 + j]);
+        }
+      }
+      expanded += beam.size();
+    }
+
+    size_t partial_size = std::min(request.GetResultLimit(), results.size());
+    std::partial_sort(results.begin(), results.begin() + partial_size,
+                      results.end());
+    results.resize(partial_size);
+    for (const auto& result : results) {
+      AddNeighbor(result.second, result.first, response);
+    }
+
+    return true;
+  }
+
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    Serve();
+    return IndexBase::Get(id, record);
+  }
+
+  // Of the graph being built, or else of what is kept out of the file.
+  MemoryUsage GetMemoryUsage() const override {
+    absl::MutexLock l(&mu_);
+    MemoryUsage usage = GetMetadataMemoryUsage();
+    if (builder_) {
+      usage += GetGraphMemoryUsage(*builder_);
+      return usage;
+    }
+    usage.codes += codebook_.capacity() * sizeof(float) + codes_.capacity();
+    // Slots of the hash map come with a control byte each
+    usage.buffers +=
+        cached_.capacity() * (sizeof(decltype(cached_)::value_type) + 1) +
+        cache_data_.capacity();
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats = IndexBase::GetStats();
+    stats.type = "disk";
+    absl::MutexLock l(&mu_);
+    stats.params = {{"path", options_.path},
+                    {"M", options_.M},
+                    {"ef_construction", options_.ef_construction},
+                    {"search_list", options_.search_list},
+                    {"beam_width", options_.beam_width},
+                    {"io_threads", options_.io_threads},
+                    {"serving", serving_.load()}};
+    if (serving_) {
+      stats.params["pq_subspaces"] = header_.pq_subspaces;
+      stats.params["pq_centroids"] = header_.pq_centroids;
+      stats.params["cached_nodes"] = cached_.size();
+    }
+    return stats;
+  }
+
+ protected:
+  void CopyVector(int64_t row, float* values) override {
+    std::vector<AlignedBuffer> buffers;
+    std::vector<const char*> nodes;
+    ReadNodes({row}, &buffers, &nodes);
+    std::memcpy(values, nodes[0], dim_size_ * sizeof(float));
+  }
+
+ private:
+  // Writes the index being built and serves it from then on.
+  void Serve() {
+    if (serving_) {
+      return;
+    }
+    absl::MutexLock l(&mu_);
+    if (serving_) {
+      return;
+    }
+    if (builder_) {
+      Write();
+      builder_.reset();
+      space_.reset();
+    }
+    Open(/*load_metadata=*/metadata_.GetSize() == 0);
+    serving_ = true;
+  }
+
+  void Write() {
+    const int64_t size = total_count_;
+    const int max_degree = builder_->maxM0_;
+    std::vector<hnswlib::tableint> internal_ids(size);
+    for (hnswlib::tableint i = 0; i < builder_->cur_element_count; ++i) {
+      internal_ids[builder_->getExternalLabel(i)] = i;
+    }
+    auto vector_of = [&](int64_t row) {
+      return reinterpret_cast<const float*>(
+          builder_->getDataByInternalId(internal_ids[row]));
+    };
+
+    // Unit vectors, which product quantization and the entry are based on
+    std::vector<float> norms(size);
+    std::vector<double> centroid(dim_size_, 0.);
+    for (int64_t row = 0; row < size; ++row) {
+      const float* values = vector_of(row);
+      norms[row] = std::sqrt(
+          std::inner_product(values, values + dim_size_, values, 0.f));
+      for (int i = 0; norms[row] > 0.f && i < dim_size_; ++i) {
+        centroid[i] += values[i] / norms[row];
+      }
+    }
+    std::vector<float> mean(centroid.begin(), centroid.end());
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.dim_size = dim_size_;
+    header.max_degree = max_degree;
+    header.size = size;
+    // The medoid of the directions, roughly
+    header.entry = 0;
+    float entry_distance = std::numeric_limits<float>::infinity();
+    for (int64_t row = 0; row < size; ++row) {
+      float distance =
+          distance_(mean.data(), vector_of(row), dim_size_);
+      if (distance < entry_distance) {
+        entry_distance = distance;
+        header.entry = row;
+      }
+    }
+    header.node_size = sizeof(float) * dim_size_ + sizeof(uint32_t) +
+                       sizeof(uint32_t) * max_degree;
+    int64_t node_sectors;
+    if (header.node_size <= kSectorSize) {
+      header.nodes_per_sector = kSectorSize / header.node_size;
+      node_sectors =
+          (size + header.nodes_per_sector - 1) / header.nodes_per_sector;
+    } else {
+      header.sectors_per_node =
+          (header.node_size + kSectorSize - 1) / kSectorSize;
+      node_sectors = size * header.sectors_per_node;
+    }
+    header.pq_subspaces =
+        options_.pq_subspaces > 0
+            ? std::min(options_.pq_subspaces, dim_size_)
+            : std::min(dim_size_, std::max(16, dim_size_ / 32));
+    header.pq_centroids = std::min<int64_t>(kPqCentroids, size);
+    header.tail_offset = (1 + node_sectors) * kSectorSize;
+
+    // Written aside and renamed over, so that an index still serving the old
+    // file, e.g. before a reload swaps it out, keeps reading it
+    const std::string temp_path = options_.path + ".tmp";
+    std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+      throw std::runtime_error(
+          absl::StrFormat("Failed to create %s", temp_path));
+    }
+    std::vector<char> sector(kSectorSize, 0);
+    std::memcpy(sector.data(), &header, sizeof(header));
+    output.write(sector.data(), sector.size());
+
+    const size_t read_size = header.nodes_per_sector
+                                 ? kSectorSize
+                                 : header.sectors_per_node * kSectorSize;
+    const int64_t nodes_per_read =
+        header.nodes_per_sector ? header.nodes_per_sector : 1;
+    std::vector<char> buffer(read_size);
+    for (int64_t row = 0; row < size;) {
+      std::fill(buffer.begin(), buffer.end(), 0);
+      for (int64_t i = 0; i < nodes_per_read && row < size; ++i, ++row) {
+        char* node = buffer.data() + i * header.node_size;
+        std::memcpy(node, vector_of(row), sizeof(float) * dim_size_);
+        hnswlib::linklistsizeint* links =
+            builder_->get_linklist0(internal_ids[row]);
+        uint32_t degree = builder_->getListCount(links);
+        auto* neighbors = reinterpret_cast<hnswlib::tableint*>(links + 1);
+        uint32_t* slots =
+            reinterpret_cast<uint32_t*>(node + sizeof(float) * dim_size_);
+        slots[0] = degree;
+        for (uint32_t j = 0; j < degree; ++j) {
+          slots[1 + j] = builder_->getExternalLabel(neighbors[j]);
+        }
+      }
+      output.write(buffer.data(), buffer.size());
+    }
+
+    std::vector<float> codebook;
+    std::vector<uint8_t> codes;
+    TrainProductQuantizer(header, vector_of, norms, &codebook, &codes);
+    output.write(reinterpret_cast<const char*>(codebook.data()),
+                 sizeof(float) * codebook.size());
+    output.write(reinterpret_cast<const char*>(codes.data()), codes.size());
+
+    // Metadata goes without the vectors, length prefixed
+    FeatureRecord record;
+    std::string serialized;
+    for (int64_t row = 0; row < size; ++row) {
+      record.Clear();
+      metadata_.CopyTo(row, &record);
+      record.SerializeToString(&serialized);
+      uint32_t length = serialized.size();
+      output.write(reinterpret_cast<const char*>(&length), sizeof(length));
+      output.write(serialized.data(), serialized.size());
+    }
+
+    output.close();
+    if (!output) {
+      throw std::runtime_error(
+          absl::StrFormat("Failed to write %s", temp_path));
+    }
+    if (std::rename(temp_path.c_str(), options_.path.c_str()) != 0) {
+      throw std::runtime_error(absl::StrFormat("Failed to rename %s to %s",
+                                               temp_path, options_.path));
+    }
+  }
+
+  // Splits the unit vectors into `pq_subspaces` slices, and trains a k-means
+  // codebook of `pq_centroids` per slice on a sample of them. Centroid `c` of
+  // every slice lands in `codebook[c * dim_size_ ...]`, at the offset of its
+  // slice, and `codes` holds the nearest centroid of every slice per row.
+  template <typename VectorOf>
+  void TrainProductQuantizer(const Header& header, const VectorOf& vector_of,
+                             const std::vector<float>& norms,
+                             std::vector<float>* codebook,
+                             std::vector<uint8_t>* codes) const {
+    const int64_t size = header.size;
+    const int subspaces = header.pq_subspaces;
+    const int centroids = header.pq_centroids;
+    const std::vector<int> offsets = SubspaceOffsets(dim_size_, subspaces);
+    codebook->assign(static_cast<size_t>(centroids) * dim_size_, 0.f);
+    codes->assign(size * subspaces, 0);
+    if (size == 0) {
+      return;
+    }
+
+    auto unit = [&](int64_t row, int offset) {
+      return norms[row] > 0.f ? vector_of(row)[offset] / norms[row] : 0.f;
+    };
+    const int64_t train_size = std::min(size, kPqTrainSize);
+    std::vector<int> membership(kPqEncodeBlock);
+    std::vector<float> distances(kPqEncodeBlock);
+    for (int j = 0; j < subspaces; ++j) {
+      const int width = offsets[j + 1] - offsets[j];
+      Eigen::MatrixXf sample(train_size, width);
+      for (int64_t i = 0; i < train_size; ++i) {
+        int64_t row = i * size / train_size;
+        for (int d = 0; d < width; ++d) {
+          sample(i, d) = unit(row, offsets[j] + d);
+        }
+      }
+      clustering::KMeans kmeans(centroids, 10);
+      kmeans.Train(sample);
+      const Eigen::MatrixXf& trained = kmeans.GetCentroids();
+      for (int c = 0; c < centroids; ++c) {
+        for (int d = 0; d < width; ++d) {
+          (*codebook)[static_cast<size_t>(c) * dim_size_ + offsets[j] + d] =
+              trained(c, d);
+        }
+      }
+
+      Eigen::VectorXf centroid_norms = trained.rowwise().squaredNorm();
+      for (int64_t start = 0; start < size; start += kPqEncodeBlock) {
+        int64_t count = std::min(kPqEncodeBlock, size - start);
+        Eigen::MatrixXf block(count, width);
+        for (int64_t i = 0; i < count; ++i) {
+          for (int d = 0; d < width; ++d) {
+            block(i, d) = unit(start + i, offsets[j] + d);
+          }
+        }
+        clustering::AssignNearest(block, trained, centroid_norms,
+                                  membership.data(), distances.data());
+        for (int64_t i = 0; i < count; ++i) {
+          (*codes)[(start + i) * subspaces + j] = membership[i];
+        }
+      }
+    }
+  }
+
+  void Open(bool load_metadata) {
+    header_ = ReadHeader(options_.path);
+    if (header_.dim_size != dim_size_) {
+      throw std::runtime_error(absl::StrFormat(
+          "%s holds vectors of dim size %d, while the index has %d",
+          options_.path, header_.dim_size, dim_size_));
+    }
+
+    // Node reads bypass the page cache where the file system allows it
+    fd_ = open(options_.path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd_ < 0) {
+      fd_ = open(options_.path.c_str(), O_RDONLY);
+    }
+    if (fd_ < 0) {
+      throw std::runtime_error(
+          absl::StrFormat("Failed to open %s", options_.path));
+    }
+    read_size_ = header_.nodes_per_sector
+                     ? kSectorSize
+                     : header_.sectors_per_node * kSectorSize;
+
+    std::ifstream input(options_.path, std::ios::binary);
+    input.seekg(header_.tail_offset);
+    codebook_.resize(static_cast<size_t>(header_.pq_centroids) * dim_size_);
+    codes_.resize(header_.size * header_.pq_subspaces);
+    input.read(reinterpret_cast<char*>(codebook_.data()),
+               sizeof(float) * codebook_.size());
+    input.read(reinterpret_cast<char*>(codes_.data()), codes_.size());
+    if (load_metadata) {
+      FeatureRecord record;
+      std::string serialized;
+      for (int64_t row = 0; row < header_.size; ++row) {
+        uint32_t length;
+        input.read(reinterpret_cast<char*>(&length), sizeof(length));
+        serialized.resize(length);
+        input.read(&serialized[0], length);
+        if (!input || !record.ParseFromString(serialized)) {
+          throw std::runtime_error(
+              absl::StrFormat("%s is truncated", options_.path));
+        }
+        AddMetadata(record);
+      }
+      total_count_ = header_.size;
+    }
+    if (!input) {
+      throw std::runtime_error(
+          absl::StrFormat("%s is truncated", options_.path));
+    }
+
+    CacheNodes();
+  }
+
+  // Keeps the nodes within the fewest hops of the entry in memory, which
+  // every search passes by first.
+  void CacheNodes() {
+    if (header_.size == 0) {
+      return;
+    }
+    const size_t limit =
+        std::min<int64_t>(std::max(options_.cache_nodes, 0), header_.size);
+    std::deque<int64_t> queue = {header_.entry};
+    absl::flat_hash_set<int64_t> seen = {header_.entry};
+    std::vector<AlignedBuffer> buffers;
+    std::vector<const char*> nodes;
+    while (!queue.empty() && cached_.size() < limit) {
+      int64_t row = queue.front();
+      queue.pop_front();
+      ReadNodes({row}, &buffers, &nodes);
+      cached_[row] = cache_data_.size();
+      cache_data_.insert(cache_data_.end(), nodes[0],
+                         nodes[0] + header_.node_size);
+
+      const uint32_t* links = reinterpret_cast<const uint32_t*>(
+          nodes[0] + sizeof(float) * dim_size_);
+      for (uint32_t j = 0; j < links[0]; ++j) {
+        if (seen.insert(links[1 + j]).second) {
+          queue.push_back(links[1 + j]);
+        }
+      }
+    }
+  }
+
+  // Dot products of the unit query with every centroid of every subspace.
+  std::vector<float> MakeDistanceTable(const float* query) const {
+    float norm =
+        std::sqrt(std::inner_product(query, query + dim_size_, query, 0.f));
+    const int subspaces = header_.pq_subspaces;
+    const int centroids = header_.pq_centroids;
+    const std::vector<int> offsets = SubspaceOffsets(dim_size_, subspaces);
+    std::vector<float> table(static_cast<size_t>(subspaces) * centroids, 0.f);
+    if (norm == 0.f) {
+      return table;
+    }
+    for (int j = 0; j < subspaces; ++j) {
+      for (int c = 0; c < centroids; ++c) {
+        const float* centroid =
+            codebook_.data() + static_cast<size_t>(c) * dim_size_;
+        float dot = 0.f;
+        for (int d = offsets[j]; d < offsets[j + 1]; ++d) {
+          dot += query[d] * centroid[d];
+        }
+        table[j * centroids + c] = dot / norm;
+      }
+    }
+    return table;
+  }
+
+  // Points `nodes` at the nodes of `rows`. Those not cached are read in
+  // parallel by the I/O threads into `buffers`.
+  void ReadNodes(const std::vector<int64_t>& rows,
+                 std::vector<AlignedBuffer>* buffers,
+                 std::vector<const char*>* nodes) {
+    nodes->assign(rows.size(), nullptr);
+    buffers->resize(std::max(buffers->size(), rows.size()));
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < rows.size(); ++i) {
+      auto it = cached_.find(rows[i]);
+      if (it != cached_.end()) {
+        (*nodes)[i] = cache_data_.data() + it->second;
+      } else {
+        misses.push_back(i);
+        if (!(*buffers)[i]) {
+          (*buffers)[i] = AllocateSectors(read_size_);
+        }
+      }
+    }
+
+    std::vector<int> errors(rows.size(), 0);
+    auto read = [&](size_t i) {
+      int64_t row = rows[i];
+      int64_t sector, offset;
+      if (header_.nodes_per_sector) {
+        sector = 1 + row / header_.nodes_per_sector;
+        offset = row % header_.nodes_per_sector * header_.node_size;
+      } else {
+        sector = 1 + row * header_.sectors_per_node;
+        offset = 0;
+      }
+      char* buffer = (*buffers)[i].get();
+      size_t done = 0;
+      while (done < read_size_) {
+        ssize_t n = pread(fd_, buffer + done, read_size_ - done,
+                          sector * kSectorSize + done);
+        if (n <= 0) {
+          errors[i] = n < 0 ? errno : EIO;
+          return;
+        }
+        done += n;
+      }
+      (*nodes)[i] = buffer + offset;
+    };
+
+    if (misses.size() == 1) {
+      read(misses[0]);
+    } else if (!misses.empty()) {
+      absl::BlockingCounter counter(misses.size());
+      for (size_t i : misses) {
+        io_pool_.Schedule([&, i]() {
+          read(i);
+          counter.DecrementCount();
+        });
+      }
+      counter.Wait();
+    }
+
+    for (size_t i : misses) {
+      if (errors[i]) {
+        throw std::runtime_error(
+            absl::StrFormat("Failed to read node %d of %s: %s", rows[i],
+                            options_.path, std::strerror(errors[i])));
+      }
+    }
+  }
+
+  DiskIndexOptions options_;
+
+  mutable absl::Mutex mu_;
+  std::atomic_bool serving_;
+
+  // While building
+  size_t capacity_;
+  std::unique_ptr<CosineSpace> space_;
+  std::unique_ptr<hnswlib::HierarchicalNSW<float>> builder_;
+
+  // While serving
+  Header header_;
+  int fd_;
+  size_t read_size_;
+  // Of the codes and the cached nodes, which every search reads
+  Arena arena_;
+  std::vector<float> codebook_;
+  ArenaVector<uint8_t> codes_;
+  // Row to the offset of its node in `cache_data_`
+  absl::flat_hash_map<int64_t, size_t> cached_;
+  ArenaVector<char> cache_data_;
+  CosineDistanceFn distance_;
+  ThreadPool io_pool_;
+};
+
+}  // namespace
+
+std::unique_ptr<IndexInterface> NewDiskIndex(int dim_size,
+                                             const DiskIndexOptions& options) {
+  return std::make_unique<DiskIndex>(dim_size, options, /*open=*/false);
+}
+
+std::unique_ptr<IndexInterface> OpenDiskIndex(const DiskIndexOptions& options) {
+  return std::make_unique<DiskIndex>(ReadHeader(options.path).dim_size,
+                                     options, /*open=*/true);
+}
+
+bool IsDiskIndexFile(const std::string& path) {
+  uint64_t magic = 0;
+  std::ifstream input(path, std::ios::binary);
+  return input.read(reinterpret_cast<char*>(&magic), sizeof(magic)) &&
+         magic == kMagic;
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
@@ -0,0 +1,51 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_DISK_INDEX_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_DISK_INDEX_H_
+
+#include <string>
+#include "image_retrieval/ann/index_interface.h"
+
+namespace image_retrieval {
+namespace ann {
+
+struct DiskIndexOptions {
+  // File of the on-disk layout
+  std::string path;
+  // Of the graph, see hnswlib. Every node keeps up to 2 * M neighbors.
+  int M = 16;
+  int ef_construction = 200;
+  // Product quantization of the in-memory vectors, 0 picks
+  // max(16, dim / 32) bytes per vector
+  int pq_subspaces = 0;
+  // Candidates kept by the beam search, and expanded per round trip to disk
+  int search_list = 64;
+  int beam_width = 4;
+  // Nodes closest to the entry point in hops kept in memory
+  int cache_nodes = 10000;
+  int io_threads = 8;
+};
+
+/**
+ * A graph index for corpora larger than memory, in the manner of DiskANN.
+ *
+ * Only product-quantized vectors and the metadata stay in memory. The full
+ * vectors and the neighbor lists of the level 0 hnswlib graph are laid out
+ * node by node in 4 KiB sectors on disk, so a node is one aligned read. A
+ * search walks the graph by the quantized distances, reading the nodes of a
+ * whole beam in parallel, and reranks the expanded nodes by the exact
+ * distances of the vectors read along the way. Distances are cosine ones.
+ *
+ * The graph is built in memory out of the added records and written on the
+ * first search, after which no record can be added.
+ */
+std::unique_ptr<IndexInterface> NewDiskIndex(int dim_size,
+                                             const DiskIndexOptions& options);
+
+// Serves the file at `options.path` written by an index of NewDiskIndex().
+std::unique_ptr<IndexInterface> OpenDiskIndex(const DiskIndexOptions& options);
+
+bool IsDiskIndexFile(const std::string& path);
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_DISK_INDEX_H_
@@ -1,51 +1,146 @@
 #include "image_retrieval/ann/flat_index.h"
 
 #include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <numeric>
 
 #include "absl/strings/str_format.h"
 #include "absl/time/clock.h"
 #include "image_retrieval/ann/vector_distance.h"
-#include "image_retrieval/feature_extraction/feature_decoder_utils.h"
+#include "image_retrieval/concurrency/numa.h"
+#include "image_retrieval/memory/arena.h"
 
 namespace image_retrieval {
 namespace ann {
 namespace {
 
+using ::image_retrieval::concurrency::GetNumaNodes;
+using ::image_retrieval::concurrency::NumaNode;
 using ::image_retrieval::concurrency::ThreadPool;
 using ::image_retrieval::feature_extraction::FeatureRecord;
-using ::image_retrieval::feature_extraction::ReadRecord;
+using ::image_retrieval::memory::Arena;
+using ::image_retrieval::memory::ArenaAllocator;
+using ::image_retrieval::memory::ArenaVector;
+using ::image_retrieval::profiling::ScopedPerfCounters;
 
 struct RecordWithDistance {
-  explicit RecordWithDistance(const FeatureRecord* record = nullptr,
-                              float distance = 0.f)
-      : record(record), distance(distance) {}
-
-  const FeatureRecord* record;
+  int64_t row;
   float distance;
 };
 
+// Records of a label, with their vectors laid out back to back.
+struct Bucket {
+  explicit Bucket(Arena* arena)
+      : values(ArenaAllocator<float>(arena)),
+        norms(ArenaAllocator<float>(arena)),
+        rows(ArenaAllocator<int64_t>(arena)) {}
+
+  ArenaVector<float> values;
+  // Norms of the vectors, for the bound of range searches
+  ArenaVector<float> norms;
+  ArenaVector<int64_t> rows;
+  // Sum of the normalized vectors, the direction buckets are ranked by when
+  // a deadline may cut the scan short
+  std::vector<float> direction;
+};
+
+// Rows [offset, offset + end - start) of a bucket, whose neighbors go to
+// [start, end) of the scanned records.
 struct BucketRange {
+  int partition;
   int bucket;
+  size_t offset;
   size_t start;
   size_t end;
 };
 
+// Where a record lives within a partition.
+struct Location {
+  int bucket;
+  size_t offset;
+};
+
+// Records waiting to be copied into a partition.
+struct StagedRecords {
+  std::vector<int64_t> rows;
+  std::vector<int> labels;
+  std::vector<float> values;
+};
+
+constexpr int kNumThreads = 10;
+
+// Records staged per partition before being copied in by a node-local thread.
+constexpr size_t kAddBatchSize = 1024;
+
+// A slice of the index whose records are allocated on, and scanned by the
+// workers of, a single NUMA node. Row `r` of the index goes to partition
+// `r % partitions` as its `r / partitions`-th record.
+struct Partition {
+  Partition(int num_threads, const std::vector<int>& cpus)
+      : thread_pool(num_threads, cpus) {}
+
+  // Of the buckets, whose pages are first touched by the workers of the node
+  Arena arena;
+  absl::Mutex mu;
+  std::unordered_map<int, Bucket> index;
+  std::vector<Location> locations;
+  StagedRecords staged;
+  ThreadPool thread_pool;
+};
+
 class FlatIndex : public IndexBase {
  public:
-  explicit FlatIndex(int dim_size) : IndexBase(dim_size), thread_pool_(10) {}
+  FlatIndex(int dim_size, const std::vector<NumaNode>& nodes,
+            std::shared_ptr<SharedMetadata> metadata)
+      : IndexBase(dim_size, std::move(metadata)),
+        distance_(GetCosineDistanceFn(dim_size)),
+        bounded_distance_(GetBoundedCosineDistanceFn(dim_size)),
+        in_flight_(0) {
+    if (nodes.size() <= 1) {
+      // Not pinned, behaves as a plain index over one partition.
+      partitions_.push_back(std::make_unique<Partition>(kNumThreads,
+                                                        std::vector<int>()));
+      return;
+    }
+
+    int num_threads = (kNumThreads + nodes.size() - 1) / nodes.size();
+    for (const auto& node : nodes) {
+      partitions_.push_back(
+          std::make_unique<Partition>(num_threads, node.cpus));
+    }
+  }
+
+  ~FlatIndex() override {
+    // Copies still queued lock mu_, which is destroyed before the workers
+    WaitForCopies();
+  }
 
   using FeatureRecord = ::image_retrieval::feature_extraction::FeatureRecord;
 
   bool Add(const FeatureRecord& record) override {
-    index_[record.label()].emplace_back(record);
+    int64_t row = AddMetadata(record);
+    if (partitions_.size() == 1) {
+      Insert(partitions_[0].get(), row, record.label(), record.value().data());
+    } else {
+      Partition* partition = partitions_[row % partitions_.size()].get();
+      StagedRecords* staged = &partition->staged;
+      staged->rows.push_back(row);
+      staged->labels.push_back(record.label());
+      staged->values.insert(staged->values.end(), record.value().begin(),
+                            record.value().end());
+      if (staged->rows.size() >= kAddBatchSize) {
+        Flush(partition);
+      }
+    }
     ++total_count_;
 
     return true;
   }
 
   bool Search(const SearchRequest& request, SearchResponse& response) override {
-    if (index_.empty()) {
+    WaitForStagedRecords();
+    if (total_count_ == 0) {
       return true;
     }
 
@@ -57,15 +152,34 @@ class FlatIndex : public IndexBase {
                           query.size(), dim_size_));
     }
 
+    // Buckets nearest to the query are scanned first, so that the best
+    // neighbors are likely found by the time a deadline stops the scan.
+    std::vector<std::pair<float, BucketRange>> buckets;
+    for (int i = 0; i < partitions_.size(); ++i) {
+      for (const auto& kv : partitions_[i]->index) {
+        int label = kv.first;
+        if (request.labels.empty() || request.labels.count(label)) {
+          buckets.push_back(
+              {distance_(query.data(), kv.second.direction.data(),
+                         query.size()),
+               {i, label, 0, 0, kv.second.rows.size()}});
+        }
+      }
+    }
+    std::stable_sort(buckets.begin(), buckets.end(),
+                     [](const auto& x, const auto& y) {
+                       return x.first < y.first;
+                     });
+
     std::vector<BucketRange> ranges;
-    ranges.reserve(index_.size());
     size_t start = 0;
-    for (const auto& kv : index_) {
-      int label = kv.first;
-      if (request.labels.empty() || request.labels.count(label)) {
-        size_t offset = index_[label].size();
-        ranges.push_back({label, start, start + offset});
-        start += offset;
+    for (const auto& bucket : buckets) {
+      size_t size = bucket.second.end;
+      for (size_t offset = 0; offset < size; offset += kScanChunkSize) {
+        size_t end = start + std::min(kScanChunkSize, size - offset);
+        ranges.push_back({bucket.second.partition, bucket.second.bucket,
+                          offset, start, end});
+        start = end;
       }
     }
     if (ranges.empty()) {
@@ -74,63 +188,252 @@ class FlatIndex : public IndexBase {
 
     size_t search_count = ranges.back().end;
     std::vector<RecordWithDistance> records(search_count);
-    auto retrieve_fn = [&](BucketRange range) {
-      size_t index = range.start;
-      size_t offset = 0;
-      for (const auto& record : index_[range.bucket]) {
-        float distance = Avx256CosineDistance(
-            query.data(), record.value().data(), query.size());
-        records[index + offset].record = &record;
-        records[index + offset].distance = distance;
-        ++offset;
+    const bool range_search = request.IsRangeSearch();
+    std::vector<float> suffix_norms;
+    if (range_search) {
+      suffix_norms = CosineSuffixNorms(query.data(), query.size());
+    }
+
+    std::vector<uint64_t> selected;
+    const bool filtered = EvaluateFilter(request, &selected);
+
+    // Rows filtered out or past `max_distance` never reach the top-k
+    // bookkeeping, the accepted ones are packed at the front of their range.
+    std::vector<size_t> counts(ranges.size(), 0);
+    std::atomic<size_t> scanned(0);
+    auto retrieve_fn = [&](size_t index) {
+      const BucketRange& range = ranges[index];
+      if (request.IsExpired()) {
+        return;
+      }
+      const Bucket& bucket =
+          partitions_[range.partition]->index.at(range.bucket);
+      const size_t size = range.offset + range.end - range.start;
+      size_t count = 0;
+      for (size_t block = range.offset; block < size; block += 64) {
+        size_t block_size = std::min<size_t>(64, size - block);
+        uint64_t mask = block_size == 64 ? ~uint64_t{0}
+                                         : (uint64_t{1} << block_size) - 1;
+        if (filtered) {
+          mask = 0;
+          for (size_t i = 0; i < block_size; ++i) {
+            mask |= uint64_t{IsRowSelected(selected, bucket.rows[block + i])}
+                    << i;
+          }
+        }
+
+        // A block without any selected row is skipped as a whole
+        for (; mask; mask &= mask - 1) {
+          size_t i = block + __builtin_ctzll(mask);
+          const float* values = bucket.values.data() + i * dim_size_;
+          float distance =
+              range_search
+                  ? bounded_distance_(query.data(), values, query.size(),
+                                      suffix_norms.data(), bucket.norms[i],
+                                      request.max_distance)
+                  : distance_(query.data(), values, query.size());
+          if (distance > request.max_distance) {
+            continue;
+          }
+          records[range.start + count].row = bucket.rows[i];
+          records[range.start + count].distance = distance;
+          ++count;
+        }
       }
+      counts[index] = count;
+      scanned += range.end - range.start;
     };
 
+    // Each partition is scanned by the workers of its own node
     std::atomic_int join(ranges.size());
-    for (BucketRange range : ranges) {
-      thread_pool_.Schedule([&, range]() {
-        retrieve_fn(range);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      partitions_[ranges[i].partition]->thread_pool.Schedule([&, i]() {
+        {
+          ScopedPerfCounters counters(request.perf);
+          retrieve_fn(i);
+        }
         --join;
       });
     }
 
     while (join) {
     }
+    if (request.perf) {
+      request.perf->AddVectors(scanned);
+    }
 
-    int partial_size =
-        request.top_k < records.size() ? request.top_k : records.size();
+    size_t size = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (size != ranges[i].start) {
+        std::copy(records.begin() + ranges[i].start,
+                  records.begin() + ranges[i].start + counts[i],
+                  records.begin() + size);
+      }
+      size += counts[i];
+    }
+    records.resize(size);
+
+    size_t partial_size = std::min(request.GetResultLimit(), records.size());
     std::partial_sort(
         records.begin(), records.begin() + partial_size, records.end(),
         [](const RecordWithDistance& x, const RecordWithDistance& y) {
           return x.distance < y.distance;
         });
-
-    if (records.size() > request.top_k) {
-      records.resize(request.top_k);
-    }
+    records.resize(partial_size);
 
     response.total_count = total_count_;
-    auto* neighbors = &response.neighbors;
+    if (scanned < search_count) {
+      response.complete = false;
+      response.scanned_fraction = static_cast<float>(scanned) / search_count;
+    }
     for (const auto& record : records) {
-      neighbors->emplace_back();
-      auto* response_record = &neighbors->back();
-      response_record->CopyFrom(*record.record);
-      response_record->distance = record.distance;
+      AddNeighbor(record.row, record.distance, response);
     }
 
     return true;
   }
 
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage = GetMetadataMemoryUsage();
+    // Staged records are swapped out by Flush(), and copied in by the workers
+    absl::MutexLock flush_lock(&flush_mu_);
+    for (const auto& partition : partitions_) {
+      absl::MutexLock l(&partition->mu);
+      for (const auto& kv : partition->index) {
+        const Bucket& bucket = kv.second;
+        usage.vectors += (bucket.values.capacity() + bucket.norms.capacity() +
+                          bucket.direction.capacity()) *
+                         sizeof(float);
+        usage.metadata += bucket.rows.capacity() * sizeof(int64_t);
+      }
+      // A node per bucket, and the table pointing to them
+      usage.metadata +=
+          partition->index.size() *
+              (sizeof(std::pair<const int, Bucket>) + sizeof(void*)) +
+          partition->index.bucket_count() * sizeof(void*) +
+          partition->locations.capacity() * sizeof(Location);
+
+      const StagedRecords& staged = partition->staged;
+      usage.buffers += staged.rows.capacity() * sizeof(int64_t) +
+                       staged.labels.capacity() * sizeof(int) +
+                       staged.values.capacity() * sizeof(float);
+    }
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats = IndexBase::GetStats();
+    stats.type = "flat";
+    stats.params = {{"numa_partitions", partitions_.size()},
+                    {"threads", kNumThreads}};
+    return stats;
+  }
+
+ protected:
+  void CopyVector(int64_t row, float* values) override {
+    WaitForStagedRecords();
+    const Partition& partition = *partitions_[row % partitions_.size()];
+    const Location& location = partition.locations[row / partitions_.size()];
+    const float* data = partition.index.at(location.bucket).values.data() +
+                        location.offset * dim_size_;
+    std::copy(data, data + dim_size_, values);
+  }
+
  private:
-  std::unordered_map<int, std::vector<FeatureRecord>> index_;
+  void Insert(Partition* partition, int64_t row, int label,
+              const float* values) {
+    Bucket& bucket =
+        partition->index.try_emplace(label, &partition->arena).first->second;
+    size_t position = row / partitions_.size();
+    if (partition->locations.size() <= position) {
+      partition->locations.resize(position + 1);
+    }
+    partition->locations[position] = {label, bucket.rows.size()};
+    bucket.rows.push_back(row);
+    bucket.values.insert(bucket.values.end(), values, values + dim_size_);
+    float norm =
+        std::sqrt(std::inner_product(values, values + dim_size_, values, 0.f));
+    bucket.norms.push_back(norm);
+    bucket.direction.resize(dim_size_, 0.f);
+    if (norm > 0.f) {
+      for (int i = 0; i < dim_size_; ++i) {
+        bucket.direction[i] += values[i] / norm;
+      }
+    }
+  }
+
+  // Hands the staged records of `partition` over to one of its workers. The
+  // worker copies them, so that with first-touch placement the vectors end up
+  // in the memory of the worker's node rather than the loader's.
+  void Flush(Partition* partition) {
+    if (partition->staged.rows.empty()) {
+      return;
+    }
 
-  concurrency::ThreadPool thread_pool_;
+    auto batch = std::make_shared<StagedRecords>();
+    std::swap(*batch, partition->staged);
+    {
+      absl::MutexLock l(&mu_);
+      ++in_flight_;
+    }
+    partition->thread_pool.Schedule([this, partition, batch]() {
+      {
+        absl::MutexLock l(&partition->mu);
+        for (size_t i = 0; i < batch->rows.size(); ++i) {
+          Insert(partition, batch->rows[i], batch->labels[i],
+                 batch->values.data() + i * dim_size_);
+        }
+      }
+      *batch = StagedRecords();
+
+      absl::MutexLock l(&mu_);
+      --in_flight_;
+    });
+  }
+
+  void WaitForStagedRecords() {
+    if (partitions_.size() == 1) {
+      return;
+    }
+
+    {
+      absl::MutexLock l(&flush_mu_);
+      for (auto& partition : partitions_) {
+        Flush(partition.get());
+      }
+    }
+    WaitForCopies();
+  }
+
+  void WaitForCopies() {
+    absl::MutexLock l(&mu_);
+    mu_.Await(absl::Condition(
+        +[](int* in_flight) { return *in_flight == 0; }, &in_flight_));
+  }
+
+  std::vector<std::unique_ptr<Partition>> partitions_;
+
+  // Picked for the dim size, see GetCosineDistanceFn()
+  CosineDistanceFn distance_;
+  BoundedCosineDistanceFn bounded_distance_;
+
+  mutable absl::Mutex flush_mu_;
+  absl::Mutex mu_;
+  int in_flight_ ABSL_GUARDED_BY(mu_);
 };
 
 }  // namespace
 
-std::unique_ptr<IndexInterface> NewFlatIndex(int dim_size) {
-  return std::make_unique<FlatIndex>(dim_size);
+std::unique_ptr<IndexInterface> NewFlatIndex(
+    int dim_size, bool numa_aware, std::shared_ptr<SharedMetadata> metadata) {
+  return std::make_unique<FlatIndex>(
+      dim_size, numa_aware ? GetNumaNodes() : std::vector<NumaNode>(),
+      std::move(metadata));
+}
+
+std::unique_ptr<IndexInterface> NewFlatIndex(
+    int dim_size, const std::vector<concurrency::NumaNode>& nodes) {
+  return std::make_unique<FlatIndex>(dim_size, nodes, nullptr);
 }
 
 }  // namespace ann
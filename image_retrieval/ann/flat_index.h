@@ -3,12 +3,24 @@
 
 #include <unordered_map>
 #include "image_retrieval/ann/index_interface.h"
+#include "image_retrieval/concurrency/numa.h"
 #include "image_retrieval/concurrency/thread_pool.h"
 
 namespace image_retrieval {
 namespace ann {
 
-std::unique_ptr<IndexInterface> NewFlatIndex(int dim_size);
+// If `numa_aware` is set, records are spread over the NUMA nodes and each node
+// scans its own partition with pinned workers. Falls back to a single
+// partition on machines with one node. The metadata are kept on their own
+// unless `metadata` is given.
+std::unique_ptr<IndexInterface> NewFlatIndex(
+    int dim_size, bool numa_aware = false,
+    std::shared_ptr<SharedMetadata> metadata = nullptr);
+
+// Partitions the records over `nodes` whatever the machine has, e.g. to run
+// the NUMA path on a single node.
+std::unique_ptr<IndexInterface> NewFlatIndex(
+    int dim_size, const std::vector<concurrency::NumaNode>& nodes);
 
 }  // namespace ann
 }  // namespace image_retrieval
@@ -1,11 +1,14 @@
-#include "image_retrieval/ann/flat_index.h"
+#include "image_retrieval/ann/hnsw_index.h"
 
 #include <algorithm>
 #include <fstream>
 
 #include "absl/strings/str_format.h"
 #include "absl/time/clock.h"
+#include "image_retrieval/ann/cosine_space.h"
+#include "image_retrieval/concurrency/thread_pool.h"
 #include "image_retrieval/feature_extraction/feature.pb.h"
+#include "image_retrieval/memory/arena.h"
 #include "third_party/hnswlib/hnswlib.h"
 
 namespace image_retrieval {
@@ -14,20 +17,72 @@ namespace {
 
 using ::image_retrieval::concurrency::ThreadPool;
 using ::image_retrieval::feature_extraction::FeatureRecord;
+using ::image_retrieval::memory::Arena;
+using ::image_retrieval::profiling::ScopedPerfCounters;
+
+// Of the graph, doubled whenever it is full
+constexpr size_t kInitialCapacity = 1 << 16;
+
+// Lets hnswlib skip the rows not selected by a filter while it searches.
+class RowFilter : public hnswlib::BaseFilterFunctor {
+ public:
+  explicit RowFilter(const std::vector<uint64_t>* words) : words_(words) {}
+
+  bool operator()(hnswlib::labeltype row) override {
+    return (*words_)[row >> 6] >> (row & 63) & 1;
+  }
+
+ private:
+  const std::vector<uint64_t>* words_;
+};
+
+// Puts the level 0 block, the vectors and links every search hops through,
+// in the huge pages of an arena.
+class ArenaLevel0Allocator : public hnswlib::Level0Allocator {
+ public:
+  explicit ArenaLevel0Allocator(Arena* arena) : arena_(arena) {}
+
+  void* allocate(size_t size) override { return arena_->Allocate(size); }
+
+  void* reallocate(void* data, size_t old_size, size_t new_size) override {
+    return arena_->Reallocate(data, old_size, new_size);
+  }
+
+  void deallocate(void* data, size_t size) override {
+    arena_->Deallocate(data, size);
+  }
+
+ private:
+  Arena* arena_;
+};
 
 class HNSWIndex : public IndexBase {
  public:
-  explicit HNSWIndex(int dim_size) : IndexBase(dim_size) {
-    space_ = std::make_unique<hnswlib::L2Space>(dim_size_);
+  HNSWIndex(int dim_size, bool cosine,
+            std::shared_ptr<SharedMetadata> metadata)
+      : IndexBase(dim_size, std::move(metadata)),
+        capacity_(kInitialCapacity),
+        level0_allocator_(&arena_) {
+    if (cosine) {
+      space_ = std::make_unique<CosineSpace>(dim_size_);
+    } else {
+      space_ = std::make_unique<hnswlib::L2Space>(dim_size_);
+    }
     alg_hnsw_ = std::make_unique<hnswlib::HierarchicalNSW<float>>(
-        space_.get(), max_elements_, M_, ef_construction_);
+        space_.get(), capacity_, M_, ef_construction_, 100, false,
+        &level0_allocator_);
   }
 
   using FeatureRecord = ::image_retrieval::feature_extraction::FeatureRecord;
 
   bool Add(const FeatureRecord& record) override {
-    alg_hnsw_->addPoint(record.value().data(), index_.size());
-    index_.push_back(record);
+    // The vector is only kept by hnswlib, labelled with the metadata row
+    int64_t row = AddMetadata(record);
+    if (row >= capacity_) {
+      capacity_ *= 2;
+      alg_hnsw_->resizeIndex(capacity_);
+    }
+    alg_hnsw_->addPoint(record.value().data(), row);
     ++total_count_;
 
     return true;
@@ -42,27 +97,75 @@ class HNSWIndex : public IndexBase {
                           query.size(), dim_size_));
     }
 
-    std::priority_queue<std::pair<float, hnswlib::labeltype>> result =
-        alg_hnsw_->searchKnn(query.data(), request.top_k);
-
+    // A graph search is short and cannot be cut in chunks, it is only skipped
+    // altogether if the deadline passed while the request was queued.
     response.total_count = total_count_;
-    auto* neighbors = &response.neighbors;
-    neighbors->resize(result.size());
+    if (request.IsExpired()) {
+      response.complete = false;
+      response.scanned_fraction = 0.f;
+      return true;
+    }
 
+    // hnswlib has no range query, so a range search keeps those of the
+    // `max_results`, or else `top_k`, nearest neighbors within the radius.
+    size_t k = request.IsRangeSearch() && request.max_results > 0
+                   ? request.max_results
+                   : request.top_k;
+    // The whole search runs on the calling thread
+    ScopedPerfCounters counters(request.perf);
+    size_t ef = request.params.ef > 0 ? request.params.ef : ef_;
+    std::vector<uint64_t> selected;
+    RowFilter filter(&selected);
+    std::priority_queue<std::pair<float, hnswlib::labeltype>> result =
+        alg_hnsw_->searchKnn(query.data(), k,
+                             EvaluateFilter(request, &selected) ? &filter
+                                                                : nullptr,
+                             ef);
+
+    // Farthest first
+    std::vector<std::pair<float, hnswlib::labeltype>> elements;
+    elements.reserve(result.size());
     while (!result.empty()) {
-      std::pair<float, hnswlib::labeltype> element = result.top();
+      if (result.top().first <= request.max_distance) {
+        elements.push_back(result.top());
+      }
       result.pop();
-      ResponseRecord* response_record = &neighbors->at(result.size());
-      response_record->CopyFrom(index_[element.second]);
-      response_record->distance = element.first;
+    }
+
+    for (auto it = elements.rbegin(); it != elements.rend(); ++it) {
+      AddNeighbor(it->second, it->first, response);
     }
 
     return true;
   }
 
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage = GetMetadataMemoryUsage();
+    usage += GetGraphMemoryUsage(*alg_hnsw_);
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats = IndexBase::GetStats();
+    stats.type = "hnsw";
+    stats.params = {{"M", M_},
+                    {"ef_construction", ef_construction_},
+                    {"ef", ef_},
+                    {"capacity", capacity_},
+                    {"cosine", dynamic_cast<CosineSpace*>(space_.get()) !=
+                                   nullptr}};
+    return stats;
+  }
+
+ protected:
+  void CopyVector(int64_t row, float* values) override {
+    std::vector<float> data = alg_hnsw_->getDataByLabel<float>(row);
+    std::copy(data.begin(), data.end(), values);
+  }
+
  private:
-  // Maximum number of elements, should be known beforehand
-  int max_elements_ = 1300000;
+  // Number of elements the graph has room for
+  size_t capacity_;
 
   // Tightly connected with internal dimensionality of the data
   int M_ = 16;
@@ -70,15 +173,46 @@ class HNSWIndex : public IndexBase {
   // Controls index search speed/build speed tradeoff
   int ef_construction_ = 200;
 
-  std::unique_ptr<hnswlib::L2Space> space_;
+  // Size of the candidate list of a search without its own, raised to the
+  // number of results. hnswlib defaults to 10, too few for most top_k.
+  int ef_ = 64;
+
+  // Declared ahead of the graph, which it outlives
+  Arena arena_;
+  ArenaLevel0Allocator level0_allocator_;
+  std::unique_ptr<hnswlib::SpaceInterface<float>> space_;
   std::unique_ptr<hnswlib::HierarchicalNSW<float>> alg_hnsw_;
-  std::vector<FeatureRecord> index_;
 };
 
 }  // namespace
 
-std::unique_ptr<IndexInterface> NewHNSWIndex(int dim_size) {
-  return std::make_unique<HNSWIndex>(dim_size);
+MemoryUsage GetGraphMemoryUsage(const hnswlib::HierarchicalNSW<float>& graph) {
+  MemoryUsage usage;
+  // Level 0 is laid out as links, vector and label per element, the upper
+  // levels only have links, allocated for the elements reaching them
+  const size_t capacity = graph.max_elements_;
+  usage.vectors = capacity * graph.data_size_;
+  usage.graph = capacity * (graph.size_links_level0_ + sizeof(char*)) +
+                graph.element_levels_.capacity() * sizeof(int) +
+                (graph.link_list_locks_.size() + graph.label_op_locks_.size()) *
+                    sizeof(std::mutex);
+  for (size_t i = 0; i < graph.cur_element_count; ++i) {
+    usage.graph += graph.element_levels_[i] * graph.size_links_per_element_;
+  }
+  // A node per label, and the table pointing to them
+  usage.metadata =
+      capacity * sizeof(hnswlib::labeltype) +
+      graph.label_lookup_.size() *
+          (sizeof(std::pair<const hnswlib::labeltype, hnswlib::tableint>) +
+           sizeof(void*)) +
+      graph.label_lookup_.bucket_count() * sizeof(void*);
+  usage.buffers = graph.visited_list_pool_->getMemoryUsage();
+  return usage;
+}
+
+std::unique_ptr<IndexInterface> NewHNSWIndex(
+    int dim_size, bool cosine, std::shared_ptr<SharedMetadata> metadata) {
+  return std::make_unique<HNSWIndex>(dim_size, cosine, std::move(metadata));
 }
 
 }  // namespace ann
@@ -3,10 +3,24 @@
 
 #include "image_retrieval/ann/index_interface.h"
 
+namespace hnswlib {
+template <typename dist_t>
+class HierarchicalNSW;
+}  // namespace hnswlib
+
 namespace image_retrieval {
 namespace ann {
 
-std::unique_ptr<IndexInterface> NewHNSWIndex(int dim_size);
+// Neighbors are ranked by squared L2 distance, or by the cosine distance of
+// the exhaustive indexes if `cosine` is set. The metadata are kept on their
+// own unless `metadata` is given.
+std::unique_ptr<IndexInterface> NewHNSWIndex(
+    int dim_size, bool cosine = false,
+    std::shared_ptr<SharedMetadata> metadata = nullptr);
+
+// Of a graph of hnswlib: the vectors and links of its capacity, the labels
+// and their lookup, and the visited lists of its searches.
+MemoryUsage GetGraphMemoryUsage(const hnswlib::HierarchicalNSW<float>& graph);
 
 }  // namespace ann
 }  // namespace image_retrieval
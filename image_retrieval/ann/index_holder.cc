@@ -0,0 +1,172 @@
+#include "image_retrieval/ann/index_holder.h"
+
+#include <sys/stat.h>
+
+#include <iostream>
+
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+// What tells a file has been rewritten, all zeros if it does not exist.
+struct FileVersion {
+  int64_t mtime_ns = 0;
+  int64_t size = 0;
+
+  bool operator==(const FileVersion& other) const {
+    return mtime_ns == other.mtime_ns && size == other.size;
+  }
+  bool operator!=(const FileVersion& other) const { return !(*this == other); }
+};
+
+FileVersion GetFileVersion(const std::string& path) {
+  struct stat st;
+  FileVersion version;
+  if (stat(path.c_str(), &st) == 0) {
+    version.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    version.size = st.st_size;
+  }
+  return version;
+}
+
+}  // namespace
+
+IndexHolder::IndexHolder(Builder builder)
+    : builder_(std::move(builder)), stopping_(false) {}
+
+IndexHolder::~IndexHolder() {
+  {
+    absl::MutexLock l(&mu_);
+    stopping_ = true;
+  }
+  if (watch_thread_.joinable()) {
+    watch_thread_.join();
+  }
+  if (reload_thread_.joinable()) {
+    reload_thread_.join();
+  }
+}
+
+void IndexHolder::Load(const std::string& input) { Swap(input); }
+
+bool IndexHolder::Reload(const std::string& input) {
+  {
+    absl::MutexLock l(&mu_);
+    if (status_.reloading || stopping_) {
+      return false;
+    }
+    status_.reloading = true;
+  }
+
+  // Only the caller that set `reloading` gets here, and the previous reload
+  // thread is done but for returning
+  if (reload_thread_.joinable()) {
+    reload_thread_.join();
+  }
+  reload_thread_ = std::thread([this, input]() {
+    std::string error;
+    try {
+      Swap(input);
+    } catch (const std::exception& e) {
+      error = e.what();
+      std::cerr << absl::StrFormat("Failed to reload %s: %s", input, error)
+                << std::endl;
+    }
+
+    absl::MutexLock l(&mu_);
+    status_.reloading = false;
+    status_.error = error;
+  });
+  return true;
+}
+
+void IndexHolder::WaitForReload() {
+  absl::MutexLock l(&mu_);
+  mu_.Await(absl::Condition(
+      +[](Status* status) { return !status->reloading; }, &status_));
+}
+
+void IndexHolder::Watch(absl::Duration interval) {
+  watch_thread_ = std::thread([this, interval]() { WatchLoop(interval); });
+}
+
+std::shared_ptr<IndexInterface> IndexHolder::Get() const {
+  absl::ReaderMutexLock l(&mu_);
+  return index_;
+}
+
+IndexHolder::Status IndexHolder::GetStatus() const {
+  absl::ReaderMutexLock l(&mu_);
+  return status_;
+}
+
+void IndexHolder::Swap(const std::string& input) {
+  int64_t start = absl::ToUnixMicros(absl::Now());
+  std::vector<std::vector<float>> samples;
+  std::shared_ptr<IndexInterface> index = builder_(input, &samples);
+
+  // Lazily built structures, thread pools and page faults are paid for here
+  // instead of by the first searches
+  for (const auto& sample : samples) {
+    SearchRequest request;
+    request.query = sample;
+    SearchResponse response;
+    index->Search(request, response);
+  }
+
+  std::shared_ptr<IndexInterface> old;
+  {
+    absl::MutexLock l(&mu_);
+    old = std::move(index_);
+    index_ = std::move(index);
+    if (old) {
+      ++status_.reloads;
+    }
+    status_.input = input;
+    status_.loaded_at = absl::Now();
+  }
+  std::cout << absl::StrFormat("Loaded %s, elapsed %.3f(s)", input,
+                               (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+            << std::endl;
+
+  // The searches still running on the old index keep it alive, it is freed
+  // here once they are done rather than by whichever of them ends last
+  while (old && old.use_count() > 1) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+}
+
+void IndexHolder::WatchLoop(absl::Duration interval) {
+  std::string input = GetStatus().input;
+  FileVersion loaded = GetFileVersion(input);
+  FileVersion last = loaded;
+  while (true) {
+    {
+      absl::MutexLock l(&mu_);
+      if (mu_.AwaitWithTimeout(absl::Condition(&stopping_), interval)) {
+        return;
+      }
+      // Reloaded from another file in the meantime
+      if (status_.input != input) {
+        input = status_.input;
+        loaded = last = GetFileVersion(input);
+      }
+    }
+
+    FileVersion current = GetFileVersion(input);
+    if (current != last) {
+      // Still being written, or just done, see again next time
+      last = current;
+      continue;
+    }
+    if (current != loaded && current != FileVersion() && Reload(input)) {
+      loaded = current;
+    }
+  }
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
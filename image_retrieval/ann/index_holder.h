@@ -0,0 +1,97 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_INDEX_HOLDER_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_INDEX_HOLDER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "image_retrieval/ann/index_interface.h"
+
+namespace image_retrieval {
+namespace ann {
+
+/**
+ * Holds the index being served and replaces it without downtime.
+ *
+ * A reload builds the new index on a background thread, warms it with a few
+ * searches, and then swaps it in. Searches hold the index they started on by
+ * a shared_ptr, so they finish on the old one, which is released by the
+ * reloading thread once the last of them is done.
+ */
+class IndexHolder {
+ public:
+  // Builds an index out of `input`, and keeps the vectors of some of its
+  // records in `samples` to warm it up. Throws on failure.
+  using Builder = std::function<std::unique_ptr<IndexInterface>(
+      const std::string& input, std::vector<std::vector<float>>* samples)>;
+
+  struct Status {
+    std::string input;
+    absl::Time loaded_at = absl::InfinitePast();
+    int64_t reloads = 0;
+    bool reloading = false;
+    // Of the last reload, empty if it succeeded
+    std::string error;
+
+    friend void to_json(nlohmann::json& j, const Status& status) {
+      j = nlohmann::json{{"input", status.input},
+                         {"loaded_at", absl::FormatTime(status.loaded_at)},
+                         {"reloads", status.reloads},
+                         {"reloading", status.reloading}};
+      if (!status.error.empty()) {
+        j["error"] = status.error;
+      }
+    }
+  };
+
+  explicit IndexHolder(Builder builder);
+
+  ~IndexHolder();
+
+  IndexHolder(const IndexHolder&) = delete;
+  IndexHolder& operator=(const IndexHolder&) = delete;
+
+  // Builds the first index in the calling thread, throws on failure.
+  void Load(const std::string& input);
+
+  // Rebuilds the index out of `input` in the background. Returns false if a
+  // reload is already running.
+  bool Reload(const std::string& input);
+
+  // Blocks until no reload is running.
+  void WaitForReload();
+
+  // Reloads the input whenever its file changes, checking every `interval`.
+  // A change is only picked up once the file stayed the same for a whole
+  // interval, so that a file being written is not loaded half way.
+  void Watch(absl::Duration interval);
+
+  // The index to search, null before Load().
+  std::shared_ptr<IndexInterface> Get() const;
+
+  Status GetStatus() const;
+
+ private:
+  // Builds, warms and swaps in an index, throws on failure.
+  void Swap(const std::string& input);
+
+  void WatchLoop(absl::Duration interval);
+
+  Builder builder_;
+
+  mutable absl::Mutex mu_;
+  std::shared_ptr<IndexInterface> index_ ABSL_GUARDED_BY(mu_);
+  Status status_ ABSL_GUARDED_BY(mu_);
+  bool stopping_ ABSL_GUARDED_BY(mu_);
+
+  std::thread reload_thread_;
+  std::thread watch_thread_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_INDEX_HOLDER_H_
@@ -0,0 +1,146 @@
+#include "image_retrieval/ann/index_holder.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+// Answers every search with a single neighbor named after its input.
+class NamedIndex : public IndexInterface {
+ public:
+  NamedIndex(const std::string& name, std::atomic_int* searches)
+      : name_(name), searches_(searches) {}
+
+  bool Add(const FeatureRecord& record) override { return true; }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    ++*searches_;
+    response.neighbors.emplace_back();
+    response.neighbors.back().record.set_id(name_);
+    return true;
+  }
+
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    return false;
+  }
+
+  int GetDimSize() const override { return 1; }
+
+  void SetAttributeFields(const std::vector<std::string>& fields) override {}
+
+  double EstimateSelectivity(const Filter& filter) const override {
+    return 1.;
+  }
+
+  MemoryUsage GetMemoryUsage() const override { return MemoryUsage(); }
+
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.type = name_;
+    return stats;
+  }
+
+ private:
+  std::string name_;
+  std::atomic_int* searches_;
+};
+
+std::string Search(IndexInterface* index) {
+  SearchRequest request;
+  request.query = {1.f};
+  SearchResponse response;
+  index->Search(request, response);
+  return response.neighbors.at(0).record.id();
+}
+
+TEST(IndexHolder, Reload) {
+  std::atomic_int searches(0);
+  absl::Notification building;
+  absl::Notification proceed;
+  IndexHolder holder([&](const std::string& input,
+                         std::vector<std::vector<float>>* samples) {
+    if (input == "bad") {
+      throw std::runtime_error("no such file");
+    }
+    if (input == "slow") {
+      building.Notify();
+      proceed.WaitForNotification();
+    }
+    samples->assign(3, {1.f});
+    return std::make_unique<NamedIndex>(input, &searches);
+  });
+  EXPECT_EQ(holder.Get(), nullptr);
+  holder.Load("first");
+  // Warmed up by the samples
+  EXPECT_EQ(searches, 3);
+
+  // A search in flight on the first index
+  std::shared_ptr<IndexInterface> in_flight = holder.Get();
+  ASSERT_TRUE(holder.Reload("slow"));
+  building.WaitForNotification();
+  EXPECT_FALSE(holder.Reload("other"));
+  EXPECT_TRUE(holder.GetStatus().reloading);
+  EXPECT_EQ(Search(holder.Get().get()), "first");
+  proceed.Notify();
+
+  // Swapped in while the old one is still alive for the search in flight
+  while (holder.GetStatus().input != "slow") {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_EQ(Search(holder.Get().get()), "slow");
+  EXPECT_EQ(Search(in_flight.get()), "first");
+  EXPECT_TRUE(holder.GetStatus().reloading);
+  in_flight.reset();
+  holder.WaitForReload();
+  EXPECT_EQ(holder.GetStatus().reloads, 1);
+
+  // A failed reload keeps serving the current index
+  ASSERT_TRUE(holder.Reload("bad"));
+  holder.WaitForReload();
+  IndexHolder::Status status = holder.GetStatus();
+  EXPECT_EQ(status.error, "no such file");
+  EXPECT_EQ(status.input, "slow");
+  EXPECT_EQ(Search(holder.Get().get()), "slow");
+}
+
+TEST(IndexHolder, Watch) {
+  std::string path = testing::TempDir() + "/index_holder_test.data";
+  std::ofstream(path) << "a";
+
+  std::atomic_int searches(0);
+  std::atomic_int builds(0);
+  IndexHolder holder([&](const std::string& input,
+                         std::vector<std::vector<float>>* samples) {
+    std::string content;
+    std::ifstream(input) >> content;
+    ++builds;
+    return std::make_unique<NamedIndex>(content, &searches);
+  });
+  holder.Load(path);
+  holder.Watch(absl::Milliseconds(20));
+  absl::SleepFor(absl::Milliseconds(100));
+  EXPECT_EQ(builds, 1);
+
+  std::ofstream(path) << "bb";
+  absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (holder.GetStatus().reloads == 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  holder.WaitForReload();
+  EXPECT_EQ(Search(holder.Get().get()), "bb");
+  EXPECT_EQ(builds, 2);
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace ann
+}  // namespace image_retrieval
@@ -1,60 +1,331 @@
 #ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_INDEX_INTERFACE_H_
 #define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_INDEX_INTERFACE_H_
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <unordered_set>
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "google/protobuf/util/json_util.h"
+#include "image_retrieval/ann/attribute_index.h"
+#include "image_retrieval/ann/metadata_store.h"
 #include "image_retrieval/feature_extraction/feature.pb.h"
+#include "image_retrieval/profiling/perf_counters.h"
 #include "nlohmann/json.hpp"
 
 namespace image_retrieval {
 namespace ann {
 
+inline nlohmann::json RecordToJson(
+    const feature_extraction::FeatureRecord& record) {
+  std::string output;
+  auto option = google::protobuf::util::JsonOptions();
+  option.add_whitespace = true;
+  option.preserve_proto_field_names = true;
+  google::protobuf::util::MessageToJsonString(record, &output, option);
+  return nlohmann::json::parse(output);
+}
+
+inline void RecordFromJson(const nlohmann::json& j,
+                           feature_extraction::FeatureRecord* record) {
+  auto option = google::protobuf::util::JsonParseOptions();
+  option.ignore_unknown_fields = true;
+  auto status =
+      google::protobuf::util::JsonStringToMessage(j.dump(), record, option);
+  if (!status.ok()) {
+    throw std::runtime_error(status.ToString());
+  }
+}
+
+// Per search accuracy and latency tradeoffs of the graph indexes, 0 for the
+// defaults of the index. Exhaustive indexes ignore them.
+struct SearchParams {
+  // HNSW: size of the candidate list, at least the number of results
+  int ef = 0;
+  // Disk: candidates kept by the beam search, and nodes read per round trip
+  int search_list = 0;
+  int beam_width = 0;
+
+  bool IsDefault() const { return *this == SearchParams(); }
+
+  bool operator==(const SearchParams& other) const {
+    return ef == other.ef && search_list == other.search_list &&
+           beam_width == other.beam_width;
+  }
+
+  friend void to_json(nlohmann::json& j, const SearchParams& params) {
+    j = nlohmann::json::object();
+    if (params.ef > 0) {
+      j["ef"] = params.ef;
+    }
+    if (params.search_list > 0) {
+      j["search_list"] = params.search_list;
+    }
+    if (params.beam_width > 0) {
+      j["beam_width"] = params.beam_width;
+    }
+  }
+
+  friend void from_json(const nlohmann::json& j, SearchParams& params) {
+    for (const auto& item : j.items()) {
+      int value = item.value().get<int>();
+      if (value < 0) {
+        throw std::invalid_argument(
+            "Negative search param " + item.key() + ": " + item.value().dump());
+      }
+      if (item.key() == "ef") {
+        params.ef = value;
+      } else if (item.key() == "search_list") {
+        params.search_list = value;
+      } else if (item.key() == "beam_width") {
+        params.beam_width = value;
+      } else {
+        throw std::invalid_argument("Unknown search param: " + item.key());
+      }
+    }
+  }
+};
+
 struct SearchRequest {
   std::vector<float> query;
+  // Searches with the vector of an indexed record instead of `query`.
+  std::string query_id;
   int top_k = 20;
   std::unordered_set<int> labels;
+  // Over the attribute fields of the index
+  Filter filter;
+  // Range search: returns every neighbor within the distance, nearest first,
+  // and at most `max_results` of them if it is positive. `top_k` is ignored.
+  float max_distance = std::numeric_limits<float>::infinity();
+  int max_results = 0;
+  // Latency budget, 0 for none. Once it is spent indexes stop scanning and
+  // answer with the best neighbors found so far, marked incomplete.
+  int deadline_ms = 0;
+  // `deadline_ms` counted from when the request was received, see
+  // StartDeadline(). Not serialized.
+  absl::Time deadline = absl::InfiniteFuture();
+  SearchParams params;
+  // Collects the hardware events of the threads searching, and the vectors
+  // they compare the query with, if set. Not serialized.
+  profiling::PerfTotals* perf = nullptr;
+
+  bool IsRangeSearch() const { return std::isfinite(max_distance); }
+
+  void StartDeadline(absl::Time received) {
+    if (deadline_ms > 0) {
+      deadline = received + absl::Milliseconds(deadline_ms);
+    }
+  }
+
+  bool IsExpired() const {
+    return deadline != absl::InfiniteFuture() && absl::Now() >= deadline;
+  }
+
+  // Maximum number of neighbors to return.
+  size_t GetResultLimit() const {
+    if (!IsRangeSearch()) {
+      return std::max(top_k, 0);
+    }
+    return max_results > 0 ? max_results : std::numeric_limits<size_t>::max();
+  }
 
   friend void to_json(nlohmann::json& j, const SearchRequest& request) {
     j = nlohmann::json{{"query", request.query},
                        {"top_k", request.top_k},
                        {"labels", request.labels}};
+    if (!request.query_id.empty()) {
+      j["query_id"] = request.query_id;
+    }
+    if (request.filter.op != Filter::Op::kNone) {
+      j["filter"] = request.filter;
+    }
+    if (request.IsRangeSearch()) {
+      j["max_distance"] = request.max_distance;
+      j["max_results"] = request.max_results;
+    }
+    if (request.deadline_ms > 0) {
+      j["deadline_ms"] = request.deadline_ms;
+    }
+    if (!request.params.IsDefault()) {
+      j["params"] = request.params;
+    }
   }
 
   friend void from_json(const nlohmann::json& j, SearchRequest& request) {
-    request.query = j.at("query").get<std::vector<float>>();
+    if (j.contains("query_id")) {
+      request.query_id = j.at("query_id").get<std::string>();
+    }
+    if (request.query_id.empty() || j.contains("query")) {
+      request.query = j.at("query").get<std::vector<float>>();
+    }
     if (j.contains("top_k")) {
       request.top_k = j.at("top_k").get<int>();
     }
     if (j.contains("labels")) {
       request.labels = j.at("labels").get<std::unordered_set<int>>();
     }
+    if (j.contains("filter")) {
+      request.filter = j.at("filter").get<Filter>();
+    }
+    if (j.contains("max_distance")) {
+      request.max_distance = j.at("max_distance").get<float>();
+    }
+    if (j.contains("max_results")) {
+      request.max_results = j.at("max_results").get<int>();
+    }
+    if (j.contains("deadline_ms")) {
+      request.deadline_ms = j.at("deadline_ms").get<int>();
+    }
+    if (j.contains("params")) {
+      request.params = j.at("params").get<SearchParams>();
+    }
   }
 };
 
-struct ResponseRecord : public feature_extraction::FeatureRecord {
+// Generated messages are final, so the record is held by value instead of
+// being inherited from. Indexes leave out the vector of a neighbor.
+struct ResponseRecord {
+  feature_extraction::FeatureRecord record;
   float distance;
 
   friend void to_json(nlohmann::json& j, const ResponseRecord& record) {
-    std::string output;
-    auto option = google::protobuf::util::JsonOptions();
-    option.add_whitespace = true;
-    option.preserve_proto_field_names = true;
-    google::protobuf::util::MessageToJsonString(record, &output, option);
-
-    j = nlohmann::json::parse(output);
+    j = RecordToJson(record.record);
     j["distance"] = record.distance;
   }
+
+  friend void from_json(const nlohmann::json& j, ResponseRecord& record) {
+    nlohmann::json fields = j;
+    record.distance = fields.at("distance").get<float>();
+    fields.erase("distance");
+    RecordFromJson(fields, &record.record);
+  }
 };
 
 struct SearchResponse {
   std::vector<ResponseRecord> neighbors;
-  float search_cost_ms;
-  int64_t total_count;
+  float search_cost_ms = 0.f;
+  int64_t total_count = 0;
+  // False if some part of the corpus was not searched, e.g. a shard timed out
+  // or the deadline passed.
+  bool complete = true;
+  // Share of the candidate records that were scanned before the deadline.
+  float scanned_fraction = 1.f;
+  std::vector<std::string> failed_shards;
+  // Of a planned index, the name of the physical index that answered
+  std::string plan;
 
   friend void to_json(nlohmann::json& j, const SearchResponse& response) {
     j = nlohmann::json{{"neighbors", response.neighbors},
                        {"search_cost_ms", response.search_cost_ms},
-                       {"total_count", response.total_count}};
+                       {"total_count", response.total_count},
+                       {"complete", response.complete}};
+    if (!response.complete) {
+      j["scanned_fraction"] = response.scanned_fraction;
+    }
+    if (!response.failed_shards.empty()) {
+      j["failed_shards"] = response.failed_shards;
+    }
+    if (!response.plan.empty()) {
+      j["plan"] = response.plan;
+    }
+  }
+
+  friend void from_json(const nlohmann::json& j, SearchResponse& response) {
+    response.neighbors = j.at("neighbors").get<std::vector<ResponseRecord>>();
+    response.total_count = j.at("total_count").get<int64_t>();
+    if (j.contains("search_cost_ms")) {
+      response.search_cost_ms = j.at("search_cost_ms").get<float>();
+    }
+    if (j.contains("complete")) {
+      response.complete = j.at("complete").get<bool>();
+    }
+    if (j.contains("scanned_fraction")) {
+      response.scanned_fraction = j.at("scanned_fraction").get<float>();
+    }
+    if (j.contains("failed_shards")) {
+      response.failed_shards =
+          j.at("failed_shards").get<std::vector<std::string>>();
+    }
+    if (j.contains("plan")) {
+      response.plan = j.at("plan").get<std::string>();
+    }
+  }
+};
+
+// Bytes held by an index, by what they hold. Containers count with their
+// capacity, which is what the host has to provide, rather than their size.
+struct MemoryUsage {
+  // Full precision vectors, with their norms
+  int64_t vectors = 0;
+  // Binary and product quantization codes, with the codebooks, hash tables
+  // and transforms they come from
+  int64_t codes = 0;
+  // Neighbor lists of the graphs, with their locks
+  int64_t graph = 0;
+  // Ids, labels, payloads, attribute bitmaps, and where the rows are
+  int64_t metadata = 0;
+  // Whole protobuf messages, e.g. the responses of a result cache
+  int64_t protobuf = 0;
+  // Records staged for the workers, node caches and search scratch space
+  int64_t buffers = 0;
+
+  int64_t GetTotal() const {
+    return vectors + codes + graph + metadata + protobuf + buffers;
+  }
+
+  MemoryUsage& operator+=(const MemoryUsage& other) {
+    vectors += other.vectors;
+    codes += other.codes;
+    graph += other.graph;
+    metadata += other.metadata;
+    protobuf += other.protobuf;
+    buffers += other.buffers;
+    return *this;
+  }
+
+  friend void to_json(nlohmann::json& j, const MemoryUsage& usage) {
+    j = nlohmann::json{{"vectors", usage.vectors},
+                       {"codes", usage.codes},
+                       {"graph", usage.graph},
+                       {"metadata", usage.metadata},
+                       {"protobuf", usage.protobuf},
+                       {"buffers", usage.buffers},
+                       {"total", usage.GetTotal()}};
+  }
+};
+
+// What an index is made of, for GET /stats.
+struct IndexStats {
+  std::string type;
+  int dim_size = 0;
+  int64_t record_count = 0;
+  // Records per label
+  std::map<int, int64_t> label_counts;
+  // Those it was built with, and searches with unless a request sets them
+  nlohmann::json params = nlohmann::json::object();
+  // Of the index and those within it
+  MemoryUsage memory;
+  // Of an index wrapping others, theirs
+  std::vector<IndexStats> indexes;
+
+  friend void to_json(nlohmann::json& j, const IndexStats& stats) {
+    nlohmann::json label_counts = nlohmann::json::object();
+    for (const auto& kv : stats.label_counts) {
+      label_counts[std::to_string(kv.first)] = kv.second;
+    }
+    j = nlohmann::json{{"type", stats.type},
+                       {"dim_size", stats.dim_size},
+                       {"record_count", stats.record_count},
+                       {"label_counts", label_counts},
+                       {"params", stats.params},
+                       {"memory", stats.memory}};
+    if (!stats.indexes.empty()) {
+      j["indexes"] = stats.indexes;
+    }
   }
 };
 
@@ -67,18 +338,141 @@ class IndexInterface {
   virtual bool Search(const SearchRequest& request,
                       SearchResponse& response) = 0;
 
+  // Looks an indexed record up by its id, returns false if there is none.
+  virtual bool Get(const std::string& id,
+                   feature_extraction::FeatureRecord* record) = 0;
+
   virtual int GetDimSize() const = 0;
+
+  // Payload fields that `SearchRequest::filter` may refer to. Only records
+  // added afterwards are indexed by them.
+  virtual void SetAttributeFields(const std::vector<std::string>& fields) = 0;
+
+  // Fraction of the records `filter` selects, estimated without evaluating
+  // it. Throws std::invalid_argument as a search with it would.
+  virtual double EstimateSelectivity(const Filter& filter) const = 0;
+
+  // Neither may run concurrently with Add().
+  virtual MemoryUsage GetMemoryUsage() const = 0;
+
+  virtual IndexStats GetStats() const = 0;
+};
+
+// The metadata and attributes of the records, by row. Indexes over the same
+// records, added in the same order, may share them.
+struct SharedMetadata {
+  MetadataStore store;
+  AttributeIndex attributes;
 };
 
 class IndexBase : public IndexInterface {
  public:
-  IndexBase(int dim_size) : dim_size_(dim_size), total_count_(0) {}
+  // Keeps the metadata on its own unless given `shared` ones.
+  explicit IndexBase(int dim_size,
+                     std::shared_ptr<SharedMetadata> shared = nullptr)
+      : dim_size_(dim_size),
+        total_count_(0),
+        owns_metadata_(!shared),
+        shared_(shared ? std::move(shared)
+                       : std::make_shared<SharedMetadata>()),
+        metadata_(shared_->store),
+        attributes_(shared_->attributes),
+        added_rows_(0) {}
+
+  bool Get(const std::string& id,
+           feature_extraction::FeatureRecord* record) override {
+    int64_t row = metadata_.Find(id);
+    if (row < 0) {
+      return false;
+    }
+    metadata_.CopyTo(row, record);
+    record->mutable_value()->Resize(dim_size_, 0.f);
+    CopyVector(row, record->mutable_value()->mutable_data());
+    return true;
+  }
 
   int GetDimSize() const override { return dim_size_; }
 
+  void SetAttributeFields(const std::vector<std::string>& fields) override {
+    attributes_.SetFields(fields);
+  }
+
+  double EstimateSelectivity(const Filter& filter) const override {
+    return attributes_.EstimateSelectivity(filter, metadata_.GetSize());
+  }
+
+  // Left to the indexes to fill in their type and params.
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.dim_size = dim_size_;
+    stats.record_count = total_count_;
+    for (int64_t row = 0; row < metadata_.GetSize(); ++row) {
+      ++stats.label_counts[metadata_.GetLabel(row)];
+    }
+    stats.memory = GetMemoryUsage();
+    return stats;
+  }
+
  protected:
+  // Rows scanned between two checks of the request deadline.
+  static constexpr size_t kScanChunkSize = 4096;
+
+  // Copies the `dim_size_` values of the record at `row` into `values`.
+  virtual void CopyVector(int64_t row, float* values) = 0;
+
+  // Stores everything of `record` but its vector, returns its row. Of shared
+  // metadata, only the first index adding the record stores it.
+  int64_t AddMetadata(const feature_extraction::FeatureRecord& record) {
+    int64_t row = added_rows_++;
+    if (row == metadata_.GetSize()) {
+      metadata_.Add(record);
+      attributes_.Add(row, record.payload());
+    }
+    return row;
+  }
+
+  // Returns false if `request` has no filter, otherwise expands the rows
+  // matching it into `words`, see Bitmap::ToWords().
+  bool EvaluateFilter(const SearchRequest& request,
+                      std::vector<uint64_t>* words) const {
+    if (request.filter.op == Filter::Op::kNone) {
+      return false;
+    }
+    attributes_.Evaluate(request.filter, metadata_.GetSize())
+        .ToWords(metadata_.GetSize(), words);
+    return true;
+  }
+
+  // Of the metadata and the attributes, which every index keeps the same way.
+  // Shared ones are left to their owner to count.
+  MemoryUsage GetMetadataMemoryUsage() const {
+    MemoryUsage usage;
+    if (owns_metadata_) {
+      usage.metadata =
+          metadata_.GetMemoryUsage() + attributes_.GetMemoryUsage();
+    }
+    return usage;
+  }
+
+  static bool IsRowSelected(const std::vector<uint64_t>& words, int64_t row) {
+    return words[row >> 6] >> (row & 63) & 1;
+  }
+
+  void AddNeighbor(int64_t row, float distance,
+                   SearchResponse& response) const {
+    response.neighbors.emplace_back();
+    metadata_.CopyTo(row, &response.neighbors.back().record);
+    response.neighbors.back().distance = distance;
+  }
+
   int dim_size_;
   int64_t total_count_;
+  bool owns_metadata_;
+  std::shared_ptr<SharedMetadata> shared_;
+  MetadataStore& metadata_;
+  AttributeIndex& attributes_;
+  // Rows of this index, which shared metadata may be ahead of
+  int64_t added_rows_;
 };
 
 }  // namespace ann
@@ -0,0 +1,758 @@
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+
+#include "absl/strings/str_format.h"
+#include "gtest/gtest.h"
+#include "image_retrieval/ann/binary_index.h"
+#include "image_retrieval/ann/disk_index.h"
+#include "image_retrieval/ann/flat_index.h"
+#include "image_retrieval/ann/hnsw_index.h"
+#include "image_retrieval/ann/planned_index.h"
+#include "image_retrieval/ann/transformed_index.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::concurrency::NumaNode;
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+constexpr int kDimSize = 16;
+
+// Partitions on any machine, with unpinned workers
+const std::vector<NumaNode> kTwoNodes = {{0, {}}, {1, {}}};
+
+FeatureRecord MakeRecord(int i) {
+  FeatureRecord record;
+  record.set_id(absl::StrFormat("img_%d", i));
+  record.set_label(i % 3);
+  record.set_payload(absl::StrFormat("{\"img\": \"%d.jpg\"}", i));
+  for (int j = 0; j < kDimSize; ++j) {
+    record.add_value(j == i % kDimSize ? 1.f + i : 0.1f * ((i + j) % 5));
+  }
+  return record;
+}
+
+std::unique_ptr<IndexInterface> NewFlatAndGraph(
+    int dim_size, const PlannerOptions& options = PlannerOptions()) {
+  auto metadata = std::make_shared<SharedMetadata>();
+  std::vector<PhysicalIndex> indexes;
+  indexes.push_back(
+      {"flat", PlanKind::kScan, NewFlatIndex(dim_size, false, metadata)});
+  indexes.push_back(
+      {"hnsw", PlanKind::kGraph, NewHNSWIndex(dim_size, true, metadata)});
+  return NewPlannedIndex(std::move(indexes), options, std::move(metadata));
+}
+
+// Expects `id` to be the nearest neighbor of `request`. Binary codes tie
+// records whose codes are equal, any of which may then come first.
+void ExpectNearest(IndexInterface* index, SearchRequest request,
+                   const std::string& id, int count) {
+  request.top_k = count;
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_FALSE(response.neighbors.empty());
+  auto it = std::find_if(
+      response.neighbors.begin(), response.neighbors.end(),
+      [&id](const ResponseRecord& record) { return record.record.id() == id; });
+  ASSERT_NE(it, response.neighbors.end());
+  EXPECT_EQ(it->distance, response.neighbors[0].distance);
+  if (response.neighbors.size() == 1 ||
+      response.neighbors[1].distance > response.neighbors[0].distance) {
+    EXPECT_EQ(response.neighbors[0].record.id(), id);
+  }
+}
+
+class IndexTest
+    : public testing::TestWithParam<
+          std::function<std::unique_ptr<IndexInterface>(int)>> {};
+
+TEST_P(IndexTest, SearchAndGet) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  const int count = 100;
+  for (int i = 0; i < count; ++i) {
+    index->Add(MakeRecord(i));
+  }
+
+  FeatureRecord record;
+  ASSERT_TRUE(index->Get("img_42", &record));
+  FeatureRecord expected = MakeRecord(42);
+  EXPECT_EQ(record.id(), expected.id());
+  EXPECT_EQ(record.label(), expected.label());
+  EXPECT_EQ(record.payload(), expected.payload());
+  ASSERT_EQ(record.value_size(), kDimSize);
+  for (int j = 0; j < kDimSize; ++j) {
+    EXPECT_EQ(record.value(j), expected.value(j));
+  }
+  EXPECT_FALSE(index->Get("img_100", &record));
+
+  SearchRequest request;
+  request.query.assign(record.value().begin(), record.value().end());
+  request.top_k = 5;
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_EQ(response.total_count, count);
+  ASSERT_EQ(response.neighbors.size(), 5);
+  ExpectNearest(index.get(), request, "img_42", count);
+  for (const auto& neighbor : response.neighbors) {
+    if (neighbor.record.id() == "img_42") {
+      EXPECT_EQ(neighbor.record.payload(), expected.payload());
+    }
+  }
+  // Neighbors come without their vectors
+  EXPECT_EQ(response.neighbors[0].record.value_size(), 0);
+  for (size_t i = 1; i < response.neighbors.size(); ++i) {
+    EXPECT_LE(response.neighbors[i - 1].distance,
+              response.neighbors[i].distance);
+  }
+}
+
+TEST_P(IndexTest, RangeSearch) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  const int count = 100;
+  for (int i = 0; i < count; ++i) {
+    index->Add(MakeRecord(i));
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(7);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = count;
+  SearchResponse all;
+  ASSERT_TRUE(index->Search(request, all));
+  ASSERT_EQ(all.neighbors.size(), count);
+
+  request.max_distance = all.neighbors[10].distance;
+  size_t expected = 0;
+  while (expected < all.neighbors.size() &&
+         all.neighbors[expected].distance <= request.max_distance) {
+    ++expected;
+  }
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), expected);
+  for (size_t i = 0; i < expected; ++i) {
+    EXPECT_EQ(response.neighbors[i].distance, all.neighbors[i].distance);
+  }
+
+  request.max_results = 3;
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), 3);
+  EXPECT_EQ(response.neighbors[0].distance, all.neighbors[0].distance);
+}
+
+TEST_P(IndexTest, Deadline) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  for (int i = 0; i < 100; ++i) {
+    index->Add(MakeRecord(i));
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(7);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.deadline_ms = 10000;
+  request.StartDeadline(absl::Now());
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_TRUE(response.complete);
+  EXPECT_EQ(response.scanned_fraction, 1.f);
+  ASSERT_FALSE(response.neighbors.empty());
+  ExpectNearest(index.get(), request, "img_7", 100);
+
+  // Already expired, nothing gets scanned
+  request.StartDeadline(absl::Now() - absl::Milliseconds(20000));
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_FALSE(response.complete);
+  EXPECT_EQ(response.scanned_fraction, 0.f);
+  EXPECT_TRUE(response.neighbors.empty());
+  EXPECT_EQ(nlohmann::json(response).at("scanned_fraction"), 0.f);
+}
+
+TEST_P(IndexTest, Filter) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  index->SetAttributeFields({"source", "tags"});
+  const int count = 200;
+  for (int i = 0; i < count; ++i) {
+    FeatureRecord record = MakeRecord(i);
+    record.set_payload(absl::StrFormat(
+        R"({"source": "%s", "tags": [%d, "t%d"]})", i % 2 ? "web" : "app",
+        i % 5, i % 3));
+    index->Add(record);
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(7);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = count;
+  // Odd rows, without those whose tags have 0 or "t1"
+  request.filter = nlohmann::json::parse(R"({"and": [
+      {"field": "source", "value": "web"},
+      {"not": {"or": [{"field": "tags", "value": 0},
+                      {"field": "tags", "value": "t1"}]}}]})");
+  std::set<std::string> expected;
+  for (int i = 0; i < count; ++i) {
+    if (i % 2 && i % 5 && i % 3 != 1) {
+      expected.insert(absl::StrFormat("img_%d", i));
+    }
+  }
+
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  std::set<std::string> ids;
+  for (const auto& neighbor : response.neighbors) {
+    ids.insert(neighbor.record.id());
+  }
+  // HNSW is approximate, though nothing unselected may show up
+  for (const auto& id : ids) {
+    EXPECT_TRUE(expected.count(id)) << id;
+  }
+  EXPECT_GE(ids.size(), expected.size() * 9 / 10);
+  // The fields are independent here
+  EXPECT_NEAR(index->EstimateSelectivity(request.filter),
+              static_cast<double>(expected.size()) / count, 0.01);
+  EXPECT_DOUBLE_EQ(index->EstimateSelectivity(nlohmann::json::parse(
+                       R"({"field": "source", "value": "web"})")),
+                   0.5);
+
+  request.filter = nlohmann::json::parse(R"({"field": "source", "value": "x"})");
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_TRUE(response.neighbors.empty());
+  EXPECT_EQ(index->EstimateSelectivity(request.filter), 0.);
+
+  request.filter = nlohmann::json::parse(R"({"field": "img", "value": "x"})");
+  EXPECT_THROW(index->Search(request, response), std::invalid_argument);
+  EXPECT_THROW(index->EstimateSelectivity(request.filter),
+               std::invalid_argument);
+}
+
+TEST_P(IndexTest, Params) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  const int count = 200;
+  for (int i = 0; i < count; ++i) {
+    index->Add(MakeRecord(i));
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(11);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = count;
+  SearchResponse everything;
+  ASSERT_TRUE(index->Search(request, everything));
+
+  // Wide enough for the graph indexes to find the exact neighbors
+  request.top_k = 10;
+  request.params =
+      nlohmann::json::parse(R"({"ef": 200, "search_list": 200,
+                                "beam_width": 8})")
+          .get<SearchParams>();
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), 10);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_FLOAT_EQ(response.neighbors[i].distance,
+                    everything.neighbors[i].distance);
+  }
+
+  // The narrowest search still answers
+  request.params = nlohmann::json::parse(R"({"ef": 1, "search_list": 1,
+                                             "beam_width": 1})");
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_FALSE(response.neighbors.empty());
+
+  nlohmann::json json = request;
+  EXPECT_EQ(json.at("params").at("ef"), 1);
+  EXPECT_THROW(nlohmann::json::parse(R"({"ef": -1})").get<SearchParams>(),
+               std::invalid_argument);
+  EXPECT_THROW(nlohmann::json::parse(R"({"nprobe": 1})").get<SearchParams>(),
+               std::invalid_argument);
+}
+
+TEST_P(IndexTest, Stats) {
+  std::unique_ptr<IndexInterface> index = GetParam()(kDimSize);
+  const int count = 100;
+  for (int i = 0; i < count; ++i) {
+    index->Add(MakeRecord(i));
+  }
+  // Some indexes lay their records out for the first search
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(7);
+  request.query.assign(query.value().begin(), query.value().end());
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+
+  IndexStats stats = index->GetStats();
+  EXPECT_FALSE(stats.type.empty());
+  EXPECT_EQ(stats.dim_size, kDimSize);
+  EXPECT_EQ(stats.record_count, count);
+  EXPECT_EQ(stats.label_counts,
+            (std::map<int, int64_t>{{0, 34}, {1, 33}, {2, 33}}));
+
+  const MemoryUsage& memory = stats.memory;
+  EXPECT_EQ(memory.GetTotal(), index->GetMemoryUsage().GetTotal());
+  // Ids and payloads, and the vectors or else their codes
+  EXPECT_GT(memory.metadata, count * sizeof("img_00"));
+  EXPECT_GT(memory.vectors + memory.codes, count);
+  for (const auto& child : stats.indexes) {
+    EXPECT_EQ(child.record_count, count);
+    EXPECT_LT(child.memory.GetTotal(), memory.GetTotal());
+  }
+
+  nlohmann::json json = stats;
+  EXPECT_EQ(json.at("memory").at("total"), memory.GetTotal());
+  EXPECT_EQ(json.at("label_counts").at("1"), 33);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Indexes, IndexTest,
+    testing::Values([](int dim_size) { return NewFlatIndex(dim_size); },
+                    [](int dim_size) { return NewFlatIndex(dim_size, true); },
+                    [](int dim_size) {
+                      return NewFlatIndex(dim_size, kTwoNodes);
+                    },
+                    [](int dim_size) { return NewHNSWIndex(dim_size); },
+                    [](int dim_size) { return NewHNSWIndex(dim_size, true); },
+                    [](int dim_size) { return NewFlatAndGraph(dim_size); },
+                    [](int dim_size) { return NewBinaryIndex2048(dim_size); },
+                    [](int dim_size) {
+                      DiskIndexOptions options;
+                      options.path = testing::TempDir() + "/index_test.disk";
+                      return NewDiskIndex(dim_size, options);
+                    }));
+
+TEST(FlatIndex, DestroyedWhileCopying) {
+  // Enough for every partition to hand batches over to its workers, which
+  // are still copying them when the index goes
+  for (int round = 0; round < 5; ++round) {
+    std::unique_ptr<IndexInterface> index = NewFlatIndex(kDimSize, kTwoNodes);
+    for (int i = 0; i < 5000; ++i) {
+      index->Add(MakeRecord(i));
+    }
+  }
+
+  std::unique_ptr<IndexInterface> index = NewFlatIndex(kDimSize, kTwoNodes);
+  for (int i = 0; i < 5000; ++i) {
+    index->Add(MakeRecord(i));
+  }
+  FeatureRecord record;
+  ASSERT_TRUE(index->Get("img_4321", &record));
+  EXPECT_EQ(record.value(4321 % kDimSize), 4322.f);
+  EXPECT_EQ(index->GetStats().params.at("numa_partitions"), 2);
+}
+
+TEST(FlatIndex, RangeSearchOddDim) {
+  // Neither the top-k nor the range search kernel may assume whole AVX lanes
+  const int dim_size = 12, count = 100;
+  std::unique_ptr<IndexInterface> index = NewFlatIndex(dim_size);
+  for (int i = 0; i < count; ++i) {
+    FeatureRecord record;
+    record.set_id(absl::StrFormat("img_%d", i));
+    for (int j = 0; j < dim_size; ++j) {
+      record.add_value(j == i % dim_size ? 1.f + i : 0.1f * ((i + j) % 5));
+    }
+    index->Add(record);
+  }
+
+  SearchRequest request;
+  request.query.assign(dim_size, 0.1f);
+  request.query[7] = 2.f;
+  request.top_k = count;
+  SearchResponse all;
+  ASSERT_TRUE(index->Search(request, all));
+  ASSERT_EQ(all.neighbors.size(), count);
+
+  request.max_distance = all.neighbors[10].distance;
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_GE(response.neighbors.size(), 11);
+  for (size_t i = 0; i < response.neighbors.size(); ++i) {
+    EXPECT_FLOAT_EQ(response.neighbors[i].distance, all.neighbors[i].distance);
+  }
+}
+
+TEST(BinaryIndex, MultiIndexHashing) {
+  const int dim_size = 64, count = 5000;
+  std::unique_ptr<IndexInterface> scan = NewBinaryIndex2048(dim_size);
+  std::unique_ptr<IndexInterface> mih = NewBinaryIndex2048(dim_size, true);
+  std::mt19937 random(7);
+  std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+  std::vector<std::vector<float>> vectors;
+  for (int i = 0; i < count; ++i) {
+    // Every tenth one a near copy of the one before
+    std::vector<float> vector(dim_size);
+    for (int j = 0; j < dim_size; ++j) {
+      vector[j] = i % 10 == 1 ? vectors.back()[j] + 0.05f * uniform(random)
+                              : uniform(random);
+    }
+    FeatureRecord record;
+    record.set_id(absl::StrFormat("img_%d", i));
+    record.set_label(i % 3);
+    *record.mutable_value() = {vector.begin(), vector.end()};
+    scan->Add(record);
+    mih->Add(record);
+    vectors.push_back(std::move(vector));
+  }
+
+  for (int i = 0; i < 50; ++i) {
+    SearchRequest request;
+    request.query = vectors[i * 7];
+    request.top_k = i % 2 ? 2 : 20;
+    if (i % 5 == 0) {
+      request.labels = {1};
+    }
+    if (i % 3 == 0) {
+      request.max_distance = 6.f;
+    }
+    SearchResponse expected, response;
+    ASSERT_TRUE(scan->Search(request, expected));
+    ASSERT_TRUE(mih->Search(request, response));
+    // Exact, though equally distant neighbors may come in any order
+    ASSERT_EQ(response.neighbors.size(), expected.neighbors.size()) << i;
+    for (size_t j = 0; j < response.neighbors.size(); ++j) {
+      EXPECT_EQ(response.neighbors[j].distance, expected.neighbors[j].distance);
+    }
+  }
+
+  SearchRequest request;
+  request.query = vectors[0];
+  request.deadline_ms = 1;
+  request.StartDeadline(absl::Now() - absl::Seconds(1));
+  SearchResponse response;
+  ASSERT_TRUE(mih->Search(request, response));
+  EXPECT_FALSE(response.complete);
+  EXPECT_TRUE(response.neighbors.empty());
+}
+
+TEST(BinaryIndex, EveryBitCounts) {
+  // One-hot vectors, whose codes differ in two bits from one another
+  std::unique_ptr<IndexInterface> index = NewBinaryIndex2048(kDimSize);
+  for (int i = 0; i < kDimSize; ++i) {
+    FeatureRecord record;
+    record.set_id(absl::StrFormat("img_%d", i));
+    for (int j = 0; j < kDimSize; ++j) {
+      record.add_value(i == j ? 1.f : 0.f);
+    }
+    index->Add(record);
+  }
+
+  for (int i = 0; i < kDimSize; ++i) {
+    SearchRequest request;
+    request.query.assign(kDimSize, 0.f);
+    request.query[i] = 1.f;
+    request.top_k = kDimSize;
+    SearchResponse response;
+    ASSERT_TRUE(index->Search(request, response));
+    ASSERT_EQ(response.neighbors.size(), kDimSize);
+    EXPECT_EQ(response.neighbors[0].record.id(), absl::StrFormat("img_%d", i));
+    EXPECT_EQ(response.neighbors[0].distance, 0.f);
+    for (int j = 1; j < kDimSize; ++j) {
+      EXPECT_EQ(response.neighbors[j].distance, 2.f) << i;
+    }
+  }
+}
+
+TEST(BinaryIndex, ConcurrentFirstSearches) {
+  const int count = 20000;
+  std::unique_ptr<IndexInterface> expected_index =
+      NewBinaryIndex2048(kDimSize, true);
+  std::unique_ptr<IndexInterface> index = NewBinaryIndex2048(kDimSize, true);
+  for (int i = 0; i < count; ++i) {
+    expected_index->Add(MakeRecord(i));
+    index->Add(MakeRecord(i));
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(42);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = 10;
+  SearchResponse expected;
+  ASSERT_TRUE(expected_index->Search(request, expected));
+
+  // The codes are built once, whichever search comes first
+  std::vector<SearchResponse> responses(8);
+  std::vector<std::thread> threads;
+  std::atomic<int> ready(0);
+  for (auto& response : responses) {
+    threads.emplace_back([&, response = &response]() {
+      // All at once
+      for (++ready; ready < responses.size();) {
+      }
+      index->Search(request, *response);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& response : responses) {
+    ASSERT_EQ(response.neighbors.size(), expected.neighbors.size());
+    for (size_t i = 0; i < response.neighbors.size(); ++i) {
+      EXPECT_EQ(response.neighbors[i].distance, expected.neighbors[i].distance);
+    }
+  }
+  EXPECT_EQ(index->GetMemoryUsage().codes,
+            expected_index->GetMemoryUsage().codes);
+}
+
+TEST(PlannedIndex, Plans) {
+  // Scans cost about a graph search of 32 distances over 1300 rows
+  PlannerOptions options;
+  options.scan_fixed_ns = 1000;
+  options.graph_ef = 4;
+  options.graph_distances_per_candidate = 8;
+  std::unique_ptr<IndexInterface> index = NewFlatAndGraph(kDimSize, options);
+  index->SetAttributeFields({"rare"});
+  const int count = 2000;
+  for (int i = 0; i < count; ++i) {
+    FeatureRecord record = MakeRecord(i);
+    record.set_payload(absl::StrFormat(R"({"rare": %s})",
+                                       i % 100 ? "false" : "true"));
+    index->Add(record);
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(300);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = 4;
+  auto search = [&]() {
+    SearchResponse response;
+    EXPECT_TRUE(index->Search(request, response));
+    EXPECT_FALSE(response.neighbors.empty());
+    return response;
+  };
+
+  SearchResponse response = search();
+  EXPECT_EQ(response.plan, "hnsw");
+  EXPECT_EQ(response.neighbors[0].record.id(), "img_300");
+  EXPECT_EQ(nlohmann::json(response).at("plan"), "hnsw");
+
+  // A graph search walks past the 99% of rows filtered out
+  request.filter = nlohmann::json::parse(R"({"field": "rare", "value": true})");
+  response = search();
+  EXPECT_EQ(response.plan, "flat");
+  EXPECT_EQ(response.neighbors[0].record.id(), "img_300");
+  request.filter = Filter();
+
+  // Only scans are restricted to labels, and return every neighbor in range
+  request.labels = {1};
+  EXPECT_EQ(search().plan, "flat");
+  request.labels.clear();
+  request.max_distance = 0.5f;
+  EXPECT_EQ(search().plan, "flat");
+  request.max_results = 2;
+  EXPECT_EQ(search().plan, "hnsw");
+  request.max_distance = std::numeric_limits<float>::infinity();
+
+  // Nothing fits, and a scan stops at the deadline
+  request.deadline_ms = 1;
+  request.StartDeadline(absl::Now() - absl::Milliseconds(10));
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_EQ(response.plan, "flat");
+  EXPECT_FALSE(response.complete);
+
+  FeatureRecord record;
+  ASSERT_TRUE(index->Get("img_7", &record));
+  EXPECT_EQ(record.value(7), 8.f);
+}
+
+TEST(PlannedIndex, SharedMetadata) {
+  std::unique_ptr<IndexInterface> index = NewFlatAndGraph(kDimSize);
+  std::unique_ptr<IndexInterface> flat = NewFlatIndex(kDimSize);
+  std::unique_ptr<IndexInterface> graph = NewHNSWIndex(kDimSize, true);
+  SharedMetadata shared;
+  for (auto* built : {index.get(), flat.get(), graph.get()}) {
+    built->SetAttributeFields({"img"});
+  }
+  shared.attributes.SetFields({"img"});
+  for (int i = 0; i < 1000; ++i) {
+    FeatureRecord record = MakeRecord(i);
+    for (auto* built : {index.get(), flat.get(), graph.get()}) {
+      built->Add(record);
+    }
+    shared.attributes.Add(shared.store.Add(record), record.payload());
+  }
+
+  // Of the indexes on their own, less one copy of the metadata, beside the
+  // counts of the 3 labels
+  const size_t expected = flat->GetMemoryUsage().metadata +
+                          graph->GetMemoryUsage().metadata -
+                          shared.store.GetMemoryUsage() -
+                          shared.attributes.GetMemoryUsage();
+  EXPECT_GE(index->GetMemoryUsage().metadata, expected);
+  EXPECT_LT(index->GetMemoryUsage().metadata, expected + 1024);
+
+  FeatureRecord record;
+  ASSERT_TRUE(index->Get("img_123", &record));
+  EXPECT_EQ(record.payload(), MakeRecord(123).payload());
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(300);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = 1;
+  request.filter =
+      nlohmann::json::parse(R"({"field": "img", "value": "300.jpg"})");
+  EXPECT_DOUBLE_EQ(index->EstimateSelectivity(request.filter), 1. / 1000);
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(response.neighbors[0].record.id(), "img_300");
+}
+
+TEST(TransformedIndex, Pca) {
+  const int dim_size = 32, rank = 8, count = 300;
+  std::mt19937 random(5);
+  std::normal_distribution<float> normal;
+  auto gaussian = [&]() { return normal(random); };
+  Eigen::MatrixXf data =
+      Eigen::MatrixXf::NullaryExpr(count, rank, gaussian) *
+      Eigen::MatrixXf::NullaryExpr(rank, dim_size, gaussian);
+
+  clustering::LinearTransform::Options options;
+  options.output_dim = rank;
+  auto transform = std::make_shared<clustering::LinearTransform>(
+      clustering::LinearTransform::Train(data, options));
+  std::unique_ptr<IndexInterface> raw = NewHNSWIndex(dim_size);
+  std::unique_ptr<IndexInterface> reduced =
+      NewTransformedIndex(NewHNSWIndex(rank), transform);
+  EXPECT_EQ(reduced->GetDimSize(), dim_size);
+  for (int i = 0; i < count; ++i) {
+    FeatureRecord record;
+    record.set_id(absl::StrFormat("img_%d", i));
+    for (int j = 0; j < dim_size; ++j) {
+      record.add_value(data(i, j));
+    }
+    raw->Add(record);
+    reduced->Add(record);
+  }
+
+  // Euclidean distances are kept, so are the neighbors
+  SearchRequest request;
+  request.query.assign(dim_size, 0.f);
+  for (int j = 0; j < dim_size; ++j) {
+    request.query[j] = data(42, j);
+  }
+  request.top_k = 10;
+  request.params.ef = count;
+  SearchResponse expected, response;
+  ASSERT_TRUE(raw->Search(request, expected));
+  ASSERT_TRUE(reduced->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), expected.neighbors.size());
+  for (size_t i = 0; i < response.neighbors.size(); ++i) {
+    EXPECT_EQ(response.neighbors[i].record.id(),
+              expected.neighbors[i].record.id());
+  }
+
+  // The reconstruction of a vector in the subspace is the vector
+  FeatureRecord record;
+  ASSERT_TRUE(reduced->Get("img_42", &record));
+  ASSERT_EQ(record.value_size(), dim_size);
+  for (int j = 0; j < dim_size; ++j) {
+    EXPECT_NEAR(record.value(j), data(42, j), 1e-3f);
+  }
+
+  // Of the graph over the reduced vectors, and the transform
+  IndexStats stats = reduced->GetStats();
+  EXPECT_EQ(stats.type, "transformed");
+  EXPECT_EQ(stats.record_count, count);
+  ASSERT_EQ(stats.indexes.size(), 1);
+  EXPECT_EQ(stats.indexes[0].type, "hnsw");
+  EXPECT_EQ(stats.indexes[0].dim_size, rank);
+  EXPECT_GE(stats.memory.codes - stats.indexes[0].memory.codes,
+            rank * dim_size * sizeof(float));
+  EXPECT_GT(raw->GetMemoryUsage().vectors, stats.memory.vectors);
+
+  request.query.resize(rank);
+  EXPECT_THROW(reduced->Search(request, response), std::runtime_error);
+}
+
+TEST(DiskIndex, Reopen) {
+  DiskIndexOptions options;
+  options.path = testing::TempDir() + "/disk_index_test.disk";
+  options.cache_nodes = 10;
+  const int count = 1000;
+  std::unique_ptr<IndexInterface> index = NewDiskIndex(kDimSize, options);
+  index->SetAttributeFields({"img"});
+  for (int i = 0; i < count; ++i) {
+    index->Add(MakeRecord(i));
+  }
+
+  SearchRequest request;
+  FeatureRecord query = MakeRecord(123);
+  request.query.assign(query.value().begin(), query.value().end());
+  request.top_k = 10;
+  SearchResponse expected;
+  ASSERT_TRUE(index->Search(request, expected));
+  ASSERT_EQ(expected.neighbors.size(), 10);
+  EXPECT_EQ(expected.neighbors[0].record.id(), "img_123");
+  EXPECT_THROW(index->Add(MakeRecord(count)), std::runtime_error);
+  index.reset();
+
+  ASSERT_TRUE(IsDiskIndexFile(options.path));
+  index = OpenDiskIndex(options);
+  index->SetAttributeFields({"img"});
+  EXPECT_EQ(index->GetDimSize(), kDimSize);
+  SearchResponse response;
+  ASSERT_TRUE(index->Search(request, response));
+  EXPECT_EQ(response.total_count, count);
+  ASSERT_EQ(response.neighbors.size(), expected.neighbors.size());
+  for (size_t i = 0; i < response.neighbors.size(); ++i) {
+    EXPECT_EQ(response.neighbors[i].record.id(),
+              expected.neighbors[i].record.id());
+    EXPECT_EQ(response.neighbors[i].distance,
+              expected.neighbors[i].distance);
+  }
+
+  FeatureRecord record;
+  ASSERT_TRUE(index->Get("img_999", &record));
+  FeatureRecord original = MakeRecord(999);
+  EXPECT_EQ(record.payload(), original.payload());
+  ASSERT_EQ(record.value_size(), kDimSize);
+  for (int j = 0; j < kDimSize; ++j) {
+    EXPECT_EQ(record.value(j), original.value(j));
+  }
+
+  // Attributes are indexed off the stored payloads
+  request.filter =
+      nlohmann::json::parse(R"({"field": "img", "value": "5.jpg"})");
+  response = SearchResponse();
+  ASSERT_TRUE(index->Search(request, response));
+  ASSERT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(response.neighbors[0].record.id(), "img_5");
+}
+
+TEST(MetadataStore, Columns) {
+  MetadataStore store;
+  FeatureRecord record;
+  record.set_id("a");
+  record.set_label(7);
+  EXPECT_EQ(store.Add(record), 0);
+  record.set_id("b");
+  record.set_payload(std::string(1 << 20, 'x'));
+  EXPECT_EQ(store.Add(record), 1);
+  record.set_id("a");
+  record.clear_payload();
+  EXPECT_EQ(store.Add(record), 2);
+
+  EXPECT_EQ(store.GetSize(), 3);
+  EXPECT_EQ(store.Find("a"), 2);
+  EXPECT_EQ(store.Find("b"), 1);
+  EXPECT_EQ(store.Find("c"), -1);
+  EXPECT_EQ(store.GetPayload(1).size(), 1 << 20);
+  EXPECT_EQ(store.GetLabel(0), 7);
+
+  FeatureRecord copy;
+  store.CopyTo(1, &copy);
+  EXPECT_EQ(copy.id(), "b");
+  EXPECT_EQ(copy.label(), 7);
+  EXPECT_EQ(copy.payload(), std::string(1 << 20, 'x'));
+}
+
+}  // namespace
+}  // namespace ann
+}  // namespace image_retrieval
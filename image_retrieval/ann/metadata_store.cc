@@ -0,0 +1,80 @@
+#include "image_retrieval/ann/metadata_store.h"
+
+#include <cstring>
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+constexpr size_t kBlockSize = 1 << 20;
+
+}  // namespace
+
+MetadataStore::MetadataStore()
+    : block_bytes_(0), block_(nullptr), block_remaining_(0) {}
+
+absl::string_view MetadataStore::Store(absl::string_view bytes) {
+  if (bytes.empty()) {
+    return absl::string_view();
+  }
+
+  char* data;
+  if (bytes.size() > kBlockSize / 4) {
+    // Large blobs get a block of their own, so they do not waste the rest of
+    // the current one.
+    blocks_.emplace_back(new char[bytes.size()]);
+    block_bytes_ += bytes.size();
+    data = blocks_.back().get();
+  } else {
+    if (bytes.size() > block_remaining_) {
+      blocks_.emplace_back(new char[kBlockSize]);
+      block_bytes_ += kBlockSize;
+      block_ = blocks_.back().get();
+      block_remaining_ = kBlockSize;
+    }
+    data = block_;
+    block_ += bytes.size();
+    block_remaining_ -= bytes.size();
+  }
+
+  std::memcpy(data, bytes.data(), bytes.size());
+  return absl::string_view(data, bytes.size());
+}
+
+int64_t MetadataStore::Add(const FeatureRecord& record) {
+  int64_t row = labels_.size();
+  absl::string_view id = Store(record.id());
+  ids_.push_back(id);
+  payloads_.push_back(Store(record.payload()));
+  labels_.push_back(record.label());
+  rows_[id] = row;
+  return row;
+}
+
+int64_t MetadataStore::Find(absl::string_view id) const {
+  auto it = rows_.find(id);
+  return it == rows_.end() ? -1 : it->second;
+}
+
+void MetadataStore::CopyTo(int64_t row, FeatureRecord* record) const {
+  record->set_id(std::string(ids_[row]));
+  record->set_label(labels_[row]);
+  if (!payloads_[row].empty()) {
+    record->set_payload(payloads_[row].data(), payloads_[row].size());
+  }
+}
+
+size_t MetadataStore::GetMemoryUsage() const {
+  return block_bytes_ +
+         blocks_.capacity() * sizeof(std::unique_ptr<char[]>) +
+         ids_.capacity() * sizeof(absl::string_view) +
+         payloads_.capacity() * sizeof(absl::string_view) +
+         labels_.capacity() * sizeof(int32_t) +
+         // Slots of the hash map come with a control byte each
+         rows_.capacity() * (sizeof(decltype(rows_)::value_type) + 1);
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
@@ -0,0 +1,66 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_METADATA_STORE_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_METADATA_STORE_H_
+
+#include <memory>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "image_retrieval/feature_extraction/feature.pb.h"
+
+namespace image_retrieval {
+namespace ann {
+
+/**
+ * Columnar storage of everything in a `FeatureRecord` but its vector. Ids and
+ * payloads are packed into large arena blocks instead of one heap string each,
+ * labels live in a plain array, and rows are numbered in the order they were
+ * added. Indexes keep their vectors on their own and refer to records by row.
+ *
+ * `Add` must not run concurrently with readers.
+ */
+class MetadataStore {
+ public:
+  MetadataStore();
+
+  MetadataStore(const MetadataStore&) = delete;
+  MetadataStore& operator=(const MetadataStore&) = delete;
+
+  // Returns the row of the appended record.
+  int64_t Add(const feature_extraction::FeatureRecord& record);
+
+  int64_t GetSize() const { return labels_.size(); }
+
+  absl::string_view GetId(int64_t row) const { return ids_[row]; }
+
+  absl::string_view GetPayload(int64_t row) const { return payloads_[row]; }
+
+  int GetLabel(int64_t row) const { return labels_[row]; }
+
+  // Returns the row with `id`, or -1 if there is none. Of duplicated ids the
+  // last one added wins.
+  int64_t Find(absl::string_view id) const;
+
+  // Fills in the id, label and payload of `row`, leaving the values alone.
+  void CopyTo(int64_t row, feature_extraction::FeatureRecord* record) const;
+
+  // Bytes of the blocks, the columns and the id lookup.
+  size_t GetMemoryUsage() const;
+
+ private:
+  absl::string_view Store(absl::string_view bytes);
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  size_t block_bytes_;
+  char* block_;
+  size_t block_remaining_;
+
+  std::vector<absl::string_view> ids_;
+  std::vector<absl::string_view> payloads_;
+  std::vector<int32_t> labels_;
+  absl::flat_hash_map<absl::string_view, int64_t> rows_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_METADATA_STORE_H_
@@ -0,0 +1,219 @@
+#include "image_retrieval/ann/planned_index.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_format.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+class PlannedIndex : public IndexInterface {
+ public:
+  PlannedIndex(std::vector<PhysicalIndex> indexes,
+               const PlannerOptions& options,
+               std::shared_ptr<SharedMetadata> metadata)
+      : indexes_(std::move(indexes)),
+        options_(options),
+        metadata_(std::move(metadata)),
+        total_count_(0) {
+    if (indexes_.empty()) {
+      throw std::invalid_argument("A planned index needs at least one index");
+    }
+    for (const auto& physical : indexes_) {
+      if (physical.index->GetDimSize() != GetDimSize()) {
+        throw std::invalid_argument(absl::StrFormat(
+            "Index %s of dim size %d, while %s has %d", physical.name,
+            physical.index->GetDimSize(), indexes_[0].name, GetDimSize()));
+      }
+    }
+  }
+
+  bool Add(const FeatureRecord& record) override {
+    bool added = true;
+    for (auto& physical : indexes_) {
+      added &= physical.index->Add(record);
+    }
+    ++label_counts_[record.label()];
+    ++total_count_;
+    return added;
+  }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    const double candidates = CountCandidates(request);
+    const PhysicalIndex* best = nullptr;
+    const PhysicalIndex* scan = nullptr;
+    double best_cost = std::numeric_limits<double>::infinity();
+    double scan_cost = std::numeric_limits<double>::infinity();
+    for (const auto& physical : indexes_) {
+      if (!CanAnswer(physical.kind, request)) {
+        continue;
+      }
+      double cost = EstimateCost(physical.kind, request, candidates);
+      if (cost < best_cost) {
+        best = &physical;
+        best_cost = cost;
+      }
+      if (physical.kind == PlanKind::kScan && cost < scan_cost) {
+        scan = &physical;
+        scan_cost = cost;
+      }
+    }
+    if (!best) {
+      throw std::invalid_argument(
+          "Label and range searches need an index that scans");
+    }
+
+    // A graph search cannot be cut short, while a scan stops at the deadline
+    // with the neighbors found in the labels nearest to the query
+    if (scan && request.deadline != absl::InfiniteFuture() &&
+        best_cost > absl::ToDoubleNanoseconds(request.deadline - absl::Now())) {
+      best = scan;
+    }
+
+    bool found = best->index->Search(request, response);
+    response.plan = best->name;
+    return found;
+  }
+
+  // The vector of a scan is the one added, that of a graph may be quantized.
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    for (const auto& physical : indexes_) {
+      if (physical.kind == PlanKind::kScan) {
+        return physical.index->Get(id, record);
+      }
+    }
+    return indexes_[0].index->Get(id, record);
+  }
+
+  int GetDimSize() const override { return indexes_[0].index->GetDimSize(); }
+
+  void SetAttributeFields(const std::vector<std::string>& fields) override {
+    for (auto& physical : indexes_) {
+      physical.index->SetAttributeFields(fields);
+    }
+  }
+
+  // Every index holds the same attributes.
+  double EstimateSelectivity(const Filter& filter) const override {
+    return indexes_[0].index->EstimateSelectivity(filter);
+  }
+
+  // Of every physical index, and of the metadata they share.
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage;
+    for (const auto& physical : indexes_) {
+      usage += physical.index->GetMemoryUsage();
+    }
+    if (metadata_) {
+      usage.metadata += metadata_->store.GetMemoryUsage() +
+                        metadata_->attributes.GetMemoryUsage();
+    }
+    // Slots of the hash map come with a control byte each
+    usage.metadata +=
+        label_counts_.capacity() *
+        (sizeof(decltype(label_counts_)::value_type) + 1);
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.type = "planned";
+    stats.dim_size = GetDimSize();
+    stats.record_count = total_count_;
+    stats.label_counts.insert(label_counts_.begin(), label_counts_.end());
+    stats.params = {
+        {"indexes", nlohmann::json::array()},
+        {"scan_ns_per_value", options_.scan_ns_per_value},
+        {"scan_fixed_ns", options_.scan_fixed_ns},
+        {"graph_ns_per_value", options_.graph_ns_per_value},
+        {"graph_distances_per_candidate",
+         options_.graph_distances_per_candidate},
+        {"graph_ef", options_.graph_ef}};
+    for (const auto& physical : indexes_) {
+      stats.params["indexes"].push_back(physical.name);
+      stats.indexes.push_back(physical.index->GetStats());
+    }
+    stats.memory = GetMemoryUsage();
+    return stats;
+  }
+
+ private:
+  static bool CanAnswer(PlanKind kind, const SearchRequest& request) {
+    if (kind == PlanKind::kScan) {
+      return true;
+    }
+    return request.labels.empty() &&
+           (!request.IsRangeSearch() || request.max_results > 0);
+  }
+
+  // Rows of the labels the filter selects, as if both were independent.
+  double CountCandidates(const SearchRequest& request) const {
+    if (total_count_ == 0) {
+      return 0.;
+    }
+    double candidates = total_count_;
+    if (!request.labels.empty()) {
+      candidates = 0.;
+      for (int label : request.labels) {
+        auto it = label_counts_.find(label);
+        if (it != label_counts_.end()) {
+          candidates += it->second;
+        }
+      }
+    }
+    if (request.filter.op != Filter::Op::kNone) {
+      // Left to the index searching to evaluate
+      candidates *= EstimateSelectivity(request.filter);
+    }
+    return candidates;
+  }
+
+  double EstimateCost(PlanKind kind, const SearchRequest& request,
+                      double candidates) const {
+    const double dim_size = GetDimSize();
+    if (kind == PlanKind::kScan) {
+      return options_.scan_fixed_ns +
+             candidates * dim_size * options_.scan_ns_per_value;
+    }
+
+    // The search expands about `ef` selected rows, and walks past the
+    // unselected ones on its way, but never computes the distance to a row
+    // twice
+    const double ef = std::max<double>(
+        request.params.ef > 0 ? request.params.ef : options_.graph_ef,
+        std::min<size_t>(request.GetResultLimit(), total_count_));
+    const double selectivity =
+        total_count_ ? std::max(candidates, 1.) / total_count_ : 1.;
+    const double distances =
+        std::min<double>(ef * options_.graph_distances_per_candidate /
+                             selectivity,
+                         total_count_);
+    return distances * dim_size * options_.graph_ns_per_value;
+  }
+
+  std::vector<PhysicalIndex> indexes_;
+  PlannerOptions options_;
+  // Shared by the indexes, if not null
+  std::shared_ptr<SharedMetadata> metadata_;
+
+  // Statistics of the records, for the estimates
+  int64_t total_count_;
+  absl::flat_hash_map<int, int64_t> label_counts_;
+};
+
+}  // namespace
+
+std::unique_ptr<IndexInterface> NewPlannedIndex(
+    std::vector<PhysicalIndex> indexes, const PlannerOptions& options,
+    std::shared_ptr<SharedMetadata> metadata) {
+  return std::make_unique<PlannedIndex>(std::move(indexes), options,
+                                        std::move(metadata));
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
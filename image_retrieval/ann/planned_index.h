@@ -0,0 +1,60 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_PLANNED_INDEX_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_PLANNED_INDEX_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "image_retrieval/ann/index_interface.h"
+
+namespace image_retrieval {
+namespace ann {
+
+enum class PlanKind {
+  // Compares the query with every candidate: exact, restricted to the labels
+  // and stopped by deadlines, e.g. the flat index
+  kScan,
+  // Walks a graph: approximate, and unaware of labels and deadlines, e.g. the
+  // HNSW index
+  kGraph,
+};
+
+// One of the indexes over the same records a request may be answered by.
+struct PhysicalIndex {
+  std::string name;
+  PlanKind kind;
+  std::unique_ptr<IndexInterface> index;
+};
+
+// The cost model, in estimated nanoseconds. The defaults are those of AVX
+// cosine distances and the 10 threads of the flat index.
+struct PlannerOptions {
+  // Per value of the candidate vectors, spread over the scanning threads
+  double scan_ns_per_value = 0.02;
+  // Of handing a scan over to the threads and merging their results
+  double scan_fixed_ns = 20000;
+  // Per value of the vectors a graph search computes the distance of
+  double graph_ns_per_value = 0.15;
+  // Distances per candidate of the graph search, about the level 0 degree
+  double graph_distances_per_candidate = 32;
+  // Candidate list of a graph search without its own `ef`
+  int graph_ef = 64;
+};
+
+// Adds every record to all of `indexes`, and answers every search with the
+// one estimated to be the cheapest of those able to. Label and range searches
+// without `max_results` only run on scans. The candidates of a request are
+// counted from the labels and the filter, of which a graph search has to walk
+// past the unselected ones. When nothing fits the deadline, a scan runs,
+// which answers with what it found by then rather than running over. The
+// name of the index is reported as the `plan` of the response. Indexes built
+// over `metadata` share it rather than keeping a copy each, and the planned
+// index counts its memory once.
+std::unique_ptr<IndexInterface> NewPlannedIndex(
+    std::vector<PhysicalIndex> indexes,
+    const PlannerOptions& options = PlannerOptions(),
+    std::shared_ptr<SharedMetadata> metadata = nullptr);
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_PLANNED_INDEX_H_
@@ -0,0 +1,212 @@
+#include "image_retrieval/ann/result_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/hash/hash.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+size_t EstimateBytes(const SearchResponse& response) {
+  size_t bytes = sizeof(SearchResponse);
+  for (const auto& neighbor : response.neighbors) {
+    bytes += sizeof(ResponseRecord) - sizeof(FeatureRecord) +
+             neighbor.record.SpaceUsedLong();
+  }
+  for (const auto& shard : response.failed_shards) {
+    bytes += sizeof(std::string) + shard.capacity();
+  }
+  return bytes;
+}
+
+class CachedIndex : public IndexInterface {
+ public:
+  CachedIndex(std::unique_ptr<IndexInterface> index,
+              std::shared_ptr<ResultCache> cache)
+      : index_(std::move(index)),
+        cache_(std::move(cache)),
+        epoch_(cache_->NewEpoch()) {}
+
+  bool Add(const FeatureRecord& record) override {
+    bool ok = index_->Add(record);
+    epoch_ = cache_->NewEpoch();
+    return ok;
+  }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    uint64_t epoch = epoch_;
+    if (cache_->Lookup(request, epoch, response)) {
+      return true;
+    }
+
+    if (!index_->Search(request, response)) {
+      return false;
+    }
+    // A search cut short by its deadline is not worth repeating
+    if (response.complete) {
+      cache_->Insert(request, epoch, response);
+    }
+    return true;
+  }
+
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    return index_->Get(id, record);
+  }
+
+  int GetDimSize() const override { return index_->GetDimSize(); }
+
+  void SetAttributeFields(const std::vector<std::string>& fields) override {
+    index_->SetAttributeFields(fields);
+  }
+
+  double EstimateSelectivity(const Filter& filter) const override {
+    return index_->EstimateSelectivity(filter);
+  }
+
+  // The responses of the cache, which it may share with the indexes it
+  // cached before, count as protobuf messages.
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage = index_->GetMemoryUsage();
+    usage.protobuf += cache_->GetStats().bytes;
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.type = "cached";
+    stats.dim_size = GetDimSize();
+    stats.indexes.push_back(index_->GetStats());
+    stats.record_count = stats.indexes[0].record_count;
+    stats.params = {{"epoch", epoch_.load()}};
+    stats.memory = GetMemoryUsage();
+    return stats;
+  }
+
+ private:
+  std::unique_ptr<IndexInterface> index_;
+  std::shared_ptr<ResultCache> cache_;
+  std::atomic<uint64_t> epoch_;
+};
+
+}  // namespace
+
+ResultCache::ResultCache(const Options& options)
+    : options_(options),
+      hits_(0),
+      misses_(0),
+      evictions_(0),
+      last_epoch_(0) {
+  int num_shards = std::max(1, options_.num_shards);
+  shard_capacity_ = options_.capacity_bytes / num_shards;
+  for (int i = 0; i < num_shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+ResultCache::Key ResultCache::MakeKey(const SearchRequest& request) const {
+  Key key;
+  key.query.reserve(request.query.size());
+  const float scale = 1.f / options_.quantization_step;
+  for (float value : request.query) {
+    float quantized = std::round(value * scale);
+    quantized = std::min<float>(quantized, std::numeric_limits<int32_t>::max());
+    quantized = std::max<float>(quantized, std::numeric_limits<int32_t>::min());
+    key.query.push_back(static_cast<int32_t>(quantized));
+  }
+  key.top_k = request.top_k;
+  key.labels.assign(request.labels.begin(), request.labels.end());
+  std::sort(key.labels.begin(), key.labels.end());
+  key.max_distance = request.max_distance;
+  key.max_results = request.max_results;
+  if (request.filter.op != Filter::Op::kNone) {
+    key.filter = nlohmann::json(request.filter).dump();
+  }
+  key.params = request.params;
+  key.hash = absl::HashOf(key.query, key.top_k, key.labels, key.max_distance,
+                          key.max_results, key.filter, key.params.ef,
+                          key.params.search_list, key.params.beam_width);
+  return key;
+}
+
+void ResultCache::Erase(Shard& shard, std::list<Entry>::iterator it) {
+  shard.bytes -= it->bytes;
+  shard.map.erase(&it->key);
+  shard.entries.erase(it);
+}
+
+bool ResultCache::Lookup(const SearchRequest& request, uint64_t epoch,
+                         SearchResponse& response) {
+  Key key = MakeKey(request);
+  Shard& shard = GetShard(key);
+  {
+    absl::MutexLock l(&shard.mu);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) {
+      if (it->second->epoch == epoch) {
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        response = it->second->response;
+        ++hits_;
+        return true;
+      }
+      // Computed against an older index
+      Erase(shard, it->second);
+    }
+  }
+
+  ++misses_;
+  return false;
+}
+
+void ResultCache::Insert(const SearchRequest& request, uint64_t epoch,
+                         const SearchResponse& response) {
+  Key key = MakeKey(request);
+  // With the map slot and its control byte, the key is held by the entry only
+  size_t bytes = sizeof(Entry) + sizeof(int32_t) * key.query.size() +
+                 sizeof(int) * key.labels.size() + key.filter.capacity() +
+                 sizeof(decltype(Shard::map)::value_type) + 1 +
+                 EstimateBytes(response);
+  if (bytes > shard_capacity_) {
+    return;
+  }
+
+  Shard& shard = GetShard(key);
+  absl::MutexLock l(&shard.mu);
+  auto it = shard.map.find(key);
+  if (it != shard.map.end()) {
+    Erase(shard, it->second);
+  }
+  while (!shard.entries.empty() && shard.bytes + bytes > shard_capacity_) {
+    Erase(shard, std::prev(shard.entries.end()));
+    ++evictions_;
+  }
+
+  shard.entries.push_front({std::move(key), epoch, bytes, response});
+  shard.map.emplace(&shard.entries.front().key, shard.entries.begin());
+  shard.bytes += bytes;
+}
+
+ResultCache::Stats ResultCache::GetStats() const {
+  Stats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  for (const auto& shard : shards_) {
+    absl::MutexLock l(&shard->mu);
+    stats.entries += shard->entries.size();
+    stats.bytes += shard->bytes;
+  }
+  return stats;
+}
+
+std::unique_ptr<IndexInterface> NewCachedIndex(
+    std::unique_ptr<IndexInterface> index, std::shared_ptr<ResultCache> cache) {
+  return std::make_unique<CachedIndex>(std::move(index), std::move(cache));
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
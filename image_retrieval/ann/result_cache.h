@@ -0,0 +1,149 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_RESULT_CACHE_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_RESULT_CACHE_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "image_retrieval/ann/index_interface.h"
+
+namespace image_retrieval {
+namespace ann {
+
+/**
+ * An LRU cache of search responses, split into independently locked shards.
+ *
+ * Queries are quantized before being hashed, so repeating a query whose floats
+ * went through a JSON round trip still hits. Every entry remembers the epoch
+ * of the index it was computed against, and is dropped on lookup once the
+ * epoch has moved on.
+ */
+class ResultCache {
+ public:
+  struct Options {
+    // Upper bound of the estimated memory held by the entries.
+    size_t capacity_bytes = 256 << 20;
+    int num_shards = 16;
+    // Query values closer than this may share an entry.
+    float quantization_step = 1e-4f;
+  };
+
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+    int64_t entries = 0;
+    int64_t bytes = 0;
+
+    friend void to_json(nlohmann::json& j, const Stats& stats) {
+      j = nlohmann::json{{"hits", stats.hits},
+                         {"misses", stats.misses},
+                         {"evictions", stats.evictions},
+                         {"entries", stats.entries},
+                         {"bytes", stats.bytes}};
+    }
+  };
+
+  explicit ResultCache(const Options& options);
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Returns an epoch never handed out before, so that indexes sharing the
+  // cache, e.g. one swapped in by a reload, never see each other's entries.
+  uint64_t NewEpoch() { return ++last_epoch_; }
+
+  // Returns true and fills `response` if an entry of `epoch` matches.
+  bool Lookup(const SearchRequest& request, uint64_t epoch,
+              SearchResponse& response);
+
+  void Insert(const SearchRequest& request, uint64_t epoch,
+              const SearchResponse& response);
+
+  Stats GetStats() const;
+
+ private:
+  struct Key {
+    std::vector<int32_t> query;
+    int top_k;
+    std::vector<int> labels;
+    float max_distance;
+    int max_results;
+    // Serialized, empty without a filter
+    std::string filter;
+    SearchParams params;
+    size_t hash;
+
+    bool operator==(const Key& other) const {
+      return hash == other.hash && top_k == other.top_k &&
+             max_distance == other.max_distance &&
+             max_results == other.max_results && query == other.query &&
+             labels == other.labels && filter == other.filter &&
+             params == other.params;
+    }
+  };
+
+  // The map points at the keys of the entries, and is looked up by keys.
+  struct KeyHash {
+    using is_transparent = void;
+    size_t operator()(const Key& key) const { return key.hash; }
+    size_t operator()(const Key* key) const { return key->hash; }
+  };
+
+  struct KeyEq {
+    using is_transparent = void;
+    static const Key& Deref(const Key& key) { return key; }
+    static const Key& Deref(const Key* key) { return *key; }
+    template <class X, class Y>
+    bool operator()(const X& x, const Y& y) const {
+      return Deref(x) == Deref(y);
+    }
+  };
+
+  struct Entry {
+    Key key;
+    uint64_t epoch;
+    size_t bytes;
+    SearchResponse response;
+  };
+
+  struct Shard {
+    mutable absl::Mutex mu;
+    // Most recently used first
+    std::list<Entry> entries ABSL_GUARDED_BY(mu);
+    // Of the keys held by the entries, which list nodes keep in place
+    absl::flat_hash_map<const Key*, std::list<Entry>::iterator, KeyHash, KeyEq>
+        map ABSL_GUARDED_BY(mu);
+    size_t bytes ABSL_GUARDED_BY(mu) = 0;
+  };
+
+  Key MakeKey(const SearchRequest& request) const;
+
+  Shard& GetShard(const Key& key) {
+    return *shards_[key.hash % shards_.size()];
+  }
+
+  // Unlinks `it` from `shard`, the caller holds the lock of `shard`.
+  static void Erase(Shard& shard, std::list<Entry>::iterator it);
+
+  Options options_;
+  size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  std::atomic<int64_t> hits_;
+  std::atomic<int64_t> misses_;
+  std::atomic<int64_t> evictions_;
+  std::atomic<uint64_t> last_epoch_;
+};
+
+// Serves repeated searches of `index` from `cache`. Adding a record moves the
+// epoch forward, which invalidates every cached response of `index`.
+std::unique_ptr<IndexInterface> NewCachedIndex(
+    std::unique_ptr<IndexInterface> index, std::shared_ptr<ResultCache> cache);
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_RESULT_CACHE_H_
@@ -0,0 +1,150 @@
+#include "image_retrieval/ann/result_cache.h"
+
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+// Answers every search with one neighbor per added record, and counts them.
+class CountingIndex : public IndexInterface {
+ public:
+  explicit CountingIndex(int* searches) : searches_(searches) {}
+
+  bool Add(const FeatureRecord& record) override {
+    records_.push_back(record);
+    return true;
+  }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    ++*searches_;
+    for (const auto& record : records_) {
+      response.neighbors.push_back({record, 0.f});
+    }
+    response.total_count = records_.size();
+    return true;
+  }
+
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    return false;
+  }
+
+  int GetDimSize() const override { return 2; }
+
+  void SetAttributeFields(const std::vector<std::string>& fields) override {}
+
+  double EstimateSelectivity(const Filter& filter) const override {
+    return 1.;
+  }
+
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage;
+    for (const auto& record : records_) {
+      usage.protobuf += record.SpaceUsedLong();
+    }
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.type = "counting";
+    stats.record_count = records_.size();
+    stats.memory = GetMemoryUsage();
+    return stats;
+  }
+
+ private:
+  int* searches_;
+  std::vector<FeatureRecord> records_;
+};
+
+SearchRequest MakeRequest(float x, float y) {
+  SearchRequest request;
+  request.query = {x, y};
+  return request;
+}
+
+TEST(ResultCache, HitsAndMisses) {
+  int searches = 0;
+  auto cache = std::make_shared<ResultCache>(ResultCache::Options());
+  auto index =
+      NewCachedIndex(std::make_unique<CountingIndex>(&searches), cache);
+  FeatureRecord record;
+  record.set_id("a");
+  index->Add(record);
+
+  SearchResponse response;
+  index->Search(MakeRequest(0.1f, 0.2f), response);
+  // Within the quantization step
+  response = SearchResponse();
+  index->Search(MakeRequest(0.10001f, 0.2f), response);
+  EXPECT_EQ(searches, 1);
+  ASSERT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(response.neighbors[0].record.id(), "a");
+
+  SearchRequest request = MakeRequest(0.1f, 0.2f);
+  request.top_k = 5;
+  index->Search(request, response);
+  request.labels = {3, 1};
+  index->Search(request, response);
+  request.labels = {1, 3};
+  index->Search(request, response);
+  // Another operating point of the same query
+  request.params.ef = 100;
+  index->Search(request, response);
+  index->Search(MakeRequest(0.2f, 0.2f), response);
+  EXPECT_EQ(searches, 5);
+
+  ResultCache::Stats stats = cache->GetStats();
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.misses, 5);
+  EXPECT_EQ(stats.entries, 5);
+  EXPECT_GT(stats.bytes, 0);
+  // The cached responses are counted along with the records of the index
+  EXPECT_EQ(index->GetMemoryUsage().protobuf,
+            record.SpaceUsedLong() + stats.bytes);
+}
+
+TEST(ResultCache, InvalidatedByAdd) {
+  int searches = 0;
+  auto cache = std::make_shared<ResultCache>(ResultCache::Options());
+  auto index =
+      NewCachedIndex(std::make_unique<CountingIndex>(&searches), cache);
+
+  SearchResponse response;
+  index->Search(MakeRequest(1.f, 1.f), response);
+  index->Add(FeatureRecord());
+  response = SearchResponse();
+  index->Search(MakeRequest(1.f, 1.f), response);
+  EXPECT_EQ(searches, 2);
+  EXPECT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(cache->GetStats().entries, 1);
+}
+
+TEST(ResultCache, MemoryCap) {
+  ResultCache::Options options;
+  options.num_shards = 1;
+  options.capacity_bytes = 4096;
+  ResultCache cache(options);
+
+  SearchResponse response;
+  response.neighbors.resize(2);
+  for (int i = 0; i < 100; ++i) {
+    cache.Insert(MakeRequest(i, 0.f), 0, response);
+  }
+  ResultCache::Stats stats = cache.GetStats();
+  EXPECT_LE(stats.bytes, options.capacity_bytes);
+  EXPECT_GT(stats.evictions, 0);
+  EXPECT_EQ(stats.entries + stats.evictions, 100);
+
+  // The most recent entry survives, the oldest does not
+  EXPECT_TRUE(cache.Lookup(MakeRequest(99, 0.f), 0, response));
+  EXPECT_FALSE(cache.Lookup(MakeRequest(0, 0.f), 0, response));
+  EXPECT_FALSE(cache.Lookup(MakeRequest(99, 0.f), 1, response));
+}
+
+}  // namespace
+}  // namespace ann
+}  // namespace image_retrieval
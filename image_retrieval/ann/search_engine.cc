@@ -1,46 +1,99 @@
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <regex>
 
+#include "absl/random/random.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
 #include "absl/time/clock.h"
 #include "cmdline/cmdline.h"
+// Ahead of httplib, as the _res macro of <resolv.h> breaks Eigen
+#include "eigen3/Eigen/Dense"
 #include "cpp-httplib/httplib.h"
 #include "nlohmann/json.hpp"
 
 #include "image_retrieval/ann/binary_index.h"
+#include "image_retrieval/ann/disk_index.h"
 #include "image_retrieval/ann/flat_index.h"
 #include "image_retrieval/ann/hnsw_index.h"
-#include "image_retrieval/feature_extraction/feature_decoder_utils.h"
+#include "image_retrieval/ann/index_holder.h"
+#include "image_retrieval/ann/planned_index.h"
+#include "image_retrieval/ann/result_cache.h"
+#include "image_retrieval/ann/shard_coordinator.h"
+#include "image_retrieval/ann/transformed_index.h"
+#include "image_retrieval/clustering/feature_batch_reader.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+#include "image_retrieval/feature_extraction/feature_file.h"
+#include "image_retrieval/memory/arena.h"
+#include "image_retrieval/profiling/perf_counters.h"
+#include "image_retrieval/server/event_server.h"
 
+using ::image_retrieval::ann::BelongsToShard;
+using ::image_retrieval::ann::DiskIndexOptions;
+using ::image_retrieval::ann::IsDiskIndexFile;
+using ::image_retrieval::ann::IndexHolder;
 using ::image_retrieval::ann::IndexInterface;
-using ::image_retrieval::ann::NewBinaryIndex2048;
+using ::image_retrieval::ann::NewBinaryIndex;
 using ::image_retrieval::ann::NewFlatIndex;
+using ::image_retrieval::ann::NewCachedIndex;
+using ::image_retrieval::ann::NewDiskIndex;
 using ::image_retrieval::ann::NewHNSWIndex;
+using ::image_retrieval::ann::NewPlannedIndex;
+using ::image_retrieval::ann::NewTransformedIndex;
+using ::image_retrieval::ann::OpenDiskIndex;
+using ::image_retrieval::ann::PartitionScheme;
+using ::image_retrieval::ann::PhysicalIndex;
+using ::image_retrieval::ann::PlanKind;
+using ::image_retrieval::ann::PlannerOptions;
+using ::image_retrieval::ann::RecordToJson;
+using ::image_retrieval::ann::ResultCache;
 using ::image_retrieval::ann::SearchRequest;
 using ::image_retrieval::ann::SearchResponse;
+using ::image_retrieval::ann::SharedMetadata;
+using ::image_retrieval::ann::ShardCoordinator;
+using ::image_retrieval::ann::ShardSpec;
+using ::image_retrieval::clustering::FeatureBatchReader;
+using ::image_retrieval::clustering::LinearTransform;
+using ::image_retrieval::clustering::ReadLinearTransform;
+using ::image_retrieval::clustering::WriteLinearTransform;
 using ::image_retrieval::feature_extraction::FeatureRecord;
-using ::image_retrieval::feature_extraction::ReadRecord;
+using ::image_retrieval::feature_extraction::SequentialRecordReader;
+using ::image_retrieval::memory::Arena;
+using ::image_retrieval::profiling::PerfCounters;
+using ::image_retrieval::profiling::PerfTotals;
+using ::image_retrieval::server::EventServer;
+using ::image_retrieval::server::HttpRequest;
+using ::image_retrieval::server::HttpResponse;
 
-// 4 M
-size_t BUFFER_SIZE{4 * 1024 * 1024};
+// Records kept aside to warm a freshly built index up with.
+constexpr int kWarmupQueries = 16;
 
-bool BuildIndex(const std::string& filepath, IndexInterface* index) {
-  std::ifstream file(filepath);
-  if (!file.good()) {
-    throw std::runtime_error(absl::StrFormat(
-        "%s does not exist, please investigate and retry!", filepath));
+// Adds the records of `filepath` belonging to the shard to `index`, and keeps
+// the vectors of up to kWarmupQueries of them, sampled uniformly, in
+// `samples`.
+bool BuildIndex(const std::string& filepath, IndexInterface* index,
+                const ShardSpec& shard_spec,
+                std::vector<std::vector<float>>* samples) {
+  // Either a length-prefixed stream or a block-compressed feature file
+  SequentialRecordReader reader(filepath);
+
+  int64_t file_count = 0;
+  if (shard_spec.num_shards > 1 &&
+      shard_spec.scheme == PartitionScheme::kRange) {
+    file_count = reader.CountRecords();
   }
 
   int dim_size = index->GetDimSize();
+  int64_t ordinal = -1;
   int64_t total_count = 0;
   int64_t start = absl::ToUnixMicros(absl::Now());
-  std::vector<char> buffer(BUFFER_SIZE);
-  while (true) {
-    if (!ReadRecord(file, buffer)) {
-      break;
+  absl::BitGen gen;
+  FeatureRecord record;
+  while (reader.Next(&record)) {
+    if (!BelongsToShard(shard_spec, record, ++ordinal, file_count)) {
+      continue;
     }
-
-    FeatureRecord record;
-    record.ParseFromArray(buffer.data(), buffer.size());
     if (dim_size != record.value_size()) {
       throw std::runtime_error(absl::StrFormat(
           "Feature dim size should be equal, while got %d vs %ld", dim_size,
@@ -48,6 +101,15 @@ bool BuildIndex(const std::string& filepath, IndexInterface* index) {
     }
 
     index->Add(record);
+    // Reservoir sampling
+    if (total_count < kWarmupQueries) {
+      samples->emplace_back(record.value().begin(), record.value().end());
+    } else {
+      int64_t slot = absl::Uniform<int64_t>(gen, 0, total_count + 1);
+      if (slot < kWarmupQueries) {
+        (*samples)[slot].assign(record.value().begin(), record.value().end());
+      }
+    }
     if (++total_count % 1000 == 0) {
       std::cout << absl::StrFormat(
                        "Read %d records, elapsed %.3f(s)", total_count,
@@ -64,16 +126,171 @@ bool BuildIndex(const std::string& filepath, IndexInterface* index) {
   return true;
 }
 
+// Reads the transform at `path`, or trains it on the first `sample` records
+// of `input` and writes it there if there is none.
+std::shared_ptr<const LinearTransform> LoadTransform(
+    const std::string& path, const std::string& input, size_t sample,
+    const LinearTransform::Options& options) {
+  if (std::ifstream(path).good()) {
+    return std::make_shared<LinearTransform>(ReadLinearTransform(path));
+  }
+  if (options.output_dim <= 0) {
+    throw std::invalid_argument(absl::StrFormat(
+        "--transform_dim is required to train the transform %s", path));
+  }
+
+  FeatureBatchReader reader(input, sample);
+  Eigen::MatrixXf data;
+  reader.Next(sample, &data);
+  auto transform =
+      std::make_shared<LinearTransform>(LinearTransform::Train(data, options));
+  WriteLinearTransform(path, *transform);
+  return transform;
+}
+
+// When the connection being served was queued for a worker thread, so that a
+// request's deadline also covers its wait in the queue. Reset once taken, the
+// later requests of a keep-alive connection count from when they are read.
+thread_local absl::Time connection_queued_at = absl::InfiniteFuture();
+
+absl::Time TakeReceivedTime() {
+  absl::Time received = std::min(absl::Now(), connection_queued_at);
+  connection_queued_at = absl::InfiniteFuture();
+  return received;
+}
+
+class TimedTaskQueue : public httplib::TaskQueue {
+ public:
+  explicit TimedTaskQueue(size_t num_threads) : thread_pool_(num_threads) {}
+
+  void enqueue(std::function<void()> fn) override {
+    thread_pool_.enqueue([fn = std::move(fn), queued_at = absl::Now()]() {
+      connection_queued_at = queued_at;
+      fn();
+    });
+  }
+
+  void shutdown() override { thread_pool_.shutdown(); }
+
+ private:
+  httplib::ThreadPool thread_pool_;
+};
+
+using Route = std::function<void(const httplib::Request&, httplib::Response&)>;
+
+// A route of the API, served by either front end.
+struct Endpoint {
+  std::string method;
+  std::string pattern;
+  Route route;
+};
+
+// Serves `route` on the epoll front end. The deadline of a request counts
+// from when it had been read, its wait for a handler thread included.
+EventServer::Handler FromHttplib(const std::string& pattern, Route route) {
+  return [pattern = std::regex(pattern), route = std::move(route)](
+             const HttpRequest& request, HttpResponse& response) {
+    httplib::Request http_request;
+    http_request.method = request.method;
+    http_request.path = request.path;
+    http_request.body = request.body;
+    std::regex_match(http_request.path, http_request.matches, pattern);
+    connection_queued_at = request.received;
+
+    httplib::Response http_response;
+    route(http_request, http_response);
+    response.status = http_response.status == -1 ? 200 : http_response.status;
+    if (http_response.has_header("Content-Type")) {
+      response.content_type = http_response.get_header_value("Content-Type");
+    }
+    response.body = std::move(http_response.body);
+  };
+}
+
 int main(int argc, char* argv[]) {
   std::ios::sync_with_stdio(false);
   cmdline::parser parser;
-  parser.add<std::string>("input", 'i', "Input filename", true, "");
+  parser.add<std::string>("input", 'i', "Input filename", false, "");
   parser.add<std::string>(
-      "index_type", 't', "Index type, 'flat' or 'binary' or 'hnsw'", false,
-      "flat", cmdline::oneof<std::string>("flat", "binary", "hnsw"));
+      "index_type", 't',
+      "Index type, 'flat' or 'binary' or 'hnsw' or 'disk', or 'planned' for "
+      "both a flat and a hnsw index picked per search",
+      false, "flat",
+      cmdline::oneof<std::string>("flat", "binary", "hnsw", "disk",
+                                  "planned"));
   parser.add<int>("dim", 'd', "Dimension size of feature", false, 2048);
   parser.add<int>("port", 'p', "port number", false, 8080,
                   cmdline::range(1, 65535));
+  parser.add("numa", 0,
+             "Partition the flat index per NUMA node and pin its workers");
+  parser.add("mih", 0,
+             "Search the binary index by multi-index hashing instead of "
+             "scanning it");
+  parser.add<std::string>(
+      "shards", 's',
+      "Comma separated shard servers(host:port), run as a coordinator if set",
+      false, "");
+  parser.add<int>("shard_timeout_ms", 0, "Timeout of a single shard search",
+                  false, 200, cmdline::range(1, 60000));
+  parser.add<int>("num_shards", 0, "Number of shards the input is split into",
+                  false, 1, cmdline::range(1, 65536));
+  parser.add<int>("shard_index", 0, "Index of the shard held by this server",
+                  false, 0);
+  parser.add<std::string>("partition", 0,
+                          "Partition scheme of shards, 'hash' or 'range'",
+                          false, "hash",
+                          cmdline::oneof<std::string>("hash", "range"));
+  parser.add<int>("cache_mb", 0, "Memory of the result cache, 0 to disable",
+                  false, 256, cmdline::range(0, 1 << 20));
+  parser.add<std::string>(
+      "attributes", 'a',
+      "Comma separated payload fields that search requests may filter on",
+      false, "");
+  parser.add<int>("watch_interval", 0,
+                  "Seconds between checks of --input for changes to reload, "
+                  "0 to disable",
+                  false, 0, cmdline::range(0, 86400));
+  parser.add<std::string>(
+      "disk_path", 0,
+      "File the disk index built out of --input is written to, unless "
+      "--input is a disk index file already",
+      false, "");
+  parser.add<std::string>(
+      "transform", 0,
+      "Linear transform reducing the vectors before indexing, trained out of "
+      "--input and written there if the file does not exist",
+      false, "");
+  parser.add<int>("transform_dim", 0, "Output dim size of a trained transform",
+                  false, 0, cmdline::range(0, 65536));
+  parser.add("whiten", 0, "Whiten the components of a trained transform");
+  parser.add("itq", 0,
+             "Rotate the components of a trained transform for binary codes");
+  parser.add<size_t>("transform_sample", 0,
+                     "Records of --input a transform is trained on", false,
+                     100000);
+  parser.add<std::string>("huge_pages", 0,
+                          "Pages of the index storage, '2m', '1g' or 'none'",
+                          false, "2m",
+                          cmdline::oneof<std::string>("2m", "1g", "none"));
+  parser.add("mlock", 0, "Lock the index storage in memory");
+  parser.add("prefault", 0,
+             "Fault the index storage in while loading rather than while "
+             "searching");
+  parser.add<int>("perf_sample_interval", 0,
+                  "Count the hardware events of every Nth search, 0 to "
+                  "disable",
+                  false, 0, cmdline::range(0, 1 << 30));
+  parser.add<std::string>(
+      "frontend", 0,
+      "HTTP front end, a thread per connection or epoll I/O threads handing "
+      "requests to --handler_threads",
+      false, "threads", cmdline::oneof<std::string>("threads", "epoll"));
+  parser.add<int>("io_threads", 0, "I/O threads of the epoll front end", false,
+                  2, cmdline::range(1, 256));
+  parser.add<int>("handler_threads", 0,
+                  "Threads handling the requests of the epoll front end",
+                  false, CPPHTTPLIB_THREAD_POOL_COUNT,
+                  cmdline::range(1, 4096));
   parser.add("help", 0, "print this message");
   bool ok = parser.parse(argc, argv);
   if (not ok) {
@@ -85,49 +302,331 @@ int main(int argc, char* argv[]) {
   const auto& index_type = parser.get<std::string>("index_type");
   int port = parser.get<int>("port");
   int dim_size = parser.get<int>("dim");
+  const auto& shards = parser.get<std::string>("shards");
+
+  // Of every index built from now on, reloaded ones included
+  Arena::Options arena_options;
+  const auto& huge_pages = parser.get<std::string>("huge_pages");
+  arena_options.huge_page_size =
+      huge_pages == "2m"   ? ::image_retrieval::memory::kHugePageSize2M
+      : huge_pages == "1g" ? ::image_retrieval::memory::kHugePageSize1G
+                           : 0;
+  arena_options.lock = parser.exist("mlock");
+  arena_options.prefault = parser.exist("prefault");
+  Arena::SetDefaultOptions(arena_options);
 
-  std::unique_ptr<IndexInterface> index;
-  if (index_type == "flat") {
-    index = NewFlatIndex(dim_size);
-  } else if (index_type == "binary") {
-    if (dim_size != 2048) {
+  std::unique_ptr<ShardCoordinator> coordinator;
+  std::shared_ptr<ResultCache> cache;
+  std::unique_ptr<IndexHolder> holder;
+  if (!shards.empty()) {
+    ShardCoordinator::Options options;
+    options.timeout_ms = parser.get<int>("shard_timeout_ms");
+    coordinator = std::make_unique<ShardCoordinator>(
+        absl::StrSplit(shards, ',', absl::SkipEmpty()), options);
+    std::cout << absl::StrFormat("Coordinating %d shards",
+                                 coordinator->GetShardSize())
+              << std::endl;
+  } else if (filename.empty()) {
+    std::cerr << "Either --input or --shards is required.\n"
+              << parser.usage();
+    return 1;
+  } else {
+    std::shared_ptr<const LinearTransform> transform;
+    if (!parser.get<std::string>("transform").empty()) {
+      LinearTransform::Options options;
+      options.output_dim = parser.get<int>("transform_dim");
+      options.whiten = parser.exist("whiten");
+      options.rotate = parser.exist("itq");
+      transform = LoadTransform(parser.get<std::string>("transform"), filename,
+                                parser.get<size_t>("transform_sample"),
+                                options);
+      if (transform->GetInputDim() != dim_size) {
+        throw std::invalid_argument(absl::StrFormat(
+            "Transform of %d dims for features of %d",
+            transform->GetInputDim(), dim_size));
+      }
+    }
+    // Of the vectors in the index
+    const int index_dim_size =
+        transform ? transform->GetOutputDim() : dim_size;
+    if (index_type == "binary" && index_dim_size > 2048) {
       throw std::invalid_argument(
-          "Binary index only supports dim_size=2048 yet.");
+          "Binary index only supports dim_size<=2048 yet.");
+    }
+
+    ShardSpec shard_spec;
+    shard_spec.num_shards = parser.get<int>("num_shards");
+    shard_spec.shard_index = parser.get<int>("shard_index");
+    shard_spec.scheme = parser.get<std::string>("partition") == "range"
+                            ? PartitionScheme::kRange
+                            : PartitionScheme::kHash;
+    if (shard_spec.shard_index < 0 ||
+        shard_spec.shard_index >= shard_spec.num_shards) {
+      std::cerr << "--shard_index should be in [0, num_shards).\n";
+      return 1;
+    }
+
+    if (parser.get<int>("cache_mb") > 0) {
+      ResultCache::Options options;
+      options.capacity_bytes =
+          static_cast<size_t>(parser.get<int>("cache_mb")) << 20;
+      cache = std::make_shared<ResultCache>(options);
+    }
+
+    // Also rebuilds the index on reloads, which start with a fresh epoch of
+    // the same cache
+    bool numa = parser.exist("numa");
+    bool mih = parser.exist("mih");
+    std::string disk_path = parser.get<std::string>("disk_path");
+    std::vector<std::string> attributes = absl::StrSplit(
+        parser.get<std::string>("attributes"), ',', absl::SkipEmpty());
+    auto builder = [=](const std::string& input,
+                       std::vector<std::vector<float>>* samples) {
+      std::unique_ptr<IndexInterface> index;
+      bool built = false;
+      if (index_type == "flat") {
+        index = NewFlatIndex(index_dim_size, numa);
+      } else if (index_type == "binary") {
+        index = NewBinaryIndex(index_dim_size, mih);
+      } else if (index_type == "disk") {
+        DiskIndexOptions options;
+        if (IsDiskIndexFile(input)) {
+          options.path = input;
+          index = OpenDiskIndex(options);
+          built = true;
+        } else if (disk_path.empty()) {
+          throw std::invalid_argument(
+              "--disk_path is required to build a disk index.");
+        } else {
+          options.path = disk_path;
+          index = NewDiskIndex(index_dim_size, options);
+        }
+      } else if (index_type == "planned") {
+        // One copy of the metadata, by row, for both
+        auto metadata = std::make_shared<SharedMetadata>();
+        std::vector<PhysicalIndex> indexes;
+        indexes.push_back({"flat", PlanKind::kScan,
+                           NewFlatIndex(index_dim_size, numa, metadata)});
+        indexes.push_back(
+            {"hnsw", PlanKind::kGraph,
+             NewHNSWIndex(index_dim_size, /*cosine=*/true, metadata)});
+        index = NewPlannedIndex(std::move(indexes), PlannerOptions(),
+                                std::move(metadata));
+      } else {
+        index = NewHNSWIndex(index_dim_size);
+      }
+      if (transform) {
+        index = NewTransformedIndex(std::move(index), transform);
+      }
+      index->SetAttributeFields(attributes);
+      if (!built) {
+        BuildIndex(input, index.get(), shard_spec, samples);
+      }
+      if (cache) {
+        index = NewCachedIndex(std::move(index), cache);
+      }
+      return index;
+    };
+    holder = std::make_unique<IndexHolder>(builder);
+    holder->Load(filename);
+    if (parser.get<int>("watch_interval") > 0) {
+      holder->Watch(absl::Seconds(parser.get<int>("watch_interval")));
     }
-    index = NewBinaryIndex2048(dim_size);
-  } else {
-    index = NewHNSWIndex(dim_size);
   }
-  BuildIndex(filename, index.get());
 
-  httplib::Server server;
-  server.Post(R"(/search)", [&](const httplib::Request& request,
-                                httplib::Response& response) {
+  // Hardware events of the sampled searches, summed
+  const int perf_sample_interval = parser.get<int>("perf_sample_interval");
+  std::atomic<int64_t> search_count{0};
+  std::atomic<int64_t> perf_sampled{0};
+  PerfTotals perf_totals;
+
+  std::unique_ptr<EventServer> event_server;
+  if (parser.get<std::string>("frontend") == "epoll") {
+    EventServer::Options options;
+    options.io_threads = parser.get<int>("io_threads");
+    options.handler_threads = parser.get<int>("handler_threads");
+    event_server = std::make_unique<EventServer>(options);
+  }
+
+  std::vector<Endpoint> endpoints;
+  endpoints.push_back({"POST", R"(/search)",
+                       [&](const httplib::Request& request,
+                           httplib::Response& response) {
     SearchRequest search_request;
+    absl::Time received = TakeReceivedTime();
+    // Kept alive by this search even if a reload swaps it out meanwhile
+    std::shared_ptr<IndexInterface> index = holder ? holder->Get() : nullptr;
     try {
       nlohmann::json json = nlohmann::json::parse(request.body);
       search_request = json.get<SearchRequest>();
+      search_request.StartDeadline(received);
     } catch (const std::exception& e) {
+      // Malformed JSON, or e.g. invalid params
+      response.status = 400;
       response.set_content(absl::StrFormat("Bad request: %s\n", e.what()),
                            "text/plain");
       return;
     }
 
+    PerfTotals perf;
+    if (perf_sample_interval > 0 &&
+        search_count.fetch_add(1) % perf_sample_interval == 0) {
+      search_request.perf = &perf;
+    }
+
     try {
       SearchResponse search_response;
       int64_t start = absl::ToUnixMicros(absl::Now());
-      index->Search(search_request, search_response);
+      if (search_request.query.empty() && !search_request.query_id.empty()) {
+        FeatureRecord record;
+        if (!(coordinator ? coordinator->Get(search_request.query_id, &record)
+                          : index->Get(search_request.query_id, &record))) {
+          response.status = 404;
+          response.set_content(
+              absl::StrFormat("Not found: %s\n", search_request.query_id),
+              "text/plain");
+          return;
+        }
+        search_request.query.assign(record.value().begin(),
+                                    record.value().end());
+      }
+      if (search_request.IsExpired()) {
+        // Dropped without searching, the deadline passed while queued
+        search_response.complete = false;
+        search_response.scanned_fraction = 0.f;
+      } else if (coordinator) {
+        coordinator->Search(search_request, search_response);
+      } else {
+        index->Search(search_request, search_response);
+      }
       int64_t search_cost = absl::ToUnixMicros(absl::Now()) - start;
       search_response.search_cost_ms = search_cost / 1000.f;
 
       nlohmann::json output = search_response;
+      if (search_request.perf) {
+        output["perf"] = perf;
+        perf_totals.Add(perf.Get());
+        perf_totals.AddVectors(perf.GetVectors());
+        ++perf_sampled;
+      }
       response.set_content(output.dump(2), "text/plain");
+    } catch (const std::invalid_argument& e) {
+      // E.g. filtering on a field that is not in --attributes
+      response.status = 400;
+      response.set_content(absl::StrFormat("Bad request: %s\n", e.what()),
+                           "text/plain");
     } catch (const std::exception& e) {
       response.set_content(absl::StrFormat("Internal error: %s\n", e.what()),
                            "text/plain");
     }
-  });
+  }});
+
+  endpoints.push_back({"GET", R"(/record/(.+))",
+                       [&](const httplib::Request& request,
+                           httplib::Response& response) {
+    const std::string id = request.matches[1];
+    std::shared_ptr<IndexInterface> index = holder ? holder->Get() : nullptr;
+    try {
+      FeatureRecord record;
+      if (!(coordinator ? coordinator->Get(id, &record)
+                        : index->Get(id, &record))) {
+        response.status = 404;
+        response.set_content(absl::StrFormat("Not found: %s\n", id),
+                             "text/plain");
+        return;
+      }
+      response.set_content(RecordToJson(record).dump(2), "text/plain");
+    } catch (const std::exception& e) {
+      response.set_content(absl::StrFormat("Internal error: %s\n", e.what()),
+                           "text/plain");
+    }
+  }});
+
+  endpoints.push_back({"GET", R"(/stats)", [&](const httplib::Request& request,
+                                             httplib::Response& response) {
+    nlohmann::json output = nlohmann::json::object();
+    if (cache) {
+      output["cache"] = cache->GetStats();
+    }
+    if (holder) {
+      output["index"] = holder->GetStatus();
+      // Of the index serving now, a reload being built is not counted
+      if (std::shared_ptr<IndexInterface> index = holder->Get()) {
+        output["index"]["stats"] = index->GetStats();
+      }
+      output["memory"] = Arena::GetTotalStats();
+    }
+    if (perf_sample_interval > 0) {
+      output["perf"] = {
+          {"available", PerfCounters::ThisThread().IsAvailable()},
+          {"sampled_searches", perf_sampled.load()},
+          {"counters", perf_totals}};
+    }
+    if (event_server) {
+      output["frontend"] = event_server->GetStats();
+    }
+    response.set_content(output.dump(2), "text/plain");
+  }});
+
+  // Rebuilds the index in the background, out of {"input": path} if given or
+  // else the file it was last loaded from, then swaps it in
+  endpoints.push_back({"POST", R"(/admin/reload)",
+                       [&](const httplib::Request& request,
+                           httplib::Response& response) {
+    if (!holder) {
+      response.status = 400;
+      response.set_content("Bad request: not serving an index\n",
+                           "text/plain");
+      return;
+    }
+
+    std::string input = holder->GetStatus().input;
+    try {
+      if (!request.body.empty()) {
+        nlohmann::json json = nlohmann::json::parse(request.body);
+        if (json.contains("input")) {
+          input = json.at("input").get<std::string>();
+        }
+      }
+    } catch (const std::exception& e) {
+      response.status = 400;
+      response.set_content(absl::StrFormat("Bad request: %s\n", e.what()),
+                           "text/plain");
+      return;
+    }
 
+    if (!holder->Reload(input)) {
+      response.status = 409;
+      response.set_content("A reload is already running\n", "text/plain");
+      return;
+    }
+    response.status = 202;
+    nlohmann::json output = holder->GetStatus();
+    response.set_content(output.dump(2), "text/plain");
+  }});
+
+  if (event_server) {
+    for (const auto& endpoint : endpoints) {
+      event_server->Handle(endpoint.method, endpoint.pattern,
+                           FromHttplib(endpoint.pattern, endpoint.route));
+    }
+    event_server->Listen("0.0.0.0", port);
+    event_server->Start();
+    event_server->Wait();
+    return 0;
+  }
+
+  httplib::Server server;
+  server.new_task_queue = [] {
+    return new TimedTaskQueue(CPPHTTPLIB_THREAD_POOL_COUNT);
+  };
+  for (const auto& endpoint : endpoints) {
+    if (endpoint.method == "POST") {
+      server.Post(endpoint.pattern.c_str(), endpoint.route);
+    } else {
+      server.Get(endpoint.pattern.c_str(), endpoint.route);
+    }
+  }
   server.listen("0.0.0.0", port);
 
   return 0;
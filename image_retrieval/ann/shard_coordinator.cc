@@ -0,0 +1,339 @@
+#include "image_retrieval/ann/shard_coordinator.h"
+
+#include <algorithm>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+struct GatherState {
+  explicit GatherState(size_t size)
+      : pending(size), done(size, false), responses(size), errors(size) {}
+
+  bool AllDone() const { return pending == 0; }
+
+  absl::Mutex mu;
+  int pending ABSL_GUARDED_BY(mu);
+  std::vector<bool> done ABSL_GUARDED_BY(mu);
+  std::vector<SearchResponse> responses ABSL_GUARDED_BY(mu);
+  std::vector<std::string> errors ABSL_GUARDED_BY(mu);
+};
+
+struct LookupState {
+  explicit LookupState(size_t size) : pending(size), found(false) {}
+
+  bool Done() const { return found || pending == 0; }
+
+  absl::Mutex mu;
+  int pending ABSL_GUARDED_BY(mu);
+  bool found ABSL_GUARDED_BY(mu);
+  FeatureRecord record ABSL_GUARDED_BY(mu);
+};
+
+}  // namespace
+
+uint64_t ShardHash(const std::string& id) {
+  // 64-bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : id) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool BelongsToShard(const ShardSpec& spec, const FeatureRecord& record,
+                    int64_t ordinal, int64_t total) {
+  if (spec.num_shards <= 1) {
+    return true;
+  }
+
+  if (spec.scheme == PartitionScheme::kHash) {
+    return ShardHash(record.id()) % spec.num_shards == spec.shard_index;
+  }
+
+  int64_t begin = total * spec.shard_index / spec.num_shards;
+  int64_t end = total * (spec.shard_index + 1) / spec.num_shards;
+  return ordinal >= begin && ordinal < end;
+}
+
+class ShardCoordinator::Shard {
+ public:
+  Shard(const std::string& address, const Options& options)
+      : address_(address),
+        options_(options),
+        thread_pool_(std::max(1, options.connections_per_shard)) {
+    std::vector<std::string> parts = absl::StrSplit(address, ':');
+    if (parts.size() != 2 || !absl::SimpleAtoi(parts[1], &port_)) {
+      throw std::invalid_argument(absl::StrFormat(
+          "Shard address should be in the form of host:port, while got '%s'",
+          address));
+    }
+    host_ = parts[0];
+  }
+
+  const std::string& GetAddress() const { return address_; }
+
+  // Runs `call` on a worker of this shard, so that a slow shard only holds
+  // up its own calls. The call is handed whether `deadline` passed while it
+  // was queued, in which case it should give up without sending anything.
+  void Schedule(absl::Time deadline, std::function<void(bool expired)> call) {
+    thread_pool_.Schedule([deadline, call = std::move(call)]() {
+      call(absl::Now() >= deadline);
+    });
+  }
+
+  bool Search(const std::string& body, absl::Time deadline,
+              SearchResponse& response, std::string& error) {
+    std::unique_ptr<httplib::Client> client = Acquire(deadline);
+    auto result = client->Post("/search", body, "application/json");
+    if (!result) {
+      // The connection may be half-broken, so it is not reused.
+      error = absl::StrFormat("%s: http error %d", address_,
+                              static_cast<int>(result.error()));
+      return false;
+    }
+
+    bool ok = false;
+    if (result->status != 200) {
+      error = absl::StrFormat("%s: http status %d", address_, result->status);
+    } else {
+      try {
+        response = nlohmann::json::parse(result->body).get<SearchResponse>();
+        ok = true;
+      } catch (const std::exception& e) {
+        error = absl::StrFormat("%s: %s", address_, e.what());
+      }
+    }
+
+    Release(std::move(client));
+    return ok;
+  }
+
+  // Sets `found` if the shard holds the record, returns false on errors.
+  bool Get(const std::string& id, absl::Time deadline, FeatureRecord* record,
+           bool* found, std::string& error) {
+    std::unique_ptr<httplib::Client> client = Acquire(deadline);
+    // Ids may hold '/', '?', '#' or '%', which the shard decodes back
+    auto result = client->Get(
+        ("/record/" + httplib::detail::encode_query_param(id)).c_str());
+    if (!result) {
+      error = absl::StrFormat("%s: http error %d", address_,
+                              static_cast<int>(result.error()));
+      return false;
+    }
+
+    bool ok = false;
+    *found = false;
+    if (result->status == 404) {
+      ok = true;
+    } else if (result->status != 200) {
+      error = absl::StrFormat("%s: http status %d", address_, result->status);
+    } else {
+      try {
+        RecordFromJson(nlohmann::json::parse(result->body), record);
+        *found = true;
+        ok = true;
+      } catch (const std::exception& e) {
+        error = absl::StrFormat("%s: %s", address_, e.what());
+      }
+    }
+
+    Release(std::move(client));
+    return ok;
+  }
+
+ private:
+  // A client whose timeouts end the call by `deadline`, not to hold the
+  // worker once the coordinator stopped waiting.
+  std::unique_ptr<httplib::Client> Acquire(absl::Time deadline) {
+    std::unique_ptr<httplib::Client> client;
+    {
+      absl::MutexLock l(&mu_);
+      if (!idle_clients_.empty()) {
+        client = std::move(idle_clients_.back());
+        idle_clients_.pop_back();
+      }
+    }
+    if (!client) {
+      client = std::make_unique<httplib::Client>(host_, port_);
+      client->set_keep_alive(true);
+    }
+
+    int64_t timeout_us = std::clamp<int64_t>(
+        absl::ToInt64Microseconds(deadline - absl::Now()), 1000,
+        options_.timeout_ms * int64_t{1000});
+    time_t sec = timeout_us / 1000000;
+    time_t usec = timeout_us % 1000000;
+    client->set_connection_timeout(sec, usec);
+    client->set_read_timeout(sec, usec);
+    client->set_write_timeout(sec, usec);
+    return client;
+  }
+
+  void Release(std::unique_ptr<httplib::Client> client) {
+    absl::MutexLock l(&mu_);
+    if (idle_clients_.size() < options_.connections_per_shard) {
+      idle_clients_.push_back(std::move(client));
+    }
+  }
+
+  std::string address_;
+  std::string host_;
+  int port_ = 0;
+  Options options_;
+
+  absl::Mutex mu_;
+  std::vector<std::unique_ptr<httplib::Client>> idle_clients_
+      ABSL_GUARDED_BY(mu_);
+
+  // Last, its calls use the members above until it has joined
+  concurrency::ThreadPool thread_pool_;
+};
+
+ShardCoordinator::ShardCoordinator(const std::vector<std::string>& shards,
+                                   const Options& options)
+    : options_(options) {
+  if (shards.empty()) {
+    throw std::invalid_argument("At least one shard is required.");
+  }
+  for (const auto& address : shards) {
+    shards_.push_back(std::make_unique<Shard>(address, options_));
+  }
+}
+
+ShardCoordinator::~ShardCoordinator() = default;
+
+bool ShardCoordinator::Search(const SearchRequest& request,
+                              SearchResponse& response) {
+  // Shards get what is left of the deadline, and are not waited for past it
+  absl::Duration timeout = absl::Milliseconds(options_.timeout_ms);
+  std::string body;
+  if (request.deadline != absl::InfiniteFuture()) {
+    absl::Duration remaining = request.deadline - absl::Now();
+    timeout = std::min(timeout, std::max(remaining, absl::ZeroDuration()));
+    SearchRequest forwarded = request;
+    forwarded.deadline_ms = std::max<int64_t>(
+        1, absl::ToInt64Milliseconds(remaining));
+    body = nlohmann::json(forwarded).dump();
+  } else {
+    body = nlohmann::json(request).dump();
+  }
+
+  // Shared with the fan-out tasks, so a shard answering after the deadline
+  // does not touch a dead stack frame.
+  const absl::Time deadline = absl::Now() + timeout;
+  auto state = std::make_shared<GatherState>(shards_.size());
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    Shard* shard = shards_[i].get();
+    shard->Schedule(deadline, [shard, state, body, deadline, i](bool expired) {
+      SearchResponse partial;
+      std::string error;
+      bool ok = false;
+      if (expired) {
+        error = absl::StrFormat("%s: dropped, queued past the deadline",
+                                shard->GetAddress());
+      } else {
+        ok = shard->Search(body, deadline, partial, error);
+      }
+
+      absl::MutexLock l(&state->mu);
+      state->done[i] = true;
+      if (ok) {
+        state->responses[i] = std::move(partial);
+      } else {
+        state->errors[i] = error.empty() ? shard->GetAddress() : error;
+      }
+      --state->pending;
+    });
+  }
+
+  std::vector<SearchResponse> responses;
+  {
+    absl::MutexLock l(&state->mu);
+    state->mu.AwaitWithDeadline(
+        absl::Condition(state.get(), &GatherState::AllDone), deadline);
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      if (!state->done[i]) {
+        response.failed_shards.push_back(
+            absl::StrFormat("%s: timeout", shards_[i]->GetAddress()));
+      } else if (!state->errors[i].empty()) {
+        response.failed_shards.push_back(state->errors[i]);
+      } else {
+        responses.push_back(std::move(state->responses[i]));
+      }
+    }
+  }
+
+  response.complete = response.failed_shards.empty();
+  response.total_count = 0;
+  // Of the shards that answered, weighted by their sizes
+  double scanned = 0.;
+  auto* neighbors = &response.neighbors;
+  for (auto& partial : responses) {
+    response.total_count += partial.total_count;
+    scanned += static_cast<double>(partial.scanned_fraction) *
+               partial.total_count;
+    response.complete = response.complete && partial.complete;
+    std::move(partial.neighbors.begin(), partial.neighbors.end(),
+              std::back_inserter(*neighbors));
+  }
+
+  if (!response.complete) {
+    response.scanned_fraction =
+        response.total_count ? scanned / response.total_count : 0.f;
+  }
+
+  size_t partial_size = std::min(request.GetResultLimit(), neighbors->size());
+  std::partial_sort(neighbors->begin(), neighbors->begin() + partial_size,
+                    neighbors->end(),
+                    [](const ResponseRecord& x, const ResponseRecord& y) {
+                      return x.distance < y.distance;
+                    });
+  neighbors->resize(partial_size);
+
+  return true;
+}
+
+bool ShardCoordinator::Get(const std::string& id, FeatureRecord* record) {
+  const absl::Time deadline =
+      absl::Now() + absl::Milliseconds(options_.timeout_ms);
+  auto state = std::make_shared<LookupState>(shards_.size());
+  for (auto& shard : shards_) {
+    shard->Schedule(deadline, [shard = shard.get(), state, id,
+                               deadline](bool expired) {
+      FeatureRecord shard_record;
+      bool found = false;
+      std::string error;
+      if (!expired) {
+        shard->Get(id, deadline, &shard_record, &found, error);
+      }
+
+      absl::MutexLock l(&state->mu);
+      if (found && !state->found) {
+        state->found = true;
+        state->record.Swap(&shard_record);
+      }
+      --state->pending;
+    });
+  }
+
+  absl::MutexLock l(&state->mu);
+  state->mu.AwaitWithDeadline(
+      absl::Condition(state.get(), &LookupState::Done), deadline);
+  if (!state->found) {
+    return false;
+  }
+  record->CopyFrom(state->record);
+  return true;
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
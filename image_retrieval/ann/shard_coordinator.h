@@ -0,0 +1,78 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_SHARD_COORDINATOR_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_SHARD_COORDINATOR_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "cpp-httplib/httplib.h"
+#include "image_retrieval/ann/index_interface.h"
+#include "image_retrieval/concurrency/thread_pool.h"
+
+namespace image_retrieval {
+namespace ann {
+
+enum class PartitionScheme { kHash, kRange };
+
+// Describes which slice of `data.pb` a shard server holds.
+struct ShardSpec {
+  int num_shards = 1;
+  int shard_index = 0;
+  PartitionScheme scheme = PartitionScheme::kHash;
+};
+
+// Stable across processes and builds, unlike absl::Hash.
+uint64_t ShardHash(const std::string& id);
+
+// Returns true if the `ordinal`-th record of a file with `total` records
+// belongs to the shard described by `spec`. `total` is only used by the range
+// scheme.
+bool BelongsToShard(const ShardSpec& spec,
+                    const feature_extraction::FeatureRecord& record,
+                    int64_t ordinal, int64_t total);
+
+/**
+ * Fans a search out to several shard servers and merges their partial top-k
+ * lists. A shard that does not answer within the timeout is reported in
+ * `SearchResponse::failed_shards` and the response is marked incomplete.
+ * Every shard has its own workers, so a slow one does not hold up the calls
+ * to the others, and calls still queued once the coordinator stopped waiting
+ * are dropped rather than sent.
+ */
+class ShardCoordinator {
+ public:
+  struct Options {
+    // Budget for a single shard, including connect, send and receive.
+    int timeout_ms = 200;
+    // Keep-alive connections kept, and calls run at once, per shard.
+    int connections_per_shard = 4;
+  };
+
+  // Each shard is given as "host:port".
+  ShardCoordinator(const std::vector<std::string>& shards,
+                   const Options& options);
+
+  ShardCoordinator(const ShardCoordinator&) = delete;
+  ShardCoordinator& operator=(const ShardCoordinator&) = delete;
+
+  ~ShardCoordinator();
+
+  bool Search(const SearchRequest& request, SearchResponse& response);
+
+  // Asks every shard for the record with `id`. Returns false if none of the
+  // shards answering within the timeout holds it.
+  bool Get(const std::string& id, feature_extraction::FeatureRecord* record);
+
+  size_t GetShardSize() const { return shards_.size(); }
+
+ private:
+  class Shard;
+
+  Options options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_SHARD_COORDINATOR_H_
@@ -0,0 +1,221 @@
+#include "image_retrieval/ann/shard_coordinator.h"
+
+#include <thread>
+#include "absl/strings/str_format.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+// A shard server on localhost answering with a fixed list of distances.
+class FakeShard {
+ public:
+  FakeShard(const std::string& name, std::vector<float> distances,
+            int delay_ms = 0) {
+    server_.Post("/search", [=](const httplib::Request& request,
+                                httplib::Response& response) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+      SearchResponse search_response;
+      search_response.total_count = distances.size();
+      for (size_t i = 0; i < distances.size(); ++i) {
+        ResponseRecord record;
+        record.record.set_id(absl::StrFormat("%s_%d", name, i));
+        record.distance = distances[i];
+        search_response.neighbors.push_back(record);
+      }
+      nlohmann::json output = search_response;
+      response.set_content(output.dump(), "text/plain");
+    });
+    // Holds the records "<name>_<i>" only
+    server_.Get(R"(/record/(.+))", [=](const httplib::Request& request,
+                                       httplib::Response& response) {
+      std::string id = request.matches[1];
+      if (id.rfind(name + "_", 0) != 0) {
+        response.status = 404;
+        return;
+      }
+      FeatureRecord record;
+      record.set_id(id);
+      record.add_value(distances.size());
+      response.set_content(RecordToJson(record).dump(), "text/plain");
+    });
+    port_ = server_.bind_to_any_port("127.0.0.1");
+    thread_ = std::thread([this]() { server_.listen_after_bind(); });
+  }
+
+  ~FakeShard() {
+    server_.stop();
+    thread_.join();
+  }
+
+  std::string GetAddress() const {
+    return absl::StrFormat("127.0.0.1:%d", port_);
+  }
+
+ private:
+  httplib::Server server_;
+  int port_;
+  std::thread thread_;
+};
+
+TEST(ShardCoordinator, MergeTopK) {
+  FakeShard shard0("a", {0.1f, 0.4f, 0.5f});
+  FakeShard shard1("b", {0.2f, 0.3f});
+  ShardCoordinator coordinator({shard0.GetAddress(), shard1.GetAddress()},
+                               ShardCoordinator::Options());
+
+  SearchRequest request;
+  request.query = {1.f, 2.f};
+  request.top_k = 4;
+  // Twice, so the second round goes over the kept-alive connections
+  for (int i = 0; i < 2; ++i) {
+    SearchResponse response;
+    ASSERT_TRUE(coordinator.Search(request, response));
+    EXPECT_TRUE(response.complete);
+    EXPECT_EQ(response.total_count, 5);
+    ASSERT_EQ(response.neighbors.size(), 4);
+    EXPECT_EQ(response.neighbors[0].record.id(), "a_0");
+    EXPECT_EQ(response.neighbors[1].record.id(), "b_0");
+    EXPECT_EQ(response.neighbors[2].record.id(), "b_1");
+    EXPECT_EQ(response.neighbors[3].record.id(), "a_1");
+  }
+}
+
+TEST(ShardCoordinator, PartialResults) {
+  FakeShard fast("fast", {0.3f});
+  FakeShard slow("slow", {0.1f}, 500);
+  ShardCoordinator::Options options;
+  options.timeout_ms = 100;
+  ShardCoordinator coordinator({fast.GetAddress(), slow.GetAddress()},
+                               options);
+
+  SearchRequest request;
+  request.query = {1.f};
+  SearchResponse response;
+  ASSERT_TRUE(coordinator.Search(request, response));
+  EXPECT_FALSE(response.complete);
+  ASSERT_EQ(response.failed_shards.size(), 1);
+  ASSERT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(response.neighbors[0].record.id(), "fast_0");
+}
+
+TEST(ShardCoordinator, Deadline) {
+  FakeShard fast("fast", {0.3f});
+  FakeShard slow("slow", {0.1f}, 500);
+  ShardCoordinator::Options options;
+  options.timeout_ms = 5000;
+  ShardCoordinator coordinator({fast.GetAddress(), slow.GetAddress()},
+                               options);
+
+  // The deadline cuts the wait shorter than the shard timeout
+  SearchRequest request;
+  request.query = {1.f};
+  request.deadline_ms = 100;
+  absl::Time start = absl::Now();
+  request.StartDeadline(start);
+  SearchResponse response;
+  ASSERT_TRUE(coordinator.Search(request, response));
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(400));
+  EXPECT_FALSE(response.complete);
+  ASSERT_EQ(response.neighbors.size(), 1);
+  EXPECT_EQ(response.neighbors[0].record.id(), "fast_0");
+}
+
+TEST(ShardCoordinator, SlowShardIsolated) {
+  FakeShard fast("fast", {0.3f});
+  FakeShard slow("slow", {0.1f}, 1000);
+  ShardCoordinator::Options options;
+  options.timeout_ms = 100;
+  options.connections_per_shard = 1;
+  ShardCoordinator coordinator({fast.GetAddress(), slow.GetAddress()},
+                               options);
+
+  // The slow shard's calls queue behind each other and are dropped once
+  // expired, while those to the fast one never wait for them
+  SearchRequest request;
+  request.query = {1.f};
+  absl::Time start = absl::Now();
+  for (int i = 0; i < 10; ++i) {
+    SearchResponse response;
+    ASSERT_TRUE(coordinator.Search(request, response));
+    EXPECT_FALSE(response.complete);
+    ASSERT_EQ(response.neighbors.size(), 1);
+    EXPECT_EQ(response.neighbors[0].record.id(), "fast_0");
+  }
+  EXPECT_LT(absl::Now() - start, absl::Seconds(2));
+}
+
+TEST(ShardCoordinator, UnreachableShard) {
+  FakeShard shard("a", {0.3f});
+  ShardCoordinator coordinator({shard.GetAddress(), "127.0.0.1:1"},
+                               ShardCoordinator::Options());
+
+  SearchRequest request;
+  request.query = {1.f};
+  SearchResponse response;
+  ASSERT_TRUE(coordinator.Search(request, response));
+  EXPECT_FALSE(response.complete);
+  EXPECT_EQ(response.neighbors.size(), 1);
+}
+
+TEST(ShardCoordinator, Get) {
+  FakeShard shard0("a", {0.1f});
+  FakeShard shard1("b", {0.2f, 0.3f});
+  ShardCoordinator coordinator({shard0.GetAddress(), shard1.GetAddress()},
+                               ShardCoordinator::Options());
+
+  FeatureRecord record;
+  ASSERT_TRUE(coordinator.Get("b_1", &record));
+  EXPECT_EQ(record.id(), "b_1");
+  ASSERT_EQ(record.value_size(), 1);
+  EXPECT_EQ(record.value(0), 2.f);
+  EXPECT_FALSE(coordinator.Get("c_0", &record));
+}
+
+TEST(ShardCoordinator, GetEscapedId) {
+  const std::string name = "dir/a?b#c%2F d+e";
+  FakeShard shard(name, {0.1f, 0.2f});
+  ShardCoordinator coordinator({shard.GetAddress()},
+                               ShardCoordinator::Options());
+
+  FeatureRecord record;
+  ASSERT_TRUE(coordinator.Get(name + "_1", &record));
+  EXPECT_EQ(record.id(), name + "_1");
+  EXPECT_FALSE(coordinator.Get("dir/a", &record));
+}
+
+TEST(SearchRequest, QueryId) {
+  auto request =
+      nlohmann::json::parse(R"({"query_id": "a_0", "top_k": 3})")
+          .get<SearchRequest>();
+  EXPECT_EQ(request.query_id, "a_0");
+  EXPECT_TRUE(request.query.empty());
+  EXPECT_THROW(nlohmann::json::parse(R"({"top_k": 3})").get<SearchRequest>(),
+               nlohmann::json::exception);
+}
+
+TEST(ShardSpec, Partition) {
+  const int64_t total = 1000;
+  for (auto scheme : {PartitionScheme::kHash, PartitionScheme::kRange}) {
+    ShardSpec spec;
+    spec.num_shards = 3;
+    spec.scheme = scheme;
+    for (int64_t i = 0; i < total; ++i) {
+      FeatureRecord record;
+      record.set_id(absl::StrFormat("n%08d.JPEG", i));
+      int owners = 0;
+      for (int shard = 0; shard < spec.num_shards; ++shard) {
+        spec.shard_index = shard;
+        owners += BelongsToShard(spec, record, i, total);
+      }
+      EXPECT_EQ(owners, 1);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace ann
+}  // namespace image_retrieval
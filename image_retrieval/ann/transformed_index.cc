@@ -0,0 +1,107 @@
+#include "image_retrieval/ann/transformed_index.h"
+
+#include "absl/strings/str_format.h"
+
+namespace image_retrieval {
+namespace ann {
+namespace {
+
+using ::image_retrieval::clustering::LinearTransform;
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+class TransformedIndex : public IndexInterface {
+ public:
+  TransformedIndex(std::unique_ptr<IndexInterface> index,
+                   std::shared_ptr<const LinearTransform> transform)
+      : index_(std::move(index)), transform_(std::move(transform)) {
+    if (index_->GetDimSize() != transform_->GetOutputDim()) {
+      throw std::invalid_argument(absl::StrFormat(
+          "Index of dim size %d for a transform to %d dims",
+          index_->GetDimSize(), transform_->GetOutputDim()));
+    }
+  }
+
+  bool Add(const FeatureRecord& record) override {
+    CheckDimSize(record.value_size());
+    FeatureRecord reduced = record;
+    reduced.mutable_value()->Resize(transform_->GetOutputDim(), 0.f);
+    transform_->Apply(record.value().data(),
+                      reduced.mutable_value()->mutable_data());
+    return index_->Add(reduced);
+  }
+
+  bool Search(const SearchRequest& request, SearchResponse& response) override {
+    CheckDimSize(request.query.size());
+    SearchRequest reduced = request;
+    reduced.query.resize(transform_->GetOutputDim());
+    transform_->Apply(request.query.data(), reduced.query.data());
+    return index_->Search(reduced, response);
+  }
+
+  bool Get(const std::string& id, FeatureRecord* record) override {
+    if (!index_->Get(id, record)) {
+      return false;
+    }
+    std::vector<float> reduced(record->value().begin(), record->value().end());
+    record->mutable_value()->Resize(transform_->GetInputDim(), 0.f);
+    transform_->Reconstruct(reduced.data(),
+                            record->mutable_value()->mutable_data());
+    return true;
+  }
+
+  int GetDimSize() const override { return transform_->GetInputDim(); }
+
+  void SetAttributeFields(const std::vector<std::string>& fields) override {
+    index_->SetAttributeFields(fields);
+  }
+
+  double EstimateSelectivity(const Filter& filter) const override {
+    return index_->EstimateSelectivity(filter);
+  }
+
+  // The transform counts as codes, of the vectors it reduced.
+  MemoryUsage GetMemoryUsage() const override {
+    MemoryUsage usage = index_->GetMemoryUsage();
+    usage.codes += (transform_->GetMean().size() +
+                    transform_->GetMatrix().size() +
+                    transform_->GetInverse().size()) *
+                   sizeof(float);
+    return usage;
+  }
+
+  IndexStats GetStats() const override {
+    IndexStats stats;
+    stats.type = "transformed";
+    stats.dim_size = GetDimSize();
+    stats.indexes.push_back(index_->GetStats());
+    stats.record_count = stats.indexes[0].record_count;
+    stats.params = {{"output_dim", transform_->GetOutputDim()}};
+    stats.memory = GetMemoryUsage();
+    return stats;
+  }
+
+ private:
+  void CheckDimSize(size_t size) const {
+    if (size != static_cast<size_t>(transform_->GetInputDim())) {
+      throw std::runtime_error(
+          absl::StrFormat("Feature dim size should be equal to the transform "
+                          "input, while got %d vs %d",
+                          size, transform_->GetInputDim()));
+    }
+  }
+
+  std::unique_ptr<IndexInterface> index_;
+  std::shared_ptr<const LinearTransform> transform_;
+};
+
+}  // namespace
+
+std::unique_ptr<IndexInterface> NewTransformedIndex(
+    std::unique_ptr<IndexInterface> index,
+    std::shared_ptr<const LinearTransform> transform) {
+  return std::make_unique<TransformedIndex>(std::move(index),
+                                            std::move(transform));
+}
+
+}  // namespace ann
+}  // namespace image_retrieval
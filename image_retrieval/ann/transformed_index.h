@@ -0,0 +1,22 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_TRANSFORMED_INDEX_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_TRANSFORMED_INDEX_H_
+
+#include <memory>
+#include "image_retrieval/ann/index_interface.h"
+#include "image_retrieval/clustering/linear_transform.h"
+
+namespace image_retrieval {
+namespace ann {
+
+// Indexes the vectors reduced by `transform` into `index`, whose dim size is
+// the output one, and searches it with the reduced queries. Records come back
+// from Get() with the reconstruction of their vector, which is reduced to the
+// same one again when searched with.
+std::unique_ptr<IndexInterface> NewTransformedIndex(
+    std::unique_ptr<IndexInterface> index,
+    std::shared_ptr<const clustering::LinearTransform> transform);
+
+}  // namespace ann
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_TRANSFORMED_INDEX_H_
@@ -1,10 +1,12 @@
 #ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_VECTOR_DISTANCE_H_
 #define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_ANN_VECTOR_DISTANCE_H_
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <limits>
 #include <type_traits>
+#include <vector>
 
 #if defined(_ENABLE_AVX) && defined(__AVX__)
 #include <immintrin.h>
@@ -40,6 +42,74 @@ inline float BaselineCosineDistance(const float* x, const float* y,
   return 1.f - dot / std::sqrt(norm_x * norm_y);
 }
 
+// Bounded cosine distances check every `kCosineBoundBlock` dimensions whether
+// the rest of the vectors can still bring the distance within the threshold.
+constexpr int64_t kCosineBoundBlock = 256;
+
+// Relative slack of the bound, so rounding never rejects a vector within the
+// threshold.
+constexpr float kCosineBoundSlack = 1e-5f;
+
+// Returns the norms of x[b * kCosineBoundBlock:] for every block b, plus a
+// trailing 0.
+inline std::vector<float> CosineSuffixNorms(const float* x, int64_t length) {
+  int64_t blocks = (length + kCosineBoundBlock - 1) / kCosineBoundBlock;
+  std::vector<float> norms(blocks + 1, 0.f);
+  float sum = 0.f;
+  for (int64_t b = blocks - 1; b >= 0; --b) {
+    for (int64_t i = b * kCosineBoundBlock;
+         i < std::min(length, (b + 1) * kCosineBoundBlock); ++i) {
+      sum += x[i] * x[i];
+    }
+    norms[b] = std::sqrt(sum);
+  }
+  return norms;
+}
+
+// Lower bound of the cosine distance once the dot product over a prefix of the
+// dimensions is `dot`, and the rest of x and y have the norms `suffix_x` and
+// `suffix_y`. By Cauchy-Schwarz the remaining dot product is at most
+// `suffix_x * suffix_y`.
+inline float CosineDistanceBound(float dot, float suffix_x, float suffix_y,
+                                 float norm_xy) {
+  return 1.f - (dot + suffix_x * suffix_y) / norm_xy - kCosineBoundSlack;
+}
+
+// Cosine distance of x and y, where `x_suffix_norms` comes from
+// CosineSuffixNorms(x) and `norm_y` is the norm of y. Once the distance is
+// known to exceed `max_distance`, returns early with a lower bound of it,
+// which is greater than `max_distance` as well. Otherwise the result is the
+// same as of BaselineCosineDistance().
+inline float BaselineBoundedCosineDistance(const float* x, const float* y,
+                                           int64_t length,
+                                           const float* x_suffix_norms,
+                                           float norm_y, float max_distance) {
+  const float norm_xy = x_suffix_norms[0] * norm_y;
+  float dot = 0.f, norm_x = 0.f, prefix_y = 0.f;
+  for (int64_t start = 0; start < length; start += kCosineBoundBlock) {
+    int64_t end = std::min(length, start + kCosineBoundBlock);
+    for (int64_t i = start; i < end; ++i) {
+      dot += x[i] * y[i];
+      norm_x += x[i] * x[i];
+      prefix_y += y[i] * y[i];
+    }
+    if (end < length && !IsAlmostEqual(norm_xy, 0.f)) {
+      float suffix_y = std::sqrt(std::max(norm_y * norm_y - prefix_y, 0.f));
+      float bound = CosineDistanceBound(
+          dot, x_suffix_norms[end / kCosineBoundBlock], suffix_y, norm_xy);
+      if (bound > max_distance) {
+        return bound;
+      }
+    }
+  }
+
+  if (IsAlmostEqual(norm_x, 0.f) || IsAlmostEqual(prefix_y, 0.f)) {
+    return 1.f;
+  }
+
+  return 1.f - dot / std::sqrt(norm_x * prefix_y);
+}
+
 inline float BaselineEuclideanDistance(const float* x, const float* y,
                                        int64_t length) {
   float distance = 0.f;
@@ -89,7 +159,148 @@ inline float Avx256CosineDistance(const float* x, const float* y,
 
   return 1.f - dot / std::sqrt(norm_x * norm_y);
 }
+
+// AVX version of BaselineBoundedCosineDistance(), with the same result as
+// Avx256CosineDistance() for vectors within the threshold.
+inline float Avx256BoundedCosineDistance(const float* x, const float* y,
+                                         int64_t length,
+                                         const float* x_suffix_norms,
+                                         float norm_y, float max_distance) {
+  assert(length % 8 == 0);
+
+  const float norm_xy = x_suffix_norms[0] * norm_y;
+  __m256 _dot = _mm256_setzero_ps();
+  __m256 _norm_x = _mm256_setzero_ps();
+  __m256 _norm_y = _mm256_setzero_ps();
+  for (int64_t start = 0; start < length; start += kCosineBoundBlock) {
+    int64_t end = std::min(length, start + kCosineBoundBlock);
+    for (int64_t i = start; i < end; i += 8) {
+      const __m256 _x = _mm256_loadu_ps(x + i);
+      const __m256 _y = _mm256_loadu_ps(y + i);
+      _dot = _mm256_fmadd_ps(_x, _y, _dot);
+      _norm_x = _mm256_fmadd_ps(_x, _x, _norm_x);
+      _norm_y = _mm256_fmadd_ps(_y, _y, _norm_y);
+    }
+    if (end < length && !IsAlmostEqual(norm_xy, 0.f)) {
+      float prefix_y = ReduceM256(_norm_y);
+      float suffix_y = std::sqrt(std::max(norm_y * norm_y - prefix_y, 0.f));
+      float bound =
+          CosineDistanceBound(ReduceM256(_dot),
+                              x_suffix_norms[end / kCosineBoundBlock],
+                              suffix_y, norm_xy);
+      if (bound > max_distance) {
+        return bound;
+      }
+    }
+  }
+
+  float dot = ReduceM256(_dot);
+  float norm_x = ReduceM256(_norm_x);
+  float norm_y2 = ReduceM256(_norm_y);
+
+  if (IsAlmostEqual(norm_x, 0.f) || IsAlmostEqual(norm_y2, 0.f)) {
+    return 1.f;
+  }
+
+  return 1.f - dot / std::sqrt(norm_x * norm_y2);
+}
+
+// Avx256CosineDistance() of vectors of `Dim` dims. With the trip count known
+// the loop is unrolled without remainder handling, and two independent sets
+// of accumulators keep twice as many FMAs in flight, as a single chain is
+// bound by the FMA latency rather than its throughput.
+template <int Dim>
+inline float Avx256CosineDistance(const float* x, const float* y) {
+  static_assert(Dim % 8 == 0, "Dim must be a multiple of 8");
+
+  __m256 _dot0 = _mm256_setzero_ps(), _dot1 = _mm256_setzero_ps();
+  __m256 _norm_x0 = _mm256_setzero_ps(), _norm_x1 = _mm256_setzero_ps();
+  __m256 _norm_y0 = _mm256_setzero_ps(), _norm_y1 = _mm256_setzero_ps();
+#pragma GCC unroll 8
+  for (int i = 0; i + 16 <= Dim; i += 16) {
+    const __m256 _x0 = _mm256_loadu_ps(x + i);
+    const __m256 _y0 = _mm256_loadu_ps(y + i);
+    const __m256 _x1 = _mm256_loadu_ps(x + i + 8);
+    const __m256 _y1 = _mm256_loadu_ps(y + i + 8);
+    _dot0 = _mm256_fmadd_ps(_x0, _y0, _dot0);
+    _dot1 = _mm256_fmadd_ps(_x1, _y1, _dot1);
+    _norm_x0 = _mm256_fmadd_ps(_x0, _x0, _norm_x0);
+    _norm_x1 = _mm256_fmadd_ps(_x1, _x1, _norm_x1);
+    _norm_y0 = _mm256_fmadd_ps(_y0, _y0, _norm_y0);
+    _norm_y1 = _mm256_fmadd_ps(_y1, _y1, _norm_y1);
+  }
+  if constexpr (Dim % 16 != 0) {
+    const __m256 _x = _mm256_loadu_ps(x + Dim - 8);
+    const __m256 _y = _mm256_loadu_ps(y + Dim - 8);
+    _dot0 = _mm256_fmadd_ps(_x, _y, _dot0);
+    _norm_x0 = _mm256_fmadd_ps(_x, _x, _norm_x0);
+    _norm_y0 = _mm256_fmadd_ps(_y, _y, _norm_y0);
+  }
+
+  float dot = ReduceM256(_mm256_add_ps(_dot0, _dot1));
+  float norm_x = ReduceM256(_mm256_add_ps(_norm_x0, _norm_x1));
+  float norm_y = ReduceM256(_mm256_add_ps(_norm_y0, _norm_y1));
+
+  if (IsAlmostEqual(norm_x, 0.f) || IsAlmostEqual(norm_y, 0.f)) {
+    return 1.f;
+  }
+
+  return 1.f - dot / std::sqrt(norm_x * norm_y);
+}
+
+// Avx256CosineDistance<Dim>() with the signature of the generic kernels.
+template <int Dim>
+inline float FixedAvx256CosineDistance(const float* x, const float* y,
+                                       int64_t length) {
+  assert(length == Dim);
+  return Avx256CosineDistance<Dim>(x, y);
+}
+#endif
+
+using CosineDistanceFn = float (*)(const float* x, const float* y,
+                                   int64_t length);
+
+// The fastest cosine distance kernel for vectors of `length` dims, to be
+// picked once rather than per distance: a specialization for the deployed
+// dims, or else the generic AVX one, or the baseline one for lengths AVX
+// cannot handle.
+inline CosineDistanceFn GetCosineDistanceFn(int64_t length) {
+#if defined(_ENABLE_AVX) && defined(__AVX__)
+  switch (length) {
+    case 128:
+      return FixedAvx256CosineDistance<128>;
+    case 256:
+      return FixedAvx256CosineDistance<256>;
+    case 512:
+      return FixedAvx256CosineDistance<512>;
+    case 1024:
+      return FixedAvx256CosineDistance<1024>;
+    case 2048:
+      return FixedAvx256CosineDistance<2048>;
+    default:
+      if (length % 8 == 0) {
+        return Avx256CosineDistance;
+      }
+  }
+#endif
+  return BaselineCosineDistance;
+}
+
+using BoundedCosineDistanceFn = float (*)(const float* x, const float* y,
+                                          int64_t length,
+                                          const float* x_suffix_norms,
+                                          float norm_y, float max_distance);
+
+// The bounded cosine distance kernel for vectors of `length` dims, the AVX one
+// or the baseline one for lengths AVX cannot handle.
+inline BoundedCosineDistanceFn GetBoundedCosineDistanceFn(int64_t length) {
+#if defined(_ENABLE_AVX) && defined(__AVX__)
+  if (length % 8 == 0) {
+    return Avx256BoundedCosineDistance;
+  }
 #endif
+  return BaselineBoundedCosineDistance;
+}
 
 }  // namespace ann
 }  // namespace image_retrieval
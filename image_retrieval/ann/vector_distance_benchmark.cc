@@ -4,11 +4,33 @@
 #include "absl/random/random.h"
 #include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
+#include "image_retrieval/profiling/perf_counters.h"
 
 namespace image_retrieval {
 namespace ann {
 namespace {
 
+using ::image_retrieval::profiling::PerfCounters;
+using ::image_retrieval::profiling::PerfSample;
+
+// Reports the hardware events per iteration since `start`, one distance, if
+// the kernel lets them be counted.
+void ReportPerfCounters(const PerfSample& start, benchmark::State& state) {
+  const PerfCounters& counters = PerfCounters::ThisThread();
+  if (!counters.IsAvailable()) {
+    return;
+  }
+  PerfSample spent = (counters.Read() - start).Scaled();
+  state.counters["cycles"] =
+      benchmark::Counter(spent.cycles, benchmark::Counter::kAvgIterations);
+  state.counters["instructions"] = benchmark::Counter(
+      spent.instructions, benchmark::Counter::kAvgIterations);
+  state.counters["llc_misses"] =
+      benchmark::Counter(spent.llc_misses, benchmark::Counter::kAvgIterations);
+  state.counters["dtlb_misses"] = benchmark::Counter(
+      spent.dtlb_misses, benchmark::Counter::kAvgIterations);
+}
+
 void BM_CosineDistance(benchmark::State& state) {  // NOLINT
   size_t dim = state.range(0);
   std::vector<float> x(dim, 0), y(dim, 0);
@@ -18,9 +40,11 @@ void BM_CosineDistance(benchmark::State& state) {  // NOLINT
     y[i] = absl::Uniform<float>(bit_gen, -1.f, 1.f);
   }
 
+  PerfSample start = PerfCounters::ThisThread().Read();
   for (auto _ : state) {
     BaselineCosineDistance(x.data(), y.data(), x.size());
   }
+  ReportPerfCounters(start, state);
 }
 
 void BM_AvxCosineDistance(benchmark::State& state) {  // NOLINT
@@ -33,16 +57,58 @@ void BM_AvxCosineDistance(benchmark::State& state) {  // NOLINT
   }
 
 #if defined(_ENABLE_AVX) && defined(__AVX__)
+  PerfSample start = PerfCounters::ThisThread().Read();
   for (auto _ : state) {
     Avx256CosineDistance(x.data(), y.data(), x.size());
   }
+  ReportPerfCounters(start, state);
 #else
   static_assert(false, "AVX is not available, please check and recompile!");
 #endif
 }
 
+// The kernel an index picks for the dim size.
+void BM_DispatchedCosineDistance(benchmark::State& state) {  // NOLINT
+  size_t dim = state.range(0);
+  std::vector<float> x(dim, 0), y(dim, 0);
+  absl::BitGen bit_gen;
+  for (size_t i = 0; i < dim; ++i) {
+    x[i] = absl::Uniform<float>(bit_gen, .1f, 1.f);
+    y[i] = absl::Uniform<float>(bit_gen, -1.f, 1.f);
+  }
+
+  CosineDistanceFn distance = GetCosineDistanceFn(dim);
+  PerfSample start = PerfCounters::ThisThread().Read();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(distance(x.data(), y.data(), x.size()));
+  }
+  ReportPerfCounters(start, state);
+}
+
+// Range search for near duplicates, `y` is unrelated to `x`.
+void BM_AvxBoundedCosineDistance(benchmark::State& state) {  // NOLINT
+  size_t dim = state.range(0);
+  std::vector<float> x(dim, 0), y(dim, 0);
+  absl::BitGen bit_gen;
+  for (size_t i = 0; i < dim; ++i) {
+    x[i] = absl::Uniform<float>(bit_gen, .1f, 1.f);
+    y[i] = absl::Uniform<float>(bit_gen, -1.f, 1.f);
+  }
+  std::vector<float> suffix_norms = CosineSuffixNorms(x.data(), dim);
+  float norm_y = CosineSuffixNorms(y.data(), dim)[0];
+
+  PerfSample start = PerfCounters::ThisThread().Read();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Avx256BoundedCosineDistance(
+        x.data(), y.data(), x.size(), suffix_norms.data(), norm_y, 0.05f));
+  }
+  ReportPerfCounters(start, state);
+}
+
 BENCHMARK(BM_CosineDistance)->Arg(16)->Arg(64)->Arg(2048);
-BENCHMARK(BM_AvxCosineDistance)->Arg(16)->Arg(64)->Arg(2048);
+BENCHMARK(BM_AvxCosineDistance)->Arg(16)->Arg(64)->Arg(256)->Arg(2048);
+BENCHMARK(BM_DispatchedCosineDistance)->Arg(64)->Arg(256)->Arg(2048);
+BENCHMARK(BM_AvxBoundedCosineDistance)->Arg(2048);
 
 }  // namespace
 }  // namespace ann
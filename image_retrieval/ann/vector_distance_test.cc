@@ -1,5 +1,6 @@
 #include "image_retrieval/ann/vector_distance.h"
 
+#include <numeric>
 #include <vector>
 #include "absl/random/random.h"
 #include "gtest/gtest.h"
@@ -33,6 +34,83 @@ TEST(AVX, Basic) {
   TestCosineDistance(2048);
 }
 
+template <int Dim>
+void TestFixedCosineDistance() {
+  std::vector<float> x(Dim), y(Dim);
+  absl::BitGen bit_gen;
+  for (int i = 0; i < Dim; ++i) {
+    x[i] = absl::Uniform<float>(bit_gen, .1f, 1.f);
+    y[i] = absl::Uniform<float>(bit_gen, -1.f, 1.f);
+  }
+
+  // Summed in another order
+  float expected = BaselineCosineDistance(x.data(), y.data(), Dim);
+  EXPECT_NEAR(Avx256CosineDistance<Dim>(x.data(), y.data()), expected, 1e-5f);
+  EXPECT_NEAR(GetCosineDistanceFn(Dim)(x.data(), y.data(), Dim), expected,
+              1e-5f);
+  EXPECT_LT(Avx256CosineDistance<Dim>(x.data(), x.data()), 1e-5f);
+}
+
+TEST(AVX, FixedCosineDistance) {
+  TestFixedCosineDistance<8>();
+  TestFixedCosineDistance<24>();
+  TestFixedCosineDistance<128>();
+  TestFixedCosineDistance<256>();
+  TestFixedCosineDistance<512>();
+  TestFixedCosineDistance<1024>();
+  TestFixedCosineDistance<2048>();
+
+  // Generic kernels for the other dims
+  std::vector<float> x(13, 1.f), y(13, 0.f);
+  y[0] = 1.f;
+  EXPECT_NEAR(GetCosineDistanceFn(13)(x.data(), y.data(), 13),
+              1.f - 1.f / std::sqrt(13.f), 1e-6f);
+  std::vector<float> zeros(40, 0.f);
+  EXPECT_EQ(GetCosineDistanceFn(40)(zeros.data(), zeros.data(), 40), 1.f);
+
+  std::vector<float> suffix_norms = CosineSuffixNorms(x.data(), 13);
+  EXPECT_NEAR(GetBoundedCosineDistanceFn(13)(x.data(), y.data(), 13,
+                                             suffix_norms.data(), 1.f, 1.f),
+              1.f - 1.f / std::sqrt(13.f), 1e-6f);
+}
+
+TEST(AVX, BoundedCosineDistance) {
+  const int64_t dim = 2048;
+  absl::BitGen bit_gen;
+  std::vector<float> x(dim), y(dim);
+  for (int64_t i = 0; i < dim; ++i) {
+    x[i] = absl::Uniform<float>(bit_gen, 0.f, 1.f);
+  }
+  std::vector<float> suffix_norms = CosineSuffixNorms(x.data(), dim);
+  EXPECT_NEAR(suffix_norms[0] * suffix_norms[0],
+              std::inner_product(x.begin(), x.end(), x.begin(), 0.f), 1e-2f);
+  EXPECT_EQ(suffix_norms.back(), 0.f);
+
+  for (int round = 0; round < 100; ++round) {
+    // From a near duplicate of x to an unrelated vector
+    float noise = round / 50.f;
+    for (int64_t i = 0; i < dim; ++i) {
+      y[i] = x[i] + absl::Uniform<float>(bit_gen, -noise, noise);
+    }
+    float norm_y = std::sqrt(std::inner_product(y.begin(), y.end(),
+                                                y.begin(), 0.f));
+    float exact = BaselineCosineDistance(x.data(), y.data(), dim);
+    for (float max_distance : {0.01f, 0.1f, 0.3f}) {
+      float d1 = BaselineBoundedCosineDistance(
+          x.data(), y.data(), dim, suffix_norms.data(), norm_y, max_distance);
+      float d2 = Avx256BoundedCosineDistance(
+          x.data(), y.data(), dim, suffix_norms.data(), norm_y, max_distance);
+      if (exact <= max_distance) {
+        EXPECT_EQ(d1, exact);
+        EXPECT_EQ(d2, Avx256CosineDistance(x.data(), y.data(), dim));
+      } else {
+        EXPECT_GT(d1, max_distance);
+        EXPECT_GT(d2, max_distance);
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace ann
 }  // namespace image_retrieval
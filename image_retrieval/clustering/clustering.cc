@@ -1,21 +1,39 @@
 #include <iostream>
 
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
 #include "cmdline/cmdline.h"
 #include "eigen3/Eigen/Dense"
+#include "image_retrieval/clustering/feature_batch_reader.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+#include "image_retrieval/clustering/mini_batch_kmeans.h"
 
-using namespace std;
+using ::image_retrieval::clustering::FeatureBatchReader;
+using ::image_retrieval::clustering::Membership;
+using ::image_retrieval::clustering::MembershipWriter;
+using ::image_retrieval::clustering::MiniBatchKMeans;
+using ::image_retrieval::clustering::WriteCentroids;
 
 int main(int argc, char* argv[]) {
   // Set stdout unbuffered
   std::setbuf(stdout, nullptr);
 
   cmdline::parser parser;
-  parser.add<std::string>(
-      "input", 'i', "Input filename(if empty, read from stdin)", false, "");
+  parser.add<std::string>("input", 'i', "Input filename", true, "");
   parser.add<std::string>("centroids", 'c', "Output centroids", true);
   parser.add<std::string>("membership", 'm', "Output membership", true);
   parser.add<size_t>("limit", 'l', "Test limit", false,
                      std::numeric_limits<size_t>::max());
+  parser.add<int>("clusters", 'k', "Number of clusters", false, 1024,
+                  cmdline::range(1, std::numeric_limits<int>::max()));
+  parser.add<int>("batch_size", 'b', "Number of points per mini-batch", false,
+                  4096, cmdline::range(1, std::numeric_limits<int>::max()));
+  parser.add<int>("epoch", 'e', "Passes over the input", false, 5,
+                  cmdline::range(0, 1000));
+  parser.add<int>("seed_sample_factor", 0,
+                  "Points sampled for k-means++ seeding, as a multiple of k",
+                  false, 16, cmdline::range(1, 1024));
+  parser.add<unsigned int>("seed", 0, "Random seed", false, 0);
   parser.add("help", 0, "print this message");
   bool ok = parser.parse(argc, argv);
   if (not ok) {
@@ -23,6 +41,39 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // TODO
+  FeatureBatchReader reader(parser.get<std::string>("input"),
+                            parser.get<size_t>("limit"));
+
+  MiniBatchKMeans::Options options;
+  options.batch_size = parser.get<int>("batch_size");
+  options.max_epoch = parser.get<int>("epoch");
+  options.seed_sample_factor = parser.get<int>("seed_sample_factor");
+  options.seed = parser.get<unsigned int>("seed");
+  MiniBatchKMeans kmeans(parser.get<int>("clusters"), options);
+  kmeans.Train(&reader);
+  WriteCentroids(parser.get<std::string>("centroids"), kmeans.GetCentroids());
+
+  // One more pass to assign every point to its final centroid
+  int64_t start = absl::ToUnixMicros(absl::Now());
+  MembershipWriter writer(parser.get<std::string>("membership"));
+  Eigen::MatrixXf batch;
+  std::vector<std::string> ids;
+  std::vector<int> membership;
+  std::vector<float> distances;
+  int64_t total_count = 0;
+  reader.Rewind();
+  while (reader.Next(options.batch_size, &batch, &ids)) {
+    kmeans.Assign(batch, &membership, &distances);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      writer.Write(Membership{ids[i], membership[i], distances[i]});
+    }
+    total_count += ids.size();
+  }
+  writer.Close();
+
+  std::cout << absl::StrFormat("Assigned %d points, elapsed %.3f(s)",
+                               total_count,
+                               (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+            << std::endl;
   return 0;
 }
@@ -0,0 +1,110 @@
+#include <iostream>
+#include <unordered_map>
+
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "cmdline/cmdline.h"
+#include "eigen3/Eigen/Dense"
+#include "image_retrieval/clustering/feature_batch_reader.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+#include "image_retrieval/clustering/knn_graph.h"
+
+using ::image_retrieval::clustering::ComputeKnnGraph;
+using ::image_retrieval::clustering::FeatureBatchReader;
+using ::image_retrieval::clustering::FindDuplicateClusters;
+using ::image_retrieval::clustering::KnnGraph;
+using ::image_retrieval::clustering::Membership;
+using ::image_retrieval::clustering::MembershipWriter;
+using ::image_retrieval::clustering::WriteKnnGraph;
+
+int main(int argc, char* argv[]) {
+  // Set stdout unbuffered
+  std::setbuf(stdout, nullptr);
+
+  cmdline::parser parser;
+  parser.add<std::string>("input", 'i', "Input filename", true, "");
+  parser.add<std::string>("graph", 'g', "Output k-NN graph", true);
+  parser.add<std::string>("membership", 'm',
+                          "Output membership of the duplicate clusters", false,
+                          "");
+  parser.add<size_t>("limit", 'l', "Test limit", false,
+                     std::numeric_limits<size_t>::max());
+  parser.add<int>("neighbors", 'k', "Number of neighbors per point", false, 10,
+                  cmdline::range(1, std::numeric_limits<int>::max()));
+  parser.add<float>("threshold", 't',
+                    "Cosine distance under which two points are duplicates",
+                    false, 0.05f);
+  parser.add<int>("block_size", 'b', "Points per tile side", false, 1024,
+                  cmdline::range(1, std::numeric_limits<int>::max()));
+  parser.add<int>("threads", 0, "Number of threads, 0 for all", false, 0);
+  parser.add("help", 0, "print this message");
+  bool ok = parser.parse(argc, argv);
+  if (not ok) {
+    std::cerr << parser.usage();
+    return 1;
+  }
+
+  // The whole corpus is held in memory, the tiles are not
+  int64_t start = absl::ToUnixMicros(absl::Now());
+  FeatureBatchReader reader(parser.get<std::string>("input"),
+                            parser.get<size_t>("limit"));
+  std::vector<Eigen::MatrixXf> batches;
+  std::vector<std::string> ids, batch_ids;
+  Eigen::MatrixXf batch;
+  long n = 0;
+  while (reader.Next(65536, &batch, &batch_ids)) {
+    n += batch.rows();
+    batches.push_back(std::move(batch));
+    ids.insert(ids.end(), batch_ids.begin(), batch_ids.end());
+  }
+  Eigen::MatrixXf data(n, std::max(0, reader.GetDimSize()));
+  long row = 0;
+  for (auto& b : batches) {
+    data.middleRows(row, b.rows()) = b;
+    row += b.rows();
+    b.resize(0, 0);
+  }
+  data.rowwise().normalize();
+  std::cout << absl::StrFormat("Loaded %d points, elapsed %.3f(s)", n,
+                               (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+            << std::endl;
+
+  start = absl::ToUnixMicros(absl::Now());
+  KnnGraph graph =
+      ComputeKnnGraph(data, parser.get<int>("neighbors"),
+                      parser.get<int>("block_size"), parser.get<int>("threads"));
+  WriteKnnGraph(parser.get<std::string>("graph"), ids, graph);
+  std::cout << absl::StrFormat("Computed the %d-NN graph, elapsed %.3f(s)",
+                               graph.k,
+                               (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+            << std::endl;
+
+  if (parser.get<std::string>("membership").empty()) {
+    return 0;
+  }
+
+  // Only the points of clusters with more than one point, each one with its
+  // distance to its nearest neighbor
+  std::vector<int64_t> clusters =
+      FindDuplicateClusters(graph, parser.get<float>("threshold"));
+  std::unordered_map<int64_t, int64_t> sizes;
+  for (int64_t cluster : clusters) {
+    ++sizes[cluster];
+  }
+  MembershipWriter writer(parser.get<std::string>("membership"));
+  int64_t duplicate_count = 0;
+  int64_t cluster_count = 0;
+  for (long i = 0; i < n; ++i) {
+    if (sizes[clusters[i]] > 1) {
+      writer.Write(Membership{ids[i], static_cast<int>(clusters[i]),
+                              graph.distances[i * graph.k]});
+      ++duplicate_count;
+      cluster_count += clusters[i] == i;
+    }
+  }
+  writer.Close();
+  std::cout << absl::StrFormat("Found %d duplicate clusters of %d points",
+                               cluster_count, duplicate_count)
+            << std::endl;
+  return 0;
+}
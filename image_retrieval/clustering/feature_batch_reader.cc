@@ -0,0 +1,64 @@
+#include "image_retrieval/clustering/feature_batch_reader.h"
+
+#include <iostream>
+#include "absl/strings/str_format.h"
+#include "image_retrieval/feature_extraction/feature.pb.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+}  // namespace
+
+FeatureBatchReader::FeatureBatchReader(const std::string& filename,
+                                       size_t limit)
+    : reader_(filename), limit_(limit), count_(0), dim_size_(-1) {}
+
+size_t FeatureBatchReader::Next(size_t batch_size, Eigen::MatrixXf* batch,
+                                std::vector<std::string>* ids) {
+  if (ids) {
+    ids->clear();
+  }
+
+  size_t rows = 0;
+  FeatureRecord record;
+  while (rows < batch_size && count_ < limit_) {
+    if (!reader_.Next(&record)) {
+      break;
+    }
+    ++count_;
+
+    if (dim_size_ < 0) {
+      dim_size_ = record.value_size();
+    } else if (dim_size_ != record.value_size()) {
+      throw std::runtime_error(absl::StrFormat(
+          "Feature dim size should be equal, while got %d vs %d", dim_size_,
+          record.value_size()));
+    }
+
+    if (rows == 0 &&
+        (batch->rows() != batch_size || batch->cols() != dim_size_)) {
+      batch->resize(batch_size, dim_size_);
+    }
+    batch->row(rows++) =
+        Eigen::Map<const Eigen::RowVectorXf>(record.value().data(), dim_size_);
+    if (ids) {
+      ids->push_back(record.id());
+    }
+  }
+
+  if (rows && rows < batch_size) {
+    batch->conservativeResize(rows, Eigen::NoChange);
+  }
+  return rows;
+}
+
+void FeatureBatchReader::Rewind() {
+  reader_.Rewind();
+  count_ = 0;
+}
+
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,45 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_FEATURE_BATCH_READER_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_FEATURE_BATCH_READER_H_
+
+#include <string>
+#include <vector>
+#include "eigen3/Eigen/Dense"
+#include "image_retrieval/feature_extraction/feature_file.h"
+
+namespace image_retrieval {
+namespace clustering {
+
+/**
+ * Streams the `FeatureRecord`s of a length-prefixed file or a feature file as
+ * row batches, so the whole dataset never has to be held in memory.
+ */
+class FeatureBatchReader {
+ public:
+  FeatureBatchReader(const std::string& filename, size_t limit);
+
+  FeatureBatchReader(const FeatureBatchReader&) = delete;
+  FeatureBatchReader& operator=(const FeatureBatchReader&) = delete;
+
+  // Reads up to `batch_size` records into the rows of `batch`, and their ids
+  // into `ids` if it is not null. Returns the number of rows read, 0 at the
+  // end of the input.
+  size_t Next(size_t batch_size, Eigen::MatrixXf* batch,
+              std::vector<std::string>* ids = nullptr);
+
+  // Starts another pass from the first record.
+  void Rewind();
+
+  // Dimension of the features, -1 before the first record has been read.
+  int GetDimSize() const { return dim_size_; }
+
+ private:
+  feature_extraction::SequentialRecordReader reader_;
+  size_t limit_;
+  size_t count_;
+  int dim_size_;
+};
+
+}  // namespace clustering
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_FEATURE_BATCH_READER_H_
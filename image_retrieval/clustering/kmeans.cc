@@ -1,14 +1,39 @@
 #include "image_retrieval/clustering/kmeans.h"
 
-#include <atomic>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <numeric>
 #include <random>
+#include <thread>
 #include "absl/strings/str_format.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "absl/time/clock.h"
+#include "eigen3/Eigen/Sparse"
+#include "image_retrieval/concurrency/thread_pool.h"
 
 namespace image_retrieval {
 namespace clustering {
+namespace {
+
+// Rows of data whose dot products are computed by one matrix multiplication
+constexpr long kBlockRows = 1024;
+
+// Centroid sums over the points handled by a single task, merged after all
+// tasks are done.
+struct PartialSums {
+  Eigen::MatrixXf sums;
+  std::vector<int64_t> counts;
+  int64_t assign = 0;
+  int64_t distance_count = 0;
+};
+
+// Bounds are only trusted if they hold with this much room, relative to the
+// norms involved, as the expanded distances carry rounding errors.
+constexpr float kBoundSlack = 1e-3f;
+
+}  // namespace
 
 std::vector<int> Permutation(size_t max) {
   std::vector<int> perm(max);
@@ -17,12 +42,43 @@ std::vector<int> Permutation(size_t max) {
   return perm;
 }
 
-int NearestCentroid(const Eigen::MatrixXf& centroids,
-                    const Eigen::RowVectorXf& point) {
-  int index;
-  Eigen::MatrixXf diff = centroids.rowwise() - point;
-  diff.rowwise().squaredNorm().minCoeff(&index);
-  return index;
+void AssignNearest(const Eigen::Ref<const Eigen::MatrixXf>& data,
+                   const Eigen::MatrixXf& centroids,
+                   const Eigen::VectorXf& centroid_norms, int* membership,
+                   float* distances, float* second_distances) {
+  long rows = data.rows();
+  // Centroids by rows, so the distances of a point are a contiguous column
+  Eigen::MatrixXf dots(centroids.rows(), std::min(rows, kBlockRows));
+  for (long begin = 0; begin < rows; begin += kBlockRows) {
+    long size = std::min(kBlockRows, rows - begin);
+    auto block = data.middleRows(begin, size);
+    dots.leftCols(size).noalias() = centroids * block.transpose();
+    for (long i = 0; i < size; ++i) {
+      float norm = block.row(i).squaredNorm();
+      int index;
+      float distance;
+      if (second_distances) {
+        float second = std::numeric_limits<float>::infinity();
+        distance = std::numeric_limits<float>::infinity();
+        index = 0;
+        for (long c = 0; c < centroids.rows(); ++c) {
+          float value = centroid_norms[c] - 2.f * dots(c, i);
+          if (value < distance) {
+            second = distance;
+            distance = value;
+            index = c;
+          } else if (value < second) {
+            second = value;
+          }
+        }
+        second_distances[begin + i] = std::max(0.f, second + norm);
+      } else {
+        distance = (centroid_norms - 2.f * dots.col(i)).minCoeff(&index);
+      }
+      membership[begin + i] = index;
+      distances[begin + i] = std::max(0.f, distance + norm);
+    }
+  }
 }
 
 void KMeans::Train(const Eigen::MatrixXf& data,
@@ -52,42 +108,212 @@ void KMeans::Train(const Eigen::MatrixXf& data,
     }
   }
 
+  int num_threads = num_threads_ > 0
+                        ? num_threads_
+                        : std::max(1u, std::thread::hardware_concurrency());
+  int num_tasks =
+      std::min<long>(num_threads, (n + kBlockRows - 1) / kBlockRows);
+  concurrency::ThreadPool thread_pool(num_tasks);
+
   // Initialization: assigning all data points to a dummy cluster
   membership_ = Eigen::MatrixXi::Constant(1, n, k_);
+  std::vector<int> membership(n);
+  std::vector<float> distances(n);
+  distance_count_ = 0;
   int64_t start = absl::ToUnixMicros(absl::Now());
 
+  // Hamerly bounds: distance to the assigned centroid (upper) and to any
+  // other centroid (lower), together with how far the centroids moved and
+  // half the distance from every centroid to its closest other centroid.
+  bool use_bounds = algorithm_ == Algorithm::kHamerly;
+  std::vector<float> upper, lower;
+  Eigen::VectorXf shifts, half_separations, point_norms;
+  int max_shift_index = 0;
+  float max_shift = 0.f, second_max_shift = 0.f;
+  if (use_bounds) {
+    upper.resize(n);
+    lower.resize(n);
+    point_norms = data.rowwise().norm();
+  }
+
   for (int it = 0; it < max_iteration_; ++it) {
-    Eigen::MatrixXf centroids = Eigen::MatrixXf::Zero(k_, dimension);
-    std::vector<int> counter(k_, 0);
-    std::atomic_long assign(0);
-
-#pragma omp parallel for schedule(dynamic, 1)
-    for (int i = 0; i < data.rows(); ++i) {
-      int centroid_index = NearestCentroid(centroids_, data.row(i));
-      if (membership_[i] != centroid_index) {
-        membership_[i] = centroid_index;
-        ++assign;
-      }
+    Eigen::VectorXf centroid_norms = centroids_.rowwise().squaredNorm();
+    bool bounded = use_bounds && it > 0;
+    float max_centroid_norm = 0.f;
+    if (bounded) {
+      max_centroid_norm = std::sqrt(centroid_norms.maxCoeff());
+      Eigen::MatrixXf separations = -2.f * centroids_ * centroids_.transpose();
+      separations.colwise() += centroid_norms;
+      separations.rowwise() += centroid_norms.transpose();
+      separations.diagonal().setConstant(std::numeric_limits<float>::max());
+      half_separations =
+          0.5f * separations.rowwise().minCoeff().cwiseMax(0.f).cwiseSqrt();
     }
 
-    for (int i = 0; i < data.rows(); ++i) {
-      int centroid_index = membership_[i];
-      centroids.row(centroid_index) =
-          counter[centroid_index] * centroids.row(centroid_index) + data.row(i);
-      // To prevent overflow
-      centroids.row(centroid_index) /= ++counter[centroid_index];
+    std::vector<PartialSums> partials(num_tasks);
+    absl::BlockingCounter join(num_tasks);
+    for (int t = 0; t < num_tasks; ++t) {
+      thread_pool.Schedule([&, t]() {
+        long begin = n * t / num_tasks;
+        long size = n * (t + 1) / num_tasks - begin;
+        auto block = data.middleRows(begin, size);
+        PartialSums* partial = &partials[t];
+
+        if (!bounded) {
+          AssignNearest(block, centroids_, centroid_norms,
+                        membership.data() + begin, distances.data() + begin,
+                        use_bounds ? lower.data() + begin : nullptr);
+          partial->distance_count += size * k_;
+          if (use_bounds) {
+            for (long i = begin; i < begin + size; ++i) {
+              upper[i] = std::sqrt(distances[i]);
+              lower[i] = std::sqrt(lower[i]);
+            }
+          }
+        } else {
+          std::vector<long> candidates;
+          for (long i = begin; i < begin + size; ++i) {
+            int assigned = membership[i];
+            upper[i] += shifts[assigned];
+            lower[i] -=
+                assigned == max_shift_index ? second_max_shift : max_shift;
+            float slack = kBoundSlack * (point_norms[i] + max_centroid_norm);
+            float bound = std::max(half_separations[assigned], lower[i]);
+            if (upper[i] + slack <= bound) {
+              continue;
+            }
+            // Tighten the upper bound before giving up on the point
+            upper[i] = (data.row(i) - centroids_.row(assigned)).norm();
+            ++partial->distance_count;
+            if (upper[i] + slack <= bound) {
+              continue;
+            }
+            candidates.push_back(i);
+          }
+
+          if (!candidates.empty()) {
+            Eigen::MatrixXf rows(candidates.size(), data.cols());
+            for (size_t j = 0; j < candidates.size(); ++j) {
+              rows.row(j) = data.row(candidates[j]);
+            }
+            std::vector<int> nearest(candidates.size());
+            std::vector<float> first(candidates.size());
+            std::vector<float> second(candidates.size());
+            AssignNearest(rows, centroids_, centroid_norms, nearest.data(),
+                          first.data(), second.data());
+            partial->distance_count += candidates.size() * k_;
+            for (size_t j = 0; j < candidates.size(); ++j) {
+              long i = candidates[j];
+              membership[i] = nearest[j];
+              upper[i] = std::sqrt(first[j]);
+              lower[i] = std::sqrt(second[j]);
+            }
+          }
+        }
+
+        for (long i = begin; i < begin + size; ++i) {
+          if (membership_[i] != membership[i]) {
+            membership_[i] = membership[i];
+            ++partial->assign;
+          }
+        }
+
+        if (!frozen_centroids_) {
+          // Sums of the rows per centroid, as a one-hot (k x size) matrix
+          // times the block.
+          Eigen::SparseMatrix<float> one_hot(k_, size);
+          one_hot.reserve(Eigen::VectorXi::Constant(size, 1));
+          partial->counts.assign(k_, 0);
+          for (long i = 0; i < size; ++i) {
+            one_hot.insert(membership[begin + i], i) = 1.f;
+            ++partial->counts[membership[begin + i]];
+          }
+          partial->sums.noalias() = one_hot * block;
+        }
+        join.DecrementCount();
+      });
+    }
+    join.Wait();
+
+    int64_t assign = 0;
+    int64_t distance_count = 0;
+    for (const auto& partial : partials) {
+      assign += partial.assign;
+      distance_count += partial.distance_count;
     }
+    distance_count_ += distance_count;
 
     std::cout << absl::StrFormat(
-                     "Iteration %d: %ld points reassigned, elapsed %.3f(s)", it,
-                     assign.load(),
+                     "Iteration %d: %ld points reassigned, %ld distances "
+                     "computed, elapsed %.3f(s)",
+                     it, assign, distance_count,
                      (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
               << std::endl;
-    if (!frozen_centroids_ && assign > 0) {
-      centroids_.swap(centroids);
+    if (frozen_centroids_ || assign == 0) {
+      break;
+    }
+
+    Eigen::MatrixXf sums = Eigen::MatrixXf::Zero(k_, dimension);
+    std::vector<int64_t> counts(k_, 0);
+    for (const auto& partial : partials) {
+      sums += partial.sums;
+      for (int c = 0; c < k_; ++c) {
+        counts[c] += partial.counts[c];
+      }
+    }
+
+    std::vector<int> empty_clusters;
+    for (int c = 0; c < k_; ++c) {
+      if (!counts[c]) {
+        empty_clusters.push_back(c);
+      }
+    }
+
+    // Exact distances to the assigned centroids, which are only known for all
+    // points in Lloyd iterations.
+    Eigen::VectorXf min_distances;
+    if (!empty_clusters.empty()) {
+      min_distances.resize(n);
+      for (long i = 0; i < n; ++i) {
+        min_distances[i] =
+            (data.row(i) - centroids_.row(membership[i])).squaredNorm();
+      }
+    }
+
+    Eigen::MatrixXf previous = centroids_;
+    for (int c = 0; c < k_; ++c) {
+      if (counts[c]) {
+        centroids_.row(c) = sums.row(c) / counts[c];
+      }
+    }
+
+    // Empty clusters are moved, one by one, onto the point farthest from all
+    // centroids so far.
+    for (int c : empty_clusters) {
+      long farthest;
+      min_distances.maxCoeff(&farthest);
+      centroids_.row(c) = data.row(farthest);
+      min_distances = min_distances.cwiseMin(
+          (data.rowwise() - centroids_.row(c)).rowwise().squaredNorm());
+    }
+    if (!empty_clusters.empty()) {
+      std::cout << absl::StrFormat("Iteration %d: %d empty clusters relocated",
+                                   it, empty_clusters.size())
+                << std::endl;
+    }
+
+    if (use_bounds) {
+      shifts = (centroids_ - previous).rowwise().norm();
+      max_shift = shifts.maxCoeff(&max_shift_index);
+      second_max_shift = 0.f;
+      for (int c = 0; c < k_; ++c) {
+        if (c != max_shift_index) {
+          second_max_shift = std::max(second_max_shift, shifts[c]);
+        }
+      }
     }
   }
 }
 
 }  // namespace clustering
-}  // namespace image_retrieval
\ No newline at end of file
+}  // namespace image_retrieval
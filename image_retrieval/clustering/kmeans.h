@@ -7,14 +7,40 @@
 namespace image_retrieval {
 namespace clustering {
 
+// Assigns every row of `data` to its nearest centroid. Squared distances are
+// expanded as ||x||^2 + ||c||^2 - 2 x.c, so the dot products of a whole block
+// of rows are computed by one matrix multiplication. `centroid_norms` holds
+// the squared norms of the centroids, `membership` and `distances` (squared)
+// are indexed by the rows of `data`. The squared distance to the second
+// nearest centroid is stored into `second_distances` if it is not null.
+void AssignNearest(const Eigen::Ref<const Eigen::MatrixXf>& data,
+                   const Eigen::MatrixXf& centroids,
+                   const Eigen::VectorXf& centroid_norms, int* membership,
+                   float* distances, float* second_distances = nullptr);
+
 class KMeans {
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-  KMeans(int k, int max_iteration, bool frozen_centroids = false)
+  enum class Algorithm {
+    // Computes all n * k distances in every iteration.
+    kLloyd,
+    // Keeps an upper bound to the assigned centroid and a lower bound to all
+    // the others per point (Hamerly, "Making k-means even faster"), and skips
+    // the points whose assignment cannot change. Gives the same assignments
+    // as kLloyd up to floating point ties.
+    kHamerly,
+  };
+
+  // `num_threads` defaults to the number of hardware threads if not positive.
+  KMeans(int k, int max_iteration, bool frozen_centroids = false,
+         int num_threads = 0, Algorithm algorithm = Algorithm::kLloyd)
       : k_(k),
         max_iteration_(max_iteration),
-        frozen_centroids_(frozen_centroids) {}
+        frozen_centroids_(frozen_centroids),
+        num_threads_(num_threads),
+        algorithm_(algorithm),
+        distance_count_(0) {}
 
   KMeans(const KMeans&) = delete;
 
@@ -28,6 +54,9 @@ class KMeans {
 
   const Eigen::RowVectorXi GetMembership() const { return membership_; }
 
+  // Number of point to centroid distances computed by the last Train().
+  int64_t GetDistanceCount() const { return distance_count_; }
+
  private:
   int k_;
 
@@ -35,6 +64,12 @@ class KMeans {
 
   bool frozen_centroids_;
 
+  int num_threads_;
+
+  Algorithm algorithm_;
+
+  int64_t distance_count_;
+
   Eigen::MatrixXf centroids_;
 
   Eigen::RowVectorXi membership_;
@@ -0,0 +1,70 @@
+#include "image_retrieval/clustering/kmeans.h"
+
+#include <vector>
+#include "benchmark/benchmark.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+// The per point assignment replaced by AssignNearest
+void BM_NaiveAssign(benchmark::State& state) {  // NOLINT
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(state.range(0), 256);
+  Eigen::MatrixXf centroids = Eigen::MatrixXf::Random(state.range(1), 256);
+
+  for (auto _ : state) {
+    for (long i = 0; i < data.rows(); ++i) {
+      int index;
+      Eigen::MatrixXf diff = centroids.rowwise() - data.row(i);
+      diff.rowwise().squaredNorm().minCoeff(&index);
+      benchmark::DoNotOptimize(index);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * data.rows());
+}
+
+void BM_AssignNearest(benchmark::State& state) {  // NOLINT
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(state.range(0), 256);
+  Eigen::MatrixXf centroids = Eigen::MatrixXf::Random(state.range(1), 256);
+  Eigen::VectorXf centroid_norms = centroids.rowwise().squaredNorm();
+  std::vector<int> membership(data.rows());
+  std::vector<float> distances(data.rows());
+
+  for (auto _ : state) {
+    AssignNearest(data, centroids, centroid_norms, membership.data(),
+                  distances.data());
+  }
+  state.SetItemsProcessed(state.iterations() * data.rows());
+}
+
+void BM_KMeansTrain(benchmark::State& state) {  // NOLINT
+  // Points scattered around more centers than there are clusters, as bounds
+  // do not help on uniformly random data.
+  Eigen::MatrixXf centers =
+      2.f * Eigen::MatrixXf::Random(4 * state.range(1), 256);
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(state.range(0), 256);
+  for (long i = 0; i < data.rows(); ++i) {
+    data.row(i) += centers.row(i % centers.rows());
+  }
+  Eigen::MatrixXf init_centroids = data.bottomRows(state.range(1));
+
+  for (auto _ : state) {
+    KMeans kmeans(state.range(1), 20, false, 0,
+                  static_cast<KMeans::Algorithm>(state.range(2)));
+    kmeans.Train(data, init_centroids);
+  }
+}
+
+BENCHMARK(BM_NaiveAssign)->Args({4096, 256})->Args({4096, 1024});
+BENCHMARK(BM_AssignNearest)->Args({4096, 256})->Args({4096, 1024});
+// Lloyd vs Hamerly
+BENCHMARK(BM_KMeansTrain)
+    ->Args({65536, 256, 0})
+    ->Args({65536, 256, 1})
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace clustering
+}  // namespace image_retrieval
+
+BENCHMARK_MAIN();
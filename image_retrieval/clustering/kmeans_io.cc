@@ -0,0 +1,245 @@
+#include "image_retrieval/clustering/kmeans_io.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include "absl/strings/str_format.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+constexpr char kCentroidsMagic[] = "IRCT";
+constexpr char kMembershipMagic[] = "IRMB";
+constexpr char kKnnGraphMagic[] = "IRKG";
+constexpr char kTransformMagic[] = "IRLT";
+constexpr uint32_t kVersion = 1;
+
+// Closes the file when going out of scope.
+struct FileCloser {
+  void operator()(FILE* file) const {
+    if (file) {
+      ::fclose(file);
+    }
+  }
+};
+using FilePtr = std::unique_ptr<FILE, FileCloser>;
+
+FilePtr Open(const std::string& filename, const char* mode) {
+  FilePtr file(::fopen(filename.c_str(), mode));
+  if (!file) {
+    throw std::runtime_error(
+        absl::StrFormat("Failed to open %s, please investigate and retry!",
+                        filename));
+  }
+  return file;
+}
+
+template <class T>
+void WriteValue(FILE* file, const T& value) {
+  if (::fwrite(&value, sizeof(T), 1, file) != 1) {
+    throw std::runtime_error("Failed to write, is the disk full?");
+  }
+}
+
+template <class T>
+T ReadValue(FILE* file) {
+  T value;
+  if (::fread(&value, sizeof(T), 1, file) != 1) {
+    throw std::runtime_error("Unexpected end of file");
+  }
+  return value;
+}
+
+void CheckHeader(FILE* file, const char* magic, const std::string& filename) {
+  char buffer[4];
+  if (::fread(buffer, 1, 4, file) != 4 || ::memcmp(buffer, magic, 4) != 0) {
+    throw std::runtime_error(
+        absl::StrFormat("%s is not a %s file", filename, magic));
+  }
+  uint32_t version = ReadValue<uint32_t>(file);
+  if (version != kVersion) {
+    throw std::runtime_error(absl::StrFormat(
+        "Unsupported version %d of %s", version, filename));
+  }
+}
+
+// Writes the values of `matrix` in row-major order.
+void WriteMatrix(FILE* file, const Eigen::MatrixXf& matrix) {
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> rows =
+      matrix;
+  if (::fwrite(rows.data(), sizeof(float), rows.size(), file) !=
+      static_cast<size_t>(rows.size())) {
+    throw std::runtime_error("Failed to write, is the disk full?");
+  }
+}
+
+Eigen::MatrixXf ReadMatrix(FILE* file, int32_t rows, int32_t cols) {
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> matrix(
+      rows, cols);
+  if (::fread(matrix.data(), sizeof(float), matrix.size(), file) !=
+      static_cast<size_t>(matrix.size())) {
+    throw std::runtime_error("Unexpected end of file");
+  }
+  return matrix;
+}
+
+}  // namespace
+
+void WriteCentroids(const std::string& filename,
+                    const Eigen::MatrixXf& centroids) {
+  FilePtr file = Open(filename, "wb");
+  ::fwrite(kCentroidsMagic, 1, 4, file.get());
+  WriteValue<uint32_t>(file.get(), kVersion);
+  WriteValue<int32_t>(file.get(), centroids.rows());
+  WriteValue<int32_t>(file.get(), centroids.cols());
+  WriteMatrix(file.get(), centroids);
+}
+
+Eigen::MatrixXf ReadCentroids(const std::string& filename) {
+  FilePtr file = Open(filename, "rb");
+  CheckHeader(file.get(), kCentroidsMagic, filename);
+  int32_t k = ReadValue<int32_t>(file.get());
+  int32_t dim = ReadValue<int32_t>(file.get());
+  return ReadMatrix(file.get(), k, dim);
+}
+
+MembershipWriter::MembershipWriter(const std::string& filename)
+    : file_(Open(filename, "wb").release()), count_(0) {
+  ::fwrite(kMembershipMagic, 1, 4, file_);
+  WriteValue<uint32_t>(file_, kVersion);
+  WriteValue<uint64_t>(file_, count_);
+}
+
+MembershipWriter::~MembershipWriter() {
+  if (file_) {
+    Close();
+  }
+}
+
+void MembershipWriter::Write(const Membership& membership) {
+  WriteValue<uint32_t>(file_, membership.id.size());
+  ::fwrite(membership.id.data(), 1, membership.id.size(), file_);
+  WriteValue<int32_t>(file_, membership.cluster);
+  WriteValue<float>(file_, membership.distance);
+  ++count_;
+}
+
+void MembershipWriter::Close() {
+  ::fseek(file_, 8, SEEK_SET);
+  WriteValue<uint64_t>(file_, count_);
+  ::fclose(file_);
+  file_ = nullptr;
+}
+
+std::vector<Membership> ReadMemberships(const std::string& filename) {
+  FilePtr file = Open(filename, "rb");
+  CheckHeader(file.get(), kMembershipMagic, filename);
+  uint64_t count = ReadValue<uint64_t>(file.get());
+
+  std::vector<Membership> memberships(count);
+  for (auto& membership : memberships) {
+    membership.id.resize(ReadValue<uint32_t>(file.get()));
+    if (::fread(&membership.id[0], 1, membership.id.size(), file.get()) !=
+        membership.id.size()) {
+      throw std::runtime_error("Unexpected end of file");
+    }
+    membership.cluster = ReadValue<int32_t>(file.get());
+    membership.distance = ReadValue<float>(file.get());
+  }
+  return memberships;
+}
+
+void WriteKnnGraph(const std::string& filename,
+                   const std::vector<std::string>& ids, const KnnGraph& graph) {
+  if (ids.size() != graph.GetSize()) {
+    throw std::invalid_argument(absl::StrFormat(
+        "%d ids for a graph of %d points", ids.size(), graph.GetSize()));
+  }
+  FilePtr file = Open(filename, "wb");
+  ::fwrite(kKnnGraphMagic, 1, 4, file.get());
+  WriteValue<uint32_t>(file.get(), kVersion);
+  WriteValue<uint64_t>(file.get(), ids.size());
+  WriteValue<int32_t>(file.get(), graph.k);
+  for (const auto& id : ids) {
+    WriteValue<uint32_t>(file.get(), id.size());
+    ::fwrite(id.data(), 1, id.size(), file.get());
+  }
+
+  uint64_t edges = std::count_if(graph.neighbors.begin(),
+                                 graph.neighbors.end(),
+                                 [](int32_t neighbor) { return neighbor >= 0; });
+  WriteValue<uint64_t>(file.get(), edges);
+  for (size_t i = 0; i < graph.neighbors.size(); ++i) {
+    if (graph.neighbors[i] >= 0) {
+      WriteValue<uint32_t>(file.get(), i / graph.k);
+      WriteValue<uint32_t>(file.get(), graph.neighbors[i]);
+      WriteValue<float>(file.get(), graph.distances[i]);
+    }
+  }
+}
+
+KnnGraph ReadKnnGraph(const std::string& filename,
+                      std::vector<std::string>* ids) {
+  FilePtr file = Open(filename, "rb");
+  CheckHeader(file.get(), kKnnGraphMagic, filename);
+  uint64_t size = ReadValue<uint64_t>(file.get());
+  KnnGraph graph;
+  graph.k = ReadValue<int32_t>(file.get());
+  ids->resize(size);
+  for (auto& id : *ids) {
+    id.resize(ReadValue<uint32_t>(file.get()));
+    if (::fread(&id[0], 1, id.size(), file.get()) != id.size()) {
+      throw std::runtime_error("Unexpected end of file");
+    }
+  }
+
+  // The edges of a point are consecutive and nearest first
+  graph.neighbors.assign(size * graph.k, -1);
+  graph.distances.assign(size * graph.k,
+                         std::numeric_limits<float>::infinity());
+  std::vector<int> degrees(size, 0);
+  uint64_t edges = ReadValue<uint64_t>(file.get());
+  for (uint64_t i = 0; i < edges; ++i) {
+    uint32_t from = ReadValue<uint32_t>(file.get());
+    uint32_t to = ReadValue<uint32_t>(file.get());
+    float distance = ReadValue<float>(file.get());
+    if (from >= size || degrees[from] >= graph.k) {
+      throw std::runtime_error(
+          absl::StrFormat("Malformed edge %d of %s", i, filename));
+    }
+    size_t slot = static_cast<size_t>(from) * graph.k + degrees[from]++;
+    graph.neighbors[slot] = to;
+    graph.distances[slot] = distance;
+  }
+  return graph;
+}
+
+void WriteLinearTransform(const std::string& filename,
+                          const LinearTransform& transform) {
+  FilePtr file = Open(filename, "wb");
+  ::fwrite(kTransformMagic, 1, 4, file.get());
+  WriteValue<uint32_t>(file.get(), kVersion);
+  WriteValue<int32_t>(file.get(), transform.GetInputDim());
+  WriteValue<int32_t>(file.get(), transform.GetOutputDim());
+  WriteMatrix(file.get(), transform.GetMean().transpose());
+  WriteMatrix(file.get(), transform.GetMatrix());
+  WriteMatrix(file.get(), transform.GetInverse());
+}
+
+LinearTransform ReadLinearTransform(const std::string& filename) {
+  FilePtr file = Open(filename, "rb");
+  CheckHeader(file.get(), kTransformMagic, filename);
+  int32_t input_dim = ReadValue<int32_t>(file.get());
+  int32_t output_dim = ReadValue<int32_t>(file.get());
+  Eigen::VectorXf mean = ReadMatrix(file.get(), 1, input_dim).transpose();
+  Eigen::MatrixXf matrix = ReadMatrix(file.get(), output_dim, input_dim);
+  Eigen::MatrixXf inverse = ReadMatrix(file.get(), input_dim, output_dim);
+  return LinearTransform(std::move(mean), std::move(matrix),
+                         std::move(inverse));
+}
+
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,79 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KMEANS_IO_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KMEANS_IO_H_
+
+#include <string>
+#include <vector>
+#include "eigen3/Eigen/Dense"
+#include "image_retrieval/clustering/knn_graph.h"
+#include "image_retrieval/clustering/linear_transform.h"
+
+namespace image_retrieval {
+namespace clustering {
+
+// Binary outputs of the clustering tools, all little-endian.
+//
+// Centroids:  "IRCT" | uint32 version | int32 k | int32 dim |
+//             float32[k * dim] in row-major order
+// Membership: "IRMB" | uint32 version | uint64 n |
+//             n * (uint32 id_size | id | int32 cluster | float32 distance)
+// k-NN graph: "IRKG" | uint32 version | uint64 n | int32 k |
+//             n * (uint32 id_size | id) | uint64 edges |
+//             edges * (uint32 from | uint32 to | float32 distance)
+//             without the padding neighbors
+// Transform:  "IRLT" | uint32 version | int32 input_dim | int32 output_dim |
+//             float32[input_dim] mean |
+//             float32[output_dim * input_dim] matrix in row-major order |
+//             float32[input_dim * output_dim] inverse in row-major order
+
+struct Membership {
+  std::string id;
+  int cluster;
+  // Squared euclidean distance to the centroid, or for the duplicate
+  // clusters, cosine distance to the nearest neighbor
+  float distance;
+};
+
+void WriteCentroids(const std::string& filename,
+                    const Eigen::MatrixXf& centroids);
+
+Eigen::MatrixXf ReadCentroids(const std::string& filename);
+
+/**
+ * Writes memberships one by one, so they never have to be held in memory.
+ */
+class MembershipWriter {
+ public:
+  explicit MembershipWriter(const std::string& filename);
+
+  MembershipWriter(const MembershipWriter&) = delete;
+  MembershipWriter& operator=(const MembershipWriter&) = delete;
+
+  ~MembershipWriter();
+
+  void Write(const Membership& membership);
+
+  // Patches the record count in the header and closes the file.
+  void Close();
+
+ private:
+  FILE* file_;
+  uint64_t count_;
+};
+
+std::vector<Membership> ReadMemberships(const std::string& filename);
+
+void WriteKnnGraph(const std::string& filename,
+                   const std::vector<std::string>& ids, const KnnGraph& graph);
+
+KnnGraph ReadKnnGraph(const std::string& filename,
+                      std::vector<std::string>* ids);
+
+void WriteLinearTransform(const std::string& filename,
+                          const LinearTransform& transform);
+
+LinearTransform ReadLinearTransform(const std::string& filename);
+
+}  // namespace clustering
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KMEANS_IO_H_
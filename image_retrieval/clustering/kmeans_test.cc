@@ -6,6 +6,15 @@ namespace image_retrieval {
 namespace clustering {
 namespace {
 
+// `blobs` well separated clusters, point i belongs to blob i % blobs.
+Eigen::MatrixXf Blobs(int blobs, int size, int dim) {
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(blobs * size, dim);
+  for (int i = 0; i < data.rows(); ++i) {
+    data.row(i).array() += 100.f * (i % blobs);
+  }
+  return data;
+}
+
 TEST(KMeans, Basic) {
   KMeans kmeans(2, 20);
   Eigen::MatrixXf data(3, 4);
@@ -18,6 +27,109 @@ TEST(KMeans, Basic) {
   std::cout << membership << std::endl;
 }
 
+TEST(KMeans, AssignNearest) {
+  // More rows than a single block
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(3000, 16);
+  Eigen::MatrixXf centroids = Eigen::MatrixXf::Random(10, 16);
+  std::vector<int> membership(data.rows());
+  std::vector<float> distances(data.rows());
+  AssignNearest(data, centroids, centroids.rowwise().squaredNorm(),
+                membership.data(), distances.data());
+
+  for (long i = 0; i < data.rows(); ++i) {
+    int index;
+    float distance =
+        (centroids.rowwise() - data.row(i)).rowwise().squaredNorm().minCoeff(
+            &index);
+    EXPECT_EQ(membership[i], index);
+    EXPECT_NEAR(distances[i], distance, 1e-4);
+  }
+}
+
+TEST(KMeans, CentroidsAreMeans) {
+  const int blobs = 4;
+  Eigen::MatrixXf data = Blobs(blobs, 500, 8);
+  KMeans kmeans(blobs, 20, false, 3);
+  kmeans.Train(data, data.topRows(blobs));
+
+  Eigen::RowVectorXi membership = kmeans.GetMembership();
+  for (int c = 0; c < blobs; ++c) {
+    Eigen::RowVectorXf sum = Eigen::RowVectorXf::Zero(data.cols());
+    int count = 0;
+    for (long i = 0; i < data.rows(); ++i) {
+      if (membership[i] == c) {
+        sum += data.row(i);
+        ++count;
+      }
+      // Points of the same blob share a cluster
+      EXPECT_EQ(membership[i], membership[i % blobs]);
+    }
+    ASSERT_EQ(count, 500);
+    EXPECT_TRUE(kmeans.GetCentroids().row(c).isApprox(sum / count, 1e-5));
+  }
+}
+
+TEST(KMeans, EmptyClusters) {
+  Eigen::MatrixXf data = Blobs(3, 100, 4);
+  // Nothing is close to the last two centroids
+  Eigen::MatrixXf init_centroids(3, 4);
+  init_centroids.row(0) = data.row(0);
+  init_centroids.row(1).setConstant(1e4);
+  init_centroids.row(2).setConstant(-1e4);
+  KMeans kmeans(3, 20);
+  kmeans.Train(data, init_centroids);
+
+  std::vector<int> counts(3, 0);
+  for (long i = 0; i < data.rows(); ++i) {
+    ++counts[kmeans.GetMembership()[i]];
+  }
+  EXPECT_EQ(counts, std::vector<int>({100, 100, 100}));
+}
+
+TEST(KMeans, ThreadCountIndependent) {
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(5000, 8);
+  Eigen::MatrixXf init_centroids = data.topRows(16);
+  KMeans single(16, 10, false, 1);
+  single.Train(data, init_centroids);
+  KMeans multiple(16, 10, false, 4);
+  multiple.Train(data, init_centroids);
+
+  EXPECT_EQ(single.GetMembership(), multiple.GetMembership());
+  EXPECT_TRUE(single.GetCentroids().isApprox(multiple.GetCentroids(), 1e-5));
+}
+
+TEST(KMeans, HamerlySameAsLloyd) {
+  for (int k : {1, 7, 32}) {
+    Eigen::MatrixXf data = Eigen::MatrixXf::Random(4000, 8);
+    Eigen::MatrixXf init_centroids = data.topRows(k);
+    KMeans lloyd(k, 30, false, 2, KMeans::Algorithm::kLloyd);
+    lloyd.Train(data, init_centroids);
+    KMeans hamerly(k, 30, false, 2, KMeans::Algorithm::kHamerly);
+    hamerly.Train(data, init_centroids);
+
+    EXPECT_EQ(lloyd.GetMembership(), hamerly.GetMembership());
+    EXPECT_TRUE(lloyd.GetCentroids().isApprox(hamerly.GetCentroids()));
+    if (k > 1) {
+      EXPECT_LT(hamerly.GetDistanceCount(), lloyd.GetDistanceCount() / 2);
+    }
+  }
+}
+
+TEST(KMeans, HamerlyEmptyClusters) {
+  Eigen::MatrixXf data = Blobs(3, 100, 4);
+  Eigen::MatrixXf init_centroids(3, 4);
+  init_centroids.row(0) = data.row(0);
+  init_centroids.row(1).setConstant(1e4);
+  init_centroids.row(2).setConstant(-1e4);
+  KMeans lloyd(3, 20, false, 0, KMeans::Algorithm::kLloyd);
+  lloyd.Train(data, init_centroids);
+  KMeans hamerly(3, 20, false, 0, KMeans::Algorithm::kHamerly);
+  hamerly.Train(data, init_centroids);
+
+  EXPECT_EQ(lloyd.GetMembership(), hamerly.GetMembership());
+  EXPECT_TRUE(lloyd.GetCentroids().isApprox(hamerly.GetCentroids()));
+}
+
 }  // namespace
 }  // namespace clustering
-}  // namespace image_retrieval
\ No newline at end of file
+}  // namespace image_retrieval
@@ -0,0 +1,152 @@
+#include "image_retrieval/clustering/knn_graph.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "image_retrieval/concurrency/thread_pool.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+// The k nearest neighbors found so far of a single point, as a max-heap by
+// distance so the farthest one is the first to go.
+class TopK {
+ public:
+  explicit TopK(int k) : k_(k) { heap_.reserve(k); }
+
+  void Push(float distance, int32_t neighbor) {
+    if (static_cast<int>(heap_.size()) < k_) {
+      heap_.emplace_back(distance, neighbor);
+      std::push_heap(heap_.begin(), heap_.end());
+    } else if (distance < heap_.front().first) {
+      std::pop_heap(heap_.begin(), heap_.end());
+      heap_.back() = {distance, neighbor};
+      std::push_heap(heap_.begin(), heap_.end());
+    }
+  }
+
+  // Writes the neighbors nearest first, padded to k.
+  void Flush(int32_t* neighbors, float* distances) {
+    std::sort_heap(heap_.begin(), heap_.end());
+    for (int i = 0; i < k_; ++i) {
+      bool found = i < static_cast<int>(heap_.size());
+      neighbors[i] = found ? heap_[i].second : -1;
+      distances[i] =
+          found ? heap_[i].first : std::numeric_limits<float>::infinity();
+    }
+  }
+
+ private:
+  int k_;
+  std::vector<std::pair<float, int32_t>> heap_;
+};
+
+int64_t FindRoot(std::vector<int64_t>* parents, int64_t i) {
+  while ((*parents)[i] != i) {
+    (*parents)[i] = (*parents)[(*parents)[i]];
+    i = (*parents)[i];
+  }
+  return i;
+}
+
+}  // namespace
+
+KnnGraph ComputeKnnGraph(const Eigen::MatrixXf& data, int k, int block_size,
+                         int num_threads) {
+  if (k <= 0 || block_size <= 0) {
+    throw std::invalid_argument(
+        absl::StrFormat("Invalid k %d or block size %d", k, block_size));
+  }
+  long n = data.rows();
+  if (n > std::numeric_limits<int32_t>::max()) {
+    throw std::invalid_argument(absl::StrFormat("Too many points: %d", n));
+  }
+
+  KnnGraph graph;
+  graph.k = k;
+  graph.neighbors.resize(n * k);
+  graph.distances.resize(n * k);
+  long num_blocks = (n + block_size - 1) / block_size;
+  if (num_blocks == 0) {
+    return graph;
+  }
+
+  num_threads = num_threads > 0
+                    ? num_threads
+                    : std::max(1u, std::thread::hardware_concurrency());
+  concurrency::ThreadPool thread_pool(std::min<long>(num_threads, num_blocks));
+  absl::BlockingCounter join(num_blocks);
+  for (long b = 0; b < num_blocks; ++b) {
+    thread_pool.Schedule([&, b]() {
+      long begin = b * block_size;
+      long size = std::min<long>(block_size, n - begin);
+      auto rows = data.middleRows(begin, size);
+      std::vector<TopK> lists(size, TopK(k));
+
+      // The other block by rows, so the dot products of a point of this block
+      // are a contiguous column
+      Eigen::MatrixXf dots(std::min<long>(block_size, n), size);
+      for (long other = 0; other < n; other += block_size) {
+        long other_size = std::min<long>(block_size, n - other);
+        dots.topRows(other_size).noalias() =
+            data.middleRows(other, other_size) * rows.transpose();
+        for (long i = 0; i < size; ++i) {
+          const float* column = dots.col(i).data();
+          for (long j = 0; j < other_size; ++j) {
+            if (other + j != begin + i) {
+              lists[i].Push(1.f - column[j], other + j);
+            }
+          }
+        }
+      }
+
+      for (long i = 0; i < size; ++i) {
+        lists[i].Flush(&graph.neighbors[(begin + i) * k],
+                       &graph.distances[(begin + i) * k]);
+      }
+      join.DecrementCount();
+    });
+  }
+  join.Wait();
+  return graph;
+}
+
+std::vector<int64_t> FindDuplicateClusters(const KnnGraph& graph,
+                                           float threshold) {
+  int64_t n = graph.GetSize();
+  std::vector<int64_t> parents(n);
+  std::iota(parents.begin(), parents.end(), 0);
+  for (int64_t i = 0; i < n; ++i) {
+    for (int j = 0; j < graph.k; ++j) {
+      int32_t neighbor = graph.neighbors[i * graph.k + j];
+      // Nearest first, so the rest are even farther
+      if (neighbor < 0 || graph.distances[i * graph.k + j] >= threshold) {
+        break;
+      }
+      int64_t a = FindRoot(&parents, i);
+      int64_t b = FindRoot(&parents, neighbor);
+      // The smaller root wins, so a cluster ends up named after its smallest
+      // point
+      if (a < b) {
+        parents[b] = a;
+      } else if (b < a) {
+        parents[a] = b;
+      }
+    }
+  }
+
+  std::vector<int64_t> clusters(n);
+  for (int64_t i = 0; i < n; ++i) {
+    clusters[i] = FindRoot(&parents, i);
+  }
+  return clusters;
+}
+
+}  // namespace clustering
+}  // namespace image_retrieval
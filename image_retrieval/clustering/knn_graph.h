@@ -0,0 +1,42 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KNN_GRAPH_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KNN_GRAPH_H_
+
+#include <cstdint>
+#include <vector>
+#include "eigen3/Eigen/Dense"
+
+namespace image_retrieval {
+namespace clustering {
+
+// The k nearest neighbors of every point, by cosine distance.
+struct KnnGraph {
+  int k = 0;
+  // Those of point `i` are at [i * k, (i + 1) * k), nearest first. Points
+  // with fewer than k others are padded with -1.
+  std::vector<int32_t> neighbors;
+  std::vector<float> distances;
+
+  int64_t GetSize() const { return k ? neighbors.size() / k : 0; }
+};
+
+// Computes the k-NN graph of the rows of `data`, which are expected to be unit
+// vectors, by exact search.
+//
+// The points are split into blocks of `block_size`. A task owns the top-k
+// lists of one block of points and multiplies it against every block in
+// turn, one tile of dot products per matrix multiplication, so every block is
+// read once per tile and no list is shared between threads. `num_threads`
+// defaults to the number of hardware threads if not positive.
+KnnGraph ComputeKnnGraph(const Eigen::MatrixXf& data, int k,
+                         int block_size = 1024, int num_threads = 0);
+
+// Groups the points connected by the edges of `graph` shorter than
+// `threshold` into clusters, and returns the cluster of every point, named
+// after its smallest point.
+std::vector<int64_t> FindDuplicateClusters(const KnnGraph& graph,
+                                           float threshold);
+
+}  // namespace clustering
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_KNN_GRAPH_H_
@@ -0,0 +1,96 @@
+#include "image_retrieval/clustering/knn_graph.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include "gtest/gtest.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+Eigen::MatrixXf RandomUnitRows(int n, int dim) {
+  Eigen::MatrixXf data = Eigen::MatrixXf::Random(n, dim);
+  data.rowwise().normalize();
+  return data;
+}
+
+TEST(KnnGraph, MatchesBruteForce) {
+  const int n = 100, dim = 16, k = 5;
+  Eigen::MatrixXf data = RandomUnitRows(n, dim);
+  // Tiles of uneven sizes, shared by several threads
+  KnnGraph graph = ComputeKnnGraph(data, k, 7, 4);
+  ASSERT_EQ(graph.GetSize(), n);
+
+  for (int i = 0; i < n; ++i) {
+    std::vector<float> distances;
+    for (int j = 0; j < n; ++j) {
+      if (j != i) {
+        distances.push_back(1.f - data.row(i).dot(data.row(j)));
+      }
+    }
+    std::sort(distances.begin(), distances.end());
+    for (int j = 0; j < k; ++j) {
+      int32_t neighbor = graph.neighbors[i * k + j];
+      ASSERT_NE(neighbor, i);
+      EXPECT_NEAR(graph.distances[i * k + j], distances[j], 1e-5f);
+      EXPECT_NEAR(graph.distances[i * k + j],
+                  1.f - data.row(i).dot(data.row(neighbor)), 1e-5f);
+    }
+  }
+}
+
+TEST(KnnGraph, Padding) {
+  KnnGraph graph = ComputeKnnGraph(RandomUnitRows(3, 4), 4, 2, 2);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_GE(graph.neighbors[i * 4 + 1], 0);
+    EXPECT_EQ(graph.neighbors[i * 4 + 2], -1);
+    EXPECT_EQ(graph.neighbors[i * 4 + 3], -1);
+  }
+}
+
+TEST(KnnGraph, DuplicateClusters) {
+  const int n = 60, dim = 32;
+  Eigen::MatrixXf data = RandomUnitRows(n, dim);
+  // Chains of near copies: 10 -> 20 -> 30 and 40 -> 50
+  for (int i : {20, 30, 50}) {
+    data.row(i) = data.row(i - 10) + 0.01f * Eigen::RowVectorXf::Random(dim);
+  }
+  data.rowwise().normalize();
+
+  KnnGraph graph = ComputeKnnGraph(data, 3, 16, 3);
+  std::vector<int64_t> clusters = FindDuplicateClusters(graph, 0.01f);
+  for (int i = 0; i < n; ++i) {
+    if (i == 20 || i == 30) {
+      EXPECT_EQ(clusters[i], 10);
+    } else if (i == 50) {
+      EXPECT_EQ(clusters[i], 40);
+    } else {
+      EXPECT_EQ(clusters[i], i);
+    }
+  }
+}
+
+TEST(KnnGraph, ReadWrite) {
+  const int n = 20;
+  KnnGraph graph = ComputeKnnGraph(RandomUnitRows(n, 8), 25, 6, 2);
+  std::vector<std::string> ids(n);
+  for (int i = 0; i < n; ++i) {
+    ids[i] = "image_" + std::to_string(i);
+  }
+
+  std::string filename = testing::TempDir() + "knn_graph_test.bin";
+  WriteKnnGraph(filename, ids, graph);
+  std::vector<std::string> read_ids;
+  KnnGraph read = ReadKnnGraph(filename, &read_ids);
+  EXPECT_EQ(read_ids, ids);
+  EXPECT_EQ(read.k, graph.k);
+  EXPECT_EQ(read.neighbors, graph.neighbors);
+  EXPECT_EQ(read.distances, graph.distances);
+  std::remove(filename.c_str());
+}
+
+}  // namespace
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,105 @@
+#include "image_retrieval/clustering/linear_transform.h"
+
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+
+namespace image_retrieval {
+namespace clustering {
+
+LinearTransform LinearTransform::Train(const Eigen::MatrixXf& data,
+                                       const Options& options) {
+  const long n = data.rows();
+  const long dim = data.cols();
+  const long k = options.output_dim;
+  if (k <= 0 || k > dim || n < k) {
+    throw std::invalid_argument(absl::StrFormat(
+        "Cannot reduce %d points of %d dims to %d", n, dim, k));
+  }
+  int64_t start = absl::ToUnixMicros(absl::Now());
+
+  Eigen::VectorXf mean = data.colwise().mean().transpose();
+  Eigen::MatrixXf centered = data.rowwise() - mean.transpose();
+  Eigen::MatrixXf covariance =
+      centered.transpose() * centered / std::max<long>(n - 1, 1);
+
+  // Eigenvalues come in increasing order, the last k are the principal ones
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> solver(covariance);
+  Eigen::MatrixXf components = solver.eigenvectors().rightCols(k);
+  Eigen::VectorXf variances =
+      solver.eigenvalues().tail(k).cwiseMax(1e-6f * solver.eigenvalues()(dim - 1));
+  Eigen::VectorXf scales = Eigen::VectorXf::Ones(k);
+  if (options.whiten) {
+    scales = variances.cwiseSqrt().cwiseInverse();
+  }
+  // Largest variance first
+  Eigen::MatrixXf matrix =
+      (components * scales.asDiagonal()).rowwise().reverse().transpose();
+  Eigen::MatrixXf inverse =
+      (components * scales.cwiseInverse().asDiagonal()).rowwise().reverse();
+
+  if (options.rotate) {
+    // Alternates between the codes of the rotated points and the rotation
+    // closest to map the points onto their codes, an orthogonal Procrustes
+    // problem solved by SVD.
+    Eigen::MatrixXf projected = centered * matrix.transpose();
+    std::mt19937 random(options.seed);
+    std::normal_distribution<float> normal;
+    Eigen::MatrixXf gaussian = Eigen::MatrixXf::NullaryExpr(
+        k, k, [&]() { return normal(random); });
+    Eigen::MatrixXf rotation = gaussian.householderQr().householderQ();
+    for (int it = 0; it < options.rotation_iterations; ++it) {
+      Eigen::MatrixXf codes = (projected * rotation).unaryExpr(
+          [](float value) { return value >= 0.f ? 1.f : -1.f; });
+      Eigen::JacobiSVD<Eigen::MatrixXf> svd(
+          projected.transpose() * codes,
+          Eigen::ComputeFullU | Eigen::ComputeFullV);
+      rotation = svd.matrixU() * svd.matrixV().transpose();
+    }
+    matrix = rotation.transpose() * matrix;
+    inverse = inverse * rotation;
+  }
+
+  std::cout << absl::StrFormat(
+                   "Trained a %d to %d transform on %d points, elapsed "
+                   "%.3f(s)",
+                   dim, k, n, (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+            << std::endl;
+  return LinearTransform(std::move(mean), std::move(matrix),
+                         std::move(inverse));
+}
+
+LinearTransform::LinearTransform(Eigen::VectorXf mean, Eigen::MatrixXf matrix,
+                                 Eigen::MatrixXf inverse)
+    : mean_(std::move(mean)),
+      matrix_(std::move(matrix)),
+      inverse_(std::move(inverse)) {
+  if (mean_.size() != matrix_.cols() || inverse_.rows() != matrix_.cols() ||
+      inverse_.cols() != matrix_.rows()) {
+    throw std::invalid_argument(absl::StrFormat(
+        "Mismatched transform of %d mean, %dx%d matrix and %dx%d inverse",
+        mean_.size(), matrix_.rows(), matrix_.cols(), inverse_.rows(),
+        inverse_.cols()));
+  }
+}
+
+void LinearTransform::Apply(const float* input, float* output) const {
+  Eigen::Map<const Eigen::VectorXf> x(input, GetInputDim());
+  Eigen::Map<Eigen::VectorXf> y(output, GetOutputDim());
+  y.noalias() = matrix_ * (x - mean_);
+}
+
+Eigen::MatrixXf LinearTransform::Apply(const Eigen::MatrixXf& data) const {
+  return (data.rowwise() - mean_.transpose()) * matrix_.transpose();
+}
+
+void LinearTransform::Reconstruct(const float* output, float* input) const {
+  Eigen::Map<const Eigen::VectorXf> y(output, GetOutputDim());
+  Eigen::Map<Eigen::VectorXf> x(input, GetInputDim());
+  x.noalias() = mean_ + inverse_ * y;
+}
+
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,64 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_LINEAR_TRANSFORM_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_LINEAR_TRANSFORM_H_
+
+#include "eigen3/Eigen/Dense"
+
+namespace image_retrieval {
+namespace clustering {
+
+/**
+ * An affine map y = A (x - mean) reducing vectors to fewer dimensions, learned
+ * by PCA. The principal components can be whitened to unit variance, and
+ * rotated as in ITQ ("Iterative Quantization: A Procrustean Approach to
+ * Learning Binary Codes" by Gong and Lazebnik), so the signs of the output
+ * make binary codes that lose as little as possible.
+ */
+class LinearTransform {
+ public:
+  struct Options {
+    int output_dim = 256;
+    bool whiten = false;
+    // Learns an ITQ rotation of the components
+    bool rotate = false;
+    int rotation_iterations = 50;
+    unsigned int seed = 0;
+  };
+
+  // Trains on the rows of `data`, which should be at least `output_dim`.
+  static LinearTransform Train(const Eigen::MatrixXf& data,
+                               const Options& options);
+
+  // `matrix` is output_dim x input_dim, and `inverse` the other way round.
+  LinearTransform(Eigen::VectorXf mean, Eigen::MatrixXf matrix,
+                  Eigen::MatrixXf inverse);
+
+  int GetInputDim() const { return matrix_.cols(); }
+
+  int GetOutputDim() const { return matrix_.rows(); }
+
+  // From `GetInputDim()` values of `input` to `GetOutputDim()` of `output`.
+  void Apply(const float* input, float* output) const;
+
+  // Transforms every row of `data`.
+  Eigen::MatrixXf Apply(const Eigen::MatrixXf& data) const;
+
+  // The point of the input space that Apply() maps to `output`, the
+  // projection of the original vector onto the learned subspace.
+  void Reconstruct(const float* output, float* input) const;
+
+  const Eigen::VectorXf& GetMean() const { return mean_; }
+
+  const Eigen::MatrixXf& GetMatrix() const { return matrix_; }
+
+  const Eigen::MatrixXf& GetInverse() const { return inverse_; }
+
+ private:
+  Eigen::VectorXf mean_;
+  Eigen::MatrixXf matrix_;
+  Eigen::MatrixXf inverse_;
+};
+
+}  // namespace clustering
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_LINEAR_TRANSFORM_H_
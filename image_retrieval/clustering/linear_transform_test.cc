@@ -0,0 +1,129 @@
+#include "image_retrieval/clustering/linear_transform.h"
+
+#include <cstdio>
+#include <random>
+#include "gtest/gtest.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+// Points of `dim` dims spanning `rank` of them, plus a little noise.
+Eigen::MatrixXf LowRankData(int n, int dim, int rank) {
+  std::mt19937 random(3);
+  std::normal_distribution<float> normal;
+  auto gaussian = [&]() { return normal(random); };
+  Eigen::MatrixXf basis = Eigen::MatrixXf::NullaryExpr(rank, dim, gaussian);
+  Eigen::MatrixXf weights = Eigen::MatrixXf::NullaryExpr(n, rank, gaussian);
+  Eigen::MatrixXf noise = Eigen::MatrixXf::NullaryExpr(n, dim, gaussian);
+  Eigen::MatrixXf data = weights * basis + 1e-3f * noise;
+  data.rowwise() += Eigen::RowVectorXf::Constant(dim, 5.f);
+  return data;
+}
+
+TEST(LinearTransform, Pca) {
+  const int n = 500, dim = 32, rank = 4;
+  Eigen::MatrixXf data = LowRankData(n, dim, rank);
+  LinearTransform::Options options;
+  options.output_dim = rank;
+  LinearTransform transform = LinearTransform::Train(data, options);
+  EXPECT_EQ(transform.GetInputDim(), dim);
+  EXPECT_EQ(transform.GetOutputDim(), rank);
+
+  // Distances are kept, as the data lies in the subspace
+  Eigen::MatrixXf reduced = transform.Apply(data);
+  for (int i = 1; i < 20; ++i) {
+    EXPECT_NEAR((reduced.row(i) - reduced.row(0)).norm(),
+                (data.row(i) - data.row(0)).norm(), 1e-2f);
+  }
+  // Largest variance first, centered
+  Eigen::RowVectorXf variances =
+      reduced.colwise().squaredNorm() / static_cast<float>(n - 1);
+  for (int j = 1; j < rank; ++j) {
+    EXPECT_GE(variances(j - 1), variances(j));
+  }
+  EXPECT_LT(reduced.colwise().mean().norm(), 1e-2f);
+
+  Eigen::RowVectorXf row = data.row(7);
+  Eigen::VectorXf output(rank), input(dim), again(rank);
+  transform.Apply(row.data(), output.data());
+  EXPECT_LT((output.transpose() - reduced.row(7)).norm(), 1e-3f);
+  transform.Reconstruct(output.data(), input.data());
+  EXPECT_LT((input.transpose() - row).norm(), 1e-2f);
+  transform.Apply(input.data(), again.data());
+  EXPECT_LT((again - output).norm(), 1e-3f);
+}
+
+TEST(LinearTransform, Whiten) {
+  const int n = 500, dim = 16, rank = 3;
+  Eigen::MatrixXf data = LowRankData(n, dim, rank);
+  LinearTransform::Options options;
+  options.output_dim = rank;
+  options.whiten = true;
+  LinearTransform transform = LinearTransform::Train(data, options);
+
+  Eigen::MatrixXf reduced = transform.Apply(data);
+  Eigen::MatrixXf covariance =
+      reduced.transpose() * reduced / static_cast<float>(n - 1);
+  EXPECT_TRUE(covariance.isIdentity(1e-2f)) << covariance;
+
+  Eigen::VectorXf input(dim), again(rank);
+  Eigen::RowVectorXf output = reduced.row(3);
+  transform.Reconstruct(output.data(), input.data());
+  transform.Apply(input.data(), again.data());
+  EXPECT_LT((again.transpose() - output).norm(), 1e-3f);
+}
+
+// Squared distance of the rows of `data` to their signs.
+float QuantizationLoss(const Eigen::MatrixXf& data) {
+  return (data - data.unaryExpr([](float value) {
+                   return value >= 0.f ? 1.f : -1.f;
+                 }))
+      .squaredNorm();
+}
+
+TEST(LinearTransform, Rotate) {
+  const int n = 1000, dim = 32, k = 8;
+  Eigen::MatrixXf data = LowRankData(n, dim, 16);
+  LinearTransform::Options options;
+  options.output_dim = k;
+  options.whiten = true;
+  LinearTransform pca = LinearTransform::Train(data, options);
+  options.rotate = true;
+  LinearTransform itq = LinearTransform::Train(data, options);
+
+  // Only rotated, so distances are the same
+  Eigen::MatrixXf rotated = itq.Apply(data);
+  Eigen::MatrixXf reduced = pca.Apply(data);
+  for (int i = 1; i < 20; ++i) {
+    EXPECT_NEAR((rotated.row(i) - rotated.row(0)).norm(),
+                (reduced.row(i) - reduced.row(0)).norm(), 1e-3f);
+  }
+  EXPECT_LT(QuantizationLoss(rotated), QuantizationLoss(reduced));
+}
+
+TEST(LinearTransform, ReadWrite) {
+  LinearTransform::Options options;
+  options.output_dim = 5;
+  options.rotate = true;
+  LinearTransform transform =
+      LinearTransform::Train(LowRankData(100, 12, 6), options);
+
+  std::string filename = testing::TempDir() + "linear_transform_test.bin";
+  WriteLinearTransform(filename, transform);
+  LinearTransform read = ReadLinearTransform(filename);
+  EXPECT_EQ(read.GetMean(), transform.GetMean());
+  EXPECT_EQ(read.GetMatrix(), transform.GetMatrix());
+  EXPECT_EQ(read.GetInverse(), transform.GetInverse());
+  std::remove(filename.c_str());
+
+  // More dims than the input has
+  options.output_dim = 20;
+  EXPECT_THROW(LinearTransform::Train(LowRankData(100, 12, 6), options),
+               std::invalid_argument);
+}
+
+}  // namespace
+}  // namespace clustering
+}  // namespace image_retrieval
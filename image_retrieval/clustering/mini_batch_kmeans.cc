@@ -0,0 +1,123 @@
+#include "image_retrieval/clustering/mini_batch_kmeans.h"
+
+#include <iostream>
+#include <random>
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "image_retrieval/clustering/kmeans.h"
+
+namespace image_retrieval {
+namespace clustering {
+
+void MiniBatchKMeans::Train(FeatureBatchReader* reader) {
+  Seed(reader);
+
+  int64_t start = absl::ToUnixMicros(absl::Now());
+  Eigen::MatrixXf batch;
+  std::vector<int> membership;
+  std::vector<float> distances;
+  for (int epoch = 0; epoch < options_.max_epoch; ++epoch) {
+    reader->Rewind();
+    int64_t total_count = 0;
+    double inertia = 0.;
+    while (reader->Next(options_.batch_size, &batch)) {
+      Assign(batch, &membership, &distances);
+      for (long i = 0; i < batch.rows(); ++i) {
+        int centroid_index = membership[i];
+        // The learning rate decays per centroid, so each centroid is the
+        // running mean of all the points assigned to it so far.
+        float eta = 1.f / ++counts_[centroid_index];
+        centroids_.row(centroid_index) +=
+            eta * (batch.row(i) - centroids_.row(centroid_index));
+        inertia += distances[i];
+      }
+      total_count += batch.rows();
+    }
+
+    std::cout << absl::StrFormat(
+                     "Epoch %d: %ld points, mean squared distance %.6f, "
+                     "elapsed %.3f(s)",
+                     epoch, total_count,
+                     inertia / std::max<int64_t>(1, total_count),
+                     (absl::ToUnixMicros(absl::Now()) - start) / 1e6)
+              << std::endl;
+  }
+}
+
+void MiniBatchKMeans::Assign(const Eigen::MatrixXf& batch,
+                             std::vector<int>* membership,
+                             std::vector<float>* distances) const {
+  std::vector<float> buffer;
+  if (!distances) {
+    distances = &buffer;
+  }
+  membership->resize(batch.rows());
+  distances->resize(batch.rows());
+  AssignNearest(batch, centroids_, centroids_.rowwise().squaredNorm(),
+                membership->data(), distances->data());
+}
+
+void MiniBatchKMeans::Seed(FeatureBatchReader* reader) {
+  std::mt19937 rng(options_.seed);
+
+  // Reservoir sampling, every point is kept with the same probability
+  int64_t capacity = static_cast<int64_t>(k_) * options_.seed_sample_factor;
+  Eigen::MatrixXf sample;
+  Eigen::MatrixXf batch;
+  int64_t total_count = 0;
+  reader->Rewind();
+  while (reader->Next(options_.batch_size, &batch)) {
+    if (sample.cols() != batch.cols()) {
+      sample.resize(capacity, batch.cols());
+    }
+    for (long i = 0; i < batch.rows(); ++i, ++total_count) {
+      int64_t slot = total_count;
+      if (slot >= capacity) {
+        slot = std::uniform_int_distribution<int64_t>(0, total_count)(rng);
+      }
+      if (slot < capacity) {
+        sample.row(slot) = batch.row(i);
+      }
+    }
+  }
+
+  if (total_count < k_) {
+    throw std::runtime_error(
+        absl::StrFormat("Number of training points (%ld) should be at least as "
+                        "large as number of clusters (%d)",
+                        total_count, k_));
+  }
+  if (total_count < capacity) {
+    sample.conservativeResize(total_count, Eigen::NoChange);
+  }
+
+  // k-means++: every next centroid is drawn with probability proportional to
+  // the squared distance to the nearest centroid chosen so far.
+  centroids_.resize(k_, sample.cols());
+  long first = std::uniform_int_distribution<long>(0, sample.rows() - 1)(rng);
+  centroids_.row(0) = sample.row(first);
+  Eigen::VectorXf min_distances =
+      (sample.rowwise() - centroids_.row(0)).rowwise().squaredNorm();
+  for (int c = 1; c < k_; ++c) {
+    long next;
+    if (min_distances.sum() > 0.f) {
+      std::discrete_distribution<long> distribution(
+          min_distances.data(), min_distances.data() + min_distances.size());
+      next = distribution(rng);
+    } else {
+      // Fewer distinct points than clusters
+      next = std::uniform_int_distribution<long>(0, sample.rows() - 1)(rng);
+    }
+    centroids_.row(c) = sample.row(next);
+    min_distances = min_distances.cwiseMin(
+        (sample.rowwise() - centroids_.row(c)).rowwise().squaredNorm());
+  }
+  counts_.assign(k_, 0);
+
+  std::cout << absl::StrFormat("Seeded %d centroids from %ld of %ld points", k_,
+                               sample.rows(), total_count)
+            << std::endl;
+}
+
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,63 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_MINI_BATCH_KMEANS_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_MINI_BATCH_KMEANS_H_
+
+#include <vector>
+#include "eigen3/Eigen/Dense"
+#include "image_retrieval/clustering/feature_batch_reader.h"
+
+namespace image_retrieval {
+namespace clustering {
+
+/**
+ * Out-of-core k-means (Sculley, "Web-Scale K-Means Clustering"). Centroids
+ * are seeded with k-means++ over a reservoir sample, then updated with
+ * per-centroid learning rates from mini-batches streamed off the reader, so
+ * memory usage only depends on k and the batch size.
+ */
+class MiniBatchKMeans {
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  struct Options {
+    int batch_size = 4096;
+    // Passes over the input after seeding
+    int max_epoch = 5;
+    // Size of the reservoir sample used for seeding, as a multiple of k
+    int seed_sample_factor = 16;
+    unsigned int seed = 0;
+  };
+
+  MiniBatchKMeans(int k, const Options& options) : k_(k), options_(options) {}
+
+  MiniBatchKMeans(const MiniBatchKMeans&) = delete;
+
+  MiniBatchKMeans& operator=(const MiniBatchKMeans&) = delete;
+
+  // Streams over `reader` 1 + max_epoch times, the reader is rewound before
+  // each pass.
+  void Train(FeatureBatchReader* reader);
+
+  // Index of the nearest centroid of every row of `batch`, and the squared
+  // distance to it if `distances` is not null.
+  void Assign(const Eigen::MatrixXf& batch, std::vector<int>* membership,
+              std::vector<float>* distances = nullptr) const;
+
+  const Eigen::MatrixXf& GetCentroids() const { return centroids_; }
+
+ private:
+  void Seed(FeatureBatchReader* reader);
+
+  int k_;
+
+  Options options_;
+
+  Eigen::MatrixXf centroids_;
+
+  // Number of points every centroid has absorbed so far
+  std::vector<int64_t> counts_;
+};
+
+}  // namespace clustering
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CLUSTERING_MINI_BATCH_KMEANS_H_
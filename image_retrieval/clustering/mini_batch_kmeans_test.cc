@@ -0,0 +1,93 @@
+#include "image_retrieval/clustering/mini_batch_kmeans.h"
+
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include "gtest/gtest.h"
+#include "image_retrieval/clustering/kmeans_io.h"
+#include "image_retrieval/feature_extraction/feature.pb.h"
+
+namespace image_retrieval {
+namespace clustering {
+namespace {
+
+using ::image_retrieval::feature_extraction::FeatureRecord;
+
+// Writes `blobs` well separated clusters of `size` points each.
+std::string WriteBlobs(int blobs, int size, int dim) {
+  std::string filename = testing::TempDir() + "mini_batch_kmeans_test.pb";
+  std::ofstream file(filename, std::ios::out | std::ios::binary);
+  for (int i = 0; i < blobs * size; ++i) {
+    FeatureRecord record;
+    record.set_id(std::to_string(i));
+    for (int j = 0; j < dim; ++j) {
+      record.add_value(100.f * (i % blobs) + 0.01f * ((i * 7 + j) % 13));
+    }
+    std::string data = record.SerializeAsString();
+    uint64_t size_bytes = data.size();
+    file.write(reinterpret_cast<const char*>(&size_bytes), sizeof(size_bytes));
+    file.write(data.data(), data.size());
+  }
+  return filename;
+}
+
+TEST(MiniBatchKMeans, SeparatedBlobs) {
+  const int blobs = 3, size = 200, dim = 8;
+  std::string filename = WriteBlobs(blobs, size, dim);
+
+  FeatureBatchReader reader(filename, std::numeric_limits<size_t>::max());
+  MiniBatchKMeans::Options options;
+  options.batch_size = 64;
+  options.max_epoch = 2;
+  MiniBatchKMeans kmeans(blobs, options);
+  kmeans.Train(&reader);
+  EXPECT_EQ(kmeans.GetCentroids().rows(), blobs);
+  EXPECT_EQ(kmeans.GetCentroids().cols(), dim);
+
+  // Every blob should be a cluster of its own
+  reader.Rewind();
+  Eigen::MatrixXf batch;
+  std::vector<std::string> ids;
+  std::vector<int> membership;
+  std::vector<std::set<int>> clusters(blobs);
+  while (reader.Next(50, &batch, &ids)) {
+    kmeans.Assign(batch, &membership);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      clusters[std::stoi(ids[i]) % blobs].insert(membership[i]);
+    }
+  }
+  std::set<int> all;
+  for (const auto& cluster : clusters) {
+    ASSERT_EQ(cluster.size(), 1);
+    all.insert(*cluster.begin());
+  }
+  EXPECT_EQ(all.size(), blobs);
+
+  std::remove(filename.c_str());
+}
+
+TEST(KMeansIO, RoundTrip) {
+  Eigen::MatrixXf centroids(2, 3);
+  centroids << 1, 2, 3, 4, 5, 6;
+  std::string centroids_file = testing::TempDir() + "centroids.bin";
+  WriteCentroids(centroids_file, centroids);
+  EXPECT_EQ(ReadCentroids(centroids_file), centroids);
+
+  std::string membership_file = testing::TempDir() + "membership.bin";
+  MembershipWriter writer(membership_file);
+  writer.Write({"a", 1, 0.5f});
+  writer.Write({"bc", 0, 2.f});
+  writer.Close();
+  std::vector<Membership> memberships = ReadMemberships(membership_file);
+  ASSERT_EQ(memberships.size(), 2);
+  EXPECT_EQ(memberships[1].id, "bc");
+  EXPECT_EQ(memberships[1].cluster, 0);
+  EXPECT_FLOAT_EQ(memberships[0].distance, 0.5f);
+
+  std::remove(centroids_file.c_str());
+  std::remove(membership_file.c_str());
+}
+
+}  // namespace
+}  // namespace clustering
+}  // namespace image_retrieval
@@ -0,0 +1,110 @@
+#include "image_retrieval/concurrency/numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <fstream>
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+
+namespace image_retrieval {
+namespace concurrency {
+namespace {
+
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+}  // namespace
+
+std::vector<int> ParseCpuList(const std::string& cpu_list) {
+  std::vector<int> cpus;
+  for (absl::string_view part :
+       absl::StrSplit(absl::StripAsciiWhitespace(cpu_list), ',',
+                      absl::SkipEmpty())) {
+    std::vector<absl::string_view> range = absl::StrSplit(part, '-');
+    int first = 0, last = 0;
+    if (!absl::SimpleAtoi(range[0], &first)) {
+      return {};
+    }
+    last = first;
+    if (range.size() > 1 && !absl::SimpleAtoi(range[1], &last)) {
+      return {};
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<NumaNode> GetNumaNodes() {
+  std::vector<int> allowed = AllowedCpus();
+  std::vector<bool> is_allowed;
+  for (int cpu : allowed) {
+    if (cpu >= is_allowed.size()) {
+      is_allowed.resize(cpu + 1, false);
+    }
+    is_allowed[cpu] = true;
+  }
+
+  std::vector<NumaNode> nodes;
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string node_list;
+  if (std::getline(online, node_list)) {
+    for (int id : ParseCpuList(node_list)) {
+      std::ifstream file(
+          absl::StrFormat("/sys/devices/system/node/node%d/cpulist", id));
+      std::string cpu_list;
+      if (!std::getline(file, cpu_list)) {
+        continue;
+      }
+
+      NumaNode node{id, {}};
+      for (int cpu : ParseCpuList(cpu_list)) {
+        if (cpu < is_allowed.size() && is_allowed[cpu]) {
+          node.cpus.push_back(cpu);
+        }
+      }
+      if (!node.cpus.empty()) {
+        nodes.push_back(std::move(node));
+      }
+    }
+  }
+
+  if (nodes.empty()) {
+    nodes.push_back(NumaNode{0, std::move(allowed)});
+  }
+  return nodes;
+}
+
+bool PinCurrentThread(const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+}  // namespace concurrency
+}  // namespace image_retrieval
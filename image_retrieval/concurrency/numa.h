@@ -0,0 +1,29 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CONCURRENCY_NUMA_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CONCURRENCY_NUMA_H_
+
+#include <string>
+#include <vector>
+
+namespace image_retrieval {
+namespace concurrency {
+
+struct NumaNode {
+  int id;
+  // Cpus of the node which this process is allowed to run on.
+  std::vector<int> cpus;
+};
+
+// Returns the NUMA nodes which have usable cpus, read from sysfs. Falls back
+// to a single node holding all allowed cpus if the topology is unavailable.
+std::vector<NumaNode> GetNumaNodes();
+
+// Parses a kernel cpu list such as "0-3,8,10-11".
+std::vector<int> ParseCpuList(const std::string& cpu_list);
+
+// Restricts the calling thread to `cpus`, returns false on failure.
+bool PinCurrentThread(const std::vector<int>& cpus);
+
+}  // namespace concurrency
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_CONCURRENCY_NUMA_H_
@@ -0,0 +1,29 @@
+#include "image_retrieval/concurrency/numa.h"
+
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace concurrency {
+namespace {
+
+TEST(Numa, ParseCpuList) {
+  EXPECT_EQ(ParseCpuList("0-3,8,10-11\n"),
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(ParseCpuList("5"), std::vector<int>({5}));
+  EXPECT_TRUE(ParseCpuList("").empty());
+  // Malformed lists give no cpus rather than some of them
+  EXPECT_TRUE(ParseCpuList("0-3,x").empty());
+}
+
+TEST(Numa, GetNumaNodes) {
+  // Every machine has at least one, the fallback included
+  std::vector<NumaNode> nodes = GetNumaNodes();
+  ASSERT_FALSE(nodes.empty());
+  for (const auto& node : nodes) {
+    EXPECT_FALSE(node.cpus.empty());
+  }
+}
+
+}  // namespace
+}  // namespace concurrency
+}  // namespace image_retrieval
@@ -1,5 +1,7 @@
 #include "image_retrieval/concurrency/thread_pool.h"
 
+#include "image_retrieval/concurrency/numa.h"
+
 namespace image_retrieval {
 namespace concurrency {
 
@@ -22,6 +24,10 @@ void ThreadPool::Schedule(std::function<void()> func) {
 }
 
 void ThreadPool::WorkLoop() {
+  if (!cpu_affinity_.empty()) {
+    PinCurrentThread(cpu_affinity_);
+  }
+
   while (true) {
     std::function<void()> func;
     {
@@ -18,7 +18,11 @@ namespace concurrency {
  */
 class ThreadPool {
  public:
-  explicit ThreadPool(int num_threads) {
+  explicit ThreadPool(int num_threads) : ThreadPool(num_threads, {}) {}
+
+  // Workers are pinned to `cpu_affinity` if it is not empty.
+  ThreadPool(int num_threads, const std::vector<int> &cpu_affinity)
+      : cpu_affinity_(cpu_affinity) {
     for (int i = 0; i < num_threads; ++i) {
       threads_.emplace_back(&ThreadPool::WorkLoop, this);
     }
@@ -41,6 +45,7 @@ class ThreadPool {
 
   absl::Mutex mu_;
   std::queue<std::function<void()>> queue_ ABSL_GUARDED_BY(mu_);
+  std::vector<int> cpu_affinity_;
   std::vector<std::thread> threads_;
 };
 
@@ -1,16 +1,43 @@
 #include <fstream>
 #include <iostream>
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
 #include "cmdline/cmdline.h"
 #include "feature_decoder_utils.h"
-#include "image_retrieval/feature_extraction/feature.pb.h"
 #include "google/protobuf/util/json_util.h"
+#include "image_retrieval/feature_extraction/feature.pb.h"
+#include "image_retrieval/feature_extraction/feature_file.h"
 
+using image_retrieval::feature_extraction::FeatureFileOptions;
+using image_retrieval::feature_extraction::FeatureFileReader;
+using image_retrieval::feature_extraction::FeatureFileWriter;
 using image_retrieval::feature_extraction::FeatureRecord;
 using image_retrieval::feature_extraction::ReadRecord;
+using image_retrieval::feature_extraction::SequentialRecordReader;
 
 // 4 M
 size_t BUFFER_SIZE{4 * 1024 * 1024};
 
+void Print(const FeatureRecord& feature_record, size_t ordinal,
+           const std::string& format) {
+  std::string line(40, '-');
+  ::fprintf(stdout, "%s #%06luth record %s\n", line.c_str(), ordinal + 1,
+            line.c_str());
+  if (format == "default") {
+    std::cout << feature_record.DebugString() << std::endl;
+  } else if (format == "json") {
+    std::string output;
+    auto option = google::protobuf::util::JsonOptions();
+    option.add_whitespace = true;
+    option.preserve_proto_field_names = true;
+    google::protobuf::util::MessageToJsonString(feature_record, &output,
+                                                option);
+    std::cout << output << std::endl;
+  } else {
+    assert(false);
+  }
+}
+
 int main(int argc, char* argv[]) {
   std::ios::sync_with_stdio(false);
   cmdline::parser parser;
@@ -21,6 +48,15 @@ int main(int argc, char* argv[]) {
                           cmdline::oneof<std::string>("default", "json"));
   parser.add<size_t>("limit", 'l', "Test limit", false,
                      std::numeric_limits<size_t>::max());
+  parser.add<std::string>(
+      "convert", 'c', "Convert the input into a block-compressed feature file",
+      false, "");
+  parser.add("fp32", 0, "Keep single precision values when converting");
+  parser.add<int>("block_size", 0, "Records per block when converting", false,
+                  1024, cmdline::range(1, 1 << 20));
+  parser.add<std::string>("id", 0, "Print the record with the id", false, "");
+  parser.add<std::string>(
+      "range", 'r', "Print records in [begin, end), as 'begin:end'", false, "");
   parser.add("help", 0, "print this message");
   bool ok = parser.parse(argc, argv);
   if (not ok) {
@@ -31,6 +67,50 @@ int main(int argc, char* argv[]) {
   const auto& filename = parser.get<std::string>("input");
   const auto& format = parser.get<std::string>("format");
   const auto& limit = parser.get<size_t>("limit");
+  const auto& convert = parser.get<std::string>("convert");
+  const auto& id = parser.get<std::string>("id");
+  const auto& range = parser.get<std::string>("range");
+
+  int64_t begin = 0, end = std::numeric_limits<int64_t>::max();
+  if (!range.empty()) {
+    std::vector<std::string> parts = absl::StrSplit(range, ':');
+    if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &begin) ||
+        (!parts[1].empty() && !absl::SimpleAtoi(parts[1], &end))) {
+      std::cerr << "--range should be in the form of 'begin:end'\n";
+      return 1;
+    }
+  }
+
+  if (not filename.empty() and FeatureFileReader::IsFeatureFile(filename) and
+      convert.empty()) {
+    // Random access, without decoding the records in front
+    FeatureFileReader reader(filename);
+    if (not id.empty()) {
+      FeatureRecord feature_record;
+      if (!reader.Find(id, &feature_record)) {
+        std::cerr << id << ": not found\n";
+        return 1;
+      }
+      Print(feature_record, 0, format);
+      return 0;
+    }
+
+    end = std::min(end, reader.GetRecordCount());
+    if (limit < static_cast<size_t>(std::max<int64_t>(end - begin, 0))) {
+      end = begin + limit;
+    }
+    while (begin < end) {
+      std::vector<FeatureRecord> records;
+      reader.ReadRange(begin, std::min<int64_t>(end, begin + 1024), &records);
+      if (records.empty()) {
+        break;
+      }
+      for (const auto& feature_record : records) {
+        Print(feature_record, begin++, format);
+      }
+    }
+    return 0;
+  }
 
   std::ifstream file(filename, std::ios::in | std::ios::binary);
   if (not filename.empty() and not file.good()) {
@@ -39,30 +119,53 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  // Converting may start from either format
+  std::unique_ptr<SequentialRecordReader> reader;
+  if (not filename.empty()) {
+    reader = std::make_unique<SequentialRecordReader>(filename);
+  }
   std::vector<char> buffer(BUFFER_SIZE);
-  for (size_t i = 0; i < limit; ++i) {
-    if (!ReadRecord(filename.empty() ? std::cin : file, buffer)) {
+  auto next = [&](FeatureRecord* feature_record) {
+    if (reader) {
+      return reader->Next(feature_record);
+    }
+    return ReadRecord(std::cin, buffer) &&
+           feature_record->ParseFromArray(buffer.data(), buffer.size());
+  };
+
+  std::unique_ptr<FeatureFileWriter> writer;
+  size_t count = 0;
+  FeatureRecord feature_record;
+  for (int64_t i = 0; count < limit && i < end; ++i) {
+    if (!next(&feature_record)) {
       break;
     }
+    if (i < begin) {
+      continue;
+    }
 
-    FeatureRecord feature_record;
-    feature_record.ParseFromArray(buffer.data(), buffer.size());
+    if (not id.empty() and feature_record.id() != id) {
+      continue;
+    }
+    ++count;
 
-    std::string line(40, '-');
-    ::fprintf(stdout, "%s #%06luth record %s\n", line.c_str(), i + 1,
-              line.c_str());
-    if (format == "default") {
-      std::cout << feature_record.DebugString() << std::endl;
-    } else if (format == "json") {
-      std::string output;
-      auto option = google::protobuf::util::JsonOptions();
-      option.add_whitespace = true;
-      option.preserve_proto_field_names = true;
-      google::protobuf::util::MessageToJsonString(feature_record, &output,
-                                                  option);
-      std::cout << output << std::endl;
+    if (not convert.empty()) {
+      if (!writer) {
+        FeatureFileOptions options;
+        options.fp16 = !parser.exist("fp32");
+        options.block_size = parser.get<int>("block_size");
+        writer = std::make_unique<FeatureFileWriter>(
+            convert, feature_record.value_size(), options);
+      }
+      writer->Write(feature_record);
     } else {
-      assert(false);
+      Print(feature_record, i, format);
     }
   }
+
+  if (writer) {
+    writer->Close();
+    std::cout << "Converted " << count << " records into " << convert
+              << std::endl;
+  }
 }
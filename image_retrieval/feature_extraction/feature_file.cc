@@ -0,0 +1,561 @@
+#include "image_retrieval/feature_extraction/feature_file.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include "absl/strings/str_format.h"
+#include "image_retrieval/feature_extraction/feature_decoder_utils.h"
+
+namespace image_retrieval {
+namespace feature_extraction {
+namespace {
+
+constexpr char kMagic[] = "IRFF";
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kFp16Flag = 1;
+constexpr size_t kHeaderSize = 16;
+constexpr size_t kBlockHeaderSize = 12;
+constexpr size_t kTrailerSize = 12;
+
+// 4 M
+size_t BUFFER_SIZE{4 * 1024 * 1024};
+
+void PutFixed32(std::string* output, uint32_t value) {
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void PutFixed64(std::string* output, uint64_t value) {
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void PutVarint(std::string* output, uint64_t value) {
+  while (value >= 0x80) {
+    output->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
+}
+
+void PutBytes(std::string* output, const std::string& bytes) {
+  PutVarint(output, bytes.size());
+  output->append(bytes);
+}
+
+uint32_t ZigZag(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^ (value >> 31);
+}
+
+int32_t UnZigZag(uint32_t value) {
+  return static_cast<int32_t>((value >> 1) ^ -(value & 1));
+}
+
+// Bounds checked decoding of a byte range, throws on malformed input.
+class Decoder {
+ public:
+  Decoder(const char* data, size_t size, const std::string& filename)
+      : data_(data), end_(data + size), filename_(filename) {}
+
+  uint32_t Fixed32() {
+    uint32_t value;
+    Copy(&value, sizeof(value));
+    return value;
+  }
+
+  uint64_t Fixed64() {
+    uint64_t value;
+    Copy(&value, sizeof(value));
+    return value;
+  }
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      Check(1);
+      uint8_t byte = static_cast<uint8_t>(*data_++);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    throw Corrupted();
+  }
+
+  std::string Bytes() {
+    uint64_t size = Varint();
+    Check(size);
+    std::string bytes(data_, size);
+    data_ += size;
+    return bytes;
+  }
+
+  void Copy(void* output, size_t size) {
+    Check(size);
+    std::memcpy(output, data_, size);
+    data_ += size;
+  }
+
+ private:
+  void Check(size_t size) const {
+    if (size > static_cast<size_t>(end_ - data_)) {
+      throw Corrupted();
+    }
+  }
+
+  std::runtime_error Corrupted() const {
+    return std::runtime_error(
+        absl::StrFormat("%s is truncated or corrupted", filename_));
+  }
+
+  const char* data_;
+  const char* end_;
+  const std::string& filename_;
+};
+
+void PreadFully(int fd, char* buffer, size_t size, uint64_t offset,
+                const std::string& filename) {
+  while (size) {
+    ssize_t bytes = ::pread(fd, buffer, size, offset);
+    if (bytes <= 0) {
+      throw std::runtime_error(
+          absl::StrFormat("Failed to read %s at offset %d", filename, offset));
+    }
+    buffer += bytes;
+    size -= bytes;
+    offset += bytes;
+  }
+}
+
+}  // namespace
+
+uint32_t Crc32c(const char* data, size_t size) {
+  static const auto* table = []() {
+    auto* table = new uint32_t[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+      }
+      table[i] = crc;
+    }
+    return table;
+  }();
+
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < size; ++i) {
+    crc = (crc >> 8) ^ table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff];
+  }
+  return crc ^ 0xffffffff;
+}
+
+uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+
+  if (bits >= 0x7f800000) {
+    // Inf or NaN
+    return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+  }
+  if (bits >= 0x477ff000) {
+    // Rounds to a value beyond the largest half
+    return sign | 0x7c00;
+  }
+  if (bits < 0x38800000) {
+    // Subnormal half, scaling by 2^24 is exact and rounds to nearest even
+    float magnitude;
+    std::memcpy(&magnitude, &bits, sizeof(magnitude));
+    return sign | static_cast<uint16_t>(std::nearbyint(magnitude * 16777216.f));
+  }
+
+  // Round to nearest even, then rebias the exponent from 127 to 15
+  bits += 0xfff + ((bits >> 13) & 1);
+  bits -= 112u << 23;
+  return sign | static_cast<uint16_t>(bits >> 13);
+}
+
+float HalfToFloat(uint16_t value) {
+  uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1f;
+  uint32_t mantissa = value & 0x3ff;
+
+  if (exponent == 0) {
+    float magnitude = mantissa / 16777216.f;
+    return sign ? -magnitude : magnitude;
+  }
+
+  uint32_t bits = exponent == 0x1f
+                      ? sign | 0x7f800000 | (mantissa << 13)
+                      : sign | ((exponent + 112) << 23) | (mantissa << 13);
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+FeatureFileWriter::FeatureFileWriter(const std::string& filename, int dim_size,
+                                     const FeatureFileOptions& options)
+    : file_(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+      dim_size_(dim_size),
+      options_(options),
+      closed_(false),
+      block_count_(0),
+      previous_label_(0),
+      ordinal_(0) {
+  if (!file_.good()) {
+    throw std::runtime_error(
+        absl::StrFormat("Failed to open %s, please investigate and retry!",
+                        filename));
+  }
+
+  std::string header(kMagic, 4);
+  PutFixed32(&header, kVersion);
+  PutFixed32(&header, dim_size_);
+  PutFixed32(&header, options_.fp16 ? kFp16Flag : 0);
+  file_.write(header.data(), header.size());
+}
+
+FeatureFileWriter::~FeatureFileWriter() {
+  if (!closed_) {
+    // Throwing here would terminate, Close() first to handle the failure
+    try {
+      Close();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+}
+
+void FeatureFileWriter::Write(const FeatureRecord& record) {
+  if (record.value_size() != dim_size_) {
+    throw std::runtime_error(absl::StrFormat(
+        "Feature dim size should be equal, while got %d vs %d", dim_size_,
+        record.value_size()));
+  }
+
+  PutBytes(&block_, record.id());
+  PutVarint(&block_, ZigZag(record.label() - previous_label_));
+  previous_label_ = record.label();
+  PutBytes(&block_, record.payload());
+  if (options_.fp16) {
+    for (float value : record.value()) {
+      uint16_t half = FloatToHalf(value);
+      block_.append(reinterpret_cast<const char*>(&half), sizeof(half));
+    }
+  } else {
+    block_.append(reinterpret_cast<const char*>(record.value().data()),
+                  sizeof(float) * dim_size_);
+  }
+
+  ids_.emplace_back(record.id(), ordinal_++);
+  if (++block_count_ >= options_.block_size) {
+    FlushBlock();
+  }
+}
+
+void FeatureFileWriter::FlushBlock() {
+  if (!block_count_) {
+    return;
+  }
+
+  blocks_.push_back({static_cast<uint64_t>(file_.tellp()),
+                     ordinal_ - block_count_, block_count_});
+  std::string header;
+  PutFixed32(&header, block_count_);
+  PutFixed32(&header, block_.size());
+  PutFixed32(&header, Crc32c(block_.data(), block_.size()));
+  file_.write(header.data(), header.size());
+  file_.write(block_.data(), block_.size());
+
+  block_.clear();
+  block_count_ = 0;
+  // Every block decodes on its own
+  previous_label_ = 0;
+}
+
+void FeatureFileWriter::Close() {
+  FlushBlock();
+
+  uint64_t footer_offset = file_.tellp();
+  std::string footer;
+  PutFixed64(&footer, blocks_.size());
+  for (const auto& block : blocks_) {
+    PutFixed64(&footer, block.offset);
+    PutFixed64(&footer, block.first_ordinal);
+    PutFixed32(&footer, block.count);
+  }
+  std::sort(ids_.begin(), ids_.end());
+  PutFixed64(&footer, ids_.size());
+  for (const auto& id : ids_) {
+    PutBytes(&footer, id.first);
+    PutVarint(&footer, id.second);
+  }
+  PutFixed32(&footer, Crc32c(footer.data(), footer.size()));
+  PutFixed64(&footer, footer_offset);
+  footer.append(kMagic, 4);
+  file_.write(footer.data(), footer.size());
+  file_.close();
+
+  closed_ = true;
+  if (file_.fail()) {
+    throw std::runtime_error("Failed to write, is the disk full?");
+  }
+}
+
+FeatureFileReader::FeatureFileReader(const std::string& filename)
+    : filename_(filename), fd_(::open(filename.c_str(), O_RDONLY)) {
+  if (fd_ < 0) {
+    throw std::runtime_error(absl::StrFormat(
+        "%s does not exist, please investigate and retry!", filename));
+  }
+
+  // The destructor does not run for a reader failing to construct
+  try {
+    ReadFooter();
+  } catch (...) {
+    ::close(fd_);
+    throw;
+  }
+}
+
+void FeatureFileReader::ReadFooter() {
+  struct stat st;
+  ::fstat(fd_, &st);
+  uint64_t file_size = st.st_size;
+  if (file_size < kHeaderSize + kTrailerSize) {
+    throw std::runtime_error(
+        absl::StrFormat("%s is not a feature file", filename_));
+  }
+
+  char header[kHeaderSize];
+  PreadFully(fd_, header, kHeaderSize, 0, filename_);
+  Decoder header_decoder(header + 4, kHeaderSize - 4, filename_);
+  if (std::memcmp(header, kMagic, 4) != 0) {
+    throw std::runtime_error(
+        absl::StrFormat("%s is not a feature file", filename_));
+  }
+  uint32_t version = header_decoder.Fixed32();
+  if (version != kVersion) {
+    throw std::runtime_error(
+        absl::StrFormat("Unsupported version %d of %s", version, filename_));
+  }
+  dim_size_ = header_decoder.Fixed32();
+  fp16_ = header_decoder.Fixed32() & kFp16Flag;
+
+  char trailer[kTrailerSize];
+  PreadFully(fd_, trailer, kTrailerSize, file_size - kTrailerSize, filename_);
+  uint64_t footer_offset;
+  std::memcpy(&footer_offset, trailer, sizeof(footer_offset));
+  if (std::memcmp(trailer + 8, kMagic, 4) != 0 ||
+      footer_offset + 4 + kTrailerSize > file_size) {
+    throw std::runtime_error(absl::StrFormat(
+        "%s has no footer, was the writer closed?", filename_));
+  }
+
+  std::string footer(file_size - kTrailerSize - footer_offset, '\0');
+  PreadFully(fd_, &footer[0], footer.size(), footer_offset, filename_);
+  uint32_t crc;
+  std::memcpy(&crc, footer.data() + footer.size() - 4, sizeof(crc));
+  if (crc != Crc32c(footer.data(), footer.size() - 4)) {
+    throw std::runtime_error(
+        absl::StrFormat("Checksum mismatch in the footer of %s", filename_));
+  }
+
+  Decoder decoder(footer.data(), footer.size() - 4, filename_);
+  blocks_.resize(decoder.Fixed64());
+  record_count_ = 0;
+  for (auto& block : blocks_) {
+    block.offset = decoder.Fixed64();
+    block.first_ordinal = decoder.Fixed64();
+    block.count = decoder.Fixed32();
+    record_count_ += block.count;
+  }
+  ids_.resize(decoder.Fixed64());
+  for (auto& id : ids_) {
+    id.first = decoder.Bytes();
+    id.second = decoder.Varint();
+  }
+}
+
+FeatureFileReader::~FeatureFileReader() { ::close(fd_); }
+
+bool FeatureFileReader::IsFeatureFile(const std::string& filename) {
+  std::ifstream file(filename, std::ios::in | std::ios::binary);
+  char magic[4];
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+}
+
+void FeatureFileReader::ReadBlock(size_t block,
+                                  std::vector<FeatureRecord>* records) const {
+  const BlockInfo& info = blocks_.at(block);
+  char header[kBlockHeaderSize];
+  PreadFully(fd_, header, kBlockHeaderSize, info.offset, filename_);
+  Decoder header_decoder(header, kBlockHeaderSize, filename_);
+  uint32_t count = header_decoder.Fixed32();
+  uint32_t size = header_decoder.Fixed32();
+  uint32_t crc = header_decoder.Fixed32();
+
+  std::string data(size, '\0');
+  PreadFully(fd_, &data[0], size, info.offset + kBlockHeaderSize, filename_);
+  if (count != info.count || crc != Crc32c(data.data(), data.size())) {
+    throw std::runtime_error(absl::StrFormat(
+        "Checksum mismatch in block %d of %s", block, filename_));
+  }
+
+  Decoder decoder(data.data(), data.size(), filename_);
+  int32_t label = 0;
+  std::vector<uint16_t> halves(fp16_ ? dim_size_ : 0);
+  for (uint32_t i = 0; i < count; ++i) {
+    records->emplace_back();
+    FeatureRecord* record = &records->back();
+    record->set_id(decoder.Bytes());
+    label += UnZigZag(decoder.Varint());
+    record->set_label(label);
+    std::string payload = decoder.Bytes();
+    if (!payload.empty()) {
+      record->set_payload(std::move(payload));
+    }
+
+    record->mutable_value()->Resize(dim_size_, 0.f);
+    float* values = record->mutable_value()->mutable_data();
+    if (fp16_) {
+      decoder.Copy(halves.data(), sizeof(uint16_t) * dim_size_);
+      for (int j = 0; j < dim_size_; ++j) {
+        values[j] = HalfToFloat(halves[j]);
+      }
+    } else {
+      decoder.Copy(values, sizeof(float) * dim_size_);
+    }
+  }
+}
+
+size_t FeatureFileReader::FindBlock(int64_t ordinal) const {
+  auto it = std::upper_bound(
+      blocks_.begin(), blocks_.end(), ordinal,
+      [](int64_t ordinal, const BlockInfo& block) {
+        return ordinal < static_cast<int64_t>(block.first_ordinal);
+      });
+  return it - blocks_.begin() - 1;
+}
+
+bool FeatureFileReader::Get(int64_t ordinal, FeatureRecord* record) const {
+  if (ordinal < 0 || ordinal >= record_count_) {
+    return false;
+  }
+
+  size_t block = FindBlock(ordinal);
+  std::vector<FeatureRecord> records;
+  ReadBlock(block, &records);
+  record->Swap(&records[ordinal - blocks_[block].first_ordinal]);
+  return true;
+}
+
+bool FeatureFileReader::Find(const std::string& id,
+                             FeatureRecord* record) const {
+  auto it = std::lower_bound(
+      ids_.begin(), ids_.end(), id,
+      [](const std::pair<std::string, uint64_t>& entry,
+         const std::string& id) { return entry.first < id; });
+  if (it == ids_.end() || it->first != id) {
+    return false;
+  }
+  return Get(it->second, record);
+}
+
+void FeatureFileReader::ReadRange(int64_t begin, int64_t end,
+                                  std::vector<FeatureRecord>* records) const {
+  begin = std::max<int64_t>(begin, 0);
+  end = std::min(end, record_count_);
+  if (begin >= end) {
+    return;
+  }
+
+  std::vector<FeatureRecord> block_records;
+  for (size_t block = FindBlock(begin);
+       block < blocks_.size() &&
+       static_cast<int64_t>(blocks_[block].first_ordinal) < end;
+       ++block) {
+    block_records.clear();
+    ReadBlock(block, &block_records);
+    int64_t first = blocks_[block].first_ordinal;
+    for (int64_t i = std::max(begin, first);
+         i < std::min<int64_t>(end, first + block_records.size()); ++i) {
+      records->emplace_back();
+      records->back().Swap(&block_records[i - first]);
+    }
+  }
+}
+
+SequentialRecordReader::SequentialRecordReader(const std::string& filename)
+    : filename_(filename), block_(0), position_(0) {
+  if (FeatureFileReader::IsFeatureFile(filename)) {
+    feature_file_ = std::make_unique<FeatureFileReader>(filename);
+    return;
+  }
+
+  stream_.open(filename, std::ios::in | std::ios::binary);
+  if (!stream_.good()) {
+    throw std::runtime_error(absl::StrFormat(
+        "%s does not exist, please investigate and retry!", filename));
+  }
+  buffer_.resize(BUFFER_SIZE);
+}
+
+bool SequentialRecordReader::Next(FeatureRecord* record) {
+  if (!feature_file_) {
+    if (!ReadRecord(stream_, buffer_)) {
+      return false;
+    }
+    return record->ParseFromArray(buffer_.data(), buffer_.size());
+  }
+
+  while (position_ >= records_.size()) {
+    if (block_ >= feature_file_->GetBlockCount()) {
+      return false;
+    }
+    records_.clear();
+    feature_file_->ReadBlock(block_++, &records_);
+    position_ = 0;
+  }
+  record->Swap(&records_[position_++]);
+  return true;
+}
+
+void SequentialRecordReader::Rewind() {
+  if (feature_file_) {
+    block_ = 0;
+    position_ = 0;
+    records_.clear();
+  } else {
+    stream_.clear();
+    stream_.seekg(0, std::ios::beg);
+  }
+}
+
+int64_t SequentialRecordReader::CountRecords() {
+  if (feature_file_) {
+    return feature_file_->GetRecordCount();
+  }
+
+  std::ifstream file(filename_, std::ios::in | std::ios::binary);
+  file.seekg(0, std::ios::end);
+  const std::streamoff file_size = file.tellg();
+  file.seekg(0, std::ios::beg);
+  int64_t count = 0;
+  uint64_t size = 0;
+  // Seeking past the end does not fail, a truncated last record is not read
+  while (file.read(reinterpret_cast<char*>(&size), sizeof(size)) &&
+         size <= static_cast<uint64_t>(file_size - file.tellg()) &&
+         file.seekg(size, std::ios::cur)) {
+    ++count;
+  }
+  return count;
+}
+
+}  // namespace feature_extraction
+}  // namespace image_retrieval
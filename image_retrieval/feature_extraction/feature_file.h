@@ -0,0 +1,168 @@
+#ifndef IMAGE_RETRIEVAL_FEATURE_EXTRACTION_FEATURE_FILE_H_
+#define IMAGE_RETRIEVAL_FEATURE_EXTRACTION_FEATURE_FILE_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "image_retrieval/feature_extraction/feature.pb.h"
+
+namespace image_retrieval {
+namespace feature_extraction {
+
+// A block-compressed, randomly accessible container of `FeatureRecord`s. All
+// integers are little-endian.
+//
+//   header:  "IRFF" | uint32 version | uint32 dim | uint32 flags
+//   block:   uint32 record count | uint32 size | uint32 crc32c | data
+//            data holds per record: varint id size | id |
+//            zigzag varint label delta | varint payload size | payload |
+//            dim values as fp16 (kFp16) or fp32
+//   footer:  uint64 block count | per block: uint64 offset |
+//            uint64 first ordinal | uint32 record count |
+//            uint64 id count | per id, sorted: varint id size | id |
+//            varint ordinal | uint32 crc32c of the footer
+//   trailer: uint64 footer offset | "IRFF"
+
+struct FeatureFileOptions {
+  // Store values as half precision floats instead of single precision.
+  bool fp16 = true;
+  int block_size = 1024;
+};
+
+class FeatureFileWriter {
+ public:
+  FeatureFileWriter(const std::string& filename, int dim_size,
+                    const FeatureFileOptions& options = FeatureFileOptions());
+
+  FeatureFileWriter(const FeatureFileWriter&) = delete;
+  FeatureFileWriter& operator=(const FeatureFileWriter&) = delete;
+
+  ~FeatureFileWriter();
+
+  void Write(const FeatureRecord& record);
+
+  // Writes the pending block and the footer. Throws std::runtime_error if
+  // the file could not be written, which the destructor only logs.
+  void Close();
+
+ private:
+  struct BlockInfo {
+    uint64_t offset;
+    uint64_t first_ordinal;
+    uint32_t count;
+  };
+
+  void FlushBlock();
+
+  std::ofstream file_;
+  int dim_size_;
+  FeatureFileOptions options_;
+  bool closed_;
+
+  std::string block_;
+  uint32_t block_count_;
+  int32_t previous_label_;
+  uint64_t ordinal_;
+  std::vector<BlockInfo> blocks_;
+  std::vector<std::pair<std::string, uint64_t>> ids_;
+};
+
+/**
+ * Reads records by ordinal, id or block. Blocks are read with pread(), so
+ * several threads may read different blocks of one reader concurrently.
+ */
+class FeatureFileReader {
+ public:
+  explicit FeatureFileReader(const std::string& filename);
+
+  FeatureFileReader(const FeatureFileReader&) = delete;
+  FeatureFileReader& operator=(const FeatureFileReader&) = delete;
+
+  ~FeatureFileReader();
+
+  // Returns true if `filename` starts with the feature file magic.
+  static bool IsFeatureFile(const std::string& filename);
+
+  int GetDimSize() const { return dim_size_; }
+
+  int64_t GetRecordCount() const { return record_count_; }
+
+  size_t GetBlockCount() const { return blocks_.size(); }
+
+  // Appends the records of the `block`-th block to `records`.
+  void ReadBlock(size_t block, std::vector<FeatureRecord>* records) const;
+
+  // Returns false if `ordinal` is out of range.
+  bool Get(int64_t ordinal, FeatureRecord* record) const;
+
+  // Returns false if no record has the id.
+  bool Find(const std::string& id, FeatureRecord* record) const;
+
+  // Appends the records in [begin, end) to `records`.
+  void ReadRange(int64_t begin, int64_t end,
+                 std::vector<FeatureRecord>* records) const;
+
+ private:
+  struct BlockInfo {
+    uint64_t offset;
+    uint64_t first_ordinal;
+    uint32_t count;
+  };
+
+  // Reads the header and the footer, throws if they are not a feature file's.
+  void ReadFooter();
+
+  size_t FindBlock(int64_t ordinal) const;
+
+  std::string filename_;
+  int fd_;
+  int dim_size_;
+  bool fp16_;
+  int64_t record_count_;
+  std::vector<BlockInfo> blocks_;
+  // Sorted by id
+  std::vector<std::pair<std::string, uint64_t>> ids_;
+};
+
+/**
+ * Reads records one by one from either a feature file or a stream of
+ * `<uint64 size><FeatureRecord>` as written by inferencer.py.
+ */
+class SequentialRecordReader {
+ public:
+  explicit SequentialRecordReader(const std::string& filename);
+
+  SequentialRecordReader(const SequentialRecordReader&) = delete;
+  SequentialRecordReader& operator=(const SequentialRecordReader&) = delete;
+
+  bool Next(FeatureRecord* record);
+
+  // Starts over from the first record.
+  void Rewind();
+
+  // Number of records, counted by skipping over a length-prefixed stream.
+  int64_t CountRecords();
+
+ private:
+  std::string filename_;
+  std::unique_ptr<FeatureFileReader> feature_file_;
+  size_t block_;
+  size_t position_;
+  std::vector<FeatureRecord> records_;
+
+  std::ifstream stream_;
+  std::vector<char> buffer_;
+};
+
+uint32_t Crc32c(const char* data, size_t size);
+
+uint16_t FloatToHalf(float value);
+
+float HalfToFloat(uint16_t value);
+
+}  // namespace feature_extraction
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_FEATURE_EXTRACTION_FEATURE_FILE_H_
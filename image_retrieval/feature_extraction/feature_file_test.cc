@@ -0,0 +1,199 @@
+#include "image_retrieval/feature_extraction/feature_file.h"
+
+#include <dirent.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include "absl/strings/str_format.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace feature_extraction {
+namespace {
+
+FeatureRecord MakeRecord(int i, int dim) {
+  FeatureRecord record;
+  record.set_id(absl::StrFormat("img_%d", i));
+  record.set_label(i % 7 - 3);
+  if (i % 2) {
+    record.set_payload(absl::StrFormat("{\"img\": %d}", i));
+  }
+  for (int j = 0; j < dim; ++j) {
+    record.add_value(0.25f * ((i + j) % 9) - 1.f);
+  }
+  return record;
+}
+
+std::string WriteFile(int count, int dim, const FeatureFileOptions& options) {
+  std::string filename = testing::TempDir() + "feature_file_test.irff";
+  FeatureFileWriter writer(filename, dim, options);
+  for (int i = 0; i < count; ++i) {
+    writer.Write(MakeRecord(i, dim));
+  }
+  writer.Close();
+  return filename;
+}
+
+void ExpectEqual(const FeatureRecord& actual, const FeatureRecord& expected) {
+  EXPECT_EQ(actual.id(), expected.id());
+  EXPECT_EQ(actual.label(), expected.label());
+  EXPECT_EQ(actual.payload(), expected.payload());
+  ASSERT_EQ(actual.value_size(), expected.value_size());
+  for (int j = 0; j < actual.value_size(); ++j) {
+    // Multiples of 0.25 are exact in half precision
+    EXPECT_EQ(actual.value(j), expected.value(j));
+  }
+}
+
+TEST(FeatureFile, RoundTrip) {
+  const int count = 100, dim = 16;
+  for (bool fp16 : {true, false}) {
+    FeatureFileOptions options;
+    options.fp16 = fp16;
+    options.block_size = 7;
+    std::string filename = WriteFile(count, dim, options);
+
+    ASSERT_TRUE(FeatureFileReader::IsFeatureFile(filename));
+    FeatureFileReader reader(filename);
+    EXPECT_EQ(reader.GetDimSize(), dim);
+    EXPECT_EQ(reader.GetRecordCount(), count);
+    EXPECT_EQ(reader.GetBlockCount(), (count + 6) / 7);
+
+    SequentialRecordReader sequential(filename);
+    EXPECT_EQ(sequential.CountRecords(), count);
+    FeatureRecord record;
+    for (int i = 0; i < count; ++i) {
+      ASSERT_TRUE(sequential.Next(&record));
+      ExpectEqual(record, MakeRecord(i, dim));
+    }
+    EXPECT_FALSE(sequential.Next(&record));
+    sequential.Rewind();
+    ASSERT_TRUE(sequential.Next(&record));
+    EXPECT_EQ(record.id(), "img_0");
+
+    std::remove(filename.c_str());
+  }
+}
+
+TEST(FeatureFile, TruncatedStream) {
+  // Length-prefixed records, the last of which is cut short
+  const int count = 5, dim = 16;
+  std::string filename = testing::TempDir() + "feature_file_test.pb";
+  {
+    std::ofstream file(filename, std::ios::binary);
+    for (int i = 0; i < count; ++i) {
+      std::string bytes = MakeRecord(i, dim).SerializeAsString();
+      uint64_t size = bytes.size();
+      if (i == count - 1) {
+        bytes.resize(size / 2);
+      }
+      file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+      file.write(bytes.data(), bytes.size());
+    }
+  }
+
+  SequentialRecordReader sequential(filename);
+  EXPECT_EQ(sequential.CountRecords(), count - 1);
+  FeatureRecord record;
+  for (int i = 0; i < count - 1; ++i) {
+    ASSERT_TRUE(sequential.Next(&record));
+  }
+  EXPECT_FALSE(sequential.Next(&record));
+  std::remove(filename.c_str());
+}
+
+TEST(FeatureFile, RandomAccess) {
+  const int count = 50, dim = 4;
+  FeatureFileOptions options;
+  options.block_size = 8;
+  std::string filename = WriteFile(count, dim, options);
+  FeatureFileReader reader(filename);
+
+  FeatureRecord record;
+  ASSERT_TRUE(reader.Get(17, &record));
+  ExpectEqual(record, MakeRecord(17, dim));
+  EXPECT_FALSE(reader.Get(count, &record));
+
+  ASSERT_TRUE(reader.Find("img_42", &record));
+  ExpectEqual(record, MakeRecord(42, dim));
+  EXPECT_FALSE(reader.Find("img_420", &record));
+
+  std::vector<FeatureRecord> records;
+  reader.ReadRange(6, 19, &records);
+  ASSERT_EQ(records.size(), 13);
+  for (size_t i = 0; i < records.size(); ++i) {
+    ExpectEqual(records[i], MakeRecord(6 + i, dim));
+  }
+  records.clear();
+  reader.ReadRange(45, 100, &records);
+  EXPECT_EQ(records.size(), 5);
+
+  std::remove(filename.c_str());
+}
+
+TEST(FeatureFile, DetectsCorruption) {
+  std::string filename = WriteFile(20, 8, FeatureFileOptions());
+  {
+    // Flips a byte inside the values of the first block
+    std::fstream file(filename, std::ios::in | std::ios::out |
+                                    std::ios::binary);
+    file.seekp(40);
+    file.put('\x5a');
+  }
+  FeatureFileReader reader(filename);
+  FeatureRecord record;
+  EXPECT_THROW(reader.Get(0, &record), std::runtime_error);
+
+  std::remove(filename.c_str());
+}
+
+int CountOpenFds() {
+  int count = 0;
+  DIR* dir = opendir("/proc/self/fd");
+  while (readdir(dir)) {
+    ++count;
+  }
+  closedir(dir);
+  return count;
+}
+
+TEST(FeatureFile, FailedOpenClosesFile) {
+  std::string filename = WriteFile(20, 8, FeatureFileOptions());
+  {
+    // Flips a byte of the footer's checksum
+    std::fstream file(filename, std::ios::in | std::ios::out |
+                                    std::ios::binary);
+    file.seekp(-17, std::ios::end);
+    file.put('\x5a');
+  }
+  const int open_fds = CountOpenFds();
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_THROW(FeatureFileReader reader(filename), std::runtime_error);
+  }
+  EXPECT_EQ(CountOpenFds(), open_fds);
+
+  std::remove(filename.c_str());
+}
+
+TEST(FeatureFile, WriterDestroyedOnFullDisk) {
+  // Every write fails, which the destructor logs rather than throws
+  FeatureFileWriter writer("/dev/full", 8);
+  writer.Write(MakeRecord(0, 8));
+}
+
+TEST(FeatureFile, HalfConversion) {
+  for (float value : {0.f, 1.f, -2.5f, 65504.f, 6.1035156e-05f, 1e-7f}) {
+    EXPECT_FLOAT_EQ(HalfToFloat(FloatToHalf(value)),
+                    value == 1e-7f ? 1.1920929e-07f : value);
+  }
+  EXPECT_TRUE(std::isinf(HalfToFloat(FloatToHalf(1e6f))));
+  EXPECT_TRUE(std::isnan(HalfToFloat(FloatToHalf(NAN))));
+  // Round to nearest even
+  EXPECT_EQ(HalfToFloat(FloatToHalf(1.f + 1.f / 2048)), 1.f);
+  EXPECT_NEAR(HalfToFloat(FloatToHalf(0.1f)), 0.1f, 1e-4f);
+}
+
+}  // namespace
+}  // namespace feature_extraction
+}  // namespace image_retrieval
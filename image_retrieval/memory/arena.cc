@@ -0,0 +1,296 @@
+#include "image_retrieval/memory/arena.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include "absl/strings/str_format.h"
+
+// Of <linux/mman.h>, missing from older glibc headers
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace image_retrieval {
+namespace memory {
+namespace {
+
+size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+size_t GetRegularPageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+size_t GetPageSize(const Arena::Options& options) {
+  const size_t huge_page_size = options.huge_page_size;
+  if (huge_page_size == 0) {
+    return GetRegularPageSize();
+  }
+  if ((huge_page_size & (huge_page_size - 1)) != 0 ||
+      huge_page_size < GetRegularPageSize()) {
+    throw std::invalid_argument(
+        absl::StrFormat("Invalid huge page size %d", huge_page_size));
+  }
+  return huge_page_size;
+}
+
+// The options of new arenas, and the live arenas their stats are summed over.
+struct Registry {
+  absl::Mutex mu;
+  Arena::Options options ABSL_GUARDED_BY(mu);
+  std::vector<const Arena*> arenas ABSL_GUARDED_BY(mu);
+};
+
+Registry& GetRegistry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+}  // namespace
+
+Arena::Stats& Arena::Stats::operator+=(const Stats& other) {
+  mapped_bytes += other.mapped_bytes;
+  allocated_bytes += other.allocated_bytes;
+  hugetlb_bytes += other.hugetlb_bytes;
+  transparent_bytes += other.transparent_bytes;
+  locked_bytes += other.locked_bytes;
+  prefaulted_bytes += other.prefaulted_bytes;
+  mappings += other.mappings;
+  allocations += other.allocations;
+  hugetlb_fallbacks += other.hugetlb_fallbacks;
+  lock_failures += other.lock_failures;
+  return *this;
+}
+
+Arena::Arena() : Arena(GetDefaultOptions()) {}
+
+Arena::Arena(const Options& options)
+    : options_(options),
+      page_size_(GetPageSize(options)),
+      chunk_size_(RoundUp(std::max(options.chunk_size, page_size_), page_size_)),
+      max_block_size_(std::max(page_size_, kHugePageSize2M) / 2),
+      chunk_position_(nullptr),
+      chunk_end_(nullptr) {
+  free_blocks_.resize(GetSizeClass(max_block_size_) + 1);
+
+  Registry& registry = GetRegistry();
+  absl::MutexLock l(&registry.mu);
+  registry.arenas.push_back(this);
+}
+
+Arena::~Arena() {
+  {
+    Registry& registry = GetRegistry();
+    absl::MutexLock l(&registry.mu);
+    registry.arenas.erase(
+        std::find(registry.arenas.begin(), registry.arenas.end(), this));
+  }
+
+  absl::MutexLock l(&mu_);
+  for (const auto& kv : large_) {
+    Unmap(kv.second);
+  }
+  for (const auto& chunk : chunks_) {
+    Unmap(chunk);
+  }
+}
+
+void* Arena::Allocate(size_t size) {
+  const int size_class = GetSizeClass(std::max<size_t>(size, 1));
+  absl::MutexLock l(&mu_);
+  if (size_class < 0) {
+    Mapping mapping = Map(RoundUp(size, page_size_));
+    large_[mapping.data] = mapping;
+    stats_.allocated_bytes += mapping.size;
+    ++stats_.allocations;
+    return mapping.data;
+  }
+
+  const size_t block_size = kMinBlockSize << size_class;
+  char* block;
+  auto& free_blocks = free_blocks_[size_class];
+  if (!free_blocks.empty()) {
+    block = free_blocks.back();
+    free_blocks.pop_back();
+  } else {
+    // The rest of a chunk too short for the block is left unused
+    if (chunk_end_ - chunk_position_ < static_cast<ptrdiff_t>(block_size)) {
+      Mapping chunk = Map(chunk_size_);
+      chunks_.push_back(chunk);
+      chunk_position_ = chunk.data;
+      chunk_end_ = chunk.data + chunk.size;
+    }
+    block = chunk_position_;
+    chunk_position_ += block_size;
+  }
+  stats_.allocated_bytes += block_size;
+  ++stats_.allocations;
+  return block;
+}
+
+void Arena::Deallocate(void* data, size_t size) {
+  if (data == nullptr) {
+    return;
+  }
+
+  const int size_class = GetSizeClass(std::max<size_t>(size, 1));
+  absl::MutexLock l(&mu_);
+  --stats_.allocations;
+  if (size_class < 0) {
+    auto it = large_.find(static_cast<char*>(data));
+    if (it == large_.end()) {
+      throw std::invalid_argument(
+          absl::StrFormat("%p of %d bytes was not mapped by the arena", data,
+                          size));
+    }
+    stats_.allocated_bytes -= it->second.size;
+    Unmap(it->second);
+    large_.erase(it);
+    return;
+  }
+
+  stats_.allocated_bytes -= kMinBlockSize << size_class;
+  free_blocks_[size_class].push_back(static_cast<char*>(data));
+}
+
+void* Arena::Reallocate(void* data, size_t old_size, size_t new_size) {
+  if (data == nullptr) {
+    return Allocate(new_size);
+  }
+
+  const int size_class = GetSizeClass(std::max<size_t>(old_size, 1));
+  if (size_class >= 0 &&
+      size_class == GetSizeClass(std::max<size_t>(new_size, 1))) {
+    return data;
+  }
+  void* moved = Allocate(new_size);
+  std::memcpy(moved, data, std::min(old_size, new_size));
+  Deallocate(data, old_size);
+  return moved;
+}
+
+Arena::Stats Arena::GetStats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+void Arena::SetDefaultOptions(const Options& options) {
+  // Fails early on invalid options, rather than at the first index built
+  GetPageSize(options);
+  Registry& registry = GetRegistry();
+  absl::MutexLock l(&registry.mu);
+  registry.options = options;
+}
+
+Arena::Options Arena::GetDefaultOptions() {
+  Registry& registry = GetRegistry();
+  absl::MutexLock l(&registry.mu);
+  return registry.options;
+}
+
+Arena* Arena::Default() {
+  static Arena* arena = new Arena();
+  return arena;
+}
+
+Arena::Stats Arena::GetTotalStats() {
+  Stats total;
+  Registry& registry = GetRegistry();
+  absl::MutexLock l(&registry.mu);
+  for (const Arena* arena : registry.arenas) {
+    total += arena->GetStats();
+  }
+  return total;
+}
+
+Arena::Mapping Arena::Map(size_t size) {
+  Mapping mapping{nullptr, size, false, false, false, false};
+  if (options_.huge_page_size > 0) {
+    // Fails unless enough pages of the size were reserved, e.g. in
+    // /sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                (__builtin_ctzll(options_.huge_page_size) << MAP_HUGE_SHIFT);
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (data != MAP_FAILED) {
+      mapping.data = static_cast<char*>(data);
+      mapping.hugetlb = true;
+    } else {
+      ++stats_.hugetlb_fallbacks;
+    }
+  }
+
+  if (!mapping.data) {
+    // Over-mapped by a page and trimmed, transparent huge pages only back
+    // ranges aligned to their size
+    const size_t extra = options_.huge_page_size > 0 ? page_size_ : 0;
+    void* data = mmap(nullptr, size + extra, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    char* start = static_cast<char*>(data);
+    mapping.data = reinterpret_cast<char*>(
+        RoundUp(reinterpret_cast<uintptr_t>(start), page_size_));
+    const size_t head = mapping.data - start;
+    if (head > 0) {
+      munmap(start, head);
+    }
+    if (extra > head) {
+      munmap(mapping.data + size, extra - head);
+    }
+    if (options_.huge_page_size > 0) {
+      mapping.transparent = madvise(mapping.data, size, MADV_HUGEPAGE) == 0;
+    }
+  }
+
+  if (options_.lock) {
+    // Limited by RLIMIT_MEMLOCK, the pages are merely not pinned beyond it
+    mapping.locked = mlock(mapping.data, size) == 0;
+    stats_.lock_failures += !mapping.locked;
+  }
+  if (options_.prefault && !mapping.locked) {
+    // Locked pages were faulted in already
+    const size_t stride = GetRegularPageSize();
+    for (size_t offset = 0; offset < size; offset += stride) {
+      mapping.data[offset] = 0;
+    }
+  }
+  mapping.prefaulted = options_.prefault || mapping.locked;
+
+  stats_.mapped_bytes += size;
+  stats_.hugetlb_bytes += mapping.hugetlb ? size : 0;
+  stats_.transparent_bytes += mapping.transparent ? size : 0;
+  stats_.locked_bytes += mapping.locked ? size : 0;
+  stats_.prefaulted_bytes += mapping.prefaulted ? size : 0;
+  ++stats_.mappings;
+  return mapping;
+}
+
+void Arena::Unmap(const Mapping& mapping) {
+  munmap(mapping.data, mapping.size);
+  stats_.mapped_bytes -= mapping.size;
+  stats_.hugetlb_bytes -= mapping.hugetlb ? mapping.size : 0;
+  stats_.transparent_bytes -= mapping.transparent ? mapping.size : 0;
+  stats_.locked_bytes -= mapping.locked ? mapping.size : 0;
+  stats_.prefaulted_bytes -= mapping.prefaulted ? mapping.size : 0;
+  --stats_.mappings;
+}
+
+int Arena::GetSizeClass(size_t size) const {
+  if (size > max_block_size_) {
+    return -1;
+  }
+  if (size <= kMinBlockSize) {
+    return 0;
+  }
+  return 64 - __builtin_clzll(size - 1) - __builtin_ctzll(kMinBlockSize);
+}
+
+}  // namespace memory
+}  // namespace image_retrieval
@@ -0,0 +1,196 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_MEMORY_ARENA_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_MEMORY_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "nlohmann/json.hpp"
+
+namespace image_retrieval {
+namespace memory {
+
+constexpr size_t kHugePageSize2M = size_t{1} << 21;
+constexpr size_t kHugePageSize1G = size_t{1} << 30;
+
+/**
+ * Memory of the index storage, mapped from the kernel in huge pages so that
+ * random hops through a large graph or long scans do not miss the TLB at
+ * every 4 KiB page.
+ *
+ * Pages come from the MAP_HUGETLB pool first, and otherwise from regular
+ * mappings aligned to, and advised to become, transparent huge pages.
+ * Allocations of less than half a huge page are carved out of shared chunks
+ * in power of two size classes, and reused once freed. Larger ones, such as
+ * the vectors of a whole bucket or the level 0 block of a graph, are mapped
+ * on their own and unmapped when freed. Everything is unmapped with the arena.
+ */
+class Arena {
+ public:
+  struct Options {
+    // kHugePageSize2M or kHugePageSize1G, 0 for regular pages
+    size_t huge_page_size = kHugePageSize2M;
+    // Pins the pages in memory, so they are never swapped out
+    bool lock = false;
+    // Touches the pages as they are mapped, so the first searches after a
+    // load do not stall on page faults
+    bool prefault = false;
+    // Mapped at once for the small allocations, rounded up to a huge page
+    size_t chunk_size = size_t{64} << 20;
+  };
+
+  struct Stats {
+    // Mapped from the kernel, and handed out of it
+    int64_t mapped_bytes = 0;
+    int64_t allocated_bytes = 0;
+    // Of the mapped bytes, the MAP_HUGETLB ones, and those advised to be
+    // transparent huge pages instead
+    int64_t hugetlb_bytes = 0;
+    int64_t transparent_bytes = 0;
+    int64_t locked_bytes = 0;
+    int64_t prefaulted_bytes = 0;
+    int64_t mappings = 0;
+    int64_t allocations = 0;
+    // Mappings which did not get MAP_HUGETLB pages, or could not be locked
+    int64_t hugetlb_fallbacks = 0;
+    int64_t lock_failures = 0;
+
+    Stats& operator+=(const Stats& other);
+
+    friend void to_json(nlohmann::json& j, const Stats& stats) {
+      j = nlohmann::json{{"mapped_bytes", stats.mapped_bytes},
+                         {"allocated_bytes", stats.allocated_bytes},
+                         {"hugetlb_bytes", stats.hugetlb_bytes},
+                         {"transparent_bytes", stats.transparent_bytes},
+                         {"locked_bytes", stats.locked_bytes},
+                         {"prefaulted_bytes", stats.prefaulted_bytes},
+                         {"mappings", stats.mappings},
+                         {"allocations", stats.allocations},
+                         {"hugetlb_fallbacks", stats.hugetlb_fallbacks},
+                         {"lock_failures", stats.lock_failures}};
+    }
+  };
+
+  // Takes the options of SetDefaultOptions().
+  Arena();
+
+  explicit Arena(const Options& options);
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  ~Arena();
+
+  // Returns 64 bytes aligned memory, throws std::bad_alloc if it cannot be
+  // mapped.
+  void* Allocate(size_t size);
+
+  // `size` is the one `data` was allocated with.
+  void Deallocate(void* data, size_t size);
+
+  // Moves `data` to an allocation of `new_size`, unless both sizes share it.
+  void* Reallocate(void* data, size_t old_size, size_t new_size);
+
+  const Options& GetOptions() const { return options_; }
+
+  Stats GetStats() const;
+
+  // Options of the arenas constructed from now on.
+  static void SetDefaultOptions(const Options& options);
+
+  static Options GetDefaultOptions();
+
+  // The arena of the allocators not given one.
+  static Arena* Default();
+
+  // Summed over every live arena.
+  static Stats GetTotalStats();
+
+ private:
+  static constexpr size_t kMinBlockSize = 64;
+
+  struct Mapping {
+    char* data;
+    size_t size;
+    bool hugetlb;
+    bool transparent;
+    bool locked;
+    bool prefaulted;
+  };
+
+  // Maps `size`, a multiple of `page_size_`, aligned to `page_size_`.
+  Mapping Map(size_t size) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  void Unmap(const Mapping& mapping) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Index of the power of two size class of `size`, or -1 for a mapping of
+  // its own.
+  int GetSizeClass(size_t size) const;
+
+  const Options options_;
+  // The huge page size, or the regular one without huge pages
+  const size_t page_size_;
+  const size_t chunk_size_;
+  // Largest size class
+  const size_t max_block_size_;
+
+  mutable absl::Mutex mu_;
+  // Bump allocated by the small allocations
+  std::vector<Mapping> chunks_ ABSL_GUARDED_BY(mu_);
+  char* chunk_position_ ABSL_GUARDED_BY(mu_);
+  char* chunk_end_ ABSL_GUARDED_BY(mu_);
+  // Freed blocks per size class
+  std::vector<std::vector<char*>> free_blocks_ ABSL_GUARDED_BY(mu_);
+  // Mapped on their own
+  absl::flat_hash_map<char*, Mapping> large_ ABSL_GUARDED_BY(mu_);
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+// An STL allocator drawing from an arena.
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  ArenaAllocator() : arena_(Arena::Default()) {}
+
+  explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.GetArena()) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->Allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* data, size_t n) {
+    arena_->Deallocate(data, n * sizeof(T));
+  }
+
+  Arena* GetArena() const { return arena_; }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return arena_ == other.GetArena();
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return arena_ != other.GetArena();
+  }
+
+ private:
+  Arena* arena_;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}  // namespace memory
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_MEMORY_ARENA_H_
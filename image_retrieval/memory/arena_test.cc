@@ -0,0 +1,155 @@
+#include "image_retrieval/memory/arena.h"
+
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace memory {
+namespace {
+
+Arena::Options RegularPages() {
+  Arena::Options options;
+  options.huge_page_size = 0;
+  options.chunk_size = 1 << 20;
+  return options;
+}
+
+TEST(Arena, SizeClasses) {
+  Arena arena(RegularPages());
+  void* x = arena.Allocate(100);
+  void* y = arena.Allocate(1);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(x) % 64, 0);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(y) % 64, 0);
+  std::memset(x, 1, 100);
+
+  Arena::Stats stats = arena.GetStats();
+  EXPECT_EQ(stats.allocations, 2);
+  EXPECT_EQ(stats.allocated_bytes, 128 + 64);
+  EXPECT_EQ(stats.mappings, 1);
+  EXPECT_EQ(stats.mapped_bytes, 1 << 20);
+
+  // A freed block is handed out again for the same size class
+  arena.Deallocate(x, 100);
+  EXPECT_EQ(arena.Allocate(128), x);
+  EXPECT_NE(arena.Allocate(100), x);
+  EXPECT_EQ(arena.GetStats().allocated_bytes, 128 + 64 + 128);
+}
+
+TEST(Arena, LargeAllocations) {
+  Arena arena(RegularPages());
+  const size_t size = (3 << 20) + 1;
+  char* data = static_cast<char*>(arena.Allocate(size));
+  std::memset(data, 7, size);
+
+  Arena::Stats stats = arena.GetStats();
+  EXPECT_EQ(stats.mappings, 1);
+  EXPECT_GE(stats.allocated_bytes, size);
+  EXPECT_EQ(stats.allocated_bytes, stats.mapped_bytes);
+
+  // Unmapped as soon as freed
+  arena.Deallocate(data, size);
+  stats = arena.GetStats();
+  EXPECT_EQ(stats.mappings, 0);
+  EXPECT_EQ(stats.mapped_bytes, 0);
+  EXPECT_EQ(stats.allocations, 0);
+  EXPECT_THROW(arena.Deallocate(data, size), std::invalid_argument);
+}
+
+TEST(Arena, Reallocate) {
+  Arena arena(RegularPages());
+  std::vector<int> values(1 << 20);
+  std::iota(values.begin(), values.end(), 0);
+
+  void* data = arena.Allocate(100 * sizeof(int));
+  std::memcpy(data, values.data(), 100 * sizeof(int));
+  // Same size class
+  EXPECT_EQ(arena.Reallocate(data, 100 * sizeof(int), 120 * sizeof(int)),
+            data);
+  // From a block to a mapping of its own, and to a larger one
+  data = arena.Reallocate(data, 120 * sizeof(int), 1000000 * sizeof(int));
+  std::memcpy(static_cast<int*>(data) + 100, values.data() + 100,
+              999900 * sizeof(int));
+  data = arena.Reallocate(data, 1000000 * sizeof(int), values.size() * 4);
+  EXPECT_EQ(std::memcmp(data, values.data(), 1000000 * sizeof(int)), 0);
+  EXPECT_EQ(arena.GetStats().allocations, 1);
+  arena.Deallocate(data, values.size() * 4);
+}
+
+TEST(Arena, HugePages) {
+  Arena::Options options;
+  options.huge_page_size = kHugePageSize2M;
+  options.prefault = true;
+  Arena arena(options);
+  char* data = static_cast<char*>(arena.Allocate(5 << 20));
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % kHugePageSize2M, 0);
+  data[(5 << 20) - 1] = 1;
+
+  // Backed by the MAP_HUGETLB pool if pages were reserved, or else advised
+  Arena::Stats stats = arena.GetStats();
+  EXPECT_EQ(stats.mapped_bytes, 6 << 20);
+  EXPECT_EQ(stats.prefaulted_bytes, 6 << 20);
+  if (stats.hugetlb_bytes == 0) {
+    EXPECT_EQ(stats.hugetlb_fallbacks, 1);
+  }
+  EXPECT_LE(stats.hugetlb_bytes + stats.transparent_bytes, 6 << 20);
+  arena.Deallocate(data, 5 << 20);
+}
+
+TEST(Arena, Lock) {
+  Arena::Options options = RegularPages();
+  options.lock = true;
+  Arena arena(options);
+  arena.Allocate(64);
+
+  // Beyond RLIMIT_MEMLOCK the pages are not locked, yet allocated
+  Arena::Stats stats = arena.GetStats();
+  EXPECT_EQ(stats.locked_bytes + stats.lock_failures * (1 << 20), 1 << 20);
+}
+
+TEST(Arena, InvalidHugePageSize) {
+  Arena::Options options;
+  options.huge_page_size = 3 << 20;
+  EXPECT_THROW(Arena arena(options), std::invalid_argument);
+  EXPECT_THROW(Arena::SetDefaultOptions(options), std::invalid_argument);
+}
+
+TEST(Arena, TotalStats) {
+  Arena::Stats before = Arena::GetTotalStats();
+  {
+    Arena x(RegularPages()), y(RegularPages());
+    x.Allocate(64);
+    y.Allocate(2 << 20);
+    Arena::Stats total = Arena::GetTotalStats();
+    EXPECT_EQ(total.allocations, before.allocations + 2);
+    EXPECT_EQ(total.mappings, before.mappings + 2);
+  }
+  EXPECT_EQ(Arena::GetTotalStats().mapped_bytes, before.mapped_bytes);
+}
+
+TEST(ArenaAllocator, Vector) {
+  Arena arena(RegularPages());
+  {
+    ArenaVector<float> values{ArenaAllocator<float>(&arena)};
+    for (int i = 0; i < 1000000; ++i) {
+      values.push_back(i);
+    }
+    EXPECT_EQ(values[999999], 999999.f);
+    EXPECT_EQ(arena.GetStats().allocations, 1);
+
+    // Moves keep the arena along
+    ArenaVector<float> moved = std::move(values);
+    EXPECT_EQ(moved.get_allocator().GetArena(), &arena);
+    ArenaVector<float> copied = moved;
+    EXPECT_EQ(copied.get_allocator().GetArena(), &arena);
+    EXPECT_EQ(arena.GetStats().allocations, 2);
+  }
+  EXPECT_EQ(arena.GetStats().allocations, 0);
+  EXPECT_EQ(arena.GetStats().allocated_bytes, 0);
+}
+
+}  // namespace
+}  // namespace memory
+}  // namespace image_retrieval
@@ -0,0 +1,189 @@
+#include "image_retrieval/profiling/perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace image_retrieval {
+namespace profiling {
+namespace {
+
+constexpr uint64_t CacheEvent(uint64_t cache, uint64_t op, uint64_t result) {
+  return cache | op << 8 | result << 16;
+}
+
+struct Event {
+  uint32_t type;
+  uint64_t config;
+  uint64_t PerfSample::*field;
+};
+
+// The first one leads the group, without it nothing is counted
+const Event kEvents[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &PerfSample::cycles},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+     &PerfSample::instructions},
+    {PERF_TYPE_HW_CACHE,
+     CacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS),
+     &PerfSample::llc_misses},
+    {PERF_TYPE_HW_CACHE,
+     CacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS),
+     &PerfSample::dtlb_misses},
+};
+
+constexpr size_t kNumEvents = sizeof(kEvents) / sizeof(kEvents[0]);
+
+// Counts `event` of the calling thread on any cpu, returns -1 on failure.
+int OpenEvent(const Event& event, int group_fd) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // User space only, which perf_event_paranoid 2 still allows
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, /*pid=*/0, /*cpu=*/-1, group_fd,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+}  // namespace
+
+PerfSample& PerfSample::operator+=(const PerfSample& other) {
+  cycles += other.cycles;
+  instructions += other.instructions;
+  llc_misses += other.llc_misses;
+  dtlb_misses += other.dtlb_misses;
+  time_enabled += other.time_enabled;
+  time_running += other.time_running;
+  return *this;
+}
+
+PerfSample PerfSample::operator-(const PerfSample& other) const {
+  PerfSample difference;
+  difference.cycles = cycles - other.cycles;
+  difference.instructions = instructions - other.instructions;
+  difference.llc_misses = llc_misses - other.llc_misses;
+  difference.dtlb_misses = dtlb_misses - other.dtlb_misses;
+  difference.time_enabled = time_enabled - other.time_enabled;
+  difference.time_running = time_running - other.time_running;
+  return difference;
+}
+
+PerfSample PerfSample::Scaled() const {
+  PerfSample scaled = *this;
+  if (time_running >= time_enabled) {
+    return scaled;
+  }
+  // Never counted, there is nothing to extrapolate from
+  const double scale =
+      time_running ? static_cast<double>(time_enabled) / time_running : 0.;
+  scaled.cycles = static_cast<uint64_t>(cycles * scale);
+  scaled.instructions = static_cast<uint64_t>(instructions * scale);
+  scaled.llc_misses = static_cast<uint64_t>(llc_misses * scale);
+  scaled.dtlb_misses = static_cast<uint64_t>(dtlb_misses * scale);
+  scaled.time_running = time_enabled;
+  return scaled;
+}
+
+PerfCounters::PerfCounters() : leader_(OpenEvent(kEvents[0], -1)) {
+  if (leader_ < 0) {
+    return;
+  }
+  fds_.push_back(leader_);
+  fields_.push_back(kEvents[0].field);
+  // Events the processor does not have are left out of the group
+  for (size_t i = 1; i < kNumEvents; ++i) {
+    int fd = OpenEvent(kEvents[i], leader_);
+    if (fd >= 0) {
+      fds_.push_back(fd);
+      fields_.push_back(kEvents[i].field);
+    }
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds_) {
+    close(fd);
+  }
+}
+
+PerfSample PerfCounters::Read() const {
+  PerfSample sample;
+  if (leader_ < 0) {
+    return sample;
+  }
+
+  // The number of events, the times the group was enabled and running, then
+  // the values in the order they were opened
+  uint64_t values[3 + kNumEvents];
+  ssize_t size = read(leader_, values, sizeof(values));
+  if (size < static_cast<ssize_t>(3 * sizeof(uint64_t)) ||
+      values[0] != fields_.size()) {
+    return sample;
+  }
+  sample.time_enabled = values[1];
+  sample.time_running = values[2];
+  for (size_t i = 0; i < fields_.size(); ++i) {
+    sample.*fields_[i] = values[3 + i];
+  }
+  return sample;
+}
+
+PerfCounters& PerfCounters::ThisThread() {
+  thread_local PerfCounters counters;
+  return counters;
+}
+
+void PerfTotals::Add(const PerfSample& sample) {
+  cycles_ += sample.cycles;
+  instructions_ += sample.instructions;
+  llc_misses_ += sample.llc_misses;
+  dtlb_misses_ += sample.dtlb_misses;
+}
+
+PerfSample PerfTotals::Get() const {
+  PerfSample sample;
+  sample.cycles = cycles_;
+  sample.instructions = instructions_;
+  sample.llc_misses = llc_misses_;
+  sample.dtlb_misses = dtlb_misses_;
+  return sample;
+}
+
+void to_json(nlohmann::json& j, const PerfTotals& totals) {
+  PerfSample sample = totals.Get();
+  j = sample;
+  const int64_t vectors = totals.GetVectors();
+  if (vectors > 0) {
+    j["vectors"] = vectors;
+    j["per_vector"] = {
+        {"cycles", static_cast<double>(sample.cycles) / vectors},
+        {"instructions", static_cast<double>(sample.instructions) / vectors},
+        {"llc_misses", static_cast<double>(sample.llc_misses) / vectors},
+        {"dtlb_misses", static_cast<double>(sample.dtlb_misses) / vectors}};
+  }
+}
+
+ScopedPerfCounters::ScopedPerfCounters(PerfTotals* totals)
+    : totals_(totals), counters_(nullptr) {
+  if (totals_) {
+    counters_ = &PerfCounters::ThisThread();
+    start_ = counters_->Read();
+  }
+}
+
+ScopedPerfCounters::~ScopedPerfCounters() {
+  if (totals_) {
+    totals_->Add((counters_->Read() - start_).Scaled());
+  }
+}
+
+}  // namespace profiling
+}  // namespace image_retrieval
@@ -0,0 +1,116 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_PROFILING_PERF_COUNTERS_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_PROFILING_PERF_COUNTERS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "nlohmann/json.hpp"
+
+namespace image_retrieval {
+namespace profiling {
+
+// Hardware events, 0 for those the processor does not count.
+struct PerfSample {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  // Loads missing the last level cache, and the data TLB
+  uint64_t llc_misses = 0;
+  uint64_t dtlb_misses = 0;
+  // Nanoseconds the group was enabled, and of them counting. The kernel takes
+  // turns at counting the groups when they need more counters than the
+  // processor has.
+  uint64_t time_enabled = 0;
+  uint64_t time_running = 0;
+
+  PerfSample& operator+=(const PerfSample& other);
+
+  PerfSample operator-(const PerfSample& other) const;
+
+  // The events extrapolated to the whole time enabled. Of the difference of
+  // two reads, as the share of time counting changes over the thread's life.
+  PerfSample Scaled() const;
+
+  friend void to_json(nlohmann::json& j, const PerfSample& sample) {
+    j = nlohmann::json{{"cycles", sample.cycles},
+                       {"instructions", sample.instructions},
+                       {"llc_misses", sample.llc_misses},
+                       {"dtlb_misses", sample.dtlb_misses}};
+  }
+};
+
+/**
+ * Counts the hardware events of the calling thread in user space, by
+ * perf_event_open(2). Where the kernel does not allow it, e.g. with
+ * kernel.perf_event_paranoid above 2, in containers without CAP_PERFMON or on
+ * virtual machines without a PMU, the counters are unavailable and every
+ * event reads as 0.
+ */
+class PerfCounters {
+ public:
+  PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  ~PerfCounters();
+
+  bool IsAvailable() const { return leader_ >= 0; }
+
+  // Counted since construction, on the thread which constructed them, not
+  // scaled yet.
+  PerfSample Read() const;
+
+  // Those of the calling thread, opened on the first call.
+  static PerfCounters& ThisThread();
+
+ private:
+  // Of the group read by Read(), the leader first
+  int leader_;
+  std::vector<int> fds_;
+  std::vector<uint64_t PerfSample::*> fields_;
+};
+
+// Events summed over the threads a search ran on, with the number of vectors
+// it compared the query with.
+class PerfTotals {
+ public:
+  void Add(const PerfSample& sample);
+
+  void AddVectors(int64_t count) { vectors_ += count; }
+
+  PerfSample Get() const;
+
+  int64_t GetVectors() const { return vectors_; }
+
+  // With the events per vector, if any was counted.
+  friend void to_json(nlohmann::json& j, const PerfTotals& totals);
+
+ private:
+  std::atomic<uint64_t> cycles_{0};
+  std::atomic<uint64_t> instructions_{0};
+  std::atomic<uint64_t> llc_misses_{0};
+  std::atomic<uint64_t> dtlb_misses_{0};
+  std::atomic<int64_t> vectors_{0};
+};
+
+// Adds the events of the calling thread, from construction to destruction, to
+// `totals` unless it is null.
+class ScopedPerfCounters {
+ public:
+  explicit ScopedPerfCounters(PerfTotals* totals);
+
+  ScopedPerfCounters(const ScopedPerfCounters&) = delete;
+  ScopedPerfCounters& operator=(const ScopedPerfCounters&) = delete;
+
+  ~ScopedPerfCounters();
+
+ private:
+  PerfTotals* totals_;
+  PerfCounters* counters_;
+  PerfSample start_;
+};
+
+}  // namespace profiling
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_PROFILING_PERF_COUNTERS_H_
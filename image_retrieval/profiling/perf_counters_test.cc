@@ -0,0 +1,82 @@
+#include "image_retrieval/profiling/perf_counters.h"
+
+#include <thread>
+#include "benchmark/benchmark.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace profiling {
+namespace {
+
+// Some work for the counters to see.
+void Spin(int iterations) {
+  uint64_t x = 1;
+  for (int i = 0; i < iterations; ++i) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    benchmark::DoNotOptimize(x);
+  }
+}
+
+TEST(PerfCounters, Count) {
+  PerfCounters& counters = PerfCounters::ThisThread();
+  if (!counters.IsAvailable()) {
+    // Nothing counted, yet nothing fails either
+    EXPECT_EQ(counters.Read().cycles, 0);
+    GTEST_SKIP() << "perf_event_open is not allowed here";
+  }
+
+  PerfSample start = counters.Read();
+  Spin(1000000);
+  PerfSample spent = (counters.Read() - start).Scaled();
+  EXPECT_GT(spent.cycles, 0);
+  EXPECT_GE(spent.instructions, 1000000);
+}
+
+TEST(PerfSample, Scaled) {
+  // Counted all the time until the start, then for a quarter of it
+  PerfSample start, end;
+  start.cycles = 1000;
+  start.time_enabled = start.time_running = 1000;
+  end.cycles = 1100;
+  end.time_enabled = 2000;
+  end.time_running = 1250;
+  PerfSample spent = (end - start).Scaled();
+  EXPECT_EQ(spent.cycles, 400);
+  EXPECT_EQ(spent.time_running, spent.time_enabled);
+  EXPECT_EQ(start.Scaled().cycles, 1000);
+
+  PerfSample idle;
+  idle.cycles = 100;
+  idle.time_enabled = 1000;
+  EXPECT_EQ(idle.Scaled().cycles, 0);
+}
+
+TEST(PerfTotals, Threads) {
+  PerfTotals totals;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&totals]() {
+      ScopedPerfCounters counters(&totals);
+      Spin(100000);
+      totals.AddVectors(10);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  // Counters without totals are no-ops
+  { ScopedPerfCounters counters(nullptr); }
+
+  nlohmann::json json = totals;
+  EXPECT_EQ(json.at("vectors"), 40);
+  if (PerfCounters::ThisThread().IsAvailable()) {
+    EXPECT_GE(totals.Get().instructions, 400000);
+    EXPECT_GE(json.at("per_vector").at("instructions").get<double>(), 10000.);
+  } else {
+    EXPECT_EQ(json.at("cycles"), 0);
+  }
+}
+
+}  // namespace
+}  // namespace profiling
+}  // namespace image_retrieval
@@ -0,0 +1,696 @@
+#include "image_retrieval/server/event_server.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+
+namespace image_retrieval {
+namespace server {
+namespace {
+
+// Ids of the epoll events which are not connections
+constexpr uint64_t kListenId = 0;
+constexpr uint64_t kWakeId = 1;
+
+constexpr int kMaxEvents = 256;
+constexpr size_t kReadSize = 64 << 10;
+
+const char* GetStatusText(int status) {
+  switch (status) {
+    case 100:
+      return "Continue";
+    case 200:
+      return "OK";
+    case 202:
+      return "Accepted";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 409:
+      return "Conflict";
+    case 413:
+      return "Payload Too Large";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+  }
+}
+
+std::string Serialize(const HttpResponse& response, bool keep_alive) {
+  std::string bytes = absl::StrFormat(
+      "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+      "Connection: %s\r\n\r\n",
+      response.status, GetStatusText(response.status), response.content_type,
+      response.body.size(), keep_alive ? "keep-alive" : "close");
+  bytes += response.body;
+  return bytes;
+}
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = absl::ascii_tolower(c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Decodes the %XX escapes, others are kept as they are. '+' is not a space
+// in paths.
+std::string DecodePath(absl::string_view path) {
+  std::string decoded;
+  decoded.reserve(path.size());
+  for (size_t i = 0; i < path.size(); ++i) {
+    int high, low;
+    if (path[i] == '%' && i + 2 < path.size() &&
+        (high = HexValue(path[i + 1])) >= 0 &&
+        (low = HexValue(path[i + 2])) >= 0) {
+      decoded += static_cast<char>(high << 4 | low);
+      i += 2;
+    } else {
+      decoded += path[i];
+    }
+  }
+  return decoded;
+}
+
+// The request line and the headers the server looks at.
+struct RequestHead {
+  std::string method;
+  std::string path;
+  uint64_t content_length = 0;
+  bool keep_alive = true;
+  bool expect_continue = false;
+  bool chunked = false;
+};
+
+// Parses the bytes ahead of the blank line, returns false if they are
+// malformed.
+bool ParseHead(absl::string_view bytes, RequestHead* head) {
+  std::vector<absl::string_view> lines = absl::StrSplit(bytes, "\r\n");
+  std::vector<absl::string_view> parts = absl::StrSplit(lines[0], ' ');
+  if (parts.size() != 3 || parts[0].empty() || parts[1].empty() ||
+      !absl::StartsWith(parts[2], "HTTP/1.")) {
+    return false;
+  }
+  head->method = std::string(parts[0]);
+  head->path = DecodePath(parts[1].substr(0, parts[1].find('?')));
+  // Only HTTP/1.1 keeps connections alive by default
+  head->keep_alive = parts[2] != "HTTP/1.0";
+
+  for (size_t i = 1; i < lines.size(); ++i) {
+    size_t colon = lines[i].find(':');
+    if (colon == absl::string_view::npos) {
+      return false;
+    }
+    absl::string_view name = lines[i].substr(0, colon);
+    absl::string_view value =
+        absl::StripAsciiWhitespace(lines[i].substr(colon + 1));
+    if (absl::EqualsIgnoreCase(name, "Content-Length")) {
+      if (!absl::SimpleAtoi(value, &head->content_length)) {
+        return false;
+      }
+    } else if (absl::EqualsIgnoreCase(name, "Connection")) {
+      if (absl::EqualsIgnoreCase(value, "close")) {
+        head->keep_alive = false;
+      } else if (absl::EqualsIgnoreCase(value, "keep-alive")) {
+        head->keep_alive = true;
+      }
+    } else if (absl::EqualsIgnoreCase(name, "Expect")) {
+      head->expect_continue = absl::EqualsIgnoreCase(value, "100-continue");
+    } else if (absl::EqualsIgnoreCase(name, "Transfer-Encoding")) {
+      head->chunked = !absl::EqualsIgnoreCase(value, "identity");
+    }
+  }
+  return true;
+}
+
+struct Connection {
+  uint64_t id;
+  int fd;
+  // Read, and not handed over yet
+  std::string input;
+  // To write, of which `written` bytes are
+  std::string output;
+  size_t written = 0;
+  // One of its requests is with a handler
+  bool handling = false;
+  // Of the request being read
+  bool continue_sent = false;
+  bool peer_closed = false;
+  // Closed once the output is written
+  bool closing = false;
+  // Registered for EPOLLOUT, while the socket does not take the output
+  bool waiting_writable = false;
+  // Left the rest in the socket, with a whole request's worth of input
+  bool paused = false;
+  // Of the last request, response or write progress
+  absl::Time last_active;
+};
+
+}  // namespace
+
+// The connections of an I/O thread, and the responses handed back to them.
+class EventServer::Loop {
+ public:
+  explicit Loop(EventServer* server)
+      : server_(server), next_id_(kWakeId + 1), buffer_(kReadSize) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || event_fd_ < 0) {
+      throw std::runtime_error(absl::StrFormat(
+          "Failed to create an event loop: %s", std::strerror(errno)));
+    }
+    // Every loop accepts, and the kernel wakes only one of them up
+    Add(server_->listen_fd_, EPOLLIN | EPOLLEXCLUSIVE, kListenId);
+    Add(event_fd_, EPOLLIN, kWakeId);
+  }
+
+  Loop(const Loop&) = delete;
+  Loop& operator=(const Loop&) = delete;
+
+  ~Loop() {
+    for (const auto& kv : connections_) {
+      --server_->open_;
+      close(kv.second->fd);
+    }
+    close(event_fd_);
+    close(epoll_fd_);
+  }
+
+  void Run() {
+    std::vector<epoll_event> events(kMaxEvents);
+    // Often enough to close idle connections about on time
+    const int timeout_ms = std::clamp<int64_t>(
+        absl::ToInt64Milliseconds(server_->options_.idle_timeout) / 2, 10,
+        1000);
+    absl::Time last_sweep = absl::Now();
+    while (!server_->stopping_) {
+      int count = epoll_wait(epoll_fd_, events.data(), events.size(),
+                             timeout_ms);
+      for (int i = 0; i < count; ++i) {
+        const uint64_t id = events[i].data.u64;
+        if (id == kListenId) {
+          Accept();
+        } else if (id == kWakeId) {
+          TakeResponses();
+        } else {
+          // May have been closed by an earlier event
+          auto it = connections_.find(id);
+          if (it == connections_.end()) {
+            continue;
+          }
+          Connection* connection = it->second.get();
+          if (events[i].events & EPOLLOUT && !Flush(connection)) {
+            continue;
+          }
+          if (events[i].events & ~EPOLLOUT) {
+            Read(connection);
+          }
+        }
+      }
+
+      absl::Time now = absl::Now();
+      if (now - last_sweep >= absl::Milliseconds(timeout_ms)) {
+        CloseIdle(now);
+        last_sweep = now;
+      }
+    }
+  }
+
+  // Called by the handler threads.
+  void Respond(uint64_t id, std::string response, bool close) {
+    {
+      absl::MutexLock l(&mu_);
+      responses_.push_back({id, std::move(response), close});
+    }
+    Wake();
+  }
+
+  void Wake() {
+    uint64_t one = 1;
+    if (write(event_fd_, &one, sizeof(one)) < 0) {
+      // Already readable, the counter is saturated
+    }
+  }
+
+ private:
+  struct Response {
+    uint64_t id;
+    std::string bytes;
+    bool close;
+  };
+
+  void Add(int fd, uint32_t events, uint64_t id) {
+    epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = id;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+      throw std::runtime_error(absl::StrFormat("Failed to watch fd %d: %s", fd,
+                                               std::strerror(errno)));
+    }
+  }
+
+  // Edge triggered, so a read or write must go on until it would block.
+  void Watch(Connection* connection, bool writable) {
+    epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (writable ? EPOLLOUT : 0);
+    event.data.u64 = connection->id;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->waiting_writable = writable;
+  }
+
+  void Accept() {
+    while (true) {
+      int fd = accept4(server_->listen_fd_, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        return;
+      }
+      if (server_->open_ >= server_->options_.max_connections) {
+        close(fd);
+        ++server_->rejected_;
+        continue;
+      }
+
+      // Responses go out in one write, there is nothing to coalesce
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      auto connection = std::make_unique<Connection>();
+      connection->id = next_id_++;
+      connection->fd = fd;
+      connection->last_active = absl::Now();
+      try {
+        Add(fd, EPOLLIN | EPOLLRDHUP | EPOLLET, connection->id);
+      } catch (const std::exception&) {
+        close(fd);
+        continue;
+      }
+      connections_[connection->id] = std::move(connection);
+      ++server_->accepted_;
+      ++server_->open_;
+    }
+  }
+
+  // Reads until the socket would block, or the input holds the largest
+  // request there can be. The peer is then held back by TCP until the
+  // requests read are handled.
+  void Read(Connection* connection) {
+    const EventServer::Options& options = server_->options_;
+    const size_t max_input =
+        options.max_header_bytes + 4 + options.max_body_bytes;
+    do {
+      connection->paused = false;
+      while (true) {
+        if (connection->input.size() >= max_input) {
+          connection->paused = true;
+          break;
+        }
+        ssize_t size = recv(connection->fd, buffer_.data(), buffer_.size(), 0);
+        if (size > 0) {
+          if (!connection->closing) {
+            connection->input.append(buffer_.data(), size);
+          }
+          continue;
+        }
+        if (size == 0) {
+          // Requests read before are still answered
+          connection->peer_closed = true;
+          break;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        Close(connection);
+        return;
+      }
+      connection->last_active = absl::Now();
+      if (!Advance(connection)) {
+        return;
+      }
+      // Edge triggered, the socket does not tell again about the rest
+    } while (connection->paused && !connection->handling &&
+             !connection->closing);
+  }
+
+  void TakeResponses() {
+    uint64_t count;
+    if (read(event_fd_, &count, sizeof(count)) < 0) {
+      // Woken up by an earlier event, nothing to take
+    }
+    std::vector<Response> responses;
+    {
+      absl::MutexLock l(&mu_);
+      responses.swap(responses_);
+    }
+
+    const absl::Time now = absl::Now();
+    for (auto& response : responses) {
+      auto it = connections_.find(response.id);
+      if (it == connections_.end()) {
+        continue;
+      }
+      Connection* connection = it->second.get();
+      connection->handling = false;
+      connection->output += response.bytes;
+      connection->closing |= response.close;
+      connection->last_active = now;
+      if (connection->paused) {
+        Read(connection);
+      } else {
+        Advance(connection);
+      }
+    }
+  }
+
+  // Hands the next request over once the previous one is answered, writes
+  // what there is to write, and closes the connection once it is done.
+  // Returns false if it was closed.
+  bool Advance(Connection* connection) {
+    Dispatch(connection);
+    if (connection->peer_closed && !connection->handling) {
+      connection->closing = true;
+    }
+    return Flush(connection);
+  }
+
+  void Dispatch(Connection* connection) {
+    const EventServer::Options& options = server_->options_;
+    while (!connection->handling && !connection->closing) {
+      std::string& input = connection->input;
+      size_t end = input.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        if (input.size() > options.max_header_bytes) {
+          Reject(connection, 431);
+        }
+        return;
+      }
+
+      RequestHead head;
+      if (end > options.max_header_bytes) {
+        Reject(connection, 431);
+        return;
+      }
+      if (!ParseHead(absl::string_view(input).substr(0, end), &head)) {
+        Reject(connection, 400);
+        return;
+      }
+      if (head.chunked) {
+        Reject(connection, 501);
+        return;
+      }
+      if (head.content_length > options.max_body_bytes) {
+        Reject(connection, 413);
+        return;
+      }
+      const size_t size = end + 4 + head.content_length;
+      if (input.size() < size) {
+        // E.g. curl waits for it before sending a body over 1 KiB
+        if (head.expect_continue && !connection->continue_sent) {
+          connection->output += "HTTP/1.1 100 Continue\r\n\r\n";
+          connection->continue_sent = true;
+        }
+        return;
+      }
+
+      HttpRequest request;
+      request.method = std::move(head.method);
+      request.path = std::move(head.path);
+      request.body = input.substr(end + 4, head.content_length);
+      request.received = absl::Now();
+      input.erase(0, size);
+      connection->continue_sent = false;
+      ++server_->requests_;
+
+      const bool keep_alive = head.keep_alive;
+      const Handler* handler = server_->Find(request.method, request.path);
+      if (!handler) {
+        ++server_->bad_requests_;
+        HttpResponse response;
+        response.status = 404;
+        response.body = absl::StrFormat("Not found: %s %s\n", request.method,
+                                        request.path);
+        connection->output += Serialize(response, keep_alive);
+        connection->closing = !keep_alive;
+        continue;
+      }
+
+      connection->handling = true;
+      server_->handler_pool_->Schedule(
+          [this, id = connection->id, handler, keep_alive,
+           request = std::move(request)]() {
+            HttpResponse response;
+            try {
+              (*handler)(request, response);
+            } catch (const std::exception& e) {
+              response = HttpResponse();
+              response.status = 500;
+              response.body = absl::StrFormat("Internal error: %s\n", e.what());
+            }
+            Respond(id, Serialize(response, keep_alive), !keep_alive);
+          });
+    }
+  }
+
+  // Answers with `status` and closes the connection, whose further bytes
+  // cannot be told apart from the bad request.
+  void Reject(Connection* connection, int status) {
+    ++server_->bad_requests_;
+    HttpResponse response;
+    response.status = status;
+    response.body = absl::StrFormat("%s\n", GetStatusText(status));
+    connection->output += Serialize(response, /*keep_alive=*/false);
+    connection->input.clear();
+    connection->closing = true;
+  }
+
+  // Returns false if the connection was closed.
+  bool Flush(Connection* connection) {
+    std::string& output = connection->output;
+    while (connection->written < output.size()) {
+      ssize_t size =
+          send(connection->fd, output.data() + connection->written,
+               output.size() - connection->written, MSG_NOSIGNAL);
+      if (size >= 0) {
+        connection->written += size;
+        connection->last_active = absl::Now();
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!connection->waiting_writable) {
+          Watch(connection, /*writable=*/true);
+        }
+        return true;
+      }
+      Close(connection);
+      return false;
+    }
+
+    output.clear();
+    connection->written = 0;
+    if (connection->waiting_writable) {
+      Watch(connection, /*writable=*/false);
+    }
+    if (connection->closing && !connection->handling) {
+      Close(connection);
+      return false;
+    }
+    return true;
+  }
+
+  void Close(Connection* connection) {
+    // Counted off before the peer can tell
+    --server_->open_;
+    close(connection->fd);
+    connections_.erase(connection->id);
+  }
+
+  // Closes the connections without a request, and those not taking their
+  // responses, for the idle timeout.
+  void CloseIdle(absl::Time now) {
+    std::vector<Connection*> idle;
+    for (const auto& kv : connections_) {
+      Connection* connection = kv.second.get();
+      if ((!connection->handling || !connection->output.empty()) &&
+          now - connection->last_active >= server_->options_.idle_timeout) {
+        idle.push_back(connection);
+      }
+    }
+    for (Connection* connection : idle) {
+      Close(connection);
+    }
+  }
+
+  EventServer* server_;
+  int epoll_fd_;
+  int event_fd_;
+  uint64_t next_id_;
+  std::vector<char> buffer_;
+  absl::flat_hash_map<uint64_t, std::unique_ptr<Connection>> connections_;
+
+  absl::Mutex mu_;
+  std::vector<Response> responses_ ABSL_GUARDED_BY(mu_);
+};
+
+EventServer::EventServer(const Options& options)
+    : options_(options),
+      listen_fd_(-1),
+      stopping_(false),
+      accepted_(0),
+      rejected_(0),
+      open_(0),
+      requests_(0),
+      bad_requests_(0) {}
+
+EventServer::~EventServer() { Stop(); }
+
+void EventServer::Handle(const std::string& method, const std::string& pattern,
+                         Handler handler) {
+  routes_.push_back({method, std::regex(pattern), std::move(handler)});
+}
+
+const EventServer::Handler* EventServer::Find(const std::string& method,
+                                              const std::string& path) const {
+  for (const auto& route : routes_) {
+    if (route.method == method && std::regex_match(path, route.pattern)) {
+      return &route.handler;
+    }
+  }
+  return nullptr;
+}
+
+int EventServer::Listen(const std::string& host, int port) {
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addresses = nullptr;
+  int error = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                          std::to_string(port).c_str(), &hints, &addresses);
+  if (error != 0) {
+    throw std::runtime_error(absl::StrFormat("Failed to resolve %s: %s", host,
+                                             gai_strerror(error)));
+  }
+
+  int fd = -1;
+  error = 0;
+  for (addrinfo* address = addresses; address; address = address->ai_next) {
+    fd = socket(address->ai_family,
+                address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                address->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 &&
+        listen(fd, SOMAXCONN) == 0) {
+      break;
+    }
+    error = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    throw std::runtime_error(absl::StrFormat(
+        "Failed to listen on %s:%d: %s", host, port, std::strerror(error)));
+  }
+  listen_fd_ = fd;
+
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+  return ntohs(address.ss_family == AF_INET6
+                   ? reinterpret_cast<sockaddr_in6*>(&address)->sin6_port
+                   : reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+}
+
+void EventServer::Start() {
+  if (listen_fd_ < 0) {
+    throw std::runtime_error("Listen() before starting the server");
+  }
+  handler_pool_ = std::make_unique<concurrency::ThreadPool>(
+      std::max(1, options_.handler_threads));
+  for (int i = 0; i < std::max(1, options_.io_threads); ++i) {
+    loops_.push_back(std::make_unique<Loop>(this));
+  }
+  for (auto& loop : loops_) {
+    threads_.emplace_back(&Loop::Run, loop.get());
+  }
+}
+
+void EventServer::Wait() { stopped_.WaitForNotification(); }
+
+void EventServer::Stop() {
+  if (stopping_.exchange(true)) {
+    return;
+  }
+  for (auto& loop : loops_) {
+    loop->Wake();
+  }
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+  // Handlers still running hand their responses to loops no longer writing
+  handler_pool_.reset();
+  loops_.clear();
+  threads_.clear();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+  }
+  stopped_.Notify();
+}
+
+EventServer::Stats EventServer::GetStats() const {
+  Stats stats;
+  stats.accepted = accepted_;
+  stats.rejected = rejected_;
+  stats.open = open_;
+  stats.requests = requests_;
+  stats.bad_requests = bad_requests_;
+  return stats;
+}
+
+}  // namespace server
+}  // namespace image_retrieval
@@ -0,0 +1,144 @@
+#ifndef IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_SERVER_EVENT_SERVER_H_
+#define IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_SERVER_EVENT_SERVER_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "image_retrieval/concurrency/thread_pool.h"
+#include "nlohmann/json.hpp"
+
+namespace image_retrieval {
+namespace server {
+
+struct HttpRequest {
+  std::string method;
+  // Without the query string, and percent-decoded
+  std::string path;
+  std::string body;
+  // When the whole request had been read
+  absl::Time received;
+};
+
+struct HttpResponse {
+  int status = 200;
+  std::string content_type = "text/plain";
+  std::string body;
+};
+
+/**
+ * An HTTP/1.1 server on non-blocking sockets. A few I/O threads, each with an
+ * epoll set of its own, accept connections and parse their requests, and hand
+ * them over to a pool of handler threads. Responses go back to the I/O thread
+ * of their connection through an eventfd, which writes them as fast as the
+ * socket takes them. Idle keep-alive connections hold no thread, so the number
+ * of connections scales apart from the number of requests being handled.
+ *
+ * A connection has one request handled at a time, those pipelined behind it
+ * are answered in order once it is.
+ */
+class EventServer {
+ public:
+  struct Options {
+    int io_threads = 2;
+    int handler_threads = 8;
+    // Connections accepted past it are closed right away
+    int max_connections = 65536;
+    // Larger requests are answered with 431 and 413. Pipelined requests are
+    // read ahead up to both.
+    size_t max_header_bytes = 64 << 10;
+    size_t max_body_bytes = 64 << 20;
+    // Connections without a request, or not taking their responses, for that
+    // long are closed
+    absl::Duration idle_timeout = absl::Seconds(60);
+  };
+
+  struct Stats {
+    int64_t accepted = 0;
+    int64_t rejected = 0;
+    int64_t open = 0;
+    int64_t requests = 0;
+    // Malformed, too large or not routed
+    int64_t bad_requests = 0;
+
+    friend void to_json(nlohmann::json& j, const Stats& stats) {
+      j = nlohmann::json{{"accepted", stats.accepted},
+                         {"rejected", stats.rejected},
+                         {"open", stats.open},
+                         {"requests", stats.requests},
+                         {"bad_requests", stats.bad_requests}};
+    }
+  };
+
+  // Runs on a handler thread. Exceptions are answered with 500.
+  using Handler = std::function<void(const HttpRequest&, HttpResponse&)>;
+
+  explicit EventServer(const Options& options);
+
+  EventServer(const EventServer&) = delete;
+  EventServer& operator=(const EventServer&) = delete;
+
+  ~EventServer();
+
+  // Routes the requests of `method` whose whole path matches the regular
+  // expression `pattern` to `handler`, the first matching route wins. Others
+  // are answered with 404. Must be called before Start().
+  void Handle(const std::string& method, const std::string& pattern,
+              Handler handler);
+
+  // Binds to `host`:`port`, any free port if it is 0, and returns the port.
+  // Throws std::runtime_error on failure.
+  int Listen(const std::string& host, int port);
+
+  // Starts the I/O threads serving the port listened on.
+  void Start();
+
+  // Blocks until Stop() is called.
+  void Wait();
+
+  // Waits for the requests being handled, then closes every connection
+  // without writing their responses.
+  void Stop();
+
+  Stats GetStats() const;
+
+ private:
+  class Loop;
+
+  struct Route {
+    std::string method;
+    std::regex pattern;
+    Handler handler;
+  };
+
+  // Of the routes, null if none matches.
+  const Handler* Find(const std::string& method,
+                      const std::string& path) const;
+
+  Options options_;
+  std::vector<Route> routes_;
+  int listen_fd_;
+
+  std::atomic_bool stopping_;
+  absl::Notification stopped_;
+  std::atomic<int64_t> accepted_;
+  std::atomic<int64_t> rejected_;
+  std::atomic<int64_t> open_;
+  std::atomic<int64_t> requests_;
+  std::atomic<int64_t> bad_requests_;
+
+  // Declared ahead of the handlers, which hand their responses to them
+  std::vector<std::unique_ptr<Loop>> loops_;
+  std::vector<std::thread> threads_;
+  std::unique_ptr<concurrency::ThreadPool> handler_pool_;
+};
+
+}  // namespace server
+}  // namespace image_retrieval
+
+#endif  // IMAGE_RETRIEVAL_IMAGE_RETRIEVAL_SERVER_EVENT_SERVER_H_
@@ -0,0 +1,409 @@
+#include "image_retrieval/server/event_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "gtest/gtest.h"
+
+namespace image_retrieval {
+namespace server {
+namespace {
+
+// A blocking client connection.
+class Client {
+ public:
+  explicit Client(int port) : fd_(socket(AF_INET, SOCK_STREAM, 0)) {
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) <
+        0) {
+      throw std::runtime_error(std::strerror(errno));
+    }
+  }
+
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  ~Client() { close(fd_); }
+
+  void Send(const std::string& bytes) {
+    size_t sent = 0;
+    while (sent < bytes.size()) {
+      ssize_t size = send(fd_, bytes.data() + sent, bytes.size() - sent,
+                          MSG_NOSIGNAL);
+      ASSERT_GT(size, 0);
+      sent += size;
+    }
+  }
+
+  // Sends `bytes` over and over, up to `limit` bytes, until the socket has
+  // not taken any for 100ms. Returns the bytes sent.
+  size_t SendUntilBlocked(const std::string& bytes, size_t limit) {
+    size_t sent = 0;
+    absl::Time blocked = absl::InfiniteFuture();
+    while (sent < limit && absl::Now() - blocked < absl::Milliseconds(100)) {
+      size_t at = sent % bytes.size();
+      ssize_t size = send(fd_, bytes.data() + at, bytes.size() - at,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (size > 0) {
+        sent += size;
+        blocked = absl::InfiniteFuture();
+      } else if (blocked == absl::InfiniteFuture()) {
+        blocked = absl::Now();
+      } else {
+        absl::SleepFor(absl::Milliseconds(1));
+      }
+    }
+    return sent;
+  }
+
+  void Post(const std::string& path, const std::string& body) {
+    Send(absl::StrFormat("POST %s HTTP/1.1\r\nHost: test\r\n"
+                         "Content-Length: %d\r\n\r\n%s",
+                         path, body.size(), body));
+  }
+
+  // The status line and the headers, then the body. Empty if the server
+  // closed the connection first.
+  std::pair<std::string, std::string> Receive() {
+    size_t end;
+    while ((end = buffer_.find("\r\n\r\n")) == std::string::npos) {
+      if (!Fill()) {
+        return {};
+      }
+    }
+    std::string head = buffer_.substr(0, end);
+    size_t length = 0;
+    size_t at = head.find("Content-Length: ");
+    if (at != std::string::npos) {
+      absl::SimpleAtoi(head.substr(at + 16, head.find("\r\n", at) - at - 16),
+                       &length);
+    }
+    while (buffer_.size() < end + 4 + length) {
+      if (!Fill()) {
+        return {};
+      }
+    }
+    std::string body = buffer_.substr(end + 4, length);
+    buffer_.erase(0, end + 4 + length);
+    return {head, body};
+  }
+
+  // Whether the server closed the connection, after everything it sent.
+  bool IsClosed() {
+    while (Fill()) {
+    }
+    return true;
+  }
+
+ private:
+  bool Fill() {
+    char bytes[4096];
+    ssize_t size = recv(fd_, bytes, sizeof(bytes), 0);
+    if (size <= 0) {
+      return false;
+    }
+    buffer_.append(bytes, size);
+    return true;
+  }
+
+  int fd_;
+  std::string buffer_;
+};
+
+EventServer::Options GetOptions() {
+  EventServer::Options options;
+  options.io_threads = 2;
+  options.handler_threads = 4;
+  return options;
+}
+
+// Answers POST /echo/<n> with the body, after <n> milliseconds.
+void AddEcho(EventServer* server) {
+  server->Handle("POST", "/echo/(\\d+)",
+                 [](const HttpRequest& request, HttpResponse& response) {
+                   int ms = 0;
+                   absl::SimpleAtoi(request.path.substr(6), &ms);
+                   absl::SleepFor(absl::Milliseconds(ms));
+                   response.content_type = "application/octet-stream";
+                   response.body = request.body;
+                 });
+}
+
+TEST(EventServer, KeepAlive) {
+  EventServer server(GetOptions());
+  AddEcho(&server);
+  server.Handle("GET", "/fail", [](const HttpRequest&, HttpResponse&) {
+    throw std::runtime_error("failed");
+  });
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  Client client(port);
+  for (int i = 0; i < 3; ++i) {
+    client.Post("/echo/0", absl::StrCat("hello ", i));
+    auto response = client.Receive();
+    EXPECT_TRUE(absl::StartsWith(response.first, "HTTP/1.1 200 OK"));
+    EXPECT_TRUE(absl::StrContains(response.first, "Connection: keep-alive"));
+    EXPECT_TRUE(absl::StrContains(response.first,
+                                  "Content-Type: application/octet-stream"));
+    EXPECT_EQ(response.second, absl::StrCat("hello ", i));
+  }
+
+  // Neither closes the connection
+  client.Send("GET /missing?x=1 HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(absl::StartsWith(client.Receive().first, "HTTP/1.1 404"));
+  client.Send("GET /fail HTTP/1.1\r\n\r\n");
+  auto failed = client.Receive();
+  EXPECT_TRUE(absl::StartsWith(failed.first, "HTTP/1.1 500"));
+  EXPECT_TRUE(absl::StrContains(failed.second, "failed"));
+
+  client.Send("POST /echo/0 HTTP/1.1\r\nConnection: close\r\n"
+              "Content-Length: 3\r\n\r\nbye");
+  auto last = client.Receive();
+  EXPECT_TRUE(absl::StrContains(last.first, "Connection: close"));
+  EXPECT_EQ(last.second, "bye");
+  EXPECT_TRUE(client.IsClosed());
+
+  EventServer::Stats stats = server.GetStats();
+  EXPECT_EQ(stats.accepted, 1);
+  EXPECT_EQ(stats.requests, 6);
+  EXPECT_EQ(stats.bad_requests, 1);
+}
+
+TEST(EventServer, Pipelined) {
+  EventServer server(GetOptions());
+  AddEcho(&server);
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  // Answered in order, though the first takes the longest
+  Client client(port);
+  std::string requests;
+  for (int i = 0; i < 3; ++i) {
+    requests += absl::StrFormat(
+        "POST /echo/%d HTTP/1.1\r\nContent-Length: 1\r\n\r\n%d", 60 - 30 * i,
+        i);
+  }
+  client.Send(requests);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(client.Receive().second, absl::StrCat(i));
+  }
+}
+
+TEST(EventServer, SplitRequests) {
+  EventServer server(GetOptions());
+  AddEcho(&server);
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  Client client(port);
+  std::string body(1 << 20, 'x');
+  std::string request = absl::StrFormat(
+      "POST /echo/0 HTTP/1.1\r\nExpect: 100-continue\r\n"
+      "Content-Length: %d\r\n\r\n",
+      body.size());
+  for (char c : request) {
+    client.Send(std::string(1, c));
+  }
+  EXPECT_TRUE(absl::StartsWith(client.Receive().first, "HTTP/1.1 100"));
+  client.Send(body.substr(0, 1000));
+  absl::SleepFor(absl::Milliseconds(10));
+  client.Send(body.substr(1000));
+  EXPECT_EQ(client.Receive().second, body);
+}
+
+TEST(EventServer, BadRequests) {
+  EventServer::Options options = GetOptions();
+  options.max_header_bytes = 1024;
+  options.max_body_bytes = 1024;
+  EventServer server(options);
+  AddEcho(&server);
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  const std::pair<std::string, std::string> cases[] = {
+      {"GARBAGE\r\n\r\n", "400"},
+      {"POST /echo/0 HTTP/1.1\r\nContent-Length: x\r\n\r\n", "400"},
+      {"POST /echo/0 HTTP/1.1\r\nContent-Length: 2048\r\n\r\n", "413"},
+      {"POST /echo/0 HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", "501"},
+      {absl::StrCat("GET /", std::string(2048, 'a')), "431"},
+  };
+  for (const auto& c : cases) {
+    Client client(port);
+    client.Send(c.first);
+    auto response = client.Receive();
+    EXPECT_TRUE(absl::StartsWith(response.first, "HTTP/1.1 " + c.second))
+        << response.first;
+    EXPECT_TRUE(client.IsClosed());
+  }
+  EXPECT_EQ(server.GetStats().bad_requests, 5);
+}
+
+TEST(EventServer, IdleTimeout) {
+  EventServer::Options options = GetOptions();
+  options.idle_timeout = absl::Milliseconds(100);
+  EventServer server(options);
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  Client client(port);
+  absl::Time start = absl::Now();
+  EXPECT_TRUE(client.IsClosed());
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(90));
+  EXPECT_EQ(server.GetStats().open, 0);
+}
+
+TEST(EventServer, StalledWrite) {
+  EventServer::Options options = GetOptions();
+  options.idle_timeout = absl::Milliseconds(100);
+  EventServer server(options);
+  server.Handle("GET", "/large",
+                [](const HttpRequest&, HttpResponse& response) {
+                  response.body.assign(64 << 20, 'x');
+                });
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  // Never reads the response, which the socket cannot take all of
+  Client client(port);
+  client.Send("GET /large HTTP/1.1\r\n\r\n");
+  absl::Time deadline = absl::Now() + absl::Seconds(5);
+  while (server.GetStats().requests == 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  while (server.GetStats().open > 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_EQ(server.GetStats().open, 0);
+}
+
+// Requests pipelined behind one being handled are read ahead only up to the
+// largest request, then left to TCP to hold back.
+TEST(EventServer, ReadAheadLimit) {
+  EventServer::Options options = GetOptions();
+  options.max_header_bytes = 1024;
+  options.max_body_bytes = 1024;
+  EventServer server(options);
+  absl::Notification unblock;
+  server.Handle("GET", "/block", [&](const HttpRequest&, HttpResponse&) {
+    unblock.WaitForNotification();
+  });
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  Client client(port);
+  client.Send("GET /block HTTP/1.1\r\n\r\n");
+  const std::string missing = "GET /missing HTTP/1.1\r\n\r\n";
+  const size_t limit = 64 << 20;
+  size_t sent = client.SendUntilBlocked(missing, limit);
+  unblock.Notify();
+  EXPECT_LT(sent, limit);
+
+  // Read on once the first one is answered
+  EXPECT_TRUE(absl::StartsWith(client.Receive().first, "HTTP/1.1 200"));
+  const size_t count = std::min<size_t>(sent / missing.size(), 10000);
+  for (size_t i = 0; i < count; ++i) {
+    auto response = client.Receive();
+    ASSERT_TRUE(absl::StartsWith(response.first, "HTTP/1.1 404")) << i;
+  }
+}
+
+TEST(EventServer, DecodedPath) {
+  EventServer server(GetOptions());
+  server.Handle("GET", "/record/(.+)",
+                [](const HttpRequest& request, HttpResponse& response) {
+                  response.body = request.path;
+                });
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  // As encoded by the shard coordinator, bad escapes are kept
+  Client client(port);
+  client.Send(
+      "GET /record/dir%2Fa%3Fb%23c%252F%20d+e%zz%4?x=%41 HTTP/1.1\r\n\r\n");
+  EXPECT_EQ(client.Receive().second, "/record/dir/a?b#c%2F d+e%zz%4");
+}
+
+// Many more connections than threads of either kind, every one of them kept
+// alive over several requests.
+TEST(EventServer, Load) {
+  EventServer server(GetOptions());
+  std::atomic<int> handling(0);
+  std::atomic<int> max_handling(0);
+  server.Handle("POST", "/search",
+                [&](const HttpRequest& request, HttpResponse& response) {
+                  int now = ++handling;
+                  int max = max_handling;
+                  while (now > max &&
+                         !max_handling.compare_exchange_weak(max, now)) {
+                  }
+                  absl::SleepFor(absl::Microseconds(100));
+                  response.body = request.body;
+                  --handling;
+                });
+  int port = server.Listen("127.0.0.1", 0);
+  server.Start();
+
+  constexpr int kClientThreads = 8;
+  constexpr int kConnections = 32;
+  constexpr int kRounds = 20;
+  std::atomic<int> answered(0);
+  std::vector<std::unique_ptr<Client>> clients[kClientThreads];
+  for (auto& connections : clients) {
+    for (int i = 0; i < kConnections; ++i) {
+      connections.push_back(std::make_unique<Client>(port));
+    }
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kClientThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int round = 0; round < kRounds; ++round) {
+        // All of them in flight at once
+        for (int i = 0; i < kConnections; ++i) {
+          clients[t][i]->Post("/search",
+                              absl::StrFormat("%d-%d-%d", t, i, round));
+        }
+        for (int i = 0; i < kConnections; ++i) {
+          if (clients[t][i]->Receive().second ==
+              absl::StrFormat("%d-%d-%d", t, i, round)) {
+            ++answered;
+          }
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(answered, kClientThreads * kConnections * kRounds);
+  EXPECT_LE(max_handling, GetOptions().handler_threads);
+  EventServer::Stats stats = server.GetStats();
+  EXPECT_EQ(stats.accepted, kClientThreads * kConnections);
+  EXPECT_EQ(stats.open, kClientThreads * kConnections);
+  EXPECT_EQ(stats.requests, kClientThreads * kConnections * kRounds);
+  EXPECT_EQ(stats.bad_requests, 0);
+
+  // With the connections still open
+  server.Stop();
+  EXPECT_EQ(server.GetStats().open, 0);
+}
+
+}  // namespace
+}  // namespace server
+}  // namespace image_retrieval
@@ -121,6 +121,15 @@ class BaseFilterFunctor {
     virtual bool operator()(hnswlib::labeltype id) { return true; }
 };
 
+// Allocates the level 0 block of an index, which is malloc-ed without one
+class Level0Allocator {
+ public:
+    virtual void *allocate(size_t size) = 0;
+    virtual void *reallocate(void *data, size_t old_size, size_t new_size) = 0;
+    virtual void deallocate(void *data, size_t size) = 0;
+    virtual ~Level0Allocator() = default;
+};
+
 template <typename T>
 class pairGreater {
  public:
@@ -39,12 +39,15 @@ class VisitedListPool {
     std::deque<VisitedList *> pool;
     std::mutex poolguard;
     int numelements;
+    // Lists ever allocated, in the pool or out of it
+    size_t numlists{0};
 
  public:
     VisitedListPool(int initmaxpools, int numelements1) {
         numelements = numelements1;
         for (int i = 0; i < initmaxpools; i++)
             pool.push_front(new VisitedList(numelements));
+        numlists = initmaxpools;
     }
 
     VisitedList *getFreeVisitedList() {
@@ -56,6 +59,7 @@ class VisitedListPool {
                 pool.pop_front();
             } else {
                 rez = new VisitedList(numelements);
+                numlists++;
             }
         }
         rez->reset();
@@ -67,6 +71,11 @@ class VisitedListPool {
         pool.push_front(vl);
     }
 
+    size_t getMemoryUsage() {
+        std::unique_lock <std::mutex> lock(poolguard);
+        return numlists * (sizeof(VisitedList) + sizeof(vl_type) * numelements);
+    }
+
     ~VisitedListPool() {
         while (pool.size()) {
             VisitedList *rez = pool.front();